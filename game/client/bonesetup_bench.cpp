@@ -0,0 +1,297 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Records the sequences, pose parameters and layers of the animating
+//			entities in a frame, and replays them through bone setup to measure
+//			bones/sec with and without anim_simd_bones.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "c_baseanimatingoverlay.h"
+#include "animation.h"
+#include "bone_setup.h"
+#include "filesystem.h"
+#include "datacache/imdlcache.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+struct BoneBenchLayer_t
+{
+	int		m_nSequence;
+	float	m_flCycle;
+	float	m_flWeight;
+};
+
+struct BoneBenchSetup_t
+{
+	CStudioHdr			*m_pStudioHdr;
+	int					m_nSequence;
+	float				m_flCycle;
+	float				m_flPoseParameter[MAXSTUDIOPOSEPARAM];
+	BoneBenchLayer_t	m_Layers[C_BaseAnimatingOverlay::MAX_OVERLAYS];
+	int					m_nLayers;
+	matrix3x4_t			*m_pBoneToWorld;	// result of the last run
+	matrix3x4_t			*m_pReference;		// result of the scalar run
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: The same blending StandardBlendingRules does, minus IK and the
+//			entity specific extras
+//-----------------------------------------------------------------------------
+static void BoneBenchRun( BoneBenchSetup_t &setup )
+{
+	Vector pos[MAXSTUDIOBONES];
+	QuaternionAligned q[MAXSTUDIOBONES];
+
+	IBoneSetup boneSetup( setup.m_pStudioHdr, BONE_USED_BY_ANYTHING, setup.m_flPoseParameter );
+	boneSetup.InitPose( pos, q );
+	boneSetup.AccumulatePose( pos, q, setup.m_nSequence, setup.m_flCycle, 1.0f, 0.0f, NULL );
+
+	for ( int i = 0; i < setup.m_nLayers; i++ )
+	{
+		const BoneBenchLayer_t &layer = setup.m_Layers[i];
+		boneSetup.AccumulatePose( pos, q, layer.m_nSequence, layer.m_flCycle, layer.m_flWeight, 0.0f, NULL );
+	}
+
+	Studio_BuildMatrices( setup.m_pStudioHdr, vec3_angle, vec3_origin, pos, q, -1, 1.0f, setup.m_pBoneToWorld, BONE_USED_BY_ANYTHING );
+}
+
+static void BoneBenchBeginLock()
+{
+	mdlcache->BeginLock();
+}
+
+static void BoneBenchEndLock()
+{
+	mdlcache->EndLock();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs every setup nPasses times, returns the elapsed seconds
+//-----------------------------------------------------------------------------
+static float BoneBenchPass( CUtlVector< BoneBenchSetup_t > &setups, int nPasses, bool bParallel )
+{
+	double flStart = Plat_FloatTime();
+	for ( int nPass = 0; nPass < nPasses; nPass++ )
+	{
+		if ( bParallel )
+		{
+			ParallelProcess( "BoneBenchRun", setups.Base(), setups.Count(), &BoneBenchRun, &BoneBenchBeginLock, &BoneBenchEndLock );
+		}
+		else
+		{
+			mdlcache->BeginLock();
+			for ( int i = 0; i < setups.Count(); i++ )
+			{
+				BoneBenchRun( setups[i] );
+			}
+			mdlcache->EndLock();
+		}
+	}
+	return (float)( Plat_FloatTime() - flStart );
+}
+
+static float BoneBenchMaxError( const CUtlVector< BoneBenchSetup_t > &setups )
+{
+	float flMaxError = 0.0f;
+	for ( int i = 0; i < setups.Count(); i++ )
+	{
+		const BoneBenchSetup_t &setup = setups[i];
+		for ( int nBone = 0; nBone < setup.m_pStudioHdr->numbones(); nBone++ )
+		{
+			const float *pA = setup.m_pBoneToWorld[nBone].Base();
+			const float *pB = setup.m_pReference[nBone].Base();
+			for ( int j = 0; j < 12; j++ )
+			{
+				flMaxError = MAX( flMaxError, fabs( pA[j] - pB[j] ) );
+			}
+		}
+	}
+	return flMaxError;
+}
+
+CON_COMMAND( anim_bonebench_record, "Saves the sequence, cycle, pose parameters and layers of every animating entity for anim_bonebench. Usage: anim_bonebench_record <file>" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: anim_bonebench_record <file>\n" );
+		return;
+	}
+
+	KeyValues *pRecording = new KeyValues( "BoneBench" );
+	int nCount = 0;
+
+	for ( C_BaseEntity *pEntity = ClientEntityList().FirstBaseEntity(); pEntity; pEntity = ClientEntityList().NextBaseEntity( pEntity ) )
+	{
+		C_BaseAnimating *pAnimating = pEntity->GetBaseAnimating();
+		if ( !pAnimating || pAnimating->IsDormant() )
+			continue;
+
+		CStudioHdr *pStudioHdr = pAnimating->GetModelPtr();
+		if ( !pStudioHdr || !pStudioHdr->SequencesAvailable() || pAnimating->GetSequence() < 0 || pAnimating->GetSequence() >= pStudioHdr->GetNumSeq() )
+			continue;
+
+		KeyValues *pSetup = pRecording->CreateNewKey();
+		pSetup->SetString( "model", modelinfo->GetModelName( pAnimating->GetModel() ) );
+		pSetup->SetString( "sequence", pStudioHdr->pSeqdesc( pAnimating->GetSequence() ).pszLabel() );
+		pSetup->SetFloat( "cycle", pAnimating->GetCycle() );
+
+		float flPoseParameter[MAXSTUDIOPOSEPARAM];
+		pAnimating->GetPoseParameters( pStudioHdr, flPoseParameter );
+		char szPose[MAXSTUDIOPOSEPARAM * 16] = "";
+		for ( int i = 0; i < pStudioHdr->GetNumPoseParameters(); i++ )
+		{
+			Q_snprintf( szPose + Q_strlen( szPose ), sizeof( szPose ) - Q_strlen( szPose ), "%g ", flPoseParameter[i] );
+		}
+		pSetup->SetString( "pose", szPose );
+
+		C_BaseAnimatingOverlay *pOverlay = dynamic_cast< C_BaseAnimatingOverlay * >( pAnimating );
+		for ( int i = 0; pOverlay && i < pOverlay->GetNumAnimOverlays(); i++ )
+		{
+			C_AnimationLayer *pLayer = pOverlay->GetAnimOverlay( i );
+			if ( pLayer->m_flWeight <= 0.0f || pLayer->m_nSequence < 0 || pLayer->m_nSequence >= pStudioHdr->GetNumSeq() )
+				continue;
+
+			KeyValues *pLayerKey = pSetup->CreateNewKey();
+			pLayerKey->SetName( "layer" );
+			pLayerKey->SetString( "sequence", pStudioHdr->pSeqdesc( pLayer->m_nSequence ).pszLabel() );
+			pLayerKey->SetFloat( "cycle", pLayer->m_flCycle );
+			pLayerKey->SetFloat( "weight", pLayer->m_flWeight );
+		}
+
+		nCount++;
+	}
+
+	if ( pRecording->SaveToFile( filesystem, args[1], "MOD" ) )
+	{
+		Msg( "Recorded %d bone setups to %s\n", nCount, args[1] );
+	}
+	else
+	{
+		Warning( "Couldn't write %s\n", args[1] );
+	}
+	pRecording->deleteThis();
+}
+
+CON_COMMAND( anim_bonebench, "Replays bone setups saved by anim_bonebench_record and reports bones/sec with and without anim_simd_bones. Usage: anim_bonebench <file> [passes]" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: anim_bonebench <file> [passes]\n" );
+		return;
+	}
+
+	int nPasses = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 100;
+
+	KeyValues *pRecording = new KeyValues( "BoneBench" );
+	if ( !pRecording->LoadFromFile( filesystem, args[1], "MOD" ) )
+	{
+		Warning( "Couldn't load %s\n", args[1] );
+		pRecording->deleteThis();
+		return;
+	}
+
+	CUtlDict< CStudioHdr *, int > studioHdrs;
+	CUtlVector< BoneBenchSetup_t > setups;
+	int nBonesPerPass = 0;
+
+	for ( KeyValues *pSetupKey = pRecording->GetFirstTrueSubKey(); pSetupKey; pSetupKey = pSetupKey->GetNextTrueSubKey() )
+	{
+		const char *pModelName = pSetupKey->GetString( "model" );
+		int nHdr = studioHdrs.Find( pModelName );
+		if ( nHdr == studioHdrs.InvalidIndex() )
+		{
+			const model_t *pModel = modelinfo->GetModel( modelinfo->GetModelIndex( pModelName ) );
+			studiohdr_t *pStudioModel = pModel ? modelinfo->GetStudiomodel( pModel ) : NULL;
+			nHdr = studioHdrs.Insert( pModelName, pStudioModel ? new CStudioHdr( pStudioModel, mdlcache ) : NULL );
+		}
+
+		CStudioHdr *pStudioHdr = studioHdrs[nHdr];
+		if ( !pStudioHdr )
+		{
+			Warning( "anim_bonebench: %s isn't loaded, skipping\n", pModelName );
+			continue;
+		}
+
+		BoneBenchSetup_t setup;
+		setup.m_pStudioHdr = pStudioHdr;
+		setup.m_nSequence = LookupSequence( pStudioHdr, pSetupKey->GetString( "sequence" ) );
+		setup.m_flCycle = pSetupKey->GetFloat( "cycle" );
+		setup.m_nLayers = 0;
+		if ( setup.m_nSequence < 0 )
+			continue;
+
+		Studio_CalcDefaultPoseParameters( pStudioHdr, setup.m_flPoseParameter, MAXSTUDIOPOSEPARAM );
+		const char *pPose = pSetupKey->GetString( "pose" );
+		for ( int i = 0; i < pStudioHdr->GetNumPoseParameters() && *pPose; i++ )
+		{
+			char *pEnd;
+			setup.m_flPoseParameter[i] = strtod( pPose, &pEnd );
+			if ( pEnd == pPose )
+				break;
+			pPose = pEnd;
+		}
+
+		FOR_EACH_TRUE_SUBKEY( pSetupKey, pLayerKey )
+		{
+			if ( Q_stricmp( pLayerKey->GetName(), "layer" ) || setup.m_nLayers >= ARRAYSIZE( setup.m_Layers ) )
+				continue;
+
+			BoneBenchLayer_t &layer = setup.m_Layers[setup.m_nLayers];
+			layer.m_nSequence = LookupSequence( pStudioHdr, pLayerKey->GetString( "sequence" ) );
+			layer.m_flCycle = pLayerKey->GetFloat( "cycle" );
+			layer.m_flWeight = pLayerKey->GetFloat( "weight" );
+			if ( layer.m_nSequence >= 0 )
+			{
+				setup.m_nLayers++;
+			}
+		}
+
+		setup.m_pBoneToWorld = new matrix3x4_t[pStudioHdr->numbones()];
+		setup.m_pReference = new matrix3x4_t[pStudioHdr->numbones()];
+		setups.AddToTail( setup );
+		nBonesPerPass += pStudioHdr->numbones();
+	}
+	pRecording->deleteThis();
+
+	if ( setups.Count() )
+	{
+		ConVarRef anim_simd_bones( "anim_simd_bones" );
+		bool bWasSIMD = anim_simd_bones.GetBool();
+		float flBones = (float)nBonesPerPass * nPasses;
+
+		anim_simd_bones.SetValue( false );
+		float flScalar = BoneBenchPass( setups, nPasses, false );
+		for ( int i = 0; i < setups.Count(); i++ )
+		{
+			Q_memcpy( setups[i].m_pReference, setups[i].m_pBoneToWorld, setups[i].m_pStudioHdr->numbones() * sizeof( matrix3x4_t ) );
+		}
+
+		anim_simd_bones.SetValue( true );
+		float flSIMD = BoneBenchPass( setups, nPasses, false );
+		float flMaxError = BoneBenchMaxError( setups );
+		float flParallel = BoneBenchPass( setups, nPasses, true );
+
+		anim_simd_bones.SetValue( bWasSIMD );
+
+		Msg( "anim_bonebench: %d setups, %d bones, %d passes\n", setups.Count(), nBonesPerPass, nPasses );
+		Msg( "  scalar          %10.0f bones/sec\n", flBones / MAX( flScalar, 1e-6f ) );
+		Msg( "  simd            %10.0f bones/sec (%.2fx)\n", flBones / MAX( flSIMD, 1e-6f ), flScalar / MAX( flSIMD, 1e-6f ) );
+		Msg( "  simd, parallel  %10.0f bones/sec (%.2fx)\n", flBones / MAX( flParallel, 1e-6f ), flScalar / MAX( flParallel, 1e-6f ) );
+		Msg( "  max difference from scalar: %g\n", flMaxError );
+	}
+	else
+	{
+		Msg( "anim_bonebench: nothing to replay in %s\n", args[1] );
+	}
+
+	for ( int i = 0; i < setups.Count(); i++ )
+	{
+		delete [] setups[i].m_pBoneToWorld;
+		delete [] setups[i].m_pReference;
+	}
+	studioHdrs.PurgeAndDeleteElements();
+}
@@ -1534,6 +1534,14 @@ void C_BaseAnimating::BuildTransformations( CStudioHdr *hdr, Vector *pos, Quater
 		}
 	}
 
+	// Build the local matrices for every bone in one pass, four at a time
+	matrix3x4_t *pBoneLocal = NULL;
+	if ( Studio_SIMDBoneSetupEnabled() )
+	{
+		pBoneLocal = (matrix3x4_t *)stackalloc( hdr->numbones() * sizeof( matrix3x4_t ) );
+		Studio_BuildLocalMatrices( hdr->numbones(), q, pos, pBoneLocal );
+	}
+
 	for (int i = 0; i < hdr->numbones(); i++)
 	{
 		// Only update bones reference by the bone mask.
@@ -1558,7 +1566,14 @@ void C_BaseAnimating::BuildTransformations( CStudioHdr *hdr, Vector *pos, Quater
 		}
 		else
 		{
-			QuaternionMatrix( q[i], pos[i], bonematrix );
+			if ( pBoneLocal )
+			{
+				bonematrix = pBoneLocal[i];
+			}
+			else
+			{
+				QuaternionMatrix( q[i], pos[i], bonematrix );
+			}
 
 			Assert( fabs( pos[i].x ) < 100000 );
 			Assert( fabs( pos[i].y ) < 100000 );
@@ -2746,6 +2761,8 @@ void C_BaseAnimating::ShutdownBoneSetupThreadPool()
 
 void C_BaseAnimating::ThreadedBoneSetup()
 {
+	Studio_BoneCacheFrameUpdate();
+
 	g_bDoThreadedBoneSetup = cl_threaded_bone_setup.GetBool();
 	if ( g_bDoThreadedBoneSetup )
 	{
@@ -155,6 +155,7 @@ public:
 			Msg( "- PLAYING DEBUG SOUNDSCAPE: %d [%s]\n", m_forcedSoundscapeIndex, SoundscapeNameByIndex(m_forcedSoundscapeIndex) );
 		}
 		Msg( "- CURRENT SOUNDSCAPE: %d [%s]\n", m_params.soundscapeIndex.Get(), SoundscapeNameByIndex(m_params.soundscapeIndex) );
+		Msg( "- SCRIPTS: %d allocations, %d bytes from the KeyValues arena\n", m_ScriptArena.GetAllocationCount(), m_ScriptArena.GetBytesAllocated() );
 		Msg( "----------------------------------\n\n" );
 	}
 
@@ -227,6 +228,7 @@ private:
 	int							m_nRestoreFrame;
 
 	CUtlVector< KeyValues * >	m_SoundscapeScripts;	// The whole script file in memory
+	CKeyValuesArena				m_ScriptArena;			// m_SoundscapeScripts live here, released on Shutdown
 	CUtlVector<KeyValues *>		m_soundscapes;			// Lookup by index of each root section
 	audioparams_t				m_params;				// current player audio params
 	CUtlVector<loopingsound_t>	m_loopingSounds;		// list of currently playing sounds
@@ -269,6 +271,9 @@ void Soundscape_Update( audioparams_t &audio )
 
 void C_SoundscapeSystem::AddSoundScapeFile( const char *filename )
 {
+	// The scripts are kept until the next level loads, so parse them into one block
+	CKeyValuesArenaScope arenaScope( &m_ScriptArena );
+
 	KeyValues *script = new KeyValues( filename );
 #ifndef _XBOX
 	if ( script->LoadFromFile( filesystem, filename ) )
@@ -342,6 +347,9 @@ bool C_SoundscapeSystem::Init()
 
 	manifest->deleteThis();
 
+	DevMsg( 2, "Soundscapes: %d KeyValues allocations (%d bytes) served from the script arena\n",
+		m_ScriptArena.GetAllocationCount(), m_ScriptArena.GetBytesAllocated() );
+
 	return true;
 }
 
@@ -399,6 +407,9 @@ void C_SoundscapeSystem::Shutdown()
 		m_SoundscapeScripts.Remove( 0 );
 		kv->deleteThis();
 	}
+
+	// deleteThis only freed what was allocated after loading, this drops the trees themselves
+	m_ScriptArena.FreeAll();
 }
 
 // NOTE: This will not flush the server side so you cannot add or remove
@@ -155,6 +155,20 @@ float AI_CriteriaSet::GetWeight( int index ) const
 	return entry->weight;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: 
+// Input  : index - 
+// Output : float
+//-----------------------------------------------------------------------------
+float AI_CriteriaSet::GetNumericValue( int index ) const
+{
+	if ( index < 0 || index >= (int)m_Lookup.Count() )
+		return 0.0f;
+
+	const CritEntry_t *entry = &m_Lookup[ index ];
+	return entry->numericvalue;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -36,6 +36,8 @@ public:
 	const char *GetName( int index ) const;
 	const char *GetValue( int index ) const;
 	float		GetWeight( int index ) const;
+	// The value run through atof when it was set, so matching doesn't have to
+	float		GetNumericValue( int index ) const;
 
 private:
 
@@ -43,7 +45,8 @@ private:
 	{
 		CritEntry_t() :
 				criterianame( UTL_INVAL_SYMBOL ),
-				weight( 0.0f )
+				weight( 0.0f ),
+				numericvalue( 0.0f )
 		{
 			value[ 0 ] = 0;
 		}
@@ -83,11 +86,14 @@ private:
 			{
 				Q_strncpy( value, str, sizeof( value ) );
 			}
+
+			numericvalue = (float)atof( value );
 		}
 				
 		CUtlSymbol criterianame;
 		char		value[ 64 ];
 		float		weight;
+		float		numericvalue;
 	};
 
 	CUtlRBTree< CritEntry_t, short > m_Lookup;
@@ -29,6 +29,8 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_ruleindex( "rr_ruleindex", "1", FCVAR_NONE, "Only score the rules whose concept (or other required criterion) can match, instead of every rule." );
+ConVar rr_logcriteria( "rr_logcriteria", "", FCVAR_NONE, "If set, every criteria set passed to the response rules system is appended to this file, for rr_benchmark to replay." );
 
 static CUtlSymbolTable g_RS;
 
@@ -59,6 +61,7 @@ public:
 		maxequals = false;
 		maxval = 0.0f;
 		minval = 0.0f;
+		tokenval = 0.0f;
 
 		token = UTL_INVAL_SYMBOL;
 		rawtoken = UTL_INVAL_SYMBOL;
@@ -110,6 +113,7 @@ public:
 
 	float	maxval;
 	float	minval;
+	float	tokenval;		// atof of the token, for numeric matchers
 
 	bool	valid : 1;      //1
 	bool	isnumeric : 1;  //2
@@ -122,6 +126,7 @@ public:
 	void	SetToken( char const *s )
 	{
 		token = g_RS.AddString( s );
+		tokenval = (float)atof( s );
 	}
 
 	char const *GetToken()
@@ -676,13 +681,20 @@ public:
 
 	int			ParseOneCriterion( const char *criterionName );
 	
-	bool		Compare( const char *setValue, Criteria *c, bool verbose = false );
-	bool		CompareUsingMatcher( const char *setValue, Matcher& m, bool verbose = false );
+	bool		Compare( const char *setValue, float flSetValue, Criteria *c, bool verbose = false );
+	bool		CompareUsingMatcher( const char *setValue, float flSetValue, Matcher& m, bool verbose = false );
 	void		ComputeMatcher( Criteria *c, Matcher& matcher );
 	void		ResolveToken( Matcher& matcher, char *token, size_t bufsize, char const *rawtoken );
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	void		FindMatchingRules( const AI_CriteriaSet& set, bool verbose, bool bUseIndex, CUtlVector< int >& bestrules );
+
+	void		InvalidateRuleIndex() { m_bRuleIndexDirty = true; }
+	void		BuildRuleIndex();
+	int			FindRuleIndexCriterion( Rule *rule );
+	void		GetCandidateRules( const AI_CriteriaSet& set, CUtlVector< unsigned short >& candidates );
+	void		LogCriteriaSet( const AI_CriteriaSet& set );
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
@@ -710,6 +722,23 @@ public:
 	CUtlDict< Rule, short >	m_Rules;
 	CUtlDict< Enumeration, short > m_Enumerations;
 
+	// Rules bucketed by one required equality criterion (the concept when
+	// there is one), so a lookup only scores rules that can possibly match.
+	// Buckets are keyed by "criterion\nvalue" and point at a span of
+	// m_RuleIndexRules, which is in rule order within each bucket.
+	struct RuleIndexBucket_t
+	{
+		int		m_nFirst;
+		int		m_nCount;
+	};
+
+	CUtlVector< const char * >		m_RuleIndexNames;	// criteria the buckets are keyed on
+	CUtlDict< RuleIndexBucket_t, int >	m_RuleIndexBuckets;
+	CUtlVector< unsigned short >	m_RuleIndexRules;
+	CUtlVector< unsigned short >	m_UnindexedRules;	// no usable criterion, always scored
+	CUtlVector< unsigned short >	m_RuleCandidates;
+	bool		m_bRuleIndexDirty;
+
 	char		token[ 1204 ];
 
 	bool		m_bUnget;
@@ -762,6 +791,7 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_bRuleIndexDirty = true;
 }
 
 //-----------------------------------------------------------------------------
@@ -817,6 +847,8 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
 	m_Enumerations.RemoveAll();
+
+	InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -991,12 +1023,12 @@ void CResponseSystem::ComputeMatcher( Criteria *c, Matcher& matcher )
 	matcher.valid = true;
 }
 
-bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, bool verbose /*=false*/ )
+bool CResponseSystem::CompareUsingMatcher( const char *setValue, float flSetValue, Matcher& m, bool verbose /*=false*/ )
 {
 	if ( !m.valid )
 		return false;
 
-	float v = (float)atof( setValue );
+	float v = flSetValue;
 	if ( setValue[0] == '[' )
 	{
 		bool found = false;
@@ -1047,7 +1079,7 @@ bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, boo
 	{
 		if ( m.isnumeric )
 		{
-			if ( v == (float)atof( m.GetToken() ) )
+			if ( v == m.tokenval )
 				return false;
 		}
 		else
@@ -1066,18 +1098,18 @@ bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, boo
 		if ( !setValue || !setValue[0] )
 			return false;
 
-		return v == (float)atof( m.GetToken() );
+		return v == m.tokenval;
 	}
 
 	return !Q_stricmp( setValue, m.GetToken() ) ? true : false;
 }
 
-bool CResponseSystem::Compare( const char *setValue, Criteria *c, bool verbose /*= false*/ )
+bool CResponseSystem::Compare( const char *setValue, float flSetValue, Criteria *c, bool verbose /*= false*/ )
 {
 	Assert( c );
 	Assert( setValue );
 
-	bool bret = CompareUsingMatcher( setValue, c->matcher, verbose );
+	bool bret = CompareUsingMatcher( setValue, flSetValue, c->matcher, verbose );
 
 	if ( verbose )
 	{
@@ -1163,6 +1195,7 @@ float CResponseSystem::ScoreCriteriaAgainstRuleCriteria( const AI_CriteriaSet& s
 	float score = 0.0f;
 
 	const char *actualValue = "";
+	float flActualValue = 0.0f;
 
 	int found = set.FindCriterionIndex( c->name );
 	if ( found != -1 )
@@ -1173,11 +1206,12 @@ float CResponseSystem::ScoreCriteriaAgainstRuleCriteria( const AI_CriteriaSet& s
 			Assert( 0 );
 			return score;
 		}
+		flActualValue = set.GetNumericValue( found );
 	}
 
 	Assert( actualValue );
 
-	if ( Compare( actualValue, c, verbose ) )
+	if ( Compare( actualValue, flActualValue, c, verbose ) )
 	{
 		float w = set.GetWeight( found );
 		score = w * c->weight.GetFloat();
@@ -1685,13 +1719,56 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
 {
 	CUtlVector< int >	bestrules;
+
+	// The index never scores rules that can't match, but verbose output and
+	// rr_debugrule want to see those too
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool bUseIndex = rr_ruleindex.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
+
+	FindMatchingRules( set, verbose, bUseIndex, bestrules );
+
+	int bestCount = bestrules.Count();
+	if ( bestCount <= 0 )
+		return -1;
+
+	if ( bestCount == 1 )
+		return bestrules[ 0 ];
+
+	// Randomly pick one of the tied matching rules
+	int idx = random->RandomInt( 0, bestCount - 1 );
+	if ( verbose )
+	{
+		DevMsg( "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+	}
+	return bestrules[ idx ];
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Fills in all of the rules tied for the best score, in rule order.
+//			The index only skips rules that would have scored zero, so the
+//			result is the same either way.
+//-----------------------------------------------------------------------------
+void CResponseSystem::FindMatchingRules( const AI_CriteriaSet& set, bool verbose, bool bUseIndex, CUtlVector< int >& bestrules )
+{
+	bestrules.RemoveAll();
 	float bestscore = 0.001f;
 
-	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+	int c;
+	if ( bUseIndex )
 	{
-		float score = ScoreCriteriaAgainstRule( set, i, verbose );
+		GetCandidateRules( set, m_RuleCandidates );
+		c = m_RuleCandidates.Count();
+	}
+	else
+	{
+		c = m_Rules.Count();
+	}
+
+	for ( int i = 0; i < c; i++ )
+	{
+		int irule = bUseIndex ? m_RuleCandidates[ i ] : i;
+
+		float score = ScoreCriteriaAgainstRule( set, irule, verbose );
 		// Check equals so that we keep track of all matching rules
 		if ( score >= bestscore )
 		{
@@ -1703,24 +1780,184 @@ int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbo
 			}
 
 			// Add to bucket
-			bestrules.AddToTail( i );
+			bestrules.AddToTail( irule );
 		}
 	}
+}
 
-	int bestCount = bestrules.Count();
-	if ( bestCount <= 0 )
-		return -1;
+//-----------------------------------------------------------------------------
+// Purpose: Picks the criterion a rule is bucketed on. It has to be required
+//			and matched by string, so a set without exactly that value can't
+//			match the rule. Returns -1 if the rule has no such criterion.
+//-----------------------------------------------------------------------------
+int CResponseSystem::FindRuleIndexCriterion( Rule *rule )
+{
+	int best = -1;
 
-	if ( bestCount == 1 )
-		return bestrules[ 0 ];
+	int count = rule->m_Criteria.Count();
+	for ( int i = 0; i < count; i++ )
+	{
+		int icriterion = rule->m_Criteria[ i ];
+		Criteria *c = &m_Criteria[ icriterion ];
+		if ( !c->required || !c->name || c->IsSubCriteriaType() )
+			continue;
 
-	// Randomly pick one of the tied matching rules
-	int idx = random->RandomInt( 0, bestCount - 1 );
-	if ( verbose )
+		Matcher& m = c->matcher;
+		if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax )
+			continue;
+
+		// The concept is nearly always there and splits the rules up the most
+		if ( !Q_stricmp( c->name, "concept" ) )
+			return icriterion;
+
+		if ( best == -1 )
+		{
+			best = icriterion;
+		}
+	}
+
+	return best;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: 
+//-----------------------------------------------------------------------------
+void CResponseSystem::BuildRuleIndex()
+{
+	m_RuleIndexNames.RemoveAll();
+	m_RuleIndexBuckets.RemoveAll();
+	m_RuleIndexRules.RemoveAll();
+	m_UnindexedRules.RemoveAll();
+	m_bRuleIndexDirty = false;
+
+	int c = m_Rules.Count();
+
+	CUtlVector< int > ruleBuckets;
+	ruleBuckets.SetCount( c );
+
+	char key[ 256 ];
+	for ( int i = 0; i < c; i++ )
 	{
-		DevMsg( "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+		ruleBuckets[ i ] = m_RuleIndexBuckets.InvalidIndex();
+
+		int icriterion = FindRuleIndexCriterion( &m_Rules[ i ] );
+		if ( icriterion == -1 )
+		{
+			m_UnindexedRules.AddToTail( i );
+			continue;
+		}
+
+		Criteria *crit = &m_Criteria[ icriterion ];
+		Q_snprintf( key, sizeof( key ), "%s\n%s", crit->name, crit->matcher.GetToken() );
+
+		int bucket = m_RuleIndexBuckets.Find( key );
+		if ( bucket == m_RuleIndexBuckets.InvalidIndex() )
+		{
+			RuleIndexBucket_t empty = { 0, 0 };
+			bucket = m_RuleIndexBuckets.Insert( key, empty );
+
+			int n;
+			for ( n = 0; n < m_RuleIndexNames.Count(); n++ )
+			{
+				if ( !Q_stricmp( m_RuleIndexNames[ n ], crit->name ) )
+					break;
+			}
+			if ( n == m_RuleIndexNames.Count() )
+			{
+				m_RuleIndexNames.AddToTail( crit->name );
+			}
+		}
+
+		m_RuleIndexBuckets[ bucket ].m_nCount++;
+		ruleBuckets[ i ] = bucket;
 	}
-	return bestrules[ idx ];
+
+	// Lay the buckets out back to back
+	int nFirst = 0;
+	for ( int b = m_RuleIndexBuckets.First(); b != m_RuleIndexBuckets.InvalidIndex(); b = m_RuleIndexBuckets.Next( b ) )
+	{
+		m_RuleIndexBuckets[ b ].m_nFirst = nFirst;
+		nFirst += m_RuleIndexBuckets[ b ].m_nCount;
+		m_RuleIndexBuckets[ b ].m_nCount = 0;
+	}
+
+	m_RuleIndexRules.SetCount( nFirst );
+	for ( int i = 0; i < c; i++ )
+	{
+		if ( ruleBuckets[ i ] == m_RuleIndexBuckets.InvalidIndex() )
+			continue;
+
+		RuleIndexBucket_t& bucket = m_RuleIndexBuckets[ ruleBuckets[ i ] ];
+		m_RuleIndexRules[ bucket.m_nFirst + bucket.m_nCount++ ] = i;
+	}
+}
+
+static int __cdecl RuleIndexCompare( const unsigned short *lhs, const unsigned short *rhs )
+{
+	return (int)*lhs - (int)*rhs;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gathers the rules that could match set, in rule order so ties are
+//			broken the same way as when every rule is scored.
+//-----------------------------------------------------------------------------
+void CResponseSystem::GetCandidateRules( const AI_CriteriaSet& set, CUtlVector< unsigned short >& candidates )
+{
+	if ( m_bRuleIndexDirty )
+	{
+		BuildRuleIndex();
+	}
+
+	candidates.RemoveAll();
+	candidates.AddMultipleToTail( m_UnindexedRules.Count(), m_UnindexedRules.Base() );
+
+	char key[ 256 ];
+	int nNames = m_RuleIndexNames.Count();
+	for ( int i = 0; i < nNames; i++ )
+	{
+		int found = set.FindCriterionIndex( m_RuleIndexNames[ i ] );
+		if ( found == -1 )
+			continue;
+
+		Q_snprintf( key, sizeof( key ), "%s\n%s", m_RuleIndexNames[ i ], set.GetValue( found ) );
+
+		int bucket = m_RuleIndexBuckets.Find( key );
+		if ( bucket == m_RuleIndexBuckets.InvalidIndex() )
+			continue;
+
+		const RuleIndexBucket_t& span = m_RuleIndexBuckets[ bucket ];
+		candidates.AddMultipleToTail( span.m_nCount, m_RuleIndexRules.Base() + span.m_nFirst );
+	}
+
+	// Each rule is in at most one bucket, so this only has to merge them
+	if ( nNames > 1 || m_UnindexedRules.Count() )
+	{
+		candidates.Sort( RuleIndexCompare );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Appends set to the rr_logcriteria file, one "name<tab>value<tab>weight"
+//			line per criterion and a blank line after the set.
+//-----------------------------------------------------------------------------
+void CResponseSystem::LogCriteriaSet( const AI_CriteriaSet& set )
+{
+	FileHandle_t fh = filesystem->Open( rr_logcriteria.GetString(), "a", "DEFAULT_WRITE_PATH" );
+	if ( fh == FILESYSTEM_INVALID_HANDLE )
+	{
+		Warning( "rr_logcriteria:  couldn't open %s for writing\n", rr_logcriteria.GetString() );
+		rr_logcriteria.SetValue( "" );
+		return;
+	}
+
+	int c = set.GetCount();
+	for ( int i = 0; i < c; i++ )
+	{
+		filesystem->FPrintf( fh, "%s\t%s\t%f\n", set.GetName( i ), set.GetValue( i ), set.GetWeight( i ) );
+	}
+	filesystem->FPrintf( fh, "\n" );
+
+	filesystem->Close( fh );
 }
 
 //-----------------------------------------------------------------------------
@@ -1736,6 +1973,11 @@ bool CResponseSystem::FindBestResponse( const AI_CriteriaSet& set, AI_Response&
 	bool showRules = ( iDbgResponse == 2 );
 	bool showResult = ( iDbgResponse == 1 || iDbgResponse == 2 );
 
+	if ( rr_logcriteria.GetString()[0] )
+	{
+		LogCriteriaSet( set );
+	}
+
 	// Look for match. verbose mode used to be at level 2, but disabled because the writers don't actually care for that info.
 	int bestRule = FindBestMatchingRule( set, iDbgResponse == 3 ); 
 
@@ -2607,6 +2849,7 @@ void CResponseSystem::ParseRule( void )
 	if ( validRule )
 	{
 		m_Rules.Insert( ruleName, newRule );
+		InvalidateRuleIndex();
 	}
 	else
 	{
@@ -2804,6 +3047,7 @@ void CResponseSystem::CopyRuleFrom( Rule *pSrcRule, int iRule, CResponseSystem *
 
 	// Add rule.
 	pCustomSystem->m_Rules.Insert( m_Rules.GetElementName( iRule ), dstRule );
+	pCustomSystem->InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -3051,6 +3295,141 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 #endif
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Replays criteria sets logged with rr_logcriteria against the default
+//			response system, once scoring every rule and once through the rule
+//			index, and reports lookups/sec for each.
+//-----------------------------------------------------------------------------
+CON_COMMAND( rr_benchmark, "Time rule lookups for criteria sets logged by rr_logcriteria.  Usage:  rr_benchmark <file> [passes]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage:  rr_benchmark <file> [passes]\n" );
+		return;
+	}
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !filesystem->ReadFile( args[ 1 ], "DEFAULT_WRITE_PATH", buf ) )
+	{
+		Warning( "rr_benchmark:  couldn't read %s\n", args[ 1 ] );
+		return;
+	}
+
+	CUtlVector< AI_CriteriaSet * > sets;
+	AI_CriteriaSet *pSet = NULL;
+	char line[ 512 ];
+	for ( ;; )
+	{
+		buf.GetLine( line, sizeof( line ) );
+		if ( !buf.IsValid() )
+			break;
+
+		int len = Q_strlen( line );
+		while ( len > 0 && ( line[ len - 1 ] == '\n' || line[ len - 1 ] == '\r' ) )
+		{
+			line[ --len ] = 0;
+		}
+
+		// A blank line ends the set
+		if ( !len )
+		{
+			pSet = NULL;
+			continue;
+		}
+
+		char *pValue = Q_strstr( line, "\t" );
+		if ( !pValue )
+			continue;
+		*pValue++ = 0;
+
+		float weight = 1.0f;
+		char *pWeight = Q_strstr( pValue, "\t" );
+		if ( pWeight )
+		{
+			*pWeight++ = 0;
+			weight = (float)atof( pWeight );
+		}
+
+		if ( !pSet )
+		{
+			pSet = new AI_CriteriaSet;
+			sets.AddToTail( pSet );
+		}
+		pSet->AppendCriteria( line, pValue, weight );
+	}
+
+	int nSets = sets.Count();
+	if ( !nSets )
+	{
+		Warning( "rr_benchmark:  no criteria sets in %s\n", args[ 1 ] );
+		return;
+	}
+
+	int nPasses = ( args.ArgC() > 2 ) ? atoi( args[ 2 ] ) : 20;
+	nPasses = max( nPasses, 1 );
+
+	// Both ways have to come up with the same rules before the timings mean anything
+	CUtlVector< int > fullRules;
+	CUtlVector< int > indexedRules;
+	int nMismatches = 0;
+	for ( int i = 0; i < nSets; i++ )
+	{
+		defaultresponsesytem.FindMatchingRules( *sets[ i ], false, false, fullRules );
+		defaultresponsesytem.FindMatchingRules( *sets[ i ], false, true, indexedRules );
+
+		bool bSame = ( fullRules.Count() == indexedRules.Count() );
+		for ( int j = 0; bSame && j < fullRules.Count(); j++ )
+		{
+			bSame = ( fullRules[ j ] == indexedRules[ j ] );
+		}
+
+		if ( !bSame )
+		{
+			++nMismatches;
+		}
+	}
+
+	double flStart = Plat_FloatTime();
+	for ( int pass = 0; pass < nPasses; pass++ )
+	{
+		for ( int i = 0; i < nSets; i++ )
+		{
+			defaultresponsesytem.FindMatchingRules( *sets[ i ], false, false, fullRules );
+		}
+	}
+	double flFullTime = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int pass = 0; pass < nPasses; pass++ )
+	{
+		for ( int i = 0; i < nSets; i++ )
+		{
+			defaultresponsesytem.FindMatchingRules( *sets[ i ], false, true, indexedRules );
+		}
+	}
+	double flIndexedTime = Plat_FloatTime() - flStart;
+
+	double flLookups = (double)nSets * nPasses;
+	flFullTime = max( flFullTime, 1e-6 );
+	flIndexedTime = max( flIndexedTime, 1e-6 );
+
+	Msg( "rr_benchmark:  %d criteria sets x %d passes against %d rules\n", nSets, nPasses, defaultresponsesytem.m_Rules.Count() );
+	Msg( "  index:       %d buckets on %d criteria, %d rules always scored\n",
+		defaultresponsesytem.m_RuleIndexBuckets.Count(), defaultresponsesytem.m_RuleIndexNames.Count(), defaultresponsesytem.m_UnindexedRules.Count() );
+	Msg( "  every rule:  %.0f lookups/sec\n", flLookups / flFullTime );
+	Msg( "  rule index:  %.0f lookups/sec (%.1fx)\n", flLookups / flIndexedTime, flFullTime / flIndexedTime );
+
+	if ( nMismatches )
+	{
+		Warning( "rr_benchmark:  %d of %d sets matched different rules through the index!\n", nMismatches, nSets );
+	}
+
+	sets.PurgeAndDeleteElements();
+}
+
 static short RESPONSESYSTEM_SAVE_RESTORE_VERSION = 1;
 
 // note:  this won't save/restore settings from instanced response systems.  Could add that with a CDefSaveRestoreOps implementation if needed
@@ -234,6 +234,7 @@ CAI_Manager g_AI_Manager;
 CAI_Manager::CAI_Manager()
 {
 	m_AIs.EnsureCapacity( MAX_AIS );
+	m_nChanges = 0;
 }
 
 //-------------------------------------
@@ -257,6 +258,7 @@ int CAI_Manager::NumAIs()
 void CAI_Manager::AddAI( CAI_BaseNPC *pAI )
 {
 	m_AIs.AddToTail( pAI );
+	m_nChanges++;
 }
 
 //-------------------------------------
@@ -266,7 +268,10 @@ void CAI_Manager::RemoveAI( CAI_BaseNPC *pAI )
 	int i = m_AIs.Find( pAI );
 
 	if ( i != -1 )
+	{
 		m_AIs.FastRemove( i );
+		m_nChanges++;
+	}
 }
 
 
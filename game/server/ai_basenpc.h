@@ -458,6 +458,9 @@ public:
 	void RemoveAI( CAI_BaseNPC *pAI );
 
 	bool FindAI( CAI_BaseNPC *pAI )	{ return ( m_AIs.Find( pAI ) != m_AIs.InvalidIndex() ); }
+
+	// Bumped whenever the AI array changes, so indices into it can be cached
+	int	GetChangeCount() const			{ return m_nChanges; }
 	
 private:
 	enum
@@ -468,6 +471,7 @@ private:
 	typedef CUtlVector<CAI_BaseNPC *> CAIArray;
 	
 	CAIArray m_AIs;
+	int m_nChanges;
 
 };
 
@@ -1639,6 +1643,8 @@ public:
 	virtual bool		IsValidShootPosition ( const Vector &vecCoverLocation, CAI_Node *pNode, CAI_Hint const *pHint );
 	virtual bool		TestShootPosition(const Vector &vecShootPos, const Vector &targetPos )	{ return WeaponLOSCondition( vecShootPos, targetPos, false ); }
 	virtual bool		IsCoverPosition( const Vector &vecThreat, const Vector &vecPosition );
+	// False while the two tests above read search state beyond the node and threat, so recent results can't be reused
+	virtual bool		CanCacheTacticalVisResults()	{ return true; }
 	virtual float		CoverRadius( void ) { return 1024; } // Default cover radius
 	virtual float		GetMaxTacticalLateralMovement( void ) { return MAXTACLAT_IGNORE; }
 
@@ -319,6 +319,7 @@ void CAI_DynamicLink::InitDynamicLinks(void)
 	if ( bUpdateZones )
 	{
 		g_AINetworkBuilder.InitZones( g_pBigAINet );
+		g_pBigAINet->GetClusters().Build( g_pBigAINet );
 	}
 }
 
@@ -494,6 +495,8 @@ void CAI_DynamicLink::SetLinkState(void)
 			{
 				pLink->m_LinkInfo &= ~bits_LINK_OFF;
 			}
+
+			g_pBigAINet->GetClusters().OnLinkStateChanged( g_pBigAINet, m_nSrcID, m_nDestID );
 		}
 		else
 		{
@@ -107,6 +107,7 @@ public:
 CAI_Network::CAI_Network()
 {
 	m_iNumNodes				= 0;		// Number of nodes in this network
+	m_nChangeCount			= 0;
 	m_pAInode				= NULL;		// Array of all nodes in this network
 
 	m_iNearestCacheNext	= NEARNODE_CACHE_SIZE - 1;
@@ -546,6 +547,7 @@ CAI_Node *CAI_Network::AddNode( const Vector &origin, float yaw )
 #endif
 
 	m_iNumNodes++;
+	m_nChangeCount++;
 
 	return m_pAInode[m_iNumNodes-1];
 };
@@ -593,6 +595,8 @@ CAI_Link *CAI_Network::CreateLink( int srcID, int destID, CAI_DynamicLink *pDyna
 	pSrcNode->AddLink(pLink);
 	pDestNode->AddLink(pLink);
 
+	m_nChangeCount++;
+
 	return pLink;
 }
 
@@ -14,6 +14,7 @@
 
 #include "ispatialpartition.h"
 #include "utlpriorityqueue.h"
+#include "ai_networkclusters.h"
 
 // ------------------------------------
 
@@ -127,6 +128,12 @@ public:
 	}
 	
 	CAI_Node**		AccessNodes() const	{ return m_pAInode; }
+
+	// Bumped whenever a node or link is added, so derived data can tell it is stale
+	int				GetChangeCount() const	{ return m_nChangeCount; }
+
+	CAI_NetworkClusters &		GetClusters()		{ return m_Clusters; }
+	const CAI_NetworkClusters &	GetClusters() const	{ return m_Clusters; }
 	
 private:
 	friend class CAI_NetworkManager;
@@ -157,6 +164,7 @@ private:
 	};
 
 	int					m_iNumNodes;				// Number of nodes in this network
+	int					m_nChangeCount;				// Number of node and link additions
 	CAI_Node**			m_pAInode;					// Array of all nodes in this network
 
 	enum
@@ -167,6 +175,8 @@ private:
 	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
 	int					m_iNearestCacheNext;					// Oldest record in the cache
 
+	CAI_NetworkClusters	m_Clusters;								// Coarse routing layer used for long routes
+
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
 	CUtlVector<int>		m_GatheredNodes;
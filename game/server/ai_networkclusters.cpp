@@ -0,0 +1,418 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Coarse cluster/portal routing layer over the AI node graph
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "utlbuffer.h"
+#include "utlpriorityqueue.h"
+#include "bitstring.h"
+
+#include "ai_networkclusters.h"
+#include "ai_network.h"
+#include "ai_node.h"
+#include "ai_link.h"
+#include "ai_dynamiclink.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define AI_CLUSTER_FILE_TAG		MAKEID( 'A', 'I', 'C', 'L' )
+#define AI_CLUSTER_FILE_VERSION	1
+
+//-----------------------------------------------------------------------------
+
+struct AI_ClusterOpen_t
+{
+	float	f;
+	int		iCluster;
+};
+
+static bool ClusterOpenIsLowerPriority( const AI_ClusterOpen_t &lhs, const AI_ClusterOpen_t &rhs )
+{
+	if ( lhs.f != rhs.f )
+		return ( lhs.f > rhs.f );
+	return ( lhs.iCluster > rhs.iCluster );
+}
+
+//-----------------------------------------------------------------------------
+// A link may take part in a cluster portal unless it is switched off for
+// everybody. Links that are off but have an allow-use filter are kept, the
+// node level search decides per NPC.
+//-----------------------------------------------------------------------------
+
+static bool IsPortalCandidate( CAI_Link *pLink )
+{
+	if ( !( pLink->m_LinkInfo & bits_LINK_OFF ) )
+		return true;
+
+	return ( pLink->m_pDynamicLink && pLink->m_pDynamicLink->m_strAllowUse != NULL_STRING );
+}
+
+//-----------------------------------------------------------------------------
+// CAI_NetworkClusters
+//-----------------------------------------------------------------------------
+
+CAI_NetworkClusters::CAI_NetworkClusters()
+{
+	m_nNetworkChangeCount = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::Purge()
+{
+	m_NodeCluster.Purge();
+	m_ClusterNodes.Purge();
+	m_Clusters.Purge();
+	m_nNetworkChangeCount = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_NetworkClusters::IsValidFor( const CAI_Network *pNetwork ) const
+{
+	return ( m_Clusters.Count() > 0 && m_nNetworkChangeCount == pNetwork->GetChangeCount() && m_NodeCluster.Count() == pNetwork->NumNodes() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Grows clusters breadth first from each unassigned node, staying
+//			inside the node's zone, until they reach AI_CLUSTER_MAX_NODES
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::Build( CAI_Network *pNetwork )
+{
+	Purge();
+
+	int nNodes = pNetwork->NumNodes();
+	if ( !nNodes )
+		return;
+
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+
+	m_NodeCluster.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		m_NodeCluster[i] = AI_CLUSTER_NONE;
+	}
+
+	CUtlVector<int> queue;
+	queue.EnsureCapacity( AI_CLUSTER_MAX_NODES );
+
+	for ( int seed = 0; seed < nNodes; seed++ )
+	{
+		if ( m_NodeCluster[seed] != AI_CLUSTER_NONE )
+			continue;
+
+		int iCluster = m_Clusters.AddToTail();
+		int zone = ppNodes[seed]->GetZone();
+
+		queue.RemoveAll();
+		queue.AddToTail( seed );
+		m_NodeCluster[seed] = iCluster;
+
+		for ( int head = 0; head < queue.Count() && queue.Count() < AI_CLUSTER_MAX_NODES; head++ )
+		{
+			int nodeID = queue[head];
+			CAI_Node *pNode = ppNodes[nodeID];
+
+			for ( int link = 0; link < pNode->NumLinks() && queue.Count() < AI_CLUSTER_MAX_NODES; link++ )
+			{
+				int destID = pNode->GetLinkByIndex( link )->DestNodeID( nodeID );
+				if ( destID < 0 || destID >= nNodes )
+					continue;
+
+				if ( m_NodeCluster[destID] != AI_CLUSTER_NONE || ppNodes[destID]->GetZone() != zone )
+					continue;
+
+				m_NodeCluster[destID] = iCluster;
+				queue.AddToTail( destID );
+			}
+		}
+	}
+
+	FinishClusters( pNetwork );
+
+	DevMsg( "AI network: %d nodes in %d clusters\n", nNodes, m_Clusters.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Given the cluster of every node, groups node IDs by cluster and
+//			computes the cluster centers and portals
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::FinishClusters( CAI_Network *pNetwork )
+{
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+	int nNodes = m_NodeCluster.Count();
+
+	m_nNetworkChangeCount = pNetwork->GetChangeCount();
+
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		m_Clusters[i].vecCenter.Init();
+		m_Clusters[i].nNodes = 0;
+	}
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		m_Clusters[m_NodeCluster[i]].nNodes++;
+	}
+
+	int iFirst = 0;
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		m_Clusters[i].iFirstNode = iFirst;
+		iFirst += m_Clusters[i].nNodes;
+		m_Clusters[i].nNodes = 0;
+	}
+
+	m_ClusterNodes.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		Cluster_t &cluster = m_Clusters[m_NodeCluster[i]];
+		m_ClusterNodes[cluster.iFirstNode + cluster.nNodes] = i;
+		cluster.nNodes++;
+		cluster.vecCenter += ppNodes[i]->GetOrigin();
+	}
+
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		m_Clusters[i].vecCenter /= m_Clusters[i].nNodes;
+		BuildClusterLinks( pNetwork, i );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the portal list of one cluster from the links of its nodes
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::BuildClusterLinks( CAI_Network *pNetwork, int iCluster )
+{
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+	Cluster_t &cluster = m_Clusters[iCluster];
+
+	cluster.links.RemoveAll();
+
+	for ( int i = 0; i < cluster.nNodes; i++ )
+	{
+		int nodeID = m_ClusterNodes[cluster.iFirstNode + i];
+		CAI_Node *pNode = ppNodes[nodeID];
+
+		for ( int link = 0; link < pNode->NumLinks(); link++ )
+		{
+			CAI_Link *pLink = pNode->GetLinkByIndex( link );
+			int iDestCluster = GetNodeCluster( pLink->DestNodeID( nodeID ) );
+
+			if ( iDestCluster == AI_CLUSTER_NONE || iDestCluster == iCluster || !IsPortalCandidate( pLink ) )
+				continue;
+
+			int iPortal;
+			for ( iPortal = 0; iPortal < cluster.links.Count(); iPortal++ )
+			{
+				if ( cluster.links[iPortal].iCluster == iDestCluster )
+					break;
+			}
+
+			if ( iPortal == cluster.links.Count() )
+			{
+				iPortal = cluster.links.AddToTail();
+				cluster.links[iPortal].iCluster = iDestCluster;
+				memset( cluster.links[iPortal].moveTypes, 0, sizeof( cluster.links[iPortal].moveTypes ) );
+			}
+
+			for ( int hull = 0; hull < NUM_HULLS; hull++ )
+			{
+				cluster.links[iPortal].moveTypes[hull] |= pLink->m_iAcceptedMoveTypes[hull];
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_NetworkClusters::AreNeighbors( int iCluster1, int iCluster2 ) const
+{
+	const Cluster_t &cluster = m_Clusters[iCluster1];
+	for ( int i = 0; i < cluster.links.Count(); i++ )
+	{
+		if ( cluster.links[i].iCluster == iCluster2 )
+			return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::OnLinkStateChanged( CAI_Network *pNetwork, int srcID, int destID )
+{
+	if ( !IsValidFor( pNetwork ) )
+		return;
+
+	int iSrcCluster = GetNodeCluster( srcID );
+	int iDestCluster = GetNodeCluster( destID );
+
+	// Links inside a cluster don't take part in any portal
+	if ( iSrcCluster == AI_CLUSTER_NONE || iDestCluster == AI_CLUSTER_NONE || iSrcCluster == iDestCluster )
+		return;
+
+	BuildClusterLinks( pNetwork, iSrcCluster );
+	BuildClusterLinks( pNetwork, iDestCluster );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A* over cluster centers. Portals are taken as usable if any link
+//			crossing them could be used by the hull, including jump links
+//			that only a jump override hint would open up. The node search
+//			that follows is the final judge.
+//-----------------------------------------------------------------------------
+
+bool CAI_NetworkClusters::BuildCorridor( int iStartCluster, int iEndCluster, Hull_t hull, int capabilities, CVarBitVec *pCorridor ) const
+{
+	int nClusters = m_Clusters.Count();
+
+	float *pG = (float *)stackalloc( nClusters * sizeof(float) );
+	short *pParent = (short *)stackalloc( nClusters * sizeof(short) );
+	for ( int i = 0; i < nClusters; i++ )
+	{
+		pG[i] = FLT_MAX;
+		pParent[i] = AI_CLUSTER_NONE;
+	}
+
+	CUtlPriorityQueue<AI_ClusterOpen_t> openList( 0, 64, ClusterOpenIsLowerPriority );
+
+	const Vector &vecEnd = m_Clusters[iEndCluster].vecCenter;
+	int usableMoveTypes = capabilities | bits_CAP_MOVE_JUMP;
+
+	pG[iStartCluster] = 0;
+	AI_ClusterOpen_t start = { ( m_Clusters[iStartCluster].vecCenter - vecEnd ).Length(), iStartCluster };
+	openList.Insert( start );
+
+	bool bFound = false;
+	while ( openList.Count() )
+	{
+		AI_ClusterOpen_t current = openList.ElementAtHead();
+		openList.RemoveAtHead();
+
+		if ( current.iCluster == iEndCluster )
+		{
+			bFound = true;
+			break;
+		}
+
+		const Cluster_t &cluster = m_Clusters[current.iCluster];
+
+		// Skip entries left behind when a cheaper route to this cluster was found
+		if ( current.f > pG[current.iCluster] + ( cluster.vecCenter - vecEnd ).Length() )
+			continue;
+
+		for ( int i = 0; i < cluster.links.Count(); i++ )
+		{
+			const ClusterLink_t &portal = cluster.links[i];
+			if ( !( portal.moveTypes[hull] & usableMoveTypes ) )
+				continue;
+
+			const Vector &vecNext = m_Clusters[portal.iCluster].vecCenter;
+			float g = pG[current.iCluster] + ( vecNext - cluster.vecCenter ).Length();
+			if ( g >= pG[portal.iCluster] )
+				continue;
+
+			pG[portal.iCluster] = g;
+			pParent[portal.iCluster] = current.iCluster;
+
+			AI_ClusterOpen_t next = { g + ( vecNext - vecEnd ).Length(), portal.iCluster };
+			openList.Insert( next );
+		}
+	}
+
+	if ( !bFound )
+		return false;
+
+	pCorridor->Resize( nClusters );
+	pCorridor->ClearAll();
+
+	for ( int iCluster = iEndCluster; iCluster != AI_CLUSTER_NONE; iCluster = pParent[iCluster] )
+	{
+		pCorridor->Set( iCluster );
+
+		const Cluster_t &cluster = m_Clusters[iCluster];
+		for ( int i = 0; i < cluster.links.Count(); i++ )
+		{
+			pCorridor->Set( cluster.links[i].iCluster );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Only cluster membership is written. Centers and portals are cheap
+//			to derive and depend on the dynamic link state at run time.
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkClusters::Save( CUtlBuffer &buf ) const
+{
+	buf.PutInt( AI_CLUSTER_FILE_TAG );
+	buf.PutInt( AI_CLUSTER_FILE_VERSION );
+	buf.PutInt( m_NodeCluster.Count() );
+	buf.PutInt( m_Clusters.Count() );
+
+	for ( int i = 0; i < m_NodeCluster.Count(); i++ )
+	{
+		buf.PutShort( m_NodeCluster[i] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_NetworkClusters::Restore( CUtlBuffer &buf, CAI_Network *pNetwork )
+{
+	Purge();
+
+	if ( buf.GetBytesRemaining() < 4 * (int)sizeof(int) )
+		return false;
+
+	if ( buf.GetInt() != AI_CLUSTER_FILE_TAG || buf.GetInt() != AI_CLUSTER_FILE_VERSION )
+		return false;
+
+	int nNodes = buf.GetInt();
+	int nClusters = buf.GetInt();
+	if ( nNodes != pNetwork->NumNodes() || nClusters <= 0 || nClusters > nNodes || buf.GetBytesRemaining() < nNodes * (int)sizeof(short) )
+		return false;
+
+	m_NodeCluster.SetCount( nNodes );
+	m_Clusters.SetCount( nClusters );
+
+	CUtlVector<bool> used;
+	used.SetCount( nClusters );
+	for ( int i = 0; i < nClusters; i++ )
+	{
+		used[i] = false;
+	}
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		int iCluster = buf.GetShort();
+		if ( iCluster < 0 || iCluster >= nClusters )
+		{
+			Purge();
+			return false;
+		}
+		m_NodeCluster[i] = iCluster;
+		used[iCluster] = true;
+	}
+
+	for ( int i = 0; i < nClusters; i++ )
+	{
+		if ( !used[i] )
+		{
+			Purge();
+			return false;
+		}
+	}
+
+	FinishClusters( pNetwork );
+
+	return true;
+}
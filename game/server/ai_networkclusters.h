@@ -0,0 +1,89 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Coarse cluster/portal routing layer over the AI node graph
+//
+//=============================================================================//
+
+#ifndef AI_NETWORKCLUSTERS_H
+#define AI_NETWORKCLUSTERS_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "ai_hull.h"
+#include "utlvector.h"
+
+class CAI_Network;
+class CUtlBuffer;
+class CVarBitVec;
+
+//-----------------------------------------------------------------------------
+
+#define AI_CLUSTER_MAX_NODES	48
+#define AI_CLUSTER_NONE			-1
+
+//-----------------------------------------------------------------------------
+// CAI_NetworkClusters
+//
+// Purpose: Groups the nodes of a network into small connected clusters that
+//			never span a zone, and records which move types each hull can use
+//			to cross from one cluster to its neighbors. Long routes are planned
+//			over the clusters first; the node search is then confined to the
+//			resulting corridor.
+//-----------------------------------------------------------------------------
+
+class CAI_NetworkClusters
+{
+public:
+	CAI_NetworkClusters();
+
+	void	Purge();
+	void	Build( CAI_Network *pNetwork );
+
+	// False once nodes or links have been added to the network since the
+	// clusters were built or restored
+	bool	IsValidFor( const CAI_Network *pNetwork ) const;
+	int		NumClusters() const					{ return m_Clusters.Count(); }
+	int		GetNodeCluster( int nodeID ) const	{ return ( nodeID >= 0 && nodeID < m_NodeCluster.Count() ) ? m_NodeCluster[nodeID] : AI_CLUSTER_NONE; }
+	bool	AreNeighbors( int iCluster1, int iCluster2 ) const;
+
+	// Recomputes the portals of the clusters on either end of a link, used
+	// when a dynamic link is switched on or off
+	void	OnLinkStateChanged( CAI_Network *pNetwork, int srcID, int destID );
+
+	// Plans a route over the clusters and marks every cluster on it, plus the
+	// clusters bordering it, in pCorridor. Returns false if no route exists
+	// for the hull and capabilities given.
+	bool	BuildCorridor( int iStartCluster, int iEndCluster, Hull_t hull, int capabilities, CVarBitVec *pCorridor ) const;
+
+	void	Save( CUtlBuffer &buf ) const;
+	bool	Restore( CUtlBuffer &buf, CAI_Network *pNetwork );
+
+private:
+	struct ClusterLink_t
+	{
+		short	iCluster;
+		byte	moveTypes[NUM_HULLS];			// Union of the move types of every usable link crossing into iCluster
+	};
+
+	struct Cluster_t
+	{
+		Vector						vecCenter;
+		int							iFirstNode;		// Into m_ClusterNodes
+		int							nNodes;
+		CUtlVector<ClusterLink_t>	links;
+	};
+
+	void	FinishClusters( CAI_Network *pNetwork );
+	void	BuildClusterLinks( CAI_Network *pNetwork, int iCluster );
+
+	CUtlVector<short>		m_NodeCluster;		// Cluster index of each node
+	CUtlVector<short>		m_ClusterNodes;		// Node IDs grouped by cluster
+	CUtlVector<Cluster_t>	m_Clusters;
+	int						m_nNetworkChangeCount;	// CAI_Network::GetChangeCount() when the clusters were made
+};
+
+//-----------------------------------------------------------------------------
+
+#endif // AI_NETWORKCLUSTERS_H
@@ -25,6 +25,7 @@
 #include "ndebugoverlay.h"
 #include "ai_hint.h"
 #include "tier0/icommandline.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -70,6 +71,8 @@ CON_COMMAND( ai_debug_node_connect, "Debug the attempted connection between two
 
 ConVar g_ai_norebuildgraph( "ai_norebuildgraph", "1" ); // TE120
 
+ConVar ai_graph_build_threaded( "ai_graph_build_threaded", "1", 0, "Run the line of sight traces of a full node graph build on the thread pool" );
+
 
 //-----------------------------------------------------------------------------
 // CAI_NetworkManager
@@ -344,6 +347,11 @@ void CAI_NetworkManager::SaveNetworkGraph( void )
 		buf.PutInt( GetEditOps()->m_pNodeIndexTable[node] );
 	}
 
+	// -------------------------------
+	// Dump routing clusters. Older readers stop before this block.
+	// -------------------------------
+	m_pNetwork->GetClusters().Save( buf );
+
 	// -------------------------------
 	// Write the file out
 	// -------------------------------
@@ -673,6 +681,14 @@ void CAI_NetworkManager::LoadNetworkGraph( void )
 		GetEditOps()->m_pNodeIndexTable[node] = buf.GetInt();
 	}
 
+	// -------------------------------
+	// Load routing clusters, graphs saved before they existed build them now
+	// -------------------------------
+	if ( !m_pNetwork->GetClusters().Restore( buf, m_pNetwork ) )
+	{
+		m_pNetwork->GetClusters().Build( m_pNetwork );
+	}
+
 	
 #if 1
 	CUtlRBTree<int> usedIds;
@@ -2168,6 +2184,7 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 	{
 		m_NeighborsTable[i].Resize( nNodes );
 	}
+	InitCandidates( pNetwork );
 	for (i = 0; i < nNodes; i++)
 	{
 		// If near point of change recalculate
@@ -2200,6 +2217,11 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 		}
 	}
 
+	// ---------------------------
+	// Regroup nodes into routing clusters
+	// ---------------------------
+	pNetwork->GetClusters().Build( pNetwork );
+
 	g_pAINetworkManager->FixupHints();
 
 	EndBuild();
@@ -2207,6 +2229,63 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 
 //-----------------------------------------------------------------------------
 
+static int __cdecl CompareNodeIDs( const int *pLeft, const int *pRight )
+{
+	return ( *pLeft - *pRight );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The line of sight test InitVisibility uses between two nodes
+//-----------------------------------------------------------------------------
+
+static bool TestNodeVisibility( const Vector &srcPos, const Vector &destPos )
+{
+	trace_t	tr;
+	tr.m_pEnt = NULL;
+
+	// Try several line of sight checks
+
+	// ------------------
+	//  Bottom to bottom
+	// ------------------
+	AI_TraceLine ( srcPos, destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+	{
+		return true;
+	}
+
+	// ------------------
+	//  Top to top
+	// ------------------
+	AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+	{	
+		return true;
+	}
+
+	// ------------------
+	//  Top to Bottom
+	// ------------------
+	AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+	{	
+		return true;
+	}
+
+	// ------------------
+	//  Bottom to Top
+	// ------------------
+	AI_TraceLine ( srcPos,destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+	{	
+		return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
 void CAI_NetworkBuilder::BeginBuild()
 {
 	m_pTestHull = CAI_TestHull::GetTestHull();
@@ -2218,9 +2297,196 @@ void CAI_NetworkBuilder::EndBuild()
 {
 	m_NeighborsTable.SetSize(0);
 	m_DidSetNeighborsTable.Resize(0);
+	m_Candidates.Purge();
+	m_PrecomputedVisTable.Purge();
+	m_NodeDeletedAtPass.Purge();
+	m_pPrecomputeNetwork = NULL;
+	m_bUsePrecomputedVis = false;
 	CAI_TestHull::ReturnTestHull();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the nodes in a uniform grid no finer than the longest
+//			possible link and records, for every node, the nodes close enough
+//			to ever become its neighbor
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkBuilder::InitCandidates( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+
+	Vector mins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector maxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	int i;
+	for ( i = 0; i < nNodes; i++ )
+	{
+		VectorMin( ppNodes[i]->GetOrigin(), mins, mins );
+		VectorMax( ppNodes[i]->GetOrigin(), maxs, maxs );
+	}
+
+	const int MAX_CELLS_PER_AXIS = 64;
+	Vector extent = maxs - mins;
+	float flCellSize = MAX( (float)MAX_AIR_NODE_LINK_DIST, MAX( extent.x, MAX( extent.y, extent.z ) ) / MAX_CELLS_PER_AXIS );
+
+	int dims[3];
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		dims[axis] = MIN( (int)( extent[axis] / flCellSize ) + 1, MAX_CELLS_PER_AXIS );
+	}
+
+	int *pNodeCell = (int *)stackalloc( nNodes * sizeof(int) );
+	int *pNodeCoords = (int *)stackalloc( nNodes * 3 * sizeof(int) );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		Vector offset = ppNodes[i]->GetOrigin() - mins;
+		int *pCoords = &pNodeCoords[i * 3];
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			pCoords[axis] = clamp( (int)( offset[axis] / flCellSize ), 0, dims[axis] - 1 );
+		}
+		pNodeCell[i] = ( pCoords[2] * dims[1] + pCoords[1] ) * dims[0] + pCoords[0];
+	}
+
+	// Counting sort of node IDs by cell, IDs stay ascending within a cell
+	int nCells = dims[0] * dims[1] * dims[2];
+	CUtlVector<int> cellStart;
+	cellStart.SetCount( nCells + 1 );
+	memset( cellStart.Base(), 0, cellStart.Count() * sizeof(int) );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		cellStart[pNodeCell[i] + 1]++;
+	}
+	for ( i = 0; i < nCells; i++ )
+	{
+		cellStart[i + 1] += cellStart[i];
+	}
+
+	CUtlVector<int> cellNodes;
+	cellNodes.SetCount( nNodes );
+	CUtlVector<int> cellFill;
+	cellFill.CopyArray( cellStart.Base(), nCells );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		cellNodes[cellFill[pNodeCell[i]]++] = i;
+	}
+
+	m_Candidates.SetSize( nNodes );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		CUtlVector<int> &candidates = m_Candidates[i];
+		candidates.RemoveAll();
+
+		const Vector &origin = ppNodes[i]->GetOrigin();
+		const int *pCoords = &pNodeCoords[i * 3];
+
+		for ( int z = MAX( pCoords[2] - 1, 0 ); z <= MIN( pCoords[2] + 1, dims[2] - 1 ); z++ )
+		{
+			for ( int y = MAX( pCoords[1] - 1, 0 ); y <= MIN( pCoords[1] + 1, dims[1] - 1 ); y++ )
+			{
+				for ( int x = MAX( pCoords[0] - 1, 0 ); x <= MIN( pCoords[0] + 1, dims[0] - 1 ); x++ )
+				{
+					int cell = ( z * dims[1] + y ) * dims[0] + x;
+					for ( int j = cellStart[cell]; j < cellStart[cell + 1]; j++ )
+					{
+						int other = cellNodes[j];
+						if ( ( ppNodes[other]->GetOrigin() - origin ).LengthSqr() <= MAX_AIR_NODE_LINK_DIST_SQ )
+						{
+							candidates.AddToTail( other );
+						}
+					}
+				}
+			}
+		}
+
+		candidates.Sort( CompareNodeIDs );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs the line of sight traces of every InitVisibility pass up
+//			front on the thread pool. InitVisibility then runs serially as
+//			before, reading the results, so the graph is identical to a
+//			serial build.
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkBuilder::PrecomputeVisibility( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+
+	// Replay the duplicate node removal InitVisibility performs as it walks
+	// the nodes in order, so the workers know which pairs it will trace
+	m_NodeDeletedAtPass.SetCount( nNodes );
+	int i;
+	for ( i = 0; i < nNodes; i++ )
+	{
+		m_NodeDeletedAtPass[i] = ( ppNodes[i]->GetType() == NODE_DELETED ) ? -1 : INT_MAX;
+	}
+
+	CUtlVector<int> sources;
+	for ( i = 0; i < nNodes; i++ )
+	{
+		if ( m_NodeDeletedAtPass[i] < i )
+			continue;
+
+		sources.AddToTail( i );
+
+		for ( int j = 0; j < m_Candidates[i].Count(); j++ )
+		{
+			int test = m_Candidates[i][j];
+			if ( test != i && m_NodeDeletedAtPass[test] == INT_MAX &&
+				 ppNodes[test]->GetOrigin() == ppNodes[i]->GetOrigin() && ppNodes[test]->GetType() != NODE_CLIMB )
+			{
+				m_NodeDeletedAtPass[test] = i;
+			}
+		}
+	}
+
+	m_PrecomputedVisTable.SetSize( nNodes );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		m_PrecomputedVisTable[i].Resize( nNodes );
+		m_PrecomputedVisTable[i].ClearAll();
+	}
+
+	m_pPrecomputeNetwork = pNetwork;
+	ParallelProcess( "CAI_NetworkBuilder::PrecomputeVisibility", sources.Base(), sources.Count(), this, &CAI_NetworkBuilder::PrecomputeNodeVisibility );
+	m_pPrecomputeNetwork = NULL;
+
+	m_bUsePrecomputedVis = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Worker for PrecomputeVisibility. Only writes the row of iNode.
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkBuilder::PrecomputeNodeVisibility( int &iNode )
+{
+	CAI_Node **ppNodes = m_pPrecomputeNetwork->AccessNodes();
+	CAI_Node *pNode = ppNodes[iNode];
+	Vector srcPos = pNode->GetPosition(HULL_SMALL_CENTERED);
+
+	const CUtlVector<int> &candidates = m_Candidates[iNode];
+	for ( int j = 0; j < candidates.Count(); j++ )
+	{
+		// Lower numbered nodes reuse their own result, see InitVisibility
+		int test = candidates[j];
+		if ( test <= iNode || m_NodeDeletedAtPass[test] <= iNode )
+			continue;
+
+		CAI_Node *pTestNode = ppNodes[test];
+		float flDistToCheckNode = ( pTestNode->GetOrigin() - pNode->GetOrigin() ).LengthSqr(); 
+		if ( flDistToCheckNode > ( ( pTestNode->GetType() == NODE_AIR ) ? MAX_AIR_NODE_LINK_DIST_SQ : MAX_NODE_LINK_DIST_SQ ) )
+			continue;
+
+		if ( TestNodeVisibility( srcPos, pTestNode->GetPosition(HULL_SMALL_CENTERED) ) )
+		{
+			m_PrecomputedVisTable[iNode].Set( test );
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:  Only called if network has changed since last time level
 //			 was loaded
@@ -2276,6 +2542,11 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 		m_NeighborsTable[i].Resize( nNodes );
 		m_NeighborsTable[i].ClearAll();
 	}
+	InitCandidates( pNetwork );
+	if ( ai_graph_build_threaded.GetBool() )
+	{
+		PrecomputeVisibility( pNetwork );
+	}
 	for (i = 0; i < nNodes; i++)
 	{	
 		InitNeighbors( pNetwork, ppNodes[i] );
@@ -2316,8 +2587,17 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 	timer.Start();
 	InitZones( pNetwork);
 	timer.End();
-	masterTimer.End();
 	DevMsg( "...done determining zones. %f seconds\n", timer.GetDuration().GetSeconds() );
+
+	// ------------------------------
+	// Group nodes into routing clusters
+	// ------------------------------
+	DevMsg( "Determining clusters...\n" );
+	timer.Start();
+	pNetwork->GetClusters().Build( pNetwork );
+	timer.End();
+	masterTimer.End();
+	DevMsg( "...done determining clusters. %f seconds\n", timer.GetDuration().GetSeconds() );
 	DevMsg( "...done building AI node graph, %f seconds\n", masterTimer.GetDuration().GetSeconds() );
 
 	g_pAINetworkManager->FixupHints();
@@ -2626,9 +2906,11 @@ void CAI_NetworkBuilder::InitVisibility(CAI_Network *pNetwork, CAI_Node *pNode)
 	// position using the smallest hull to make sure were not in geometry
 	Vector srcPos = pNode->GetPosition(HULL_SMALL_CENTERED);
 
-	// Check the visibility on every other node in the network
-	for (int testnode = 0; testnode < pNetwork->NumNodes(); testnode++ )
+	// Check the visibility on every other node in link range
+	const CUtlVector<int> &candidates = m_Candidates[pNode->m_iID];
+	for (int iCandidate = 0; iCandidate < candidates.Count(); iCandidate++ )
   	{
+		int testnode = candidates[iCandidate];
 		CAI_Node *testNode = pNetwork->GetNode( testnode );
 
 		if ( DebuggingConnect( pNode->m_iID, testnode ) )
@@ -2678,61 +2960,20 @@ void CAI_NetworkBuilder::InitVisibility(CAI_Network *pNetwork, CAI_Node *pNode)
 				continue;
 		}
 
-		// The actual position of some nodes may be inside geometry as they have
-		// hull specific position offsets (e.g. climb nodes).  Get the hull specific 
-		// position using the smallest hull to make sure were not in geometry
-		Vector destPos = pNetwork->GetNode( testnode )->GetPosition(HULL_SMALL_CENTERED);
-
-		trace_t	tr;
-		tr.m_pEnt = NULL;
-
-		// Try several line of sight checks
-
-		bool isVisible = false;
-
-		// ------------------
-		//  Bottom to bottom
-		// ------------------
-		AI_TraceLine ( srcPos, destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-		if (!tr.startsolid && tr.fraction == 1.0)
-		{
-			isVisible = true;
-		}
+		bool isVisible;
 
-		// ------------------
-		//  Top to top
-		// ------------------
-		if (!isVisible)
+		if ( m_bUsePrecomputedVis )
 		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = m_PrecomputedVisTable[pNode->m_iID].IsBitSet( testnode );
 		}
-
-		// ------------------
-		//  Top to Bottom
-		// ------------------
-		if (!isVisible)
+		else
 		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
-		}
+			// The actual position of some nodes may be inside geometry as they have
+			// hull specific position offsets (e.g. climb nodes).  Get the hull specific 
+			// position using the smallest hull to make sure were not in geometry
+			Vector destPos = pNetwork->GetNode( testnode )->GetPosition(HULL_SMALL_CENTERED);
 
-		// ------------------
-		//  Bottom to Top
-		// ------------------
-		if (!isVisible)
-		{
-			AI_TraceLine ( srcPos,destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = TestNodeVisibility( srcPos, destPos );
 		}
 
 		// ------------------
@@ -2809,9 +3050,12 @@ void CAI_NetworkBuilder::InitNeighbors(CAI_Network *pNetwork, CAI_Node *pNode)
 	AI_PROFILE_SCOPE_BEGIN( CAI_Node_InitNeighbors );
 
 	// Now check each neighbor against all other neighbors to see if one of
-	// them is a redundant connection
-	for (int checknode = 0; checknode < pNetwork->NumNodes(); checknode++ )
+	// them is a redundant connection. Neighbors are always link range candidates.
+	const CUtlVector<int> &candidates = m_Candidates[pNode->m_iID];
+	for (int iCheck = 0; iCheck < candidates.Count(); iCheck++ )
 	{
+		int checknode = candidates[iCheck];
+
 		if ( DebuggingConnect( pNode->m_iID, checknode ) )
 		{
 			DevMsg( " " ); // break here..
@@ -2832,8 +3076,10 @@ void CAI_NetworkBuilder::InitNeighbors(CAI_Network *pNetwork, CAI_Node *pNode)
 
 		CAI_Node *pCheckNode = pNetwork->GetNode(checknode);
 
-		for (int testnode = 0; testnode < pNetwork->NumNodes(); testnode++ )
+		for (int iTest = 0; iTest < candidates.Count(); iTest++ )
 		{
+			int testnode = candidates[iTest];
+
 			// don't check against itself
 			if (( testnode == checknode ) || (testnode == pNode->m_iID))
 			{
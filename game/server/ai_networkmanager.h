@@ -117,9 +117,19 @@ private:
 	void 			BeginBuild();
 	void			EndBuild();
 
+	void			InitCandidates( CAI_Network *pNetwork );
+	void			PrecomputeVisibility( CAI_Network *pNetwork );
+	void			PrecomputeNodeVisibility( int &iNode );
+
 	CUtlVector<CVarBitVec>	m_NeighborsTable;
 	CVarBitVec				m_DidSetNeighborsTable;
 	CAI_TestHull *			m_pTestHull;
+
+	CUtlVector< CUtlVector<int> >	m_Candidates;			// Nodes within link range of each node, in ID order
+	CUtlVector<CVarBitVec>	m_PrecomputedVisTable;		// Line of sight from each node to higher numbered candidates
+	CUtlVector<int>			m_NodeDeletedAtPass;		// Which InitVisibility pass removes a duplicate node
+	CAI_Network *			m_pPrecomputeNetwork;
+	bool					m_bUsePrecomputedVis;
 };
 
 extern CAI_NetworkBuilder g_AINetworkBuilder;
@@ -21,10 +21,13 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "vstdlib/random.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
 
+extern CBaseEntity *FindPickerEntity( CBasePlayer *pPlayer );
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -272,6 +275,183 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// CAI_PathfindScratch
+//
+// Purpose: Per-query A* state used by FindBestPath. Storage is sized to the
+//			network once and reused across queries; a search serial marks
+//			which entries belong to the current query, so nothing is cleared
+//			per call. The open list is an indexed binary heap on F with
+//			decrease-key. Ties are broken on node ID so nodes are expanded in
+//			exactly the order the old linear FindBSSmallest scan produced.
+//-----------------------------------------------------------------------------
+
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iSerial( 0 )
+	{
+	}
+
+	void BeginSearch( int nNodes )
+	{
+		if ( m_Nodes.Count() < nNodes )
+		{
+			int iFirstNew = m_Nodes.Count();
+			m_Nodes.AddMultipleToTail( nNodes - iFirstNew );
+			m_Parents.AddMultipleToTail( nNodes - iFirstNew );
+			for ( int i = iFirstNew; i < nNodes; i++ )
+			{
+				m_Nodes[i].serial = 0;
+			}
+		}
+
+		if ( ++m_iSerial == 0 )
+		{
+			// Serial wrapped, stale stamps could alias the new search
+			for ( int i = 0; i < m_Nodes.Count(); i++ )
+			{
+				m_Nodes[i].serial = 0;
+			}
+			m_iSerial = 1;
+		}
+
+		m_Heap.RemoveAll();
+	}
+
+	bool	IsVisited( int id ) const	{ return ( m_Nodes[id].serial == m_iSerial ); }
+	float	GetG( int id ) const		{ return m_Nodes[id].g; }
+	int *	GetParents()				{ return m_Parents.Base(); }
+	bool	IsOpenEmpty() const			{ return ( m_Heap.Count() == 0 ); }
+
+	// Records new costs for a node and places it on the open list, moving it
+	// within the heap if it is already there
+	void Open( int id, int parentID, float g, float f )
+	{
+		Node_t &node = m_Nodes[id];
+		if ( node.serial != m_iSerial )
+		{
+			node.serial = m_iSerial;
+			node.heapIndex = -1;
+		}
+
+		node.g = g;
+		node.f = f;
+		m_Parents[id] = parentID;
+
+		if ( node.heapIndex == -1 )
+		{
+			node.heapIndex = m_Heap.AddToTail( id );
+			SiftUp( node.heapIndex );
+		}
+		else
+		{
+			SiftUp( node.heapIndex );
+			SiftDown( node.heapIndex );
+		}
+	}
+
+	int PopSmallest()
+	{
+		Assert( m_Heap.Count() );
+		int id = m_Heap[0];
+		m_Nodes[id].heapIndex = -1;
+
+		int iLast = m_Heap.Count() - 1;
+		if ( iLast > 0 )
+		{
+			m_Heap[0] = m_Heap[iLast];
+			m_Nodes[m_Heap[0]].heapIndex = 0;
+			m_Heap.FastRemove( iLast );
+			SiftDown( 0 );
+		}
+		else
+		{
+			m_Heap.RemoveAll();
+		}
+		return id;
+	}
+
+private:
+	struct Node_t
+	{
+		float			g;
+		float			f;
+		int				heapIndex;
+		unsigned int	serial;
+	};
+
+	bool IsBefore( int idA, int idB ) const
+	{
+		float fA = m_Nodes[idA].f;
+		float fB = m_Nodes[idB].f;
+		return ( fA < fB || ( fA == fB && idA < idB ) );
+	}
+
+	void Swap( int i, int j )
+	{
+		int id = m_Heap[i];
+		m_Heap[i] = m_Heap[j];
+		m_Heap[j] = id;
+		m_Nodes[m_Heap[i]].heapIndex = i;
+		m_Nodes[m_Heap[j]].heapIndex = j;
+	}
+
+	void SiftUp( int i )
+	{
+		while ( i > 0 )
+		{
+			int parent = ( i - 1 ) >> 1;
+			if ( !IsBefore( m_Heap[i], m_Heap[parent] ) )
+				break;
+			Swap( i, parent );
+			i = parent;
+		}
+	}
+
+	void SiftDown( int i )
+	{
+		int count = m_Heap.Count();
+		for ( ;; )
+		{
+			int child = ( i << 1 ) + 1;
+			if ( child >= count )
+				break;
+			if ( child + 1 < count && IsBefore( m_Heap[child + 1], m_Heap[child] ) )
+				child++;
+			if ( !IsBefore( m_Heap[child], m_Heap[i] ) )
+				break;
+			Swap( i, child );
+			i = child;
+		}
+	}
+
+	CUtlVector<Node_t>	m_Nodes;
+	CUtlVector<int>		m_Parents;		// Kept apart so MakeRouteFromParents can walk it directly
+	CUtlVector<int>		m_Heap;
+	unsigned int		m_iSerial;
+};
+
+static CAI_PathfindScratch g_AIPathfindScratch;
+
+//-----------------------------------------------------------------------------
+
+struct AI_PathfindQuery_t
+{
+	int startID;
+	int endID;
+};
+
+#define AI_PATHFIND_MAX_RECORDED 4096
+
+static CUtlVector<AI_PathfindQuery_t> g_AIPathfindQueries;
+
+ConVar ai_pathfind_record( "ai_pathfind_record", "0", FCVAR_CHEAT, "Record FindBestPath start/end node pairs for replay by ai_pathfind_benchmark" );
+ConVar ai_pathfind_hierarchical( "ai_pathfind_hierarchical", "1", 0, "Plan long node routes over the network clusters first and search only the resulting corridor" );
+
+static CVarBitVec g_AIPathfindCorridor;
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -287,38 +467,60 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	m_nPerfStatPB++;
 #endif
 
-	int nNodes = GetNetwork()->NumNodes();
-	CAI_Node **pAInode = GetNetwork()->AccessNodes();
-
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
-
-	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
+	if ( ai_pathfind_record.GetBool() && g_AIPathfindQueries.Count() < AI_PATHFIND_MAX_RECORDED )
+	{
+		AI_PathfindQuery_t query = { startID, endID };
+		g_AIPathfindQueries.AddToTail( query );
+	}
 
-	for (int node=0;node<nNodes;node++)
+	// Routes that leave the neighborhood of the start are planned over the
+	// clusters first. Clusters only approximate connectivity for a given NPC,
+	// so whenever the corridor fails fall back to the whole graph.
+	const CAI_NetworkClusters &clusters = GetNetwork()->GetClusters();
+	if ( ai_pathfind_hierarchical.GetBool() && clusters.IsValidFor( GetNetwork() ) )
 	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
+		int iStartCluster = clusters.GetNodeCluster( startID );
+		int iEndCluster = clusters.GetNodeCluster( endID );
+
+		if ( iStartCluster != iEndCluster && !clusters.AreNeighbors( iStartCluster, iEndCluster ) )
+		{
+			if ( clusters.BuildCorridor( iStartCluster, iEndCluster, GetHullType(), CapabilitiesGet(), &g_AIPathfindCorridor ) )
+			{
+				AI_Waypoint_t *pRoute = FindBestPathInCorridor( startID, endID, &g_AIPathfindCorridor );
+				if ( pRoute )
+					return pRoute;
+			}
+		}
 	}
 
-	nodeG[startID] = 0;
+	return FindBestPathInCorridor( startID, endID, NULL );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A* over the nodes, optionally limited to the clusters set in
+//			pCorridor
+//-----------------------------------------------------------------------------
+
+AI_Waypoint_t *CAI_Pathfinder::FindBestPathInCorridor( int startID, int endID, const CVarBitVec *pCorridor )
+{
+	const CAI_NetworkClusters &clusters = GetNetwork()->GetClusters();
+
+	int nNodes = GetNetwork()->NumNodes();
+	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+
+	// ------------- INITIALIZE ------------------------
+	CAI_PathfindScratch &scratch = g_AIPathfindScratch;
+	scratch.BeginSearch( nNodes );
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	const Vector &vecEnd = pAInode[endID]->GetPosition(GetHullType());
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
+	float startH = 0.1*(pAInode[startID]->GetPosition(GetHullType())-vecEnd).Length(); // Don't want to over estimate
+	scratch.Open( startID, NO_NODE, 0, startH );
 
 	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
+	while (!scratch.IsOpenEmpty()) 
 	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
+		int smallestID = scratch.PopSmallest();
 
 		CAI_Node *pSmallestNode = pAInode[smallestID];
 		
@@ -327,7 +529,7 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 
 		if (smallestID == endID) 
 		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
+			AI_Waypoint_t* route = MakeRouteFromParents(scratch.GetParents(), endID);
 			return route;
 		}
 
@@ -351,17 +553,15 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			if ( dist == FLT_MAX )
 				continue;
 
-			float new_g  = nodeG[smallestID] + dist;
+			if ( pCorridor && !pCorridor->IsBitSet( clusters.GetNodeCluster( testID ) ) )
+				continue;
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
-			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
+			float new_g  = scratch.GetG(smallestID) + dist;
 
-				closeBS.Set( testID );
-				openBS.Set( testID );
+			if ( !scratch.IsVisited(testID) || (new_g < scratch.GetG(testID)) ) 
+			{
+				float new_h = (r2-vecEnd).Length();
+				scratch.Open( testID, smallestID, new_g, new_g + new_h );
 			}
 		}
 	}
@@ -369,6 +569,101 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	return NULL;   
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Replays recorded (or random) node pairs through FindBestPath on
+//			the loaded graph and reports throughput
+//-----------------------------------------------------------------------------
+
+CON_COMMAND_F( ai_pathfind_benchmark, "Replays node routes recorded with ai_pathfind_record through FindBestPath and reports queries/sec.\n\tArguments:	[passes] [npc name]  (picks the NPC under the crosshair, then the first NPC, if no name given)", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !g_pBigAINet || !g_pBigAINet->NumNodes() )
+	{
+		Msg( "ai_pathfind_benchmark: no node graph loaded\n" );
+		return;
+	}
+
+	int nPasses = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10;
+
+	CAI_BaseNPC *pNPC = NULL;
+	if ( args.ArgC() > 2 )
+	{
+		CBaseEntity *pEntity = gEntList.FindEntityByName( NULL, args[2] );
+		pNPC = ( pEntity ) ? pEntity->MyNPCPointer() : NULL;
+	}
+	else
+	{
+		CBaseEntity *pEntity = FindPickerEntity( UTIL_GetCommandClient() );
+		pNPC = ( pEntity ) ? pEntity->MyNPCPointer() : NULL;
+		if ( !pNPC && g_AI_Manager.NumAIs() )
+		{
+			pNPC = g_AI_Manager.AccessAIs()[0];
+		}
+	}
+
+	if ( !pNPC || !pNPC->GetPathfinder() )
+	{
+		Msg( "ai_pathfind_benchmark: no NPC to path with\n" );
+		return;
+	}
+
+	int nNodes = g_pBigAINet->NumNodes();
+
+	CUtlVector<AI_PathfindQuery_t> queries;
+	for ( int i = 0; i < g_AIPathfindQueries.Count(); i++ )
+	{
+		if ( g_AIPathfindQueries[i].startID < nNodes && g_AIPathfindQueries[i].endID < nNodes )
+		{
+			queries.AddToTail( g_AIPathfindQueries[i] );
+		}
+	}
+
+	if ( !queries.Count() )
+	{
+		// Nothing recorded on this graph, use a fixed random set so runs are comparable
+		CUniformRandomStream stream;
+		stream.SetSeed( nNodes );
+		for ( int i = 0; i < 256; i++ )
+		{
+			AI_PathfindQuery_t query = { stream.RandomInt( 0, nNodes - 1 ), stream.RandomInt( 0, nNodes - 1 ) };
+			queries.AddToTail( query );
+		}
+		Msg( "ai_pathfind_benchmark: no recorded routes for this graph, using %d random pairs\n", queries.Count() );
+	}
+
+	bool bWasRecording = ai_pathfind_record.GetBool();
+	ai_pathfind_record.SetValue( 0 );
+
+	int nFound = 0;
+	double flStart = Plat_FloatTime();
+	for ( int pass = 0; pass < nPasses; pass++ )
+	{
+		for ( int i = 0; i < queries.Count(); i++ )
+		{
+			AI_Waypoint_t *pRoute = pNPC->GetPathfinder()->FindBestPath( queries[i].startID, queries[i].endID );
+			if ( pRoute )
+			{
+				nFound++;
+				DeleteAll( pRoute );
+			}
+		}
+	}
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	ai_pathfind_record.SetValue( bWasRecording );
+
+	int nQueries = nPasses * queries.Count();
+	Msg( "ai_pathfind_benchmark: %d queries (%d routed) on %d nodes in %.2f ms, %.0f queries/sec (%s)\n",
+		 nQueries, nFound, nNodes, flElapsed * 1000.0, ( flElapsed > 0 ) ? nQueries / flElapsed : 0.0, pNPC->GetDebugName() );
+}
+
+CON_COMMAND_F( ai_pathfind_record_clear, "Discards the node routes recorded by ai_pathfind_record", FCVAR_CHEAT )
+{
+	g_AIPathfindQueries.Purge();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Find a short random path of at least pathLength distance.  If
 //			vDirection is given random path will expand in the given direction,
@@ -21,6 +21,7 @@ struct AI_Waypoint_t;
 class CAI_Link;
 class CAI_Network;
 class CAI_Node;
+class CVarBitVec;
 
 
 //-----------------------------------------------------------------------------
@@ -116,6 +117,7 @@ private:
 
 	//---------------------------------
 	
+	AI_Waypoint_t*	FindBestPathInCorridor( int startID, int endID, const CVarBitVec *pCorridor );
 	AI_Waypoint_t*	MakeRouteFromParents(int *parentArray, int endID);
 	AI_Waypoint_t*	CreateNodeWaypoint( Hull_t hullType, int nodeID, int nodeFlags = 0 );
 	
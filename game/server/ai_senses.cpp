@@ -35,9 +35,18 @@ const float AI_EFFICIENT_NPC_SEARCH_TIME = .35;
 const float AI_HIGH_PRIORITY_SEARCH_TIME = 0.15;
 const float AI_MISC_SEARCH_TIME  = 0.45;
 
+// Things are bucketed once a tick but move as they think, so the shared sight
+// queries are padded by this much
+const float AI_SHARED_SIGHT_SLACK = 64;
+const float AI_SHARED_SIGHT_CELL_SIZE = 1024;
+
+ConVar ai_shared_sight( "ai_shared_sight", "1", FCVAR_NONE, "Gather NPC sight candidates once a tick from a spatial grid instead of having every NPC test every other" );
+ConVar ai_shared_sight_stats( "ai_shared_sight_stats", "0", FCVAR_NONE, "Show the pairs tested and LOS tests made by NPC sight gathering each tick" );
+
 //-----------------------------------------------------------------------------
 
 CAI_SensedObjectsManager g_AI_SensedObjectsManager;
+CAI_SharedSight g_AI_SharedSight;
 
 //-----------------------------------------------------------------------------
 
@@ -167,7 +176,11 @@ bool CAI_Senses::ShouldSeeEntity( CBaseEntity *pSightEnt )
 
 bool CAI_Senses::CanSeeEntity( CBaseEntity *pSightEnt )
 {
-	return ( GetOuter()->FInViewCone( pSightEnt ) && GetOuter()->FVisible( pSightEnt ) );
+	if ( !GetOuter()->FInViewCone( pSightEnt ) )
+		return false;
+
+	g_AI_SharedSight.CountLOSTest();
+	return GetOuter()->FVisible( pSightEnt );
 }
 
 #ifdef PORTAL
@@ -459,14 +472,33 @@ int CAI_Senses::LookForNPCs( int iDistance )
 			BeginGather();
 
 			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
-			
-			for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+
+			const unsigned short *pCandidates;
+			int nCandidates;
+			if ( g_AI_SharedSight.GetNPCCandidates( GetOuter(), iDistance, &pCandidates, &nCandidates ) )
 			{
-				if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+				for ( i = 0; i < nCandidates; i++ )
 				{
-					if ( Look( ppAIs[i] ) )
+					CAI_BaseNPC *pNPC = ppAIs[ pCandidates[i] ];
+					if ( pNPC != GetOuter() && ( pNPC->ShouldNotDistanceCull() || origin.DistToSqr(pNPC->GetAbsOrigin()) < distSq ) )
 					{
-						nSeen++;
+						if ( Look( pNPC ) )
+						{
+							nSeen++;
+						}
+					}
+				}
+			}
+			else
+			{
+				for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+				{
+					if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+					{
+						if ( Look( ppAIs[i] ) )
+						{
+							nSeen++;
+						}
 					}
 				}
 			}
@@ -516,18 +548,38 @@ int CAI_Senses::LookForObjects( int iDistance )
 
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
-		int iter;
-		CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
-		while ( pEnt )
+
+		const unsigned short *pCandidates;
+		int nCandidates;
+		if ( g_AI_SharedSight.GetObjectCandidates( origin, iDistance, &pCandidates, &nCandidates ) )
 		{
-			if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+			for ( int i = 0; i < nCandidates; i++ )
 			{
-				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+				CBaseEntity *pEnt = g_AI_SensedObjectsManager.Get( pCandidates[i] );
+				if ( pEnt && ( pEnt->GetFlags() & BOX_QUERY_MASK ) )
 				{
-					nSeen++;
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
 				}
 			}
-			pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+		}
+		else
+		{
+			int iter;
+			CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+			while ( pEnt )
+			{
+				if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+				{
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
+				}
+				pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+			}
 		}
 		
 		EndGather( nSeen, &m_SeenMisc );
@@ -683,6 +735,7 @@ void CAI_SensedObjectsManager::Term()
 {
 	gEntList.RemoveListenerEntity( this );
 	m_SensedObjects.RemoveAll();
+	m_nChanges++;
 }
 
 //-----------------------------------------------------------------------------
@@ -721,6 +774,7 @@ void CAI_SensedObjectsManager::OnEntitySpawned( CBaseEntity *pEntity )
 	if ( ( pEntity->GetFlags() & FL_OBJECT ) && !pEntity->IsPlayer() && !pEntity->IsNPC() )
 	{
 		m_SensedObjects.AddToTail( pEntity );
+		m_nChanges++;
 	}
 }
 
@@ -732,7 +786,10 @@ void CAI_SensedObjectsManager::OnEntityDeleted( CBaseEntity *pEntity )
 	{
 		int i = m_SensedObjects.Find( pEntity );
 		if ( i != m_SensedObjects.InvalidIndex() )
+		{
 			m_SensedObjects.FastRemove( i );
+			m_nChanges++;
+		}
 	}
 }
 
@@ -747,6 +804,249 @@ void CAI_SensedObjectsManager::AddEntity( CBaseEntity *pEntity )
 	// Add the object flag so it gets removed when it dies
 	pEntity->AddFlag( FL_OBJECT );
 	m_SensedObjects.AddToTail( pEntity );
+	m_nChanges++;
+}
+
+//=============================================================================
+//
+// CAI_SharedSight
+//
+//=============================================================================
+
+CAI_SharedSight::CGrid::CGrid()
+{
+	RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::CGrid::RemoveAll()
+{
+	for ( int i = 0; i < HASH_SIZE; i++ )
+	{
+		m_Heads[i] = INVALID_ENTRY;
+	}
+	m_Entries.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::CGrid::Insert( const Vector &pos, int iItem )
+{
+	int x = (int)floor( pos.x / AI_SHARED_SIGHT_CELL_SIZE );
+	int y = (int)floor( pos.y / AI_SHARED_SIGHT_CELL_SIZE );
+	int iHash = HashCell( x, y );
+
+	int i = m_Entries.AddToTail();
+	m_Entries[i].x = x;
+	m_Entries[i].y = y;
+	m_Entries[i].iItem = iItem;
+	m_Entries[i].iNext = m_Heads[iHash];
+	m_Heads[iHash] = i;
+}
+
+//-----------------------------------------------------------------------------
+// Appends the items in every cell touching the square around center. Cells
+// sharing a hash bucket are told apart by their coordinates, so nothing is
+// returned twice.
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::CGrid::Query( const Vector &center, float flRadius, CUtlVector<unsigned short> *pResult ) const
+{
+	int x0 = (int)floor( ( center.x - flRadius ) / AI_SHARED_SIGHT_CELL_SIZE );
+	int x1 = (int)floor( ( center.x + flRadius ) / AI_SHARED_SIGHT_CELL_SIZE );
+	int y0 = (int)floor( ( center.y - flRadius ) / AI_SHARED_SIGHT_CELL_SIZE );
+	int y1 = (int)floor( ( center.y + flRadius ) / AI_SHARED_SIGHT_CELL_SIZE );
+
+	// Nothing is bucketed outside the world, however far the looker can see
+	const int nMaxCell = (int)( MAX_COORD_INTEGER / AI_SHARED_SIGHT_CELL_SIZE );
+	x0 = MAX( x0, -nMaxCell - 1 );
+	y0 = MAX( y0, -nMaxCell - 1 );
+	x1 = MIN( x1, nMaxCell );
+	y1 = MIN( y1, nMaxCell );
+
+	for ( int x = x0; x <= x1; x++ )
+	{
+		for ( int y = y0; y <= y1; y++ )
+		{
+			for ( unsigned short i = m_Heads[ HashCell( x, y ) ]; i != INVALID_ENTRY; i = m_Entries[i].iNext )
+			{
+				const Entry_t &entry = m_Entries[i];
+				if ( entry.x == x && entry.y == y )
+				{
+					pResult->AddToTail( entry.iItem );
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CAI_SharedSight::CAI_SharedSight()
+ :	m_iNPCTick( -1 ),
+	m_iNPCChanges( -1 ),
+	m_iObjectTick( -1 ),
+	m_iObjectChanges( -1 ),
+	m_iStatsTick( -1 ),
+	m_nNPCs( 0 ),
+	m_nNPCLooks( 0 ),
+	m_nNPCPairs( 0 ),
+	m_nObjectLooks( 0 ),
+	m_nObjectPairs( 0 ),
+	m_nLOSTests( 0 )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+static int __cdecl SharedSightIndexCompare( const unsigned short *pLeft, const unsigned short *pRight )
+{
+	return (int)*pLeft - (int)*pRight;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::UpdateNPCs()
+{
+	AI_PROFILE_SCOPE( CAI_SharedSight_UpdateNPCs );
+
+	m_iNPCTick = gpGlobals->tickcount;
+	m_iNPCChanges = g_AI_Manager.GetChangeCount();
+
+	m_NPCGrid.RemoveAll();
+	m_Uncullable.RemoveAll();
+
+	int nAIs = g_AI_Manager.NumAIs();
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < nAIs; i++ )
+	{
+		if ( ppAIs[i]->ShouldNotDistanceCull() )
+		{
+			m_Uncullable.AddToTail( i );
+		}
+		else
+		{
+			m_NPCGrid.Insert( ppAIs[i]->GetAbsOrigin(), i );
+		}
+	}
+
+	m_nNPCs = nAIs;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSight::GetNPCCandidates( CAI_BaseNPC *pLooker, int iDistance, const unsigned short **ppCandidates, int *pCount )
+{
+	if ( !ai_shared_sight.GetBool() )
+		return false;
+
+	UpdateStats();
+
+	if ( m_iNPCTick != gpGlobals->tickcount || m_iNPCChanges != g_AI_Manager.GetChangeCount() )
+	{
+		UpdateNPCs();
+	}
+
+	m_Candidates.RemoveAll();
+	m_NPCGrid.Query( pLooker->GetAbsOrigin(), iDistance + AI_SHARED_SIGHT_SLACK, &m_Candidates );
+	m_Candidates.AddMultipleToTail( m_Uncullable.Count(), m_Uncullable.Base() );
+
+	// Look at them in AI array order, as a full scan would
+	m_Candidates.Sort( SharedSightIndexCompare );
+
+	*ppCandidates = m_Candidates.Base();
+	*pCount = m_Candidates.Count();
+
+	m_nNPCLooks++;
+	m_nNPCPairs += m_Candidates.Count();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::UpdateObjects()
+{
+	AI_PROFILE_SCOPE( CAI_SharedSight_UpdateObjects );
+
+	m_iObjectTick = gpGlobals->tickcount;
+	m_iObjectChanges = g_AI_SensedObjectsManager.GetChangeCount();
+
+	m_ObjectGrid.RemoveAll();
+
+	int nObjects = g_AI_SensedObjectsManager.GetCount();
+	for ( int i = 0; i < nObjects; i++ )
+	{
+		CBaseEntity *pEnt = g_AI_SensedObjectsManager.Get( i );
+		if ( pEnt )
+		{
+			m_ObjectGrid.Insert( pEnt->GetAbsOrigin(), i );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SharedSight::GetObjectCandidates( const Vector &origin, int iDistance, const unsigned short **ppCandidates, int *pCount )
+{
+	if ( !ai_shared_sight.GetBool() )
+		return false;
+
+	UpdateStats();
+
+	if ( m_iObjectTick != gpGlobals->tickcount || m_iObjectChanges != g_AI_SensedObjectsManager.GetChangeCount() )
+	{
+		UpdateObjects();
+	}
+
+	m_Candidates.RemoveAll();
+	m_ObjectGrid.Query( origin, iDistance + AI_SHARED_SIGHT_SLACK, &m_Candidates );
+
+	// Keep the order of the object list
+	m_Candidates.Sort( SharedSightIndexCompare );
+
+	*ppCandidates = m_Candidates.Base();
+	*pCount = m_Candidates.Count();
+
+	m_nObjectLooks++;
+	m_nObjectPairs += m_Candidates.Count();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::CountLOSTest()
+{
+	UpdateStats();
+	m_nLOSTests++;
+}
+
+//-----------------------------------------------------------------------------
+// Shows the last tick's counts once a new tick starts
+//-----------------------------------------------------------------------------
+
+void CAI_SharedSight::UpdateStats()
+{
+	if ( m_iStatsTick == gpGlobals->tickcount )
+		return;
+
+	if ( ai_shared_sight_stats.GetBool() && m_iStatsTick != -1 )
+	{
+		// A full scan tests every other AI and every sensed object
+		int nNPCFull = m_nNPCLooks * MAX( m_nNPCs - 1, 0 );
+		int nObjectFull = m_nObjectLooks * g_AI_SensedObjectsManager.GetCount();
+		engine->Con_NPrintf( 0, "Shared sight, tick %d:  %d NPCs", m_iStatsTick, m_nNPCs );
+		engine->Con_NPrintf( 1, "  NPC looks:     %d, %d pairs considered (full scan %d)", m_nNPCLooks, m_nNPCPairs, nNPCFull );
+		engine->Con_NPrintf( 2, "  object looks:  %d, %d pairs considered (full scan %d)", m_nObjectLooks, m_nObjectPairs, nObjectFull );
+		engine->Con_NPrintf( 3, "  LOS tests:     %d", m_nLOSTests );
+	}
+
+	m_iStatsTick = gpGlobals->tickcount;
+	m_nNPCLooks = 0;
+	m_nNPCPairs = 0;
+	m_nObjectLooks = 0;
+	m_nObjectPairs = 0;
+	m_nLOSTests = 0;
 }
 
 //=============================================================================
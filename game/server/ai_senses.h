@@ -153,16 +153,106 @@ public:
 
 	virtual void 	AddEntity( CBaseEntity *pEntity );
 
+	int				GetCount() const		{ return m_SensedObjects.Count(); }
+	CBaseEntity *	Get( int i )			{ return m_SensedObjects[i]; }
+
+	// Bumped whenever the list changes, so indices into it can be cached
+	int				GetChangeCount() const	{ return m_nChanges; }
+
 private:
 	virtual void 	OnEntitySpawned( CBaseEntity *pEntity );
 	virtual void 	OnEntityDeleted( CBaseEntity *pEntity );
 
 	CUtlVector<EHANDLE> m_SensedObjects;
+	int				m_nChanges;
 };
 
 extern CAI_SensedObjectsManager g_AI_SensedObjectsManager;
 
 //-----------------------------------------------------------------------------
+// class CAI_SharedSight
+//
+// Purpose: Sight gathering shared by all the NPCs. The NPCs and sensed objects
+//			are bucketed in a coarse grid once a tick, so a looker only has to
+//			test the ones in nearby cells instead of every one in the level.
+//-----------------------------------------------------------------------------
+
+class CAI_SharedSight
+{
+public:
+	CAI_SharedSight();
+
+	// NPCs that may be within iDistance of pLooker, or that are never
+	// distance culled, as indices into g_AI_Manager.AccessAIs() in ascending
+	// order. Returns false if the looker has to scan every AI itself.
+	bool			GetNPCCandidates( CAI_BaseNPC *pLooker, int iDistance, const unsigned short **ppCandidates, int *pCount );
+
+	// Sensed objects that may be within iDistance of origin, as indices for
+	// g_AI_SensedObjectsManager.Get() in ascending order.
+	bool			GetObjectCandidates( const Vector &origin, int iDistance, const unsigned short **ppCandidates, int *pCount );
+
+	void			CountLOSTest();
+
+private:
+	// Hashed 2D grid of item indices; the cells are columns, height is only
+	// checked by the callers' distance tests.
+	class CGrid
+	{
+	public:
+		CGrid();
+
+		void		RemoveAll();
+		void		Insert( const Vector &pos, int iItem );
+		void		Query( const Vector &center, float flRadius, CUtlVector<unsigned short> *pResult ) const;
+
+	private:
+		enum
+		{
+			HASH_SIZE = 256,
+			INVALID_ENTRY = 0xffff,
+		};
+
+		struct Entry_t
+		{
+			short			x, y;
+			unsigned short	iItem;
+			unsigned short	iNext;
+		};
+
+		static int	HashCell( int x, int y ) { return ( ( x * 73 ) ^ ( y * 151 ) ) & ( HASH_SIZE - 1 ); }
+
+		unsigned short		m_Heads[HASH_SIZE];
+		CUtlVector<Entry_t>	m_Entries;
+	};
+
+	void			UpdateNPCs();
+	void			UpdateObjects();
+	void			UpdateStats();
+
+	int				m_iNPCTick;
+	int				m_iNPCChanges;
+	int				m_iObjectTick;
+	int				m_iObjectChanges;
+
+	CGrid			m_NPCGrid;
+	CGrid			m_ObjectGrid;
+
+	CUtlVector<unsigned short>	m_Uncullable;	// NPCs that are seen at any range
+	CUtlVector<unsigned short>	m_Candidates;
+
+	// For ai_shared_sight_stats
+	int				m_iStatsTick;
+	int				m_nNPCs;
+	int				m_nNPCLooks;
+	int				m_nNPCPairs;
+	int				m_nObjectLooks;
+	int				m_nObjectPairs;
+	int				m_nLOSTests;
+};
+
+extern CAI_SharedSight g_AI_SharedSight;
+
+//-----------------------------------------------------------------------------
 
 
 
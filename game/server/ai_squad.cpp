@@ -8,6 +8,7 @@
 #include "ai_squad.h"
 #include "ai_squadslot.h"
 #include "ai_basenpc.h"
+#include "ai_tacticalservices.h"
 #include "saverestore_bitstring.h"
 #include "saverestore_utlvector.h"
 
@@ -158,6 +159,7 @@ CAI_Squad::CAI_Squad(string_t newName)
  :	m_squadSlotsUsed(MAX_SQUADSLOTS)
 #endif
 {
+	m_pTacticalVisCache = NULL;
 	Init( newName );
 }
 
@@ -168,6 +170,7 @@ CAI_Squad::CAI_Squad()
  :	m_squadSlotsUsed(MAX_SQUADSLOTS)
 #endif
 {
+	m_pTacticalVisCache = NULL;
 	Init( NULL_STRING );
 }
 
@@ -195,6 +198,18 @@ void CAI_Squad::Init(string_t newName)
 
 CAI_Squad::~CAI_Squad(void)
 {
+	delete m_pTacticalVisCache;
+}
+
+//-------------------------------------
+
+CAI_TacticalVisCache *CAI_Squad::GetTacticalVisCache( bool bCreate )
+{
+	if ( !m_pTacticalVisCache && bCreate )
+	{
+		m_pTacticalVisCache = new CAI_TacticalVisCache;
+	}
+	return m_pTacticalVisCache;
 }
 
 //-------------------------------------
@@ -12,6 +12,7 @@
 #include "bitstring.h"
 
 class CAI_Squad;
+class CAI_TacticalVisCache;
 typedef CHandle<CAI_BaseNPC> AIHANDLE;
 
 #define PER_ENEMY_SQUADSLOTS 1
@@ -126,6 +127,9 @@ public:
 
 	static bool				IsSilentMember( const CAI_BaseNPC *pNPC );
 
+	// Node visibility results shared by the squad's tactical searches
+	CAI_TacticalVisCache *	GetTacticalVisCache( bool bCreate = true );
+
 	template <typename T>
 	void					SetSquadData( unsigned slot, const T &data )
 	{
@@ -176,6 +180,8 @@ private:
 
 	int												m_SquadData[MAX_SQUAD_DATA_SLOTS];
 
+	CAI_TacticalVisCache *							m_pTacticalVisCache;		// not saved, created on first use
+
 #ifdef PER_ENEMY_SQUADSLOTS
 
 	AISquadEnemyInfo_t *FindEnemyInfo( CBaseEntity *pEnemy );
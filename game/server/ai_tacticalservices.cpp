@@ -16,12 +16,16 @@
 #include "ai_navigator.h"
 #include "ai_networkmanager.h"
 #include "ai_hint.h"
+#include "ai_squad.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
 ConVar ai_find_lateral_cover( "ai_find_lateral_cover", "1" );
 ConVar ai_find_lateral_los( "ai_find_lateral_los", "1" );
+ConVar ai_tactical_vis_cache( "ai_tactical_vis_cache", "1", 0, "Reuse an NPC's recent cover and shoot position tests against a threat" );
+ConVar ai_tactical_vis_cache_time( "ai_tactical_vis_cache_time", "0.75", 0, "How long a cached cover/shoot position test is good for" );
+ConVar ai_tactical_vis_cache_grain( "ai_tactical_vis_cache_grain", "16", 0, "Threat positions within this many units of each other share cached results" );
 
 #ifdef _DEBUG
 ConVar ai_debug_cover( "ai_debug_cover", "0" );
@@ -404,7 +408,7 @@ int CAI_TacticalServices::FindCoverNode(const Vector &vNearPos, const Vector &vT
 			if ( GetOuter()->IsValidCover( nodeOrigin, pNode->GetHint() ) )
 			{
 				// Check if this location will block the threat's line of sight to me
-				if (GetOuter()->IsCoverPosition(vThreatEyePos, vEyePos))
+				if ( TestCoverNode( nodeIndex, nodeOrigin, vEyePos, vThreatEyePos ) )
 				{
 					// --------------------------------------------------------
 					// Don't let anyone else use this node for a while
@@ -595,7 +599,7 @@ int CAI_TacticalServices::FindLosNode(const Vector &vThreatPos, const Vector &vT
 					CAI_Node *pNode = GetNetwork()->GetNode(nodeIndex);
 					if ( GetOuter()->IsValidShootPosition( nodeOrigin, pNode, pNode->GetHint() ) )
 					{
-						if (GetOuter()->TestShootPosition(nodeOrigin,vThreatEyePos))
+						if ( TestShootNode( nodeIndex, nodeOrigin, vThreatEyePos ) )
 						{
 							// Note when this node was used, so we don't try 
 							// to use it again right away.
@@ -676,6 +680,57 @@ int CAI_TacticalServices::FindLosNode(const Vector &vThreatPos, const Vector &vT
 	return NO_NODE;
 }
 
+//-------------------------------------
+
+CAI_TacticalVisCache *CAI_TacticalServices::GetVisCache()
+{
+	CAI_Squad *pSquad = GetOuter()->GetSquad();
+	if ( !pSquad || !ai_tactical_vis_cache.GetBool() || !GetOuter()->CanCacheTacticalVisResults() )
+		return NULL;
+
+	return pSquad->GetTacticalVisCache();
+}
+
+//-------------------------------------
+
+bool CAI_TacticalServices::TestCoverNode( int iNode, const Vector &vNodeOrigin, const Vector &vEyePos, const Vector &vThreatEyePos )
+{
+	CAI_TacticalVisCache *pCache = GetVisCache();
+	if ( !pCache )
+		return GetOuter()->IsCoverPosition( vThreatEyePos, vEyePos );
+
+	CAI_TacticalVisCache::Key_t key;
+	CAI_TacticalVisCache::MakeKey( GetOuter(), TACTICAL_VIS_COVER, iNode, vEyePos.z - vNodeOrigin.z, vThreatEyePos, &key );
+
+	bool bResult;
+	if ( !pCache->Lookup( key, &bResult ) )
+	{
+		bResult = GetOuter()->IsCoverPosition( vThreatEyePos, vEyePos );
+		pCache->Store( key, bResult );
+	}
+	return bResult;
+}
+
+//-------------------------------------
+
+bool CAI_TacticalServices::TestShootNode( int iNode, const Vector &vNodeOrigin, const Vector &vThreatEyePos )
+{
+	CAI_TacticalVisCache *pCache = GetVisCache();
+	if ( !pCache )
+		return GetOuter()->TestShootPosition( vNodeOrigin, vThreatEyePos );
+
+	CAI_TacticalVisCache::Key_t key;
+	CAI_TacticalVisCache::MakeKey( GetOuter(), TACTICAL_VIS_SHOOT, iNode, 0, vThreatEyePos, &key );
+
+	bool bResult;
+	if ( !pCache->Lookup( key, &bResult ) )
+	{
+		bResult = GetOuter()->TestShootPosition( vNodeOrigin, vThreatEyePos );
+		pCache->Store( key, bResult );
+	}
+	return bResult;
+}
+
 //-------------------------------------
 // Checks lateral LOS
 //-------------------------------------
@@ -792,3 +847,135 @@ Vector CAI_TacticalServices::GetNodePos( int node )
 }
 
 //-----------------------------------------------------------------------------
+
+//=============================================================================
+//
+// CAI_TacticalVisCache
+//
+//=============================================================================
+
+CAI_TacticalVisCache::CAI_TacticalVisCache()
+ :	m_Entries( 0, 0, CEntryLess( 0 ) ),
+	m_flNextPurge( 0 ),
+	m_nHits( 0 ),
+	m_nMisses( 0 )
+{
+}
+
+//-------------------------------------
+
+void CAI_TacticalVisCache::MakeKey( CAI_BaseNPC *pAsker, TacticalVisQuery_t query, int iNode, float flEyeHeight, const Vector &vThreatEyePos, Key_t *pKey )
+{
+	// Compared with memcmp, so the padding has to be clear too
+	memset( pKey, 0, sizeof( *pKey ) );
+
+	float flGrain = MAX( ai_tactical_vis_cache_grain.GetFloat(), 1.0f );
+	for ( int i = 0; i < 3; i++ )
+	{
+		pKey->threat[i] = (short)floor( vThreatEyePos[i] / flGrain + 0.5f );
+	}
+
+	CBaseCombatWeapon *pWeapon = pAsker->GetActiveWeapon();
+	CBaseEntity *pEnemy = pAsker->GetEnemy();
+
+	pKey->iClassname = pAsker->m_iClassname;
+	pKey->iWeapon = pWeapon ? pWeapon->m_iClassname : NULL_STRING;
+	pKey->iAsker = pAsker->entindex();
+	pKey->iEnemy = pEnemy ? pEnemy->entindex() : -1;
+	pKey->iNode = iNode;
+	pKey->eyeHeight = (short)RoundFloatToInt( flEyeHeight );
+	pKey->query = (unsigned char)query;
+	pKey->hull = (unsigned char)pAsker->GetHullType();
+}
+
+//-------------------------------------
+
+bool CAI_TacticalVisCache::Lookup( const Key_t &key, bool *pbResult )
+{
+	Entry_t search;
+	search.key = key;
+
+	unsigned short i = m_Entries.Find( search );
+	if ( i != m_Entries.InvalidIndex() && gpGlobals->curtime - m_Entries[i].flTime < ai_tactical_vis_cache_time.GetFloat() )
+	{
+		m_nHits++;
+		*pbResult = m_Entries[i].bResult;
+		return true;
+	}
+
+	m_nMisses++;
+	return false;
+}
+
+//-------------------------------------
+
+void CAI_TacticalVisCache::Store( const Key_t &key, bool bResult )
+{
+	if ( gpGlobals->curtime >= m_flNextPurge )
+	{
+		RemoveExpired();
+		m_flNextPurge = gpGlobals->curtime + ai_tactical_vis_cache_time.GetFloat();
+	}
+
+	Entry_t entry;
+	entry.key = key;
+
+	unsigned short i = m_Entries.Find( entry );
+	if ( i == m_Entries.InvalidIndex() )
+	{
+		i = m_Entries.Insert( entry );
+	}
+
+	m_Entries[i].bResult = bResult;
+	m_Entries[i].flTime = gpGlobals->curtime;
+}
+
+//-------------------------------------
+
+void CAI_TacticalVisCache::RemoveExpired()
+{
+	float flLifetime = ai_tactical_vis_cache_time.GetFloat();
+
+	unsigned short i = m_Entries.FirstInorder();
+	while ( i != m_Entries.InvalidIndex() )
+	{
+		unsigned short iNext = m_Entries.NextInorder( i );
+		if ( gpGlobals->curtime - m_Entries[i].flTime >= flLifetime )
+		{
+			m_Entries.RemoveAt( i );
+		}
+		i = iNext;
+	}
+}
+
+//-------------------------------------
+
+void CAI_TacticalVisCache::RemoveAll()
+{
+	m_Entries.RemoveAll();
+}
+
+//-------------------------------------
+
+CON_COMMAND( ai_tactical_vis_cache_report, "Show how often cover and shoot position tests were reused, per squad" )
+{
+	int nTotalHits = 0;
+	int nTotalMisses = 0;
+
+	AISquadsIter_t iter;
+	for ( CAI_Squad *pSquad = g_AI_SquadManager.GetFirstSquad( &iter ); pSquad; pSquad = g_AI_SquadManager.GetNextSquad( &iter ) )
+	{
+		CAI_TacticalVisCache *pCache = pSquad->GetTacticalVisCache( false );
+		int nTests = pCache ? pCache->GetHits() + pCache->GetMisses() : 0;
+		if ( !nTests )
+			continue;
+
+		Msg( "%-24s %6d tests, %6d hits (%5.1f%%), %5d entries\n", pSquad->GetName(), nTests, pCache->GetHits(), 100.0f * pCache->GetHits() / nTests, pCache->Count() );
+
+		nTotalHits += pCache->GetHits();
+		nTotalMisses += pCache->GetMisses();
+	}
+
+	int nTotal = nTotalHits + nTotalMisses;
+	Msg( "Total: %d tests, %d hits (%.1f%%)\n", nTotal, nTotalHits, nTotal ? 100.0f * nTotalHits / nTotal : 0.0f );
+}
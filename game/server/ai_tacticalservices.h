@@ -6,6 +6,7 @@
 #define AI_TACTICALSERVICES_H
 
 #include "ai_component.h"
+#include "tier1/utlrbtree.h"
 
 #if defined( _WIN32 )
 #pragma once
@@ -13,6 +14,7 @@
 
 class CAI_Network;
 class CAI_Pathfinder;
+class CAI_TacticalVisCache;
 
 
 enum FlankType_t
@@ -58,6 +60,11 @@ private:
 	int				FindCoverNode( const Vector &vThreatPos, const Vector &vThreatEyePos, float flMinDist, float flMaxDist );
 	int				FindCoverNode( const Vector &vNearPos, const Vector &vThreatPos, const Vector &vThreatEyePos, float flMinDist, float flMaxDist );
 	int				FindLosNode( const Vector &vThreatPos, const Vector &vThreatEyePos, float flMinThreatDist, float flMaxThreatDist, float flBlockTime, FlankType_t eFlankType, const Vector &vThreatFacing, float flFlankParam );
+
+	// IsCoverPosition/TestShootPosition for a node, through the squad's cache
+	bool			TestCoverNode( int iNode, const Vector &vNodeOrigin, const Vector &vEyePos, const Vector &vThreatEyePos );
+	bool			TestShootNode( int iNode, const Vector &vNodeOrigin, const Vector &vThreatEyePos );
+	CAI_TacticalVisCache *GetVisCache();
 	
 	Vector			GetNodePos( int );
 
@@ -75,6 +82,79 @@ private:
 	DECLARE_SIMPLE_DATADESC();
 };
 
+//-----------------------------------------------------------------------------
+// CAI_TacticalVisCache
+//
+// Purpose: Remembers for a short time whether a node had cover from, or a shot
+//			at, a threat's eye position. An NPC tends to run several searches
+//			against the same threat within a second. The tests depend on who is
+//			asking, so entries are per NPC; the squad just owns the storage and
+//			the counters. Threat positions are quantized, so a threat that has
+//			barely moved still hits.
+//-----------------------------------------------------------------------------
+
+enum TacticalVisQuery_t
+{
+	TACTICAL_VIS_COVER,		// IsCoverPosition() from the node's cover eye position
+	TACTICAL_VIS_SHOOT,		// TestShootPosition() from the node
+};
+
+class CAI_TacticalVisCache
+{
+public:
+	struct Key_t
+	{
+		string_t		iClassname;		// results depend on the NPC's overrides and weapon
+		string_t		iWeapon;
+		int				iAsker;			// the tests ignore the asker's own body and pick pass entities from its enemy
+		int				iEnemy;
+		int				iNode;
+		short			threat[3];		// quantized threat eye position
+		short			eyeHeight;		// of the tested position above the node
+		unsigned char	query;
+		unsigned char	hull;
+		unsigned char	pad[2];
+	};
+
+	CAI_TacticalVisCache();
+
+	static void		MakeKey( CAI_BaseNPC *pAsker, TacticalVisQuery_t query, int iNode, float flEyeHeight, const Vector &vThreatEyePos, Key_t *pKey );
+
+	bool			Lookup( const Key_t &key, bool *pbResult );
+	void			Store( const Key_t &key, bool bResult );
+	void			RemoveAll();
+
+	int				Count() const		{ return m_Entries.Count(); }
+	int				GetHits() const		{ return m_nHits; }
+	int				GetMisses() const	{ return m_nMisses; }
+
+private:
+	struct Entry_t
+	{
+		Key_t			key;
+		float			flTime;
+		bool			bResult;
+	};
+
+	class CEntryLess
+	{
+	public:
+		CEntryLess( int ) {}
+		bool operator!() const { return false; }
+		bool operator()( const Entry_t &lhs, const Entry_t &rhs ) const
+		{
+			return ( memcmp( &lhs.key, &rhs.key, sizeof( Key_t ) ) < 0 );
+		}
+	};
+
+	void			RemoveExpired();
+
+	CUtlRBTree<Entry_t, unsigned short, CEntryLess> m_Entries;
+	float			m_flNextPurge;
+	int				m_nHits;
+	int				m_nMisses;
+};
+
 //-----------------------------------------------------------------------------
 
 #endif // AI_TACTICALSERVICES_H
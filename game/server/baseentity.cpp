@@ -613,6 +613,7 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.ReportEntityClassnameChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -280,6 +280,473 @@ void SimThink_EntityChanged( CBaseEntity *pEntity )
 	g_SimThinkManager.EntityChanged( pEntity );
 }
 
+//-----------------------------------------------------------------------------
+// ENTITY FINDER
+//
+// A coarse XY grid over entity bounds plus a classname -> entity index, so the
+// radius and classname searches don't have to walk the whole entity list.
+// Every entry remembers the order its entity was added to the list, which is
+// the order of the active list, so searches return entities (and resume from
+// pStartEntity) exactly like a linear walk would.
+//
+// Entries are marked dirty when an entity moves, changes bounds or changes
+// classname, and are brought up to date lazily by the next search.
+//-----------------------------------------------------------------------------
+ConVar ent_find_accelerated( "ent_find_accelerated", "1", 0, "Use the spatial grid and classname index for entity list searches" );
+
+#define ENTFINDER_CELL_SIZE			512
+#define ENTFINDER_GRID_SIZE			( 2 * MAX_COORD_INTEGER / ENTFINDER_CELL_SIZE )
+// Entities spanning more cells than this on either axis are checked by every search
+#define ENTFINDER_MAX_CELL_SPAN		4
+// Searches covering more cells than this walk the entity list instead
+#define ENTFINDER_MAX_SEARCH_CELLS	256
+#define ENTFINDER_INVALID			0xFFFF
+
+struct entfindergather_t
+{
+	unsigned int	sequence;
+	unsigned short	index;
+};
+
+typedef CUtlVector<entfindergather_t> EntityFinderList_t;
+
+struct entfinderentry_t
+{
+	CBaseEntity		*pEntity;
+	unsigned int	sequence;		// position in the active list, 0 if not in the list
+	unsigned int	gatherStamp;
+	string_t		classname;		// classname this entry is filed under
+	unsigned short	classBucket;
+	short			cellMins[2];	// cellMins[0] < 0 if not in the grid
+	short			cellMaxs[2];
+	bool			bOversized;
+	bool			bDirty;
+};
+
+class CEntityFinder
+{
+public:
+	CEntityFinder()
+	{
+		m_nextSequence = 1;
+		m_gatherStamp = 0;
+		m_changeCount = 0;
+		m_gatherChangeCount = 0xFFFFFFFF;
+		m_gatherAfterSequence = 0;
+		m_gatherMins.Init();
+		m_gatherMaxs.Init();
+		for ( int i = 0; i < ARRAYSIZE(m_entries); i++ )
+		{
+			ResetEntry( i );
+		}
+	}
+
+	void AddEntity( CBaseEntity *pEntity, int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		Assert( entry.pEntity == NULL );
+		ResetEntry( index );
+		entry.pEntity = pEntity;
+		entry.sequence = m_nextSequence++;
+		MarkDirty( index );
+	}
+
+	void RemoveEntity( int index )
+	{
+		UnlinkCells( index );
+		UnlinkClassname( index );
+		ResetEntry( index );
+	}
+
+	void MarkDirty( int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		if ( entry.bDirty || !entry.pEntity )
+			return;
+
+		AUTO_LOCK( m_dirtyMutex );
+		if ( !entry.bDirty )
+		{
+			entry.bDirty = true;
+			m_dirtyList.AddToTail( (unsigned short)index );
+		}
+	}
+
+	// Brings every dirty entry up to date, call before searching
+	void Update()
+	{
+		if ( !m_dirtyList.Count() )
+			return;
+
+		// Computing bounds can mark entries dirty again, so work on a copy
+		{
+			AUTO_LOCK( m_dirtyMutex );
+			m_updateList.Swap( m_dirtyList );
+		}
+
+		for ( int i = 0; i < m_updateList.Count(); i++ )
+		{
+			int index = m_updateList[i];
+			entfinderentry_t &entry = m_entries[index];
+			if ( !entry.bDirty )
+				continue;
+
+			entry.bDirty = false;
+			if ( entry.pEntity )
+			{
+				UpdateClassname( index );
+				UpdateCells( index );
+			}
+		}
+		m_updateList.RemoveAll();
+	}
+
+	// Returns the list position of an entity, 0 if it isn't in the list
+	unsigned int GetSequence( CBaseEntity *pEntity ) const
+	{
+		const CBaseHandle &eh = pEntity->GetRefEHandle();
+		if ( !eh.IsValid() )
+			return 0;
+
+		const entfinderentry_t &entry = m_entries[eh.GetEntryIndex()];
+		return ( entry.pEntity == pEntity ) ? entry.sequence : 0;
+	}
+
+	CBaseEntity *GetEntity( int index ) const { return m_entries[index].pEntity; }
+
+	// Returns the number of grid cells a search of the box visits
+	int CountCellsInBox( const Vector &mins, const Vector &maxs ) const
+	{
+		int cellMins[2], cellMaxs[2];
+		ComputeCellRect( mins, maxs, cellMins, cellMaxs );
+		return ( cellMaxs[0] - cellMins[0] + 1 ) * ( cellMaxs[1] - cellMins[1] + 1 );
+	}
+
+	// Returns the entities whose bounds may touch the box, in list order, with *pFirst set to the
+	// first one after afterSequence. The last gather is kept until an entry is refiled, so a loop
+	// resuming a search over the same box from the entity it just got walks the cells only once.
+	const EntityFinderList_t &GatherInBox( const Vector &mins, const Vector &maxs, unsigned int afterSequence, int *pFirst )
+	{
+		if ( m_gatherChangeCount != m_changeCount || afterSequence < m_gatherAfterSequence || mins != m_gatherMins || maxs != m_gatherMaxs )
+		{
+			m_gatherList.RemoveAll();
+			GatherCells( mins, maxs, afterSequence );
+			m_gatherList.Sort( CompareGatherSequence );
+
+			m_gatherChangeCount = m_changeCount;
+			m_gatherAfterSequence = afterSequence;
+			m_gatherMins = mins;
+			m_gatherMaxs = maxs;
+		}
+
+		int lo = 0;
+		int hi = m_gatherList.Count();
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) >> 1;
+			if ( m_gatherList[mid].sequence <= afterSequence )
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		*pFirst = lo;
+		return m_gatherList;
+	}
+
+	// Returns the entities filed under a classname in list order, NULL if there are none
+	const CUtlVector<unsigned short> *GetClassnameList( const char *pszClassname ) const
+	{
+		int i = m_classnameDict.Find( pszClassname );
+		if ( i == m_classnameDict.InvalidIndex() )
+			return NULL;
+		return &m_classBuckets[m_classnameDict[i]];
+	}
+
+	// Returns the first position in a classname list after afterSequence
+	int FindFirstAfter( const CUtlVector<unsigned short> &list, unsigned int afterSequence ) const
+	{
+		int lo = 0;
+		int hi = list.Count();
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) >> 1;
+			if ( m_entries[list[mid]].sequence <= afterSequence )
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+private:
+	void ResetEntry( int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		entry.pEntity = NULL;
+		entry.sequence = 0;
+		entry.gatherStamp = 0;
+		entry.classname = NULL_STRING;
+		entry.classBucket = ENTFINDER_INVALID;
+		entry.cellMins[0] = entry.cellMins[1] = -1;
+		entry.cellMaxs[0] = entry.cellMaxs[1] = -1;
+		entry.bOversized = false;
+		entry.bDirty = false;
+	}
+
+	// Collects the entities after afterSequence whose bounds may touch the box into m_gatherList
+	void GatherCells( const Vector &mins, const Vector &maxs, unsigned int afterSequence )
+	{
+		int cellMins[2], cellMaxs[2];
+		ComputeCellRect( mins, maxs, cellMins, cellMaxs );
+
+		if ( ++m_gatherStamp == 0 )
+		{
+			for ( int i = 0; i < ARRAYSIZE(m_entries); i++ )
+			{
+				m_entries[i].gatherStamp = 0;
+			}
+			m_gatherStamp = 1;
+		}
+
+		for ( int y = cellMins[1]; y <= cellMaxs[1]; y++ )
+		{
+			for ( int x = cellMins[0]; x <= cellMaxs[0]; x++ )
+			{
+				AddToGather( m_cells[y * ENTFINDER_GRID_SIZE + x], afterSequence );
+			}
+		}
+		AddToGather( m_oversized, afterSequence );
+	}
+
+	void AddToGather( const CUtlVector<unsigned short> &cell, unsigned int afterSequence )
+	{
+		for ( int i = 0; i < cell.Count(); i++ )
+		{
+			entfinderentry_t &entry = m_entries[cell[i]];
+			if ( entry.gatherStamp == m_gatherStamp || entry.sequence <= afterSequence )
+				continue;
+			entry.gatherStamp = m_gatherStamp;
+
+			int j = m_gatherList.AddToTail();
+			m_gatherList[j].sequence = entry.sequence;
+			m_gatherList[j].index = cell[i];
+		}
+	}
+
+	static int __cdecl CompareGatherSequence( const entfindergather_t *pLeft, const entfindergather_t *pRight )
+	{
+		if ( pLeft->sequence == pRight->sequence )
+			return 0;
+		return ( pLeft->sequence < pRight->sequence ) ? -1 : 1;
+	}
+
+	static int CoordToCell( float flCoord )
+	{
+		int cell = (int)floor( ( flCoord + MAX_COORD_INTEGER ) * ( 1.0f / ENTFINDER_CELL_SIZE ) );
+		return clamp( cell, 0, ENTFINDER_GRID_SIZE - 1 );
+	}
+
+	static void ComputeCellRect( const Vector &mins, const Vector &maxs, int *pCellMins, int *pCellMaxs )
+	{
+		for ( int i = 0; i < 2; i++ )
+		{
+			pCellMins[i] = CoordToCell( mins[i] );
+			pCellMaxs[i] = CoordToCell( maxs[i] );
+		}
+	}
+
+	void UpdateCells( int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		CBaseEntity *pEntity = entry.pEntity;
+
+		// The origin is included because the radius searches measure from it
+		Vector mins, maxs;
+		pEntity->CollisionProp()->WorldSpaceAABB( &mins, &maxs );
+		const Vector &vecOrigin = pEntity->GetAbsOrigin();
+		VectorMin( mins, vecOrigin, mins );
+		VectorMax( maxs, vecOrigin, maxs );
+
+		int cellMins[2], cellMaxs[2];
+		bool bOversized = ( index == 0 ) || !mins.IsValid() || !maxs.IsValid();
+		if ( !bOversized )
+		{
+			ComputeCellRect( mins, maxs, cellMins, cellMaxs );
+			bOversized = ( cellMaxs[0] - cellMins[0] >= ENTFINDER_MAX_CELL_SPAN ) || ( cellMaxs[1] - cellMins[1] >= ENTFINDER_MAX_CELL_SPAN );
+		}
+
+		if ( bOversized )
+		{
+			if ( entry.bOversized )
+				return;
+			UnlinkCells( index );
+			entry.bOversized = true;
+			m_oversized.AddToTail( (unsigned short)index );
+			return;
+		}
+
+		if ( !entry.bOversized && entry.cellMins[0] == cellMins[0] && entry.cellMins[1] == cellMins[1] && 
+			entry.cellMaxs[0] == cellMaxs[0] && entry.cellMaxs[1] == cellMaxs[1] )
+			return;
+
+		UnlinkCells( index );
+		for ( int i = 0; i < 2; i++ )
+		{
+			entry.cellMins[i] = cellMins[i];
+			entry.cellMaxs[i] = cellMaxs[i];
+		}
+		for ( int y = cellMins[1]; y <= cellMaxs[1]; y++ )
+		{
+			for ( int x = cellMins[0]; x <= cellMaxs[0]; x++ )
+			{
+				m_cells[y * ENTFINDER_GRID_SIZE + x].AddToTail( (unsigned short)index );
+			}
+		}
+	}
+
+	void UnlinkCells( int index )
+	{
+		// Every change to what the cells hold comes through here first
+		m_changeCount++;
+
+		entfinderentry_t &entry = m_entries[index];
+		if ( entry.bOversized )
+		{
+			m_oversized.FindAndFastRemove( (unsigned short)index );
+			entry.bOversized = false;
+		}
+		else if ( entry.cellMins[0] >= 0 )
+		{
+			for ( int y = entry.cellMins[1]; y <= entry.cellMaxs[1]; y++ )
+			{
+				for ( int x = entry.cellMins[0]; x <= entry.cellMaxs[0]; x++ )
+				{
+					m_cells[y * ENTFINDER_GRID_SIZE + x].FindAndFastRemove( (unsigned short)index );
+				}
+			}
+		}
+		entry.cellMins[0] = entry.cellMins[1] = -1;
+		entry.cellMaxs[0] = entry.cellMaxs[1] = -1;
+	}
+
+	void UpdateClassname( int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		string_t classname = entry.pEntity->m_iClassname;
+		if ( entry.classBucket != ENTFINDER_INVALID && entry.classname == classname )
+			return;
+
+		UnlinkClassname( index );
+		if ( classname == NULL_STRING || !STRING(classname)[0] )
+			return;
+
+		int i = m_classnameDict.Find( STRING(classname) );
+		if ( i == m_classnameDict.InvalidIndex() )
+		{
+			MEM_ALLOC_CREDIT();
+			i = m_classnameDict.Insert( STRING(classname), m_classBuckets.AddToTail() );
+		}
+
+		// Keep the bucket in list order
+		CUtlVector<unsigned short> &bucket = m_classBuckets[m_classnameDict[i]];
+		bucket.InsertBefore( FindFirstAfter( bucket, entry.sequence ), (unsigned short)index );
+		entry.classname = classname;
+		entry.classBucket = (unsigned short)m_classnameDict[i];
+	}
+
+	void UnlinkClassname( int index )
+	{
+		entfinderentry_t &entry = m_entries[index];
+		if ( entry.classBucket == ENTFINDER_INVALID )
+			return;
+
+		CUtlVector<unsigned short> &bucket = m_classBuckets[entry.classBucket];
+		int i = FindFirstAfter( bucket, entry.sequence - 1 );
+		Assert( i < bucket.Count() && bucket[i] == index );
+		bucket.Remove( i );
+		entry.classname = NULL_STRING;
+		entry.classBucket = ENTFINDER_INVALID;
+	}
+
+	entfinderentry_t					m_entries[NUM_ENT_ENTRIES];
+	CUtlVector<unsigned short>			m_cells[ENTFINDER_GRID_SIZE * ENTFINDER_GRID_SIZE];
+	CUtlVector<unsigned short>			m_oversized;
+	CUtlDict<int, int>					m_classnameDict;
+	CUtlVector< CUtlVector<unsigned short> >	m_classBuckets;
+	CUtlVector<unsigned short>			m_dirtyList;
+	CUtlVector<unsigned short>			m_updateList;
+	CThreadFastMutex					m_dirtyMutex;
+	unsigned int						m_nextSequence;
+	unsigned int						m_gatherStamp;
+	unsigned int						m_changeCount;
+
+	// The last GatherInBox
+	EntityFinderList_t					m_gatherList;
+	unsigned int						m_gatherChangeCount;
+	unsigned int						m_gatherAfterSequence;
+	Vector								m_gatherMins;
+	Vector								m_gatherMaxs;
+};
+
+static CEntityFinder g_EntityFinder;
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets where a search resumes in the finder, returns false if it
+//			has to walk the entity list instead.
+//-----------------------------------------------------------------------------
+static bool GetFinderStart( CBaseEntity *pStartEntity, unsigned int *pAfterSequence )
+{
+	if ( !ent_find_accelerated.GetBool() )
+		return false;
+
+	*pAfterSequence = pStartEntity ? g_EntityFinder.GetSequence( pStartEntity ) : 0;
+	if ( pStartEntity && *pAfterSequence == 0 )
+		return false;
+
+	g_EntityFinder.Update();
+	return true;
+}
+
+// Wildcards and empty names can match more than one classname
+static bool IsExactClassname( const char *szName )
+{
+	return szName && szName[0] && !strchr( szName, '*' );
+}
+
+// Boxes over too many cells are cheaper to search by walking the entity list
+static bool IsFinderBox( const Vector &vecMins, const Vector &vecMaxs )
+{
+	return g_EntityFinder.CountCellsInBox( vecMins, vecMaxs ) <= ENTFINDER_MAX_SEARCH_CELLS;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the first entity in list order after afterSequence whose
+//			bounds may touch the box and that passes the filter.
+//-----------------------------------------------------------------------------
+template< class FILTER >
+static CBaseEntity *FindFirstInBox( const Vector &vecMins, const Vector &vecMaxs, unsigned int afterSequence, FILTER &filter )
+{
+	int first;
+	const EntityFinderList_t &candidates = g_EntityFinder.GatherInBox( vecMins, vecMaxs, afterSequence, &first );
+
+	for ( int i = first; i < candidates.Count(); i++ )
+	{
+		CBaseEntity *pEntity = g_EntityFinder.GetEntity( candidates[i].index );
+		if ( filter( pEntity ) )
+			return pEntity;
+	}
+
+	return NULL;
+}
+
 static CBaseEntityClassList *s_pClassLists = NULL;
 CBaseEntityClassList::CBaseEntityClassList()
 {
@@ -455,6 +922,24 @@ void CGlobalEntityList::ReportEntityFlagsChanged( CBaseEntity *pEntity, unsigned
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Refiles an entity in the search index after it moved or its bounds
+//			changed. Cheap, the index is updated by the next search.
+//-----------------------------------------------------------------------------
+void CGlobalEntityList::ReportEntityMoved( CBaseEntity *pEntity )
+{
+	const CBaseHandle &eh = pEntity->GetRefEHandle();
+	if ( eh.IsValid() && g_EntityFinder.GetEntity( eh.GetEntryIndex() ) == pEntity )
+	{
+		g_EntityFinder.MarkDirty( eh.GetEntryIndex() );
+	}
+}
+
+void CGlobalEntityList::ReportEntityClassnameChanged( CBaseEntity *pEntity )
+{
+	ReportEntityMoved( pEntity );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Used to confirm a pointer is a pointer to an entity, useful for
 //			asserts.
@@ -481,6 +966,17 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 {
+	unsigned int afterSequence;
+	if ( IsExactClassname( szName ) && GetFinderStart( pStartEntity, &afterSequence ) )
+	{
+		const CUtlVector<unsigned short> *pList = g_EntityFinder.GetClassnameList( szName );
+		if ( !pList )
+			return NULL;
+
+		int i = g_EntityFinder.FindFirstAfter( *pList, afterSequence );
+		return ( i < pList->Count() ) ? g_EntityFinder.GetEntity( (*pList)[i] ) : NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -682,8 +1178,34 @@ CBaseEntity	*CGlobalEntityList::FindEntityByTarget( CBaseEntity *pStartEntity, c
 //			vecCenter - 
 //			flRadius - 
 //-----------------------------------------------------------------------------
+struct EntityInSphereFilter_t
+{
+	EntityInSphereFilter_t( const Vector &vecCenter, float flRadius ) : m_vecCenter( vecCenter ), m_flRadius( flRadius ) {}
+
+	bool operator()( CBaseEntity *ent ) const
+	{
+		if ( !ent->edict() )
+			return false;
+
+		Vector vecRelativeCenter;
+		ent->CollisionProp()->WorldToCollisionSpace( m_vecCenter, &vecRelativeCenter );
+		return IsBoxIntersectingSphere( ent->CollisionProp()->OBBMins(),	ent->CollisionProp()->OBBMaxs(), vecRelativeCenter, m_flRadius );
+	}
+
+	const Vector &m_vecCenter;
+	float m_flRadius;
+};
+
 CBaseEntity *CGlobalEntityList::FindEntityInSphere( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius )
 {
+	unsigned int afterSequence;
+	Vector vecExtents( fabs( flRadius ), fabs( flRadius ), fabs( flRadius ) );
+	if ( IsFinderBox( vecCenter - vecExtents, vecCenter + vecExtents ) && GetFinderStart( pStartEntity, &afterSequence ) )
+	{
+		EntityInSphereFilter_t filter( vecCenter, flRadius );
+		return FindFirstInBox( vecCenter - vecExtents, vecCenter + vecExtents, afterSequence, filter );
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -733,6 +1255,34 @@ CBaseEntity *CGlobalEntityList::FindEntityByNameNearest( const char *szName, con
 	{
 		flMaxDist2 = MAX_TRACE_LENGTH * MAX_TRACE_LENGTH;
 	}
+	else if ( szName && szName[0] && szName[0] != '!' )
+	{
+		// Procedural names resolve through FindEntityByName, everything else can come from the grid
+		unsigned int afterSequence;
+		Vector vecExtents( fabs( flRadius ), fabs( flRadius ), fabs( flRadius ) );
+		if ( IsFinderBox( vecSrc - vecExtents, vecSrc + vecExtents ) && GetFinderStart( NULL, &afterSequence ) )
+		{
+			int first;
+			const EntityFinderList_t &candidates = g_EntityFinder.GatherInBox( vecSrc - vecExtents, vecSrc + vecExtents, afterSequence, &first );
+
+			// Candidates are in list order, so ties go to the earliest entity as in the walk below
+			for ( int i = first; i < candidates.Count(); i++ )
+			{
+				CBaseEntity *pSearch = g_EntityFinder.GetEntity( candidates[i].index );
+				if ( !pSearch->edict() || !pSearch->m_iName || !pSearch->NameMatches( szName ) )
+					continue;
+
+				float flDist2 = (pSearch->GetAbsOrigin() - vecSrc).LengthSqr();
+				if ( flMaxDist2 > flDist2 )
+				{
+					pEntity = pSearch;
+					flMaxDist2 = flDist2;
+				}
+			}
+
+			return pEntity;
+		}
+	}
 
 	CBaseEntity *pSearch = NULL;
 	while ((pSearch = gEntList.FindEntityByName( pSearch, szName, pSearchingEntity, pActivator, pCaller )) != NULL)
@@ -835,6 +1385,24 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameNearest( const char *szName
 
 
 
+struct EntityClassnameInRadiusFilter_t
+{
+	EntityClassnameInRadiusFilter_t( const char *szName, const Vector &vecSrc, float flMaxDist2 ) : m_szName( szName ), m_vecSrc( vecSrc ), m_flMaxDist2( flMaxDist2 ) {}
+
+	bool operator()( CBaseEntity *pEntity ) const
+	{
+		if ( !pEntity->edict() || !pEntity->ClassMatches( m_szName ) )
+			return false;
+
+		float flDist2 = (pEntity->GetAbsOrigin() - m_vecSrc).LengthSqr();
+		return ( m_flMaxDist2 > flDist2 );
+	}
+
+	const char *m_szName;
+	const Vector &m_vecSrc;
+	float m_flMaxDist2;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: Finds the first entity within radius distance by class name.
 // Input  : pStartEntity - The entity to start from when doing the search.
@@ -855,6 +1423,37 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameWithin( CBaseEntity *pStart
 		return gEntList.FindEntityByClassname( pEntity, szName );
 	}
 
+	unsigned int afterSequence;
+	if ( GetFinderStart( pStartEntity, &afterSequence ) )
+	{
+		Vector vecExtents( fabs( flRadius ), fabs( flRadius ), fabs( flRadius ) );
+		EntityClassnameInRadiusFilter_t filter( szName, vecSrc, flMaxDist2 );
+
+		const CUtlVector<unsigned short> *pList = NULL;
+		if ( IsExactClassname( szName ) )
+		{
+			pList = g_EntityFinder.GetClassnameList( szName );
+			if ( !pList )
+				return NULL;
+		}
+
+		// A rare classname is cheaper to walk than the grid around a large radius
+		int nCells = g_EntityFinder.CountCellsInBox( vecSrc - vecExtents, vecSrc + vecExtents );
+		if ( pList && pList->Count() < nCells )
+		{
+			for ( int i = g_EntityFinder.FindFirstAfter( *pList, afterSequence ); i < pList->Count(); i++ )
+			{
+				pEntity = g_EntityFinder.GetEntity( (*pList)[i] );
+				if ( filter( pEntity ) )
+					return pEntity;
+			}
+			return NULL;
+		}
+
+		if ( nCells <= ENTFINDER_MAX_SEARCH_CELLS )
+			return FindFirstInBox( vecSrc - vecExtents, vecSrc + vecExtents, afterSequence, filter );
+	}
+
 	while ((pEntity = gEntList.FindEntityByClassname( pEntity, szName )) != NULL)
 	{
 		if ( !pEntity->edict() )
@@ -872,6 +1471,28 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameWithin( CBaseEntity *pStart
 }
 
 
+struct EntityClassnameInBoxFilter_t
+{
+	EntityClassnameInBoxFilter_t( const char *szName, const Vector &vecMins, const Vector &vecMaxs ) : m_szName( szName ), m_vecMins( vecMins ), m_vecMaxs( vecMaxs ) {}
+
+	bool operator()( CBaseEntity *pEntity ) const
+	{
+		if ( !pEntity->edict() && !pEntity->IsEFlagSet( EFL_SERVER_ONLY ) )
+			return false;
+
+		if ( !pEntity->ClassMatches( m_szName ) )
+			return false;
+
+		Vector entMins, entMaxs;
+		pEntity->CollisionProp()->WorldSpaceAABB( &entMins, &entMaxs );
+		return IsBoxIntersectingBox( m_vecMins, m_vecMaxs, entMins, entMaxs );
+	}
+
+	const char *m_szName;
+	const Vector &m_vecMins;
+	const Vector &m_vecMaxs;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: Finds the first entity within an extent by class name.
 // Input  : pStartEntity - The entity to start from when doing the search.
@@ -887,6 +1508,13 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameWithin( CBaseEntity *pStart
 	//
 	CBaseEntity *pEntity = pStartEntity;
 
+	unsigned int afterSequence;
+	if ( IsFinderBox( vecMins, vecMaxs ) && GetFinderStart( pStartEntity, &afterSequence ) )
+	{
+		EntityClassnameInBoxFilter_t filter( szName, vecMins, vecMaxs );
+		return FindFirstInBox( vecMins, vecMaxs, afterSequence, filter );
+	}
+
 	while ((pEntity = gEntList.FindEntityByClassname( pEntity, szName )) != NULL)
 	{
 		if ( !pEntity->edict() && !pEntity->IsEFlagSet( EFL_SERVER_ONLY ) )
@@ -1095,6 +1723,8 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+	g_EntityFinder.AddEntity( pBaseEnt, handle.GetEntryIndex() );
+
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1126,6 +1756,8 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 		m_iNumEdicts--;
 
 	m_iNumEnts--;
+
+	g_EntityFinder.RemoveEntity( handle.GetEntryIndex() );
 }
 
 void CGlobalEntityList::NotifyCreateEntity( CBaseEntity *pEnt )
@@ -108,6 +108,10 @@ public:
 
 	void ReportEntityFlagsChanged( CBaseEntity *pEntity, unsigned int flagsOld, unsigned int flagsNow );
 
+	// keep the search index up to date
+	void ReportEntityMoved( CBaseEntity *pEntity );
+	void ReportEntityClassnameChanged( CBaseEntity *pEntity );
+
 	// entity is about to be removed, notify the listeners
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
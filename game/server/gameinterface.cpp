@@ -89,6 +89,10 @@
 #include "tier3/tier3.h"
 #include "serverbenchmark_base.h"
 #include "querycache.h"
+#include "bone_setup.h"
+#ifdef LINUX
+#include "tier1/pathmatch.h"
+#endif
 
 
 #ifdef TF_DLL
@@ -235,6 +239,12 @@ static int		g_nCommandClientIndex = 0;
 // The chapter number of the current
 static int		g_nCurrentChapterIndex = -1;
 
+#ifdef LINUX
+// tier1 is linked statically into every module, so these counters only see the lookups made by
+// the server module itself; the filesystem's level load lookups are counted in its own copy.
+static ConVar sv_pathmatch_server_stats( "sv_pathmatch_server_stats", "0", 0, "Report the case insensitive path lookups made by the server module while loading each level (ENABLE_PATHMATCH only, excludes engine and filesystem lookups)." );
+#endif
+
 #ifdef _DEBUG
 static ConVar sv_showhitboxes( "sv_showhitboxes", "-1", FCVAR_CHEAT, "Send server-side hitboxes for specified entity to client (NOTE:  this uses lots of bandwidth, use on listen server only)." );
 #endif
@@ -1152,6 +1162,16 @@ void CServerGameDLL::ServerActivate( edict_t *pEdictList, int edictCount, int cl
 #ifdef NEXT_BOT
 	TheNextBots().OnMapLoaded();
 #endif
+
+#ifdef LINUX
+	if ( sv_pathmatch_server_stats.GetBool() )
+	{
+		PathMatchStats_t stats;
+		PathMatch_GetStats( &stats );
+		Msg( "pathmatch (server module only): %u directory index hits, %u misses, %u directory scans, %u invalidations\n",
+			stats.m_nIndexHits, stats.m_nIndexMisses, stats.m_nDirScans, stats.m_nInvalidations );
+	}
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -1245,6 +1265,7 @@ void CServerGameDLL::GameFrame( bool simulating )
 #endif
 
 	UpdateQueryCache();
+	Studio_BoneCacheFrameUpdate();
 	g_pServerBenchmark->UpdateBenchmark();
 
 	Physics_RunThinkFunctions( simulating );
@@ -1384,6 +1405,11 @@ void CServerGameDLL::LevelShutdown( void )
 
 	g_pServerBenchmark->EndBenchmark();
 
+#ifdef LINUX
+	// Counts from here to the next ServerActivate cover the next level's load.
+	PathMatch_ResetStats();
+#endif
+
 	MDLCACHE_CRITICAL_SECTION();
 	IGameSystem::LevelShutdownPreEntityAllSystems();
 
@@ -2685,6 +2685,16 @@ bool CNPC_PlayerCompanion::IsCoverPosition( const Vector &vecThreat, const Vecto
 	return BaseClass::IsCoverPosition( vecThreat, vecPosition );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Multi-enemy, turret and mortar searches read the static search
+//			state, our enemies and our origin, so only plain searches can reuse
+//			earlier cover tests
+//-----------------------------------------------------------------------------
+bool CNPC_PlayerCompanion::CanCacheTacticalVisResults()
+{
+	return ( !gm_bFindingCoverFromAllEnemies && gm_fCoverSearchType == CT_NORMAL );
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 bool CNPC_PlayerCompanion::IsMortar( CBaseEntity *pEntity )
@@ -262,6 +262,7 @@ public:
 	bool			FindCoverPos( CSound *pSound, Vector *pResult );
 	bool			FindMortarCoverPos( CSound *pSound, Vector *pResult );
 	bool 			IsCoverPosition( const Vector &vecThreat, const Vector &vecPosition );
+	bool			CanCacheTacticalVisResults();
 
 	bool			IsEnemyTurret() { return ( GetEnemy() && IsTurret(GetEnemy()) ); }
 	
@@ -291,6 +291,7 @@ public:
 
 	unsigned int GetID( void ) const	{ return m_id; }		// return this area's unique ID
 	static void CompressIDs( void );							// re-orders area ID's so they are continuous
+	static unsigned int GetNextID( void )	{ return m_nextID; }	// one past the largest area ID in use
 	unsigned int GetDebugID( void ) const { return m_debugid; }
 
 	void SetAttributes( int bits )			{ m_attributeFlags = bits; }
@@ -983,4 +983,692 @@ void SelectSeparatedShuffleSet( int maxCount, float minSeparation, const CUtlVec
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Search state for NavAreaBuildPath() and SearchSurroundingAreas() kept outside of the CNavArea's.
+ * The static open list and the marker, cost and parent fields in CNavArea only allow one search
+ * at a time on the main thread. A CNavSearchContext owns its own open list, costs and parent links
+ * in a side table indexed by area ID, so any number of contexts can search the mesh at once, on
+ * any thread, as long as nobody is changing the mesh while they do.
+ * A context is reused from search to search; the side table is only cleared when the marker wraps.
+ */
+class CNavSearchContext
+{
+public:
+	CNavSearchContext( void ) : m_marker( 0 ), m_openSequence( 0 ) { }
+
+	/**
+	 * Same as NavAreaBuildPath(), but all search state lives in this context.
+	 * Cost functors must read costs from the context (see NavSearchShortestPathCost), not the areas.
+	 */
+	template< typename CostFunctor >
+	bool BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false );
+
+	/**
+	 * Same as the functor version of SearchSurroundingAreas(), but all search state lives in this context.
+	 * Visited areas answer true to IsVisited(), and GetCostSoFar() is their approximate travel distance.
+	 */
+	template < typename Functor >
+	void SearchSurroundingAreas( CNavArea *startArea, const Vector &startPos, Functor &func, float maxRange = -1.0f, unsigned int options = 0, int teamID = TEAM_ANY );
+
+	// results of the last search
+	bool IsVisited( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node != NULL; }
+	CNavArea *GetParent( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node ? node->parent : NULL; }
+	NavTraverseType GetParentHow( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node ? node->parentHow : NUM_TRAVERSE_TYPES; }
+	float GetCostSoFar( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node ? node->costSoFar : 0.0f; }
+	float GetTotalCost( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node ? node->totalCost : 0.0f; }
+	float GetPathLengthSoFar( const CNavArea *area ) const	{ const SearchNode_t *node = FindNode( area ); return node ? node->pathLengthSoFar : 0.0f; }
+
+	/**
+	 * Follow parent links back from 'endArea' and store the path from the start of the last search.
+	 * Returns the distance along the path between area centers.
+	 */
+	float GetPath( CNavArea *endArea, CUtlVector< CNavArea * > *areaVector, CUtlVector< NavTraverseType > *howVector = NULL ) const;
+
+private:
+	enum SearchState
+	{
+		SEARCH_NEW,
+		SEARCH_OPEN,
+		SEARCH_CLOSED,
+	};
+
+	struct SearchNode_t
+	{
+		CNavArea *area;
+		CNavArea *parent;
+		unsigned int marker;			// node is only valid for the search with this marker
+		unsigned int openSequence;		// order added to the open list, so equal costs come off first-in first-out
+		int heapIndex;
+		float costSoFar;
+		float totalCost;
+		float pathLengthSoFar;
+		NavTraverseType parentHow;
+		SearchState state;
+	};
+
+	struct SearchConnect_t
+	{
+		CNavArea *area;
+		NavTraverseType how;
+		const CNavLadder *ladder;
+		const CFuncElevator *elevator;
+		float length;
+	};
+	typedef CUtlVectorFixedGrowable< SearchConnect_t, 32 > SearchConnectVector;
+
+	void BeginSearch( void );
+	SearchNode_t &Touch( CNavArea *area );
+
+	const SearchNode_t *FindNode( const CNavArea *area ) const
+	{
+		if ( area == NULL || area->GetID() >= (unsigned int)m_nodes.Count() )
+			return NULL;
+		const SearchNode_t &node = m_nodes[ area->GetID() ];
+		return ( node.marker == m_marker && node.area == area ) ? &node : NULL;
+	}
+
+	bool IsOpenListEmpty( void ) const	{ return m_openHeap.Count() == 0; }
+	void AddToOpenList( SearchNode_t &node );
+	void UpdateOnOpenList( SearchNode_t &node );
+	CNavArea *PopOpenList( void );
+
+	bool IsHeapLess( int i, int j ) const;
+	void HeapSwap( int i, int j );
+	void HeapUp( int i );
+	void HeapDown( int i );
+
+	static void CollectConnections( CNavArea *area, SearchConnectVector *connections );
+
+	CUtlVector< SearchNode_t > m_nodes;		// indexed by area ID
+	CUtlVector< SearchNode_t * > m_openHeap;	// binary heap ordered by total cost
+	unsigned int m_marker;
+	unsigned int m_openSequence;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * ShortestPathCost for use with CNavSearchContext::BuildPath()
+ */
+class NavSearchShortestPathCost
+{
+public:
+	NavSearchShortestPathCost( const CNavSearchContext &search ) : m_search( search )
+	{
+	}
+
+	float operator() ( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length )
+	{
+		if ( fromArea == NULL )
+		{
+			// first area in path, no cost
+			return 0.0f;
+		}
+
+		// compute distance traveled along path so far
+		float dist;
+
+		if ( ladder )
+		{
+			dist = ladder->m_length;
+		}
+		else if ( length > 0.0 )
+		{
+			dist = length;
+		}
+		else
+		{
+			dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
+		}
+
+		float cost = dist + m_search.GetCostSoFar( fromArea );
+
+		// if this is a "crouch" area, add penalty
+		if ( area->GetAttributes() & NAV_MESH_CROUCH )
+		{
+			const float crouchPenalty = 20.0f;
+			cost += crouchPenalty * dist;
+		}
+
+		// if this is a "jump" area, add penalty
+		if ( area->GetAttributes() & NAV_MESH_JUMP )
+		{
+			const float jumpPenalty = 5.0f;
+			cost += jumpPenalty * dist;
+		}
+
+		return cost;
+	}
+
+private:
+	const CNavSearchContext &m_search;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline void CNavSearchContext::BeginSearch( void )
+{
+	// the mesh may have grown since the last search
+	int areaCount = (int)CNavArea::GetNextID();
+	if ( m_nodes.Count() < areaCount )
+	{
+		int first = m_nodes.AddMultipleToTail( areaCount - m_nodes.Count() );
+		for( int i=first; i<m_nodes.Count(); ++i )
+		{
+			m_nodes[i].area = NULL;
+			m_nodes[i].marker = 0;
+		}
+	}
+
+	++m_marker;
+	if ( m_marker == 0 )
+	{
+		// wrapped, forget every old search
+		FOR_EACH_VEC( m_nodes, it )
+		{
+			m_nodes[ it ].marker = 0;
+		}
+		m_marker = 1;
+	}
+
+	m_openHeap.RemoveAll();
+	m_openSequence = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavSearchContext::SearchNode_t &CNavSearchContext::Touch( CNavArea *area )
+{
+	Assert( area->GetID() < (unsigned int)m_nodes.Count() );
+	SearchNode_t &node = m_nodes[ area->GetID() ];
+	if ( node.marker != m_marker || node.area != area )
+	{
+		node.area = area;
+		node.parent = NULL;
+		node.marker = m_marker;
+		node.openSequence = 0;
+		node.heapIndex = -1;
+		node.costSoFar = 0.0f;
+		node.totalCost = 0.0f;
+		node.pathLengthSoFar = 0.0f;
+		node.parentHow = NUM_TRAVERSE_TYPES;
+		node.state = SEARCH_NEW;
+	}
+	return node;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline bool CNavSearchContext::IsHeapLess( int i, int j ) const
+{
+	const SearchNode_t *a = m_openHeap[i];
+	const SearchNode_t *b = m_openHeap[j];
+	if ( a->totalCost != b->totalCost )
+		return a->totalCost < b->totalCost;
+	return a->openSequence < b->openSequence;
+}
+
+inline void CNavSearchContext::HeapSwap( int i, int j )
+{
+	SearchNode_t *tmp = m_openHeap[i];
+	m_openHeap[i] = m_openHeap[j];
+	m_openHeap[j] = tmp;
+	m_openHeap[i]->heapIndex = i;
+	m_openHeap[j]->heapIndex = j;
+}
+
+inline void CNavSearchContext::HeapUp( int i )
+{
+	while ( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !IsHeapLess( i, parent ) )
+			break;
+		HeapSwap( i, parent );
+		i = parent;
+	}
+}
+
+inline void CNavSearchContext::HeapDown( int i )
+{
+	int count = m_openHeap.Count();
+	while ( true )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+		if ( child + 1 < count && IsHeapLess( child + 1, child ) )
+			++child;
+		if ( !IsHeapLess( child, i ) )
+			break;
+		HeapSwap( i, child );
+		i = child;
+	}
+}
+
+inline void CNavSearchContext::AddToOpenList( SearchNode_t &node )
+{
+	Assert( node.state != SEARCH_OPEN );
+	node.state = SEARCH_OPEN;
+	node.openSequence = ++m_openSequence;
+	node.heapIndex = m_openHeap.AddToTail( &node );
+	HeapUp( node.heapIndex );
+}
+
+inline void CNavSearchContext::UpdateOnOpenList( SearchNode_t &node )
+{
+	// costs only ever decrease while on the open list
+	Assert( node.state == SEARCH_OPEN );
+	HeapUp( node.heapIndex );
+}
+
+inline CNavArea *CNavSearchContext::PopOpenList( void )
+{
+	SearchNode_t *node = m_openHeap[0];
+	int last = m_openHeap.Count() - 1;
+	if ( last > 0 )
+	{
+		HeapSwap( 0, last );
+	}
+	m_openHeap.Remove( last );
+	if ( last > 0 )
+	{
+		HeapDown( 0 );
+	}
+
+	// popped areas count as closed until the search is done with them
+	node->heapIndex = -1;
+	node->state = SEARCH_CLOSED;
+	return node->area;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the areas reachable from 'area', in the order NavAreaBuildPath() visits them
+ */
+inline void CNavSearchContext::CollectConnections( CNavArea *area, SearchConnectVector *connections )
+{
+	connections->RemoveAll();
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+		FOR_EACH_VEC( (*floorList), it )
+		{
+			SearchConnect_t &connect = connections->Element( connections->AddToTail() );
+			connect.area = (*floorList)[ it ].area;
+			connect.how = (NavTraverseType)dir;
+			connect.ladder = NULL;
+			connect.elevator = NULL;
+			connect.length = (*floorList)[ it ].length;
+		}
+	}
+
+	const NavLadderConnectVector *ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+	FOR_EACH_VEC( (*ladderList), it )
+	{
+		const CNavLadder *ladder = (*ladderList)[ it ].ladder;
+
+		// do not use BEHIND connection, as its very hard to get to when going up a ladder
+		CNavArea *topArea[] = { ladder->m_topForwardArea, ladder->m_topLeftArea, ladder->m_topRightArea };
+		for( int i=0; i<ARRAYSIZE( topArea ); ++i )
+		{
+			if ( topArea[i] == NULL )
+				continue;
+
+			SearchConnect_t &connect = connections->Element( connections->AddToTail() );
+			connect.area = topArea[i];
+			connect.how = GO_LADDER_UP;
+			connect.ladder = ladder;
+			connect.elevator = NULL;
+			connect.length = -1.0f;
+		}
+	}
+
+	ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+	FOR_EACH_VEC( (*ladderList), it )
+	{
+		const CNavLadder *ladder = (*ladderList)[ it ].ladder;
+		if ( ladder->m_bottomArea == NULL )
+			continue;
+
+		SearchConnect_t &connect = connections->Element( connections->AddToTail() );
+		connect.area = ladder->m_bottomArea;
+		connect.how = GO_LADDER_DOWN;
+		connect.ladder = ladder;
+		connect.elevator = NULL;
+		connect.length = -1.0f;
+	}
+
+	const CFuncElevator *elevator = area->GetElevator();
+	if ( elevator )
+	{
+		const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+		FOR_EACH_VEC( elevatorAreas, it )
+		{
+			SearchConnect_t &connect = connections->Element( connections->AddToTail() );
+			connect.area = elevatorAreas[ it ].area;
+			connect.how = ( connect.area->GetCenter().z > area->GetCenter().z ) ? GO_ELEVATOR_UP : GO_ELEVATOR_DOWN;
+			connect.ladder = NULL;
+			connect.elevator = elevator;
+			connect.length = -1.0f;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template< typename CostFunctor >
+bool CNavSearchContext::BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers )
+{
+	VPROF_BUDGET( "CNavSearchContext::BuildPath", "NextBotSpiky" );
+
+	if ( closestArea )
+	{
+		*closestArea = startArea;
+	}
+
+	if (startArea == NULL)
+		return false;
+
+	// start search
+	BeginSearch();
+
+	SearchNode_t &startNode = Touch( startArea );
+
+	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
+		goalArea = NULL;
+
+	if (goalArea == NULL && goalPos == NULL)
+		return false;
+
+	// if we are already in the goal area, build trivial path
+	if (startArea == goalArea)
+	{
+		return true;
+	}
+
+	// determine actual goal position
+	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
+
+	// compute estimate of path length
+	startNode.totalCost = (startArea->GetCenter() - actualGoalPos).Length();
+
+	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
+	if (initCost < 0.0f)
+		return false;
+	startNode.costSoFar = initCost;
+	startNode.pathLengthSoFar = 0.0f;
+
+	AddToOpenList( startNode );
+
+	// keep track of the area we visit that is closest to the goal
+	float closestAreaDist = startNode.totalCost;
+
+	bool bHaveMaxPathLength = ( maxPathLength > 0.0f );
+	SearchConnectVector connections;
+
+	// do A* search
+	while( !IsOpenListEmpty() )
+	{
+		// get next area to check
+		CNavArea *area = PopOpenList();
+
+		// don't consider blocked areas
+		if ( area->IsBlocked( teamID, ignoreNavBlockers ) )
+			continue;
+
+		// check if we have found the goal area or position
+		if (area == goalArea || (goalArea == NULL && goalPos && area->Contains( *goalPos )))
+		{
+			if (closestArea)
+			{
+				*closestArea = area;
+			}
+
+			return true;
+		}
+
+		// nodes don't move, the side table is sized before the search starts
+		const SearchNode_t &areaNode = m_nodes[ area->GetID() ];
+
+		CollectConnections( area, &connections );
+		FOR_EACH_VEC( connections, it )
+		{
+			const SearchConnect_t &connect = connections[ it ];
+			CNavArea *newArea = connect.area;
+
+			// don't backtrack
+			Assert( newArea );
+			if ( newArea == areaNode.parent )
+				continue;
+			if ( newArea == area ) // self neighbor?
+				continue;
+
+			// don't consider blocked areas
+			if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
+				continue;
+
+			float newCostSoFar = costFunc( newArea, area, connect.ladder, connect.elevator, connect.length );
+
+			// check if cost functor says this area is a dead-end
+			if ( newCostSoFar < 0.0f )
+				continue;
+
+			// same safety margin as NavAreaBuildPath against a bogus functor
+			Assert( newCostSoFar >= areaNode.costSoFar );
+			float minNewCostSoFar = areaNode.costSoFar * 1.00001 + 0.00001;
+			newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
+
+			// stop if path length limit reached
+			float newLengthSoFar = 0.0f;
+			if ( bHaveMaxPathLength )
+			{
+				// keep track of path length so far
+				float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
+				newLengthSoFar = areaNode.pathLengthSoFar + deltaLength;
+				if ( newLengthSoFar > maxPathLength )
+					continue;
+			}
+
+			SearchNode_t &newNode = Touch( newArea );
+			if ( newNode.state != SEARCH_NEW && newNode.costSoFar <= newCostSoFar )
+			{
+				// this is a worse path - skip it
+				continue;
+			}
+
+			// compute estimate of distance left to go
+			float distSq = ( newArea->GetCenter() - actualGoalPos ).LengthSqr();
+			float newCostRemaining = ( distSq > 0.0 ) ? FastSqrt( distSq ) : 0.0 ;
+
+			// track closest area to goal in case path fails
+			if ( closestArea && newCostRemaining < closestAreaDist )
+			{
+				*closestArea = newArea;
+				closestAreaDist = newCostRemaining;
+			}
+
+			newNode.costSoFar = newCostSoFar;
+			newNode.totalCost = newCostSoFar + newCostRemaining;
+			newNode.pathLengthSoFar = newLengthSoFar;
+			newNode.parent = area;
+			newNode.parentHow = connect.how;
+
+			if ( newNode.state == SEARCH_OPEN )
+			{
+				// area already on open list, update the heap to keep costs sorted
+				UpdateOnOpenList( newNode );
+			}
+			else
+			{
+				// new, or reopening a closed area
+				AddToOpenList( newNode );
+			}
+		}
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template < typename Functor >
+void CNavSearchContext::SearchSurroundingAreas( CNavArea *startArea, const Vector &startPos, Functor &func, float maxRange, unsigned int options, int teamID )
+{
+	if (startArea == NULL)
+		return;
+
+	BeginSearch();
+
+	AddToOpenList( Touch( startArea ) );
+
+	CUtlVectorFixedGrowable< CNavArea *, 32 > adjVector;
+
+	while( !IsOpenListEmpty() )
+	{
+		// get next area to check
+		CNavArea *area = PopOpenList();
+
+		// don't use blocked areas
+		if ( area->IsBlocked( teamID ) && !(options & INCLUDE_BLOCKED_AREAS) )
+			continue;
+
+		// invoke functor on area
+		if ( !func( area ) )
+			continue;
+
+		// collect adjacent areas in the same order as the global version
+		adjVector.RemoveAll();
+
+		for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+		{
+			int count = area->GetAdjacentCount( (NavDirType)dir );
+			for( int i=0; i<count; ++i )
+			{
+				CNavArea *adjArea = area->GetAdjacentArea( (NavDirType)dir, i );
+				if ( options & EXCLUDE_OUTGOING_CONNECTIONS )
+				{
+					if ( !adjArea->IsConnected( area, NUM_DIRECTIONS ) )
+					{
+						continue;	// skip this outgoing connection
+					}
+				}
+
+				adjVector.AddToTail( adjArea );
+			}
+		}
+
+		// potentially include areas that connect TO this area via a one-way link
+		if (options & INCLUDE_INCOMING_CONNECTIONS)
+		{
+			for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+			{
+				const NavConnectVector *list = area->GetIncomingConnections( (NavDirType)dir );
+				FOR_EACH_VEC( (*list), it )
+				{
+					adjVector.AddToTail( (*list)[ it ].area );
+				}
+			}
+		}
+
+		const NavLadderConnectVector *ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+		FOR_EACH_VEC( (*ladderList), it )
+		{
+			const CNavLadder *ladder = (*ladderList)[ it ].ladder;
+
+			// do not use BEHIND connection, as its very hard to get to when going up a ladder
+			adjVector.AddToTail( ladder->m_topForwardArea );
+			adjVector.AddToTail( ladder->m_topLeftArea );
+			adjVector.AddToTail( ladder->m_topRightArea );
+		}
+
+		ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+		FOR_EACH_VEC( (*ladderList), it )
+		{
+			adjVector.AddToTail( (*ladderList)[ it ].ladder->m_bottomArea );
+		}
+
+		if ( (options & EXCLUDE_ELEVATORS) == 0 )
+		{
+			const NavConnectVector &elevatorList = area->GetElevatorAreas();
+			FOR_EACH_VEC( elevatorList, it )
+			{
+				adjVector.AddToTail( elevatorList[ it ].area );
+			}
+		}
+
+		const SearchNode_t &areaNode = m_nodes[ area->GetID() ];
+		FOR_EACH_VEC( adjVector, it )
+		{
+			CNavArea *adjArea = adjVector[ it ];
+			if ( adjArea == NULL || IsVisited( adjArea ) )
+				continue;
+
+			// same rules as AddAreaToOpenList()
+			SearchNode_t &adjNode = Touch( adjArea );
+			adjNode.parent = area;
+
+			if (maxRange > 0.0f)
+			{
+				// make sure this area overlaps range
+				Vector closePos;
+				adjArea->GetClosestPointOnArea( startPos, &closePos );
+				if ((closePos - startPos).AsVector2D().IsLengthLessThan( maxRange ))
+				{
+					// compute approximate distance along path to limit travel range, too
+					float distAlong = areaNode.costSoFar;
+					distAlong += (adjArea->GetCenter() - area->GetCenter()).Length();
+					adjNode.costSoFar = distAlong;
+
+					// allow for some fudge due to large size areas
+					if (distAlong <= 1.5f * maxRange)
+						AddToOpenList( adjNode );
+				}
+			}
+			else
+			{
+				// infinite range
+				AddToOpenList( adjNode );
+			}
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavSearchContext::GetPath( CNavArea *endArea, CUtlVector< CNavArea * > *areaVector, CUtlVector< NavTraverseType > *howVector ) const
+{
+	if ( areaVector )
+	{
+		areaVector->RemoveAll();
+	}
+	if ( howVector )
+	{
+		howVector->RemoveAll();
+	}
+
+	float distance = 0.0f;
+	for( const SearchNode_t *node = FindNode( endArea ); node; node = FindNode( node->parent ) )
+	{
+		if ( areaVector )
+		{
+			areaVector->AddToHead( node->area );
+		}
+		if ( howVector )
+		{
+			howVector->AddToHead( node->parentHow );
+		}
+		if ( node->parent )
+		{
+			distance += ( node->area->GetCenter() - node->parent->GetCenter() ).Length();
+		}
+	}
+
+	return distance;
+}
+
+
 #endif // _NAV_PATHFIND_H_
@@ -0,0 +1,128 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Round trips objects through CSave/CRestore to check that datamaps
+//			written through cached save plans come back intact.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "saverestore.h"
+#include "saverestoretypes.h"
+#include "saverestore_utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// The utlvector save ops write their elements through a typedescription built
+// on the stack, with the element count as its size. Two vectors of different
+// lengths must each be written at their own length.
+struct SaveRestoreTestVectors_t
+{
+	DECLARE_SIMPLE_DATADESC();
+
+	CUtlVector<int>	m_First;
+	CUtlVector<int>	m_Second;
+	int				m_iTail;
+};
+
+BEGIN_SIMPLE_DATADESC( SaveRestoreTestVectors_t )
+	DEFINE_UTLVECTOR( m_First, FIELD_INTEGER ),
+	DEFINE_UTLVECTOR( m_Second, FIELD_INTEGER ),
+	DEFINE_FIELD( m_iTail, FIELD_INTEGER ),
+END_DATADESC()
+
+static void FillTestVectors( SaveRestoreTestVectors_t *pVectors, int nFirst, int nSecond, int iSeed )
+{
+	for ( int i = 0; i < nFirst; i++ )
+	{
+		pVectors->m_First.AddToTail( iSeed + i + 1 );
+	}
+	for ( int i = 0; i < nSecond; i++ )
+	{
+		pVectors->m_Second.AddToTail( -( iSeed + i + 1 ) );
+	}
+	pVectors->m_iTail = iSeed;
+}
+
+static bool TestVectorsMatch( const SaveRestoreTestVectors_t &expected, const SaveRestoreTestVectors_t &restored )
+{
+	if ( expected.m_First.Count() != restored.m_First.Count() || expected.m_Second.Count() != restored.m_Second.Count() )
+		return false;
+
+	for ( int i = 0; i < expected.m_First.Count(); i++ )
+	{
+		if ( expected.m_First[i] != restored.m_First[i] )
+			return false;
+	}
+	for ( int i = 0; i < expected.m_Second.Count(); i++ )
+	{
+		if ( expected.m_Second[i] != restored.m_Second[i] )
+			return false;
+	}
+	return ( expected.m_iTail == restored.m_iTail );
+}
+
+CON_COMMAND_F( test_saverestore, "Round trips utlvectors of different lengths through save/restore.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const int nTests = 4;
+	static const int lengths[nTests][2] = { { 2, 5 }, { 7, 1 }, { 2, 5 }, { 0, 9 } };
+
+	SaveRestoreTestVectors_t saved[nTests];
+	for ( int i = 0; i < nTests; i++ )
+	{
+		FillTestVectors( &saved[i], lengths[i][0], lengths[i][1], 100 * ( i + 1 ) );
+	}
+
+	const int nBufferSize = 64 * 1024;
+	const int nTokens = 0xfff;
+	char *pBuffer = new char[nBufferSize];
+	char **ppTokens = new char *[nTokens];
+
+	CSaveRestoreData saveData;
+	saveData.Init( pBuffer, nBufferSize );
+	saveData.InitSymbolTable( ppTokens, nTokens );
+
+	{
+		CSave save( &saveData );
+		for ( int i = 0; i < nTests; i++ )
+		{
+			save.WriteAll( &saved[i], &SaveRestoreTestVectors_t::m_DataMap );
+		}
+	}
+
+	// Read back from the start of what was written, with the same symbols
+	saveData.Init( pBuffer, saveData.GetCurPos() );
+
+	int nFailed = 0;
+	{
+		CRestore restore( &saveData );
+		for ( int i = 0; i < nTests; i++ )
+		{
+			SaveRestoreTestVectors_t restored;
+			restore.ReadAll( &restored, &SaveRestoreTestVectors_t::m_DataMap );
+			if ( !TestVectorsMatch( saved[i], restored ) )
+			{
+				Warning( "test_saverestore: object %d (%d and %d elements) came back as %d and %d elements\n", i,
+					saved[i].m_First.Count(), saved[i].m_Second.Count(), restored.m_First.Count(), restored.m_Second.Count() );
+				nFailed++;
+			}
+		}
+	}
+
+	saveData.DetachSymbolTable();
+	delete [] ppTokens;
+	delete [] pBuffer;
+
+	if ( nFailed )
+	{
+		Warning( "test_saverestore: %d of %d objects failed\n", nFailed, nTests );
+	}
+	else
+	{
+		Msg( "test_saverestore: all %d objects passed\n", nTests );
+	}
+}
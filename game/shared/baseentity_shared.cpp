@@ -444,6 +444,12 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 		return true;
 	}
 
+	if ( FStrEq( szKeyName, "classname" ) )
+	{
+		SetClassname( szValue );
+		return true;
+	}
+
 	// loop through the data description, and try and place the keys in
 	if ( !*ent_debugkeys.GetString() )
 	{
@@ -1488,6 +1494,9 @@ void CBaseEntity::InvalidatePhysicsRecursive( int nChangeFlags )
 			MarkRenderHandleDirty();
 			g_pClientShadowMgr->AddToDirtyShadowList( this );
 			g_pClientShadowMgr->MarkRenderToTextureShadowDirty( GetShadowHandle() );
+#else
+			// The surrounding box doesn't care, but the world space AABB of a rotated OBB does
+			gEntList.ReportEntityMoved( this );
 #endif
 		}
 
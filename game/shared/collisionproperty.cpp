@@ -1356,6 +1356,11 @@ void CCollisionProperty::UpdateServerPartitionMask( )
 //-----------------------------------------------------------------------------
 void CCollisionProperty::MarkPartitionHandleDirty()
 {
+#ifndef CLIENT_DLL
+	// Keeps the entity list's search grid current
+	gEntList.ReportEntityMoved( m_pOuter );
+#endif
+
 	// don't bother with the world
 	if ( m_pOuter->entindex() == 0 )
 		return;
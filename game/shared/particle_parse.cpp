@@ -7,6 +7,7 @@
 #include "cbase.h"
 #include "filesystem.h"
 #include <KeyValues.h>
+#include "tier1/kvcompiled.h"
 #include "particle_parse.h"
 #include "particles/particles.h"
 
@@ -58,10 +59,10 @@ int GetAttachTypeFromString( const char *pszString )
 void GetParticleManifest( CUtlVector<CUtlString>& list )
 {
 	// Open the manifest file, and read the particles specified inside it
-	KeyValues *manifest = new KeyValues( PARTICLES_MANIFEST_FILE );
-	if ( manifest->LoadFromFile( filesystem, PARTICLES_MANIFEST_FILE, "GAME" ) )
+	CCompiledKeyValues manifest;
+	if ( manifest.LoadFromFile( filesystem, PARTICLES_MANIFEST_FILE, "GAME" ) )
 	{
-		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL; sub = sub->GetNextKey() )
+		for ( const CKeyValuesView *sub = manifest.GetRoot()->GetFirstSubKey(); sub != NULL; sub = sub->GetNextKey() )
 		{
 			if ( !Q_stricmp( sub->GetName(), "file" ) )
 			{
@@ -76,8 +77,6 @@ void GetParticleManifest( CUtlVector<CUtlString>& list )
 	{
 		Warning( "PARTICLE SYSTEM: Unable to load manifest file '%s'\n", PARTICLES_MANIFEST_FILE );
 	}
-
-	manifest->deleteThis();
 }
 
 
@@ -24,6 +24,9 @@
 #include "vphysics/object_hash.h"
 #include "datacache/imdlcache.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "utlmap.h"
+#include "utldict.h"
 
 #if !defined( CLIENT_DLL )
 
@@ -93,6 +96,167 @@ static int gSizes[FIELD_TYPECOUNT] =
 	FIELD_SIZE( FIELD_VECTOR2D ),
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: A datamap's field table compiled for save/restore. Built the first
+//			time the map is written or read through WriteAll/ReadAll and kept
+//			for the life of the DLL, so the per-save walk skips unsaved fields,
+//			doesn't re-check field types and doesn't re-hash field names.
+//
+//			Some save ops (the utlvector ones, for instance) build datamaps on
+//			the stack and change field sizes from call to call, so a plan keeps
+//			a copy of everything it was compiled from and is only used while
+//			the table still matches it. Plans refer to fields by index and
+//			never keep pointers into the table.
+//-----------------------------------------------------------------------------
+
+// Fields at most this big that copy straight out of memory are gathered into
+// one buffer write per run instead of a header write and a data write each.
+#define SAVE_PLAN_MAX_RAW_RUN	1024
+
+struct SavePlanField_t
+{
+	int					iField;			// index in the datamap's dataDesc
+	int					nBytes;			// header size for raw fields, 0 otherwise
+	unsigned short		iSymbol;		// last symbol this name got in a save, checked before use
+	bool				bRaw;			// saved as a header plus the bytes in memory
+};
+
+// The parts of a typedescription_t that save/restore depends on
+struct SavePlanSource_t
+{
+	int					fieldType;
+	const char			*fieldName;
+	int					fieldOffset;
+	int					fieldSize;
+	int					flags;
+	int					fieldSizeInBytes;
+	datamap_t			*td;
+	ISaveRestoreOps		*pSaveRestoreOps;
+};
+
+class CSaveFieldPlan
+{
+public:
+	CSaveFieldPlan( const datamap_t *pMap );
+
+	int Count() const							{ return m_Fields.Count(); }
+	SavePlanField_t &operator[]( int i )		{ return m_Fields[i]; }
+
+	// Returns NULL if the map no longer matches the plan cached for it
+	static CSaveFieldPlan *Find( const datamap_t *pMap );
+
+private:
+	static void GetSource( const typedescription_t &field, SavePlanSource_t *pSource );
+	bool Matches( const datamap_t *pMap ) const;
+
+	const typedescription_t *m_pDataDesc;
+	CUtlVector<SavePlanSource_t> m_Source;
+	CUtlVector<SavePlanField_t> m_Fields;
+};
+
+CSaveFieldPlan::CSaveFieldPlan( const datamap_t *pMap )
+{
+	m_pDataDesc = pMap->dataDesc;
+	m_Source.SetCount( pMap->dataNumFields );
+	m_Fields.EnsureCapacity( pMap->dataNumFields );
+	for ( int i = 0; i < pMap->dataNumFields; i++ )
+	{
+		const typedescription_t *pField = &pMap->dataDesc[i];
+		GetSource( *pField, &m_Source[i] );
+
+		if ( !(pField->flags & FTYPEDESC_SAVE) || pField->fieldType == FIELD_VOID )
+			continue;
+
+		SavePlanField_t &entry = m_Fields[ m_Fields.AddToTail() ];
+		entry.iField = i;
+		entry.nBytes = 0;
+		entry.iSymbol = 0;
+		entry.bRaw = false;
+
+		switch ( pField->fieldType )
+		{
+		case FIELD_FLOAT:
+		case FIELD_VECTOR:
+		case FIELD_QUATERNION:
+		case FIELD_INTEGER:
+		case FIELD_BOOLEAN:
+		case FIELD_SHORT:
+		case FIELD_CHARACTER:
+		case FIELD_COLOR32:
+			// Mistyped fields take the slow path, which warns about them on every save
+			if ( pField->fieldSizeInBytes == pField->fieldSize * gSizes[pField->fieldType] && pField->fieldSizeInBytes <= SAVE_PLAN_MAX_RAW_RUN - 2 * sizeof(short) )
+			{
+				entry.nBytes = pField->fieldSizeInBytes;
+				entry.bRaw = true;
+			}
+			break;
+		}
+	}
+}
+
+void CSaveFieldPlan::GetSource( const typedescription_t &field, SavePlanSource_t *pSource )
+{
+	// Filled in member by member so the padding is always zero and the
+	// sources can be compared with memcmp
+	memset( pSource, 0, sizeof(*pSource) );
+	pSource->fieldType = field.fieldType;
+	pSource->fieldName = field.fieldName;
+	pSource->fieldOffset = field.fieldOffset[ TD_OFFSET_NORMAL ];
+	pSource->fieldSize = field.fieldSize;
+	pSource->flags = field.flags;
+	pSource->fieldSizeInBytes = field.fieldSizeInBytes;
+	pSource->td = field.td;
+	pSource->pSaveRestoreOps = field.pSaveRestoreOps;
+}
+
+bool CSaveFieldPlan::Matches( const datamap_t *pMap ) const
+{
+	if ( pMap->dataDesc != m_pDataDesc || pMap->dataNumFields != m_Source.Count() )
+		return false;
+
+	for ( int i = 0; i < pMap->dataNumFields; i++ )
+	{
+		SavePlanSource_t source;
+		GetSource( pMap->dataDesc[i], &source );
+		if ( memcmp( &source, &m_Source[i], sizeof(source) ) != 0 )
+			return false;
+	}
+	return true;
+}
+
+static CUtlMap<const datamap_t *, CSaveFieldPlan *> g_SaveFieldPlans( DefLessFunc( const datamap_t * ) );
+
+CSaveFieldPlan *CSaveFieldPlan::Find( const datamap_t *pMap )
+{
+	unsigned short i = g_SaveFieldPlans.Find( pMap );
+	if ( i != g_SaveFieldPlans.InvalidIndex() )
+	{
+		CSaveFieldPlan *pPlan = g_SaveFieldPlans[i];
+		return ( pPlan->Matches( pMap ) ) ? pPlan : NULL;
+	}
+
+	CSaveFieldPlan *pPlan = new CSaveFieldPlan( pMap );
+	g_SaveFieldPlans.Insert( pMap, pPlan );
+	return pPlan;
+}
+
+// The symbol table stores the first pointer it was given for a name, which is
+// nearly always the field's own name, so a cached symbol is checked with a
+// pointer compare and only falls back to a string compare or a lookup.
+static inline unsigned short FindPlanFieldSymbol( CSaveRestoreSegment *pData, SavePlanField_t &entry, const char *pszName )
+{
+	if ( entry.iSymbol < pData->SizeSymbolTable() )
+	{
+		const char *pszSymbol = pData->StringFromSymbol( entry.iSymbol );
+		if ( pszSymbol == pszName || ( pszSymbol && !strcmp( pszSymbol, pszName ) ) )
+			return entry.iSymbol;
+	}
+
+	entry.iSymbol = pData->FindCreateSymbol( pszName );
+	return entry.iSymbol;
+}
+
+
 
 // helpers to offset worldspace matrices
 static void VMatrixOffset( VMatrix &dest, const VMatrix &matrixIn, const Vector &offset )
@@ -203,18 +367,23 @@ CSave::CSave( CSaveRestoreData *pdata )
 
 inline int CSave::DataEmpty( const char *pdata, int size )
 {
-	if ( size != 4 )
+	// Or everything together and test once at the end. No early out, so the
+	// word loop has no branches in it and the compiler can vectorize it.
+	unsigned int bits = 0;
+	const char *pLimit = pdata + size;
+	for ( ; pdata + sizeof(unsigned int) <= pLimit; pdata += sizeof(unsigned int) )
 	{
-		const char *pLimit = pdata + size;
-		while ( pdata < pLimit )
-		{
-			if ( *pdata++ )
-				return 0;
-		}
-		return 1;
+		// Fields can sit at any offset, memcpy makes this a plain (unaligned) load
+		unsigned int word;
+		memcpy( &word, pdata, sizeof(word) );
+		bits |= word;
+	}
+	while ( pdata < pLimit )
+	{
+		bits |= (unsigned char)*pdata++;
 	}
 
-	return ( *((int *)pdata) == 0 );
+	return ( bits == 0 );
 }
 
 //-----------------------------------------------------------------------------
@@ -815,6 +984,13 @@ bool CSave::WriteField( const char *pname, void *pData, datamap_t *pRootMap, typ
 //-------------------------------------
 
 int CSave::WriteFields( const char *pname, const void *pBaseData, datamap_t *pRootMap, typedescription_t *pFields, int fieldCount )
+{
+	return WriteFields( pname, pBaseData, pRootMap, pFields, fieldCount, NULL );
+}
+
+//-------------------------------------
+
+int CSave::WriteFields( const char *pname, const void *pBaseData, datamap_t *pRootMap, typedescription_t *pFields, int fieldCount, CSaveFieldPlan *pPlan )
 {
 	typedescription_t *pTest;
 	int iHeaderPos = m_pData->GetCurPos();
@@ -835,11 +1011,49 @@ int CSave::WriteFields( const char *pname, const void *pBaseData, datamap_t *pRo
 	__dcbt( 512, pDest );
 #endif
 
-	for ( int i = 0; i < fieldCount; i++ )
+	// Raw fields are gathered here, header and data, and written in one go
+	// when the run ends or the buffer fills.
+	char runBuffer[SAVE_PLAN_MAX_RAW_RUN];
+	int nRunBytes = 0;
+
+	// Without a plan every field goes through ShouldSaveField and WriteField
+	int nEntries = ( pPlan ) ? pPlan->Count() : fieldCount;
+	for ( int i = 0; i < nEntries; i++ )
 	{
-		pTest = &pFields[ i ];
+		SavePlanField_t *pEntry = ( pPlan ) ? &(*pPlan)[i] : NULL;
+		pTest = &pFields[ ( pEntry ) ? pEntry->iField : i ];
 		void *pOutputData = ( (char *)pBaseData + pTest->fieldOffset[ TD_OFFSET_NORMAL ] );
 
+		if ( pEntry && pEntry->bRaw )
+		{
+			SavePlanField_t &entry = *pEntry;
+			if ( DataEmpty( (const char *)pOutputData, entry.nBytes ) )
+				continue;
+
+#ifdef _DEBUG
+			Log( pname, (fieldtype_t)pTest->fieldType, pOutputData, pTest->fieldSize );
+#endif
+			int nRecordBytes = 2 * sizeof(short) + entry.nBytes;
+			if ( nRunBytes + nRecordBytes > (int)sizeof(runBuffer) )
+			{
+				BufferData( runBuffer, nRunBytes );
+				nRunBytes = 0;
+			}
+
+			short header[2] = { (short)entry.nBytes, (short)FindPlanFieldSymbol( m_pData, entry, pTest->fieldName ) };
+			memcpy( runBuffer + nRunBytes, header, sizeof(header) );
+			memcpy( runBuffer + nRunBytes + sizeof(header), pOutputData, entry.nBytes );
+			nRunBytes += nRecordBytes;
+			count++;
+			continue;
+		}
+
+		if ( nRunBytes )
+		{
+			BufferData( runBuffer, nRunBytes );
+			nRunBytes = 0;
+		}
+
 		if ( !ShouldSaveField( pOutputData, pTest ) )
 			continue;
 
@@ -848,6 +1062,11 @@ int CSave::WriteFields( const char *pname, const void *pBaseData, datamap_t *pRo
 		count++;
 	}
 
+	if ( nRunBytes )
+	{
+		BufferData( runBuffer, nRunBytes );
+	}
+
 	int iCurPos = m_pData->GetCurPos();
 	int iRewind = iCurPos - iHeaderPos;
 	m_pData->Rewind( iRewind );
@@ -872,7 +1091,7 @@ int CSave::DoWriteAll( const void *pLeafObject, datamap_t *pLeafMap, datamap_t *
 			return status;
 	}
 
-	return WriteFields( pCurMap->dataClassName, pLeafObject, pLeafMap, pCurMap->dataDesc, pCurMap->dataNumFields );
+	return WriteFields( pCurMap->dataClassName, pLeafObject, pLeafMap, pCurMap->dataDesc, pCurMap->dataNumFields, CSaveFieldPlan::Find( pCurMap ) );
 }
 
 //-------------------------------------
@@ -1526,6 +1745,31 @@ typedescription_t *CRestore::FindField( const char *pszFieldName, typedescriptio
 
 //-------------------------------------
 
+static typedescription_t *FindPlanField( const char *pszFieldName, typedescription_t *pFields, CSaveFieldPlan &plan, int *pCookie )
+{
+	int &fieldNumber = *pCookie;
+	int fieldCount = plan.Count();
+	if ( pszFieldName )
+	{
+		for ( int i = 0; i < fieldCount; i++ )
+		{
+			typedescription_t *pTest = &pFields[ plan[fieldNumber].iField ];
+
+			++fieldNumber;
+			if ( fieldNumber == fieldCount )
+				fieldNumber = 0;
+
+			if ( stricmp( pTest->fieldName, pszFieldName ) == 0 )
+				return pTest;
+		}
+	}
+
+	fieldNumber = 0;
+	return NULL;
+}
+
+//-------------------------------------
+
 bool CRestore::ShouldEmptyField( typedescription_t *pField )
 {
 	// don't clear out fields that don't get saved, or that are handled specially
@@ -1631,6 +1875,13 @@ void CRestore::EndBlock()
 //-------------------------------------
 
 int CRestore::ReadFields( const char *pname, void *pBaseData, datamap_t *pRootMap, typedescription_t *pFields, int fieldCount )
+{
+	return ReadFields( pname, pBaseData, pRootMap, pFields, fieldCount, NULL );
+}
+
+//-------------------------------------
+
+int CRestore::ReadFields( const char *pname, void *pBaseData, datamap_t *pRootMap, typedescription_t *pFields, int fieldCount, CSaveFieldPlan *pPlan )
 {
 	static int lastName = -1;
 	Verify( ReadShort() == sizeof(int) );			// First entry should be an int
@@ -1662,7 +1913,9 @@ int CRestore::ReadFields( const char *pname, void *pBaseData, datamap_t *pRootMa
 	{
 		ReadHeader( &header );
 
-		typedescription_t *pField = FindField( m_pData->StringFromSymbol( header.symbol ), pFields, fieldCount, &searchCookie);
+		// Only fields that are ever written can be in the file, so a plan only searches those
+		const char *pszFieldName = m_pData->StringFromSymbol( header.symbol );
+		typedescription_t *pField = ( pPlan ) ? FindPlanField( pszFieldName, pFields, *pPlan, &searchCookie ) : FindField( pszFieldName, pFields, fieldCount, &searchCookie );
 		if ( pField && ShouldReadField( pField ) )
 		{
 			ReadField( header, ((char *)pBaseData + pField->fieldOffset[ TD_OFFSET_NORMAL ]), pRootMap, pField );
@@ -1728,7 +1981,7 @@ int CRestore::DoReadAll( void *pLeafObject, datamap_t *pLeafMap, datamap_t *pCur
 			return status;
 	}
 
-	return ReadFields( pCurMap->dataClassName, pLeafObject, pLeafMap, pCurMap->dataDesc, pCurMap->dataNumFields );
+	return ReadFields( pCurMap->dataClassName, pLeafObject, pLeafMap, pCurMap->dataDesc, pCurMap->dataNumFields, CSaveFieldPlan::Find( pCurMap ) );
 }
 
 //-------------------------------------
@@ -2455,10 +2708,53 @@ void CEntitySaveRestoreBlockHandler::PreSave( CSaveRestoreData *pSaveData )
 
 //---------------------------------
 
+ConVar save_class_timings( "save_class_timings", "0", 0, "After each save, print the N entity classes that took longest to write." );
+
+struct SaveClassTiming_t
+{
+	const char *pszClassname;
+	int		nEntities;
+	int		nBytes;
+	float	flMilliseconds;
+};
+
+static int SaveClassTimingCompare( const SaveClassTiming_t * const *ppLeft, const SaveClassTiming_t * const *ppRight )
+{
+	if ( (*ppLeft)->flMilliseconds != (*ppRight)->flMilliseconds )
+		return ( (*ppLeft)->flMilliseconds > (*ppRight)->flMilliseconds ) ? -1 : 1;
+	return 0;
+}
+
+static void ReportSaveClassTimings( CUtlDict<SaveClassTiming_t, unsigned short> &timings, int nReport )
+{
+	CUtlVector<SaveClassTiming_t *> sorted;
+	float flTotal = 0;
+	int nBytes = 0;
+	for ( unsigned short i = timings.First(); i != timings.InvalidIndex(); i = timings.Next( i ) )
+	{
+		sorted.AddToTail( &timings[i] );
+		flTotal += timings[i].flMilliseconds;
+		nBytes += timings[i].nBytes;
+	}
+	sorted.Sort( SaveClassTimingCompare );
+
+	Msg( "Saved %d classes, %d bytes in %.2f ms\n", sorted.Count(), nBytes, flTotal );
+	Msg( "    ms      %%   count    bytes  class\n" );
+	for ( int i = 0; i < sorted.Count() && i < nReport; i++ )
+	{
+		const SaveClassTiming_t &timing = *sorted[i];
+		Msg( "%6.2f  %5.1f  %6d  %7d  %s\n", timing.flMilliseconds, flTotal > 0 ? 100.0f * timing.flMilliseconds / flTotal : 0.0f,
+			timing.nEntities, timing.nBytes, timing.pszClassname );
+	}
+}
+
 void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 {
 	CGameSaveRestoreInfo *pSaveData = pSave->GetGameSaveRestoreInfo();
 
+	int nReportTimings = save_class_timings.GetInt();
+	CUtlDict<SaveClassTiming_t, unsigned short> timings( k_eDictCompareTypeCaseSensitive );
+
 	// write entity list that was previously built by SaveInitEntities()
 	for ( int i = 0; i < pSaveData->NumEntities(); i++ )
 	{
@@ -2477,12 +2773,40 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 					   "Saving entity with invalid classname" );
 #endif
 
+			CFastTimer timer;
+			if ( nReportTimings )
+			{
+				timer.Start();
+			}
+
 			pSaveData->SetCurrentEntityContext( pEnt );
 			pEnt->Save( *pSave );
 			pSaveData->SetCurrentEntityContext( NULL );
 
 			pEntInfo->size = pSave->GetWritePos() - pEntInfo->location;	// Size of entity block is data size written to block
 
+			if ( nReportTimings )
+			{
+				timer.End();
+
+				const char *pszClassname = pEnt->GetClassname();
+				unsigned short iTiming = timings.Find( pszClassname );
+				if ( iTiming == timings.InvalidIndex() )
+				{
+					iTiming = timings.Insert( pszClassname );
+					SaveClassTiming_t &timing = timings[iTiming];
+					timing.pszClassname = timings.GetElementName( iTiming );
+					timing.nEntities = 0;
+					timing.nBytes = 0;
+					timing.flMilliseconds = 0;
+				}
+
+				SaveClassTiming_t &timing = timings[iTiming];
+				timing.nEntities++;
+				timing.nBytes += pEntInfo->size;
+				timing.flMilliseconds += timer.GetDuration().GetMillisecondsF();
+			}
+
 			pEntInfo->classname = pEnt->m_iClassname;	// Remember entity class for respawn
 
 #if !defined( CLIENT_DLL )
@@ -2497,6 +2821,11 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 #endif
 		}
 	}
+
+	if ( nReportTimings )
+	{
+		ReportSaveClassTimings( timings, nReportTimings );
+	}
 }
 
 //---------------------------------
@@ -22,6 +22,7 @@
 
 class CSaveRestoreData;
 class CSaveRestoreSegment;
+class CSaveFieldPlan;
 class CGameSaveRestoreInfo;
 struct typedescription_t;
 struct edict_t;
@@ -46,6 +47,8 @@ public:
 	void			EndLogging( void );
 
 	//---------------------------------
+	// The engine owns the save snapshot, compression and file write, so game
+	// code can't overlap an async save with simulation
 	bool			IsAsync();
 
 	//---------------------------------
@@ -150,6 +153,7 @@ private:
 	void			WriteHeader( const char *pname, int size );
 
 	int				DoWriteAll( const void *pLeafObject, datamap_t *pLeafMap, datamap_t *pCurMap );
+	int				WriteFields( const char *pname, const void *pBaseData, datamap_t *pMap, typedescription_t *pFields, int fieldCount, CSaveFieldPlan *pPlan );
 	bool 			WriteField( const char *pname, void *pData, datamap_t *pRootMap, typedescription_t *pField );
 	
 	bool 			WriteBasicField( const char *pname, void *pData, datamap_t *pRootMap, typedescription_t *pField );
@@ -274,6 +278,7 @@ private:
 	void			BufferSkipBytes( int bytes );
 	
 	int				DoReadAll( void *pLeafObject, datamap_t *pLeafMap, datamap_t *pCurMap );
+	int				ReadFields( const char *pname, void *pBaseData, datamap_t *pMap, typedescription_t *pFields, int fieldCount, CSaveFieldPlan *pPlan );
 	
 	typedescription_t *FindField( const char *pszFieldName, typedescription_t *pFields, int fieldCount, int *pIterator );
 	void			ReadField( const SaveRestoreRecordHeader_t &header, void *pDest, datamap_t *pRootMap, typedescription_t *pField );
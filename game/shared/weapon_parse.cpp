@@ -6,6 +6,7 @@
 //=============================================================================//
 #include "cbase.h"
 #include <KeyValues.h>
+#include "tier1/kvcompiled.h"
 #include <tier0/mem.h>
 #include "filesystem.h"
 #include "utldict.h"
@@ -165,10 +166,10 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 	if ( m_WeaponInfoDatabase.Count() )
 		return;
 
-	KeyValues *manifest = new KeyValues( "weaponscripts" );
-	if ( manifest->LoadFromFile( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
+	CCompiledKeyValues manifest;
+	if ( manifest.LoadFromFile( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
 	{
-		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
+		for ( const CKeyValuesView *sub = manifest.GetRoot()->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
 		{
 			if ( !Q_stricmp( sub->GetName(), "file" ) )
 			{
@@ -190,7 +191,6 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 			}
 		}
 	}
-	manifest->deleteThis();
 }
 
 KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameWithoutExtension, const unsigned char *pICEKey, bool bForceReadEncryptedFile /*= false*/ )
@@ -210,7 +210,14 @@ KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameW
 
 	Q_snprintf(szFullName,sizeof(szFullName), "%s.txt", szFilenameWithoutExtension);
 
-	if ( bForceReadEncryptedFile || !pKV->LoadFromFile( filesystem, szFullName, pSearchPath ) ) // try to load the normal .txt file first
+	// try to load the normal .txt file first, through the compiled script cache
+	CCompiledKeyValues compiledKV;
+	if ( !bForceReadEncryptedFile && compiledKV.LoadFromFile( filesystem, szFullName, pSearchPath ) )
+	{
+		pKV->deleteThis();
+		pKV = compiledKV.MakeKeyValues();
+	}
+	else
 	{
 #ifndef _XBOX
 		if ( pICEKey )
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "tier1/utlvector.h"
+#include "tier0/threadtools.h"
 
 
 
@@ -26,9 +27,9 @@ struct GeneratePolyhedronFromPlanes_UnorderedLineLL;
 struct GeneratePolyhedronFromPlanes_UnorderedPolygonLL;
 
 Vector FindPointInPlanes( const float *pPlanes, int planeCount );
-bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount, Vector *pAABBMins, Vector *pAABBMaxs );
-CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory );
-CPolyhedron *ConvertLinkedGeometryToPolyhedron( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, bool bUseTemporaryMemory );
+bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount, Vector *pAABBMins, Vector *pAABBMaxs, CPolyhedronScratch *pScratch );
+CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch );
+CPolyhedron *ConvertLinkedGeometryToPolyhedron( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch );
 
 //#define ENABLE_DEBUG_POLYHEDRON_DUMPS //Dumps debug information to disk for use with glview. Requires that tier2 also be in all projects using debug mathlib
 //#define DEBUG_DUMP_POLYHEDRONS_TO_NUMBERED_GLVIEWS //dumps successfully generated polyhedrons
@@ -99,53 +100,137 @@ CPolyhedron_AllocByNew *CPolyhedron_AllocByNew::Allocate( unsigned short iVertic
 }
 
 
-class CPolyhedron_TempMemory : public CPolyhedron
+CPolyhedronScratch::CPolyhedronScratch( int iBlockSize ) :
+	m_pBlocks( NULL ),
+	m_iBlockSize( iBlockSize ),
+	m_iBytesReserved( 0 ),
+	m_iHeapAllocations( 0 ),
+	m_pTempMemory( NULL ),
+	m_iTempMemorySize( 0 )
 {
-public:
-#ifdef DBGFLAG_ASSERT
-	int iReferenceCount;
-#endif
+}
+
+CPolyhedronScratch::~CPolyhedronScratch( void )
+{
+	Purge();
+}
+
+#define POLYHEDRON_SCRATCH_ALIGN( x ) (((x) + 7) & ~7)
 
-	virtual void Release( void )
+void *CPolyhedronScratch::Alloc( int iSize )
+{
+	iSize = POLYHEDRON_SCRATCH_ALIGN( iSize );
+
+	if( (m_pBlocks == NULL) || (m_pBlocks->iUsed + iSize > m_pBlocks->iSize) )
 	{
-#ifdef DBGFLAG_ASSERT
-		--iReferenceCount;
-#endif
+		int iNewBlockSize = MAX( m_iBlockSize, (int)POLYHEDRON_SCRATCH_ALIGN( sizeof( Block_t ) ) + iSize );
+		Block_t *pBlock = (Block_t *)new unsigned char [iNewBlockSize];
+		pBlock->pNext = m_pBlocks;
+		pBlock->iSize = iNewBlockSize;
+		pBlock->iUsed = POLYHEDRON_SCRATCH_ALIGN( sizeof( Block_t ) );
+		m_pBlocks = pBlock;
+		m_iBytesReserved += iNewBlockSize;
+		++m_iHeapAllocations;
 	}
 
-	CPolyhedron_TempMemory( void )
-#ifdef DBGFLAG_ASSERT
-		: iReferenceCount( 0 )
-#endif
-	{ };
-};
+	void *pReturn = (unsigned char *)m_pBlocks + m_pBlocks->iUsed;
+	m_pBlocks->iUsed += iSize;
+	return pReturn;
+}
 
+void CPolyhedronScratch::Reset( void )
+{
+	if( m_pBlocks == NULL )
+		return;
 
-static CUtlVector<unsigned char> s_TempMemoryPolyhedron_Buffer;
-static CPolyhedron_TempMemory s_TempMemoryPolyhedron;
+	if( m_pBlocks->pNext != NULL )
+	{
+		//outgrew the first block, trade them all in for one that fits everything so this much work doesn't allocate next time
+		int iTotalSize = m_iBytesReserved;
+		while( m_pBlocks )
+		{
+			Block_t *pNext = m_pBlocks->pNext;
+			delete [] (unsigned char *)m_pBlocks;
+			m_pBlocks = pNext;
+		}
+		m_iBytesReserved = 0;
+		m_iBlockSize = MAX( m_iBlockSize, iTotalSize );
+		Alloc( 0 );
+	}
+
+	m_pBlocks->iUsed = POLYHEDRON_SCRATCH_ALIGN( sizeof( Block_t ) );
+}
+
+void CPolyhedronScratch::Purge( void )
+{
+	while( m_pBlocks )
+	{
+		Block_t *pNext = m_pBlocks->pNext;
+		delete [] (unsigned char *)m_pBlocks;
+		m_pBlocks = pNext;
+	}
+	m_iBytesReserved = 0;
 
-CPolyhedron *GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons ) //grab the temporary polyhedron. Avoids new/delete for quick work. Can only be in use by one chunk of code at a time
+	delete [] m_pTempMemory;
+	m_pTempMemory = NULL;
+	m_iTempMemorySize = 0;
+}
+
+CPolyhedron *CPolyhedronScratch::GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons )
 {
-	AssertMsg( s_TempMemoryPolyhedron.iReferenceCount == 0, "Temporary polyhedron memory being rewritten before released" );
+	AssertMsg( m_TempPolyhedron.iReferenceCount == 0, "Temporary polyhedron memory being rewritten before released" );
 #ifdef DBGFLAG_ASSERT
-	++s_TempMemoryPolyhedron.iReferenceCount;
+	++m_TempPolyhedron.iReferenceCount;
 #endif
-	s_TempMemoryPolyhedron_Buffer.SetCount( (sizeof( Vector ) * iVertices) +
-											(sizeof( Polyhedron_IndexedLine_t ) * iLines) +
-											(sizeof( Polyhedron_IndexedLineReference_t ) * iIndices) +
-											(sizeof( Polyhedron_IndexedPolygon_t ) * iPolygons) );
-
-	s_TempMemoryPolyhedron.iVertexCount = iVertices;
-	s_TempMemoryPolyhedron.iLineCount = iLines;
-	s_TempMemoryPolyhedron.iIndexCount = iIndices;
-	s_TempMemoryPolyhedron.iPolygonCount = iPolygons;
-
-	s_TempMemoryPolyhedron.pVertices = (Vector *)s_TempMemoryPolyhedron_Buffer.Base();
-	s_TempMemoryPolyhedron.pLines = (Polyhedron_IndexedLine_t *)(&s_TempMemoryPolyhedron.pVertices[s_TempMemoryPolyhedron.iVertexCount]);
-	s_TempMemoryPolyhedron.pIndices = (Polyhedron_IndexedLineReference_t *)(&s_TempMemoryPolyhedron.pLines[s_TempMemoryPolyhedron.iLineCount]);
-	s_TempMemoryPolyhedron.pPolygons = (Polyhedron_IndexedPolygon_t *)(&s_TempMemoryPolyhedron.pIndices[s_TempMemoryPolyhedron.iIndexCount]);
-
-	return &s_TempMemoryPolyhedron;
+	int iSize = (sizeof( Vector ) * iVertices) +
+				(sizeof( Polyhedron_IndexedLine_t ) * iLines) +
+				(sizeof( Polyhedron_IndexedLineReference_t ) * iIndices) +
+				(sizeof( Polyhedron_IndexedPolygon_t ) * iPolygons);
+
+	if( iSize > m_iTempMemorySize )
+	{
+		delete [] m_pTempMemory;
+		m_pTempMemory = new unsigned char [iSize];
+		m_iTempMemorySize = iSize;
+		++m_iHeapAllocations;
+	}
+
+	m_TempPolyhedron.iVertexCount = iVertices;
+	m_TempPolyhedron.iLineCount = iLines;
+	m_TempPolyhedron.iIndexCount = iIndices;
+	m_TempPolyhedron.iPolygonCount = iPolygons;
+
+	m_TempPolyhedron.pVertices = (Vector *)m_pTempMemory;
+	m_TempPolyhedron.pLines = (Polyhedron_IndexedLine_t *)(&m_TempPolyhedron.pVertices[m_TempPolyhedron.iVertexCount]);
+	m_TempPolyhedron.pIndices = (Polyhedron_IndexedLineReference_t *)(&m_TempPolyhedron.pLines[m_TempPolyhedron.iLineCount]);
+	m_TempPolyhedron.pPolygons = (Polyhedron_IndexedPolygon_t *)(&m_TempPolyhedron.pIndices[m_TempPolyhedron.iIndexCount]);
+
+	return &m_TempPolyhedron;
+}
+
+
+static CThreadLocalPtr<CPolyhedronScratch> s_pThreadPolyhedronScratch;
+
+CPolyhedronScratch *GetThreadPolyhedronScratch( void )
+{
+	CPolyhedronScratch *pScratch = s_pThreadPolyhedronScratch;
+	if( pScratch == NULL )
+	{
+		pScratch = new CPolyhedronScratch;
+		s_pThreadPolyhedronScratch = pScratch;
+	}
+	return pScratch;
+}
+
+void FreeThreadPolyhedronScratch( void )
+{
+	delete (CPolyhedronScratch *)s_pThreadPolyhedronScratch;
+	s_pThreadPolyhedronScratch = (CPolyhedronScratch *)NULL;
+}
+
+CPolyhedron *GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons ) //grab the calling thread's temporary polyhedron. Avoids new/delete for quick work. Can only be in use by one chunk of code at a time on each thread
+{
+	return GetThreadPolyhedronScratch()->GetTempPolyhedron( iVertices, iLines, iIndices, iPolygons );
 }
 
 
@@ -247,14 +332,19 @@ struct GeneratePolyhedronFromPlanes_UnorderedPointLL //an unordered collection o
 
 
 
-CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory )
+CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch )
 {
 	if( pExistingPolyhedron == NULL )
 		return NULL;
 
 	AssertMsg( (pExistingPolyhedron->iVertexCount >= 3) && (pExistingPolyhedron->iPolygonCount >= 2), "Polyhedron doesn't meet absolute minimum spec" );
 
-	float *pUsefulPlanes = (float *)stackalloc( sizeof( float ) * 4 * iPlaneCount );
+	if( pScratch == NULL )
+		pScratch = GetThreadPolyhedronScratch();
+
+	pScratch->Reset();
+
+	float *pUsefulPlanes = (float *)pScratch->Alloc( sizeof( float ) * 4 * iPlaneCount );
 	int iUsefulPlaneCount = 0;
 	Vector *pExistingVertices = pExistingPolyhedron->pVertices;
 
@@ -304,7 +394,7 @@ CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float
 		CPolyhedron *pReturn;
 		if( bUseTemporaryMemory )
 		{
-			pReturn = GetTempPolyhedron( pExistingPolyhedron->iVertexCount, 
+			pReturn = pScratch->GetTempPolyhedron( pExistingPolyhedron->iVertexCount, 
 											pExistingPolyhedron->iLineCount, 
 											pExistingPolyhedron->iIndexCount, 
 											pExistingPolyhedron->iPolygonCount );
@@ -328,11 +418,11 @@ CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float
 
 
 	//convert the polyhedron to linked geometry
-	GeneratePolyhedronFromPlanes_Point *pStartPoints = (GeneratePolyhedronFromPlanes_Point *)stackalloc( pExistingPolyhedron->iVertexCount * sizeof( GeneratePolyhedronFromPlanes_Point ) );
-	GeneratePolyhedronFromPlanes_Line *pStartLines = (GeneratePolyhedronFromPlanes_Line *)stackalloc( pExistingPolyhedron->iLineCount * sizeof( GeneratePolyhedronFromPlanes_Line ) );
-	GeneratePolyhedronFromPlanes_Polygon *pStartPolygons = (GeneratePolyhedronFromPlanes_Polygon *)stackalloc( pExistingPolyhedron->iPolygonCount * sizeof( GeneratePolyhedronFromPlanes_Polygon ) );
+	GeneratePolyhedronFromPlanes_Point *pStartPoints = (GeneratePolyhedronFromPlanes_Point *)pScratch->Alloc( pExistingPolyhedron->iVertexCount * sizeof( GeneratePolyhedronFromPlanes_Point ) );
+	GeneratePolyhedronFromPlanes_Line *pStartLines = (GeneratePolyhedronFromPlanes_Line *)pScratch->Alloc( pExistingPolyhedron->iLineCount * sizeof( GeneratePolyhedronFromPlanes_Line ) );
+	GeneratePolyhedronFromPlanes_Polygon *pStartPolygons = (GeneratePolyhedronFromPlanes_Polygon *)pScratch->Alloc( pExistingPolyhedron->iPolygonCount * sizeof( GeneratePolyhedronFromPlanes_Polygon ) );
 
-	GeneratePolyhedronFromPlanes_LineLL *pStartLineLinks = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( pExistingPolyhedron->iLineCount * 4 * sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+	GeneratePolyhedronFromPlanes_LineLL *pStartLineLinks = (GeneratePolyhedronFromPlanes_LineLL *)pScratch->Alloc( pExistingPolyhedron->iLineCount * 4 * sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
 	
 	int iCurrentLineLinkIndex = 0;
 
@@ -443,9 +533,9 @@ CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float
 		} while( pWorkLink != pFirstLink );
 	}
 
-	GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints = (GeneratePolyhedronFromPlanes_UnorderedPointLL *)stackalloc( pExistingPolyhedron->iVertexCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedPointLL ) );
-	GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines = (GeneratePolyhedronFromPlanes_UnorderedLineLL *)stackalloc( pExistingPolyhedron->iLineCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedLineLL ) );
-	GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons = (GeneratePolyhedronFromPlanes_UnorderedPolygonLL *)stackalloc( pExistingPolyhedron->iPolygonCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedPolygonLL ) );
+	GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints = (GeneratePolyhedronFromPlanes_UnorderedPointLL *)pScratch->Alloc( pExistingPolyhedron->iVertexCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedPointLL ) );
+	GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines = (GeneratePolyhedronFromPlanes_UnorderedLineLL *)pScratch->Alloc( pExistingPolyhedron->iLineCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedLineLL ) );
+	GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons = (GeneratePolyhedronFromPlanes_UnorderedPolygonLL *)pScratch->Alloc( pExistingPolyhedron->iPolygonCount * sizeof( GeneratePolyhedronFromPlanes_UnorderedPolygonLL ) );
 
 	//setup point collection
 	{
@@ -498,7 +588,7 @@ CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float
 		pPolygons[iLastPolygon].pNext = NULL;
 	}
 
-	return ClipLinkedGeometry( pPolygons, pLines, pPoints, pUsefulPlanes, iUsefulPlaneCount, fOnPlaneEpsilon, bUseTemporaryMemory );
+	return ClipLinkedGeometry( pPolygons, pLines, pPoints, pUsefulPlanes, iUsefulPlaneCount, fOnPlaneEpsilon, bUseTemporaryMemory, pScratch );
 }
 
 
@@ -520,7 +610,7 @@ Vector FindPointInPlanes( const float *pPlanes, int planeCount )
 
 
 
-bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount, Vector *pAABBMins, Vector *pAABBMaxs ) //bounding box of the convex shape (subject to floating point error)
+bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount, Vector *pAABBMins, Vector *pAABBMaxs, CPolyhedronScratch *pScratch ) //bounding box of the convex shape (subject to floating point error)
 {
 	//returns false if the AABB hasn't been set
 	if( pAABBMins == NULL && pAABBMaxs == NULL ) //no use in actually finding out what it is
@@ -532,7 +622,7 @@ bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount
 		int iVertCount;
 	};
 
-	float *pMovedPlanes = (float *)stackalloc( iPlaneCount * 4 * sizeof( float ) );
+	float *pMovedPlanes = (float *)pScratch->Alloc( iPlaneCount * 4 * sizeof( float ) );
 	//Vector vPointInPlanes = FindPointInPlanes( pInwardFacingPlanes, iPlaneCount );
 
 	for( int i = 0; i != iPlaneCount; ++i )
@@ -547,10 +637,10 @@ bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount
 
 	//vAABBMins = vAABBMaxs = FindPointInPlanes( pPlanes, iPlaneCount );
 	float *vertsIn = NULL; //we'll be allocating a new buffer for this with each new polygon, and moving it off to the polygon array
-	float *vertsOut = (float *)stackalloc( (iPlaneCount + 4) * (sizeof( float ) * 3) ); //each plane will initially have 4 points in its polygon representation, and each plane clip has the possibility to add 1 point to the polygon
+	float *vertsOut = (float *)pScratch->Alloc( (iPlaneCount + 4) * (sizeof( float ) * 3) ); //each plane will initially have 4 points in its polygon representation, and each plane clip has the possibility to add 1 point to the polygon
 	float *vertsSwap;
 
-	FindConvexShapeAABB_Polygon_t *pPolygons = (FindConvexShapeAABB_Polygon_t *)stackalloc( iPlaneCount * sizeof( FindConvexShapeAABB_Polygon_t ) );
+	FindConvexShapeAABB_Polygon_t *pPolygons = (FindConvexShapeAABB_Polygon_t *)pScratch->Alloc( iPlaneCount * sizeof( FindConvexShapeAABB_Polygon_t ) );
 	int iPolyCount = 0;
 
 	for ( int i = 0; i < iPlaneCount; i++ )
@@ -559,7 +649,7 @@ bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount
 		float fPlaneDist = pInwardFacingPlanes[(i*4) + 3];
 
 		if( vertsIn == NULL )
-			vertsIn = (float *)stackalloc( (iPlaneCount + 4) * (sizeof( float ) * 3) );
+			vertsIn = (float *)pScratch->Alloc( (iPlaneCount + 4) * (sizeof( float ) * 3) );
 
 		// Build a big-ass poly in this plane
 		int vertCount = PolyFromPlane( (Vector *)vertsIn, *pPlaneNormal, fPlaneDist, 100000.0f );
@@ -667,7 +757,7 @@ bool FindConvexShapeLooseAABB( const float *pInwardFacingPlanes, int iPlaneCount
 
 
 
-CPolyhedron *ConvertLinkedGeometryToPolyhedron( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, bool bUseTemporaryMemory )
+CPolyhedron *ConvertLinkedGeometryToPolyhedron( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pPoints, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch )
 {
 	Assert( (pPolygons != NULL) && (pLines != NULL) && (pPoints != NULL) );
 	unsigned int iPolyCount = 0, iLineCount = 0, iPointCount = 0, iIndexCount = 0;
@@ -706,7 +796,7 @@ CPolyhedron *ConvertLinkedGeometryToPolyhedron( GeneratePolyhedronFromPlanes_Uno
 	CPolyhedron *pReturn;
 	if( bUseTemporaryMemory )
 	{
-		pReturn = GetTempPolyhedron( iPointCount, iLineCount, iIndexCount, iPolyCount );
+		pReturn = pScratch->GetTempPolyhedron( iPointCount, iLineCount, iIndexCount, iPolyCount );
 	}
 	else
 	{
@@ -861,7 +951,48 @@ const char * DumpPolyhedronCutHistory( const CUtlVector<CPolyhedron *> &DumpedHi
 
 #endif
 
-CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pAllPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pAllLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pAllPoints, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory )
+//Geometry that died on an earlier plane gets reused before any more scratch memory is touched.
+//Points, lines and polygons are recycled along with the unordered list link that held them.
+template< typename UnorderedLL, typename Element >
+static inline UnorderedLL *AllocLinkedGeometry( UnorderedLL *&pFreeList, Element *UnorderedLL::*pElement, CPolyhedronScratch *pScratch )
+{
+	UnorderedLL *pReturn = pFreeList;
+	if( pReturn )
+	{
+		pFreeList = pReturn->pNext;
+		return pReturn;
+	}
+
+	pReturn = (UnorderedLL *)pScratch->Alloc( sizeof( UnorderedLL ) );
+	pReturn->*pElement = (Element *)pScratch->Alloc( sizeof( Element ) );
+	return pReturn;
+}
+
+static inline GeneratePolyhedronFromPlanes_LineLL *AllocLineLink( GeneratePolyhedronFromPlanes_LineLL *&pFreeList, CPolyhedronScratch *pScratch )
+{
+	GeneratePolyhedronFromPlanes_LineLL *pReturn = pFreeList;
+	if( pReturn )
+	{
+		pFreeList = pReturn->pNext;
+		return pReturn;
+	}
+
+	return (GeneratePolyhedronFromPlanes_LineLL *)pScratch->Alloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+}
+
+template< typename LL >
+static inline void FreeLinkedGeometry( LL *&pFreeList, LL *pDeadList )
+{
+	while( pDeadList )
+	{
+		LL *pNext = pDeadList->pNext;
+		pDeadList->pNext = pFreeList;
+		pFreeList = pDeadList;
+		pDeadList = pNext;
+	}
+}
+
+CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pAllPolygons, GeneratePolyhedronFromPlanes_UnorderedLineLL *pAllLines, GeneratePolyhedronFromPlanes_UnorderedPointLL *pAllPoints, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch )
 {
 	const float fNegativeOnPlaneEpsilon = -fOnPlaneEpsilon;
 
@@ -874,7 +1005,7 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 	static int iPolyhedronClipCount = 0;
 	++iPolyhedronClipCount;
 	
-	DebugCutHistory.AddToTail( ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, false ) );
+	DebugCutHistory.AddToTail( ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, false, NULL ) );
 #endif
 
 	//clear out polygon work variables
@@ -894,6 +1025,12 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 	GeneratePolyhedronFromPlanes_UnorderedPolygonLL	*pDeadPolygonCollection = NULL;
 	GeneratePolyhedronFromPlanes_LineLL				*pDeadLineLinkCollection = NULL;
 
+	//Dead collections from earlier planes, free for reuse.
+	GeneratePolyhedronFromPlanes_UnorderedPointLL	*pFreePointCollection = NULL;
+	GeneratePolyhedronFromPlanes_UnorderedLineLL	*pFreeLineCollection = NULL;
+	GeneratePolyhedronFromPlanes_UnorderedPolygonLL	*pFreePolygonCollection = NULL;
+	GeneratePolyhedronFromPlanes_LineLL				*pFreeLineLinkCollection = NULL;
+
 
 	for( int iCurrentPlane = 0; iCurrentPlane != iPlaneCount; ++iCurrentPlane )
 	{
@@ -909,7 +1046,11 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 			} while( pActiveLineWalk );
 		}
 		
-		//TODO: Move these pointers into a reallocation pool
+		//nothing references the last plane's dead geometry anymore, recycle it
+		FreeLinkedGeometry( pFreePointCollection, pDeadPointCollection );
+		FreeLinkedGeometry( pFreeLineCollection, pDeadLineCollection );
+		FreeLinkedGeometry( pFreeLineLinkCollection, pDeadLineLinkCollection );
+		FreeLinkedGeometry( pFreePolygonCollection, pDeadPolygonCollection );
 		pDeadPointCollection = NULL; 
 		pDeadLineCollection = NULL;
 		pDeadLineLinkCollection = NULL;
@@ -1318,14 +1459,14 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 					//We'll be de-linking from the old point and generating a new one. We do this so other lines can still access the dead point's untouched data.
 					
 					//Generate a new point
-					GeneratePolyhedronFromPlanes_Point *pNewPoint = (GeneratePolyhedronFromPlanes_Point *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_Point ) );
+					GeneratePolyhedronFromPlanes_UnorderedPointLL *pNewPointLink = AllocLinkedGeometry( pFreePointCollection, &GeneratePolyhedronFromPlanes_UnorderedPointLL::pPoint, pScratch );
+					GeneratePolyhedronFromPlanes_Point *pNewPoint = pNewPointLink->pPoint;
 					{
 						//add this point to the active list
-						pAllPoints->pPrev = (GeneratePolyhedronFromPlanes_UnorderedPointLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_UnorderedPointLL ) );
+						pAllPoints->pPrev = pNewPointLink;
 						pAllPoints->pPrev->pNext = pAllPoints;
 						pAllPoints = pAllPoints->pPrev;
 						pAllPoints->pPrev = NULL;
-						pAllPoints->pPoint = pNewPoint;
 
 
 						float fInvTotalDist = 1.0f/(pDeadPoint->fPlaneDist - pLivingPoint->fPlaneDist); //subtraction because the living index is known to be negative
@@ -1355,7 +1496,7 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 						pNewPoint->fPlaneDist = 0.0f;
 					}
 					
-					GeneratePolyhedronFromPlanes_LineLL *pNewLineLink = pNewPoint->pConnectedLines = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+					GeneratePolyhedronFromPlanes_LineLL *pNewLineLink = pNewPoint->pConnectedLines = AllocLineLink( pFreeLineLinkCollection, pScratch );
 					pNewLineLink->pLine = pWorkLine;
 					pNewLineLink->pNext = pNewLineLink;
 					pNewLineLink->pPrev = pNewLineLink;
@@ -1454,14 +1595,14 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 			}
 
 			//create the new polygon
-			GeneratePolyhedronFromPlanes_Polygon *pNewPolygon = (GeneratePolyhedronFromPlanes_Polygon *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_Polygon ) );
+			GeneratePolyhedronFromPlanes_UnorderedPolygonLL *pNewPolygonLink = AllocLinkedGeometry( pFreePolygonCollection, &GeneratePolyhedronFromPlanes_UnorderedPolygonLL::pPolygon, pScratch );
+			GeneratePolyhedronFromPlanes_Polygon *pNewPolygon = pNewPolygonLink->pPolygon;
 			{
 				//before we forget, add this polygon to the active list
-				pAllPolygons->pPrev = (GeneratePolyhedronFromPlanes_UnorderedPolygonLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_UnorderedPolygonLL ) );
+				pAllPolygons->pPrev = pNewPolygonLink;
 				pAllPolygons->pPrev->pNext = pAllPolygons;
 				pAllPolygons = pAllPolygons->pPrev;
 				pAllPolygons->pPrev = NULL;
-				pAllPolygons->pPolygon = pNewPolygon;
 
 				pNewPolygon->bMissingASide = false; //technically missing all it's sides, but we're fixing it now
 				pNewPolygon->vSurfaceNormal = vNormal;
@@ -1503,14 +1644,14 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 					}
 #endif
 
-					GeneratePolyhedronFromPlanes_Line *pJoinLine = (GeneratePolyhedronFromPlanes_Line *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_Line ) );
+					GeneratePolyhedronFromPlanes_UnorderedLineLL *pJoinLineLink = AllocLinkedGeometry( pFreeLineCollection, &GeneratePolyhedronFromPlanes_UnorderedLineLL::pLine, pScratch );
+					GeneratePolyhedronFromPlanes_Line *pJoinLine = pJoinLineLink->pLine;
 					{
 						//before we forget, add this line to the active list
-						pAllLines->pPrev = (GeneratePolyhedronFromPlanes_UnorderedLineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_UnorderedLineLL ) );
+						pAllLines->pPrev = pJoinLineLink;
 						pAllLines->pPrev->pNext = pAllLines;
 						pAllLines = pAllLines->pPrev;
 						pAllLines->pPrev = NULL;
-						pAllLines->pLine = pJoinLine;
 
 						pJoinLine->bAlive = false;
 						pJoinLine->bCut = false;
@@ -1525,12 +1666,12 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 
 					//now create all 4 links into the line
 					GeneratePolyhedronFromPlanes_LineLL *pPointLinks[2];
-					pPointLinks[0] = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
-					pPointLinks[1] = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+					pPointLinks[0] = AllocLineLink( pFreeLineLinkCollection, pScratch );
+					pPointLinks[1] = AllocLineLink( pFreeLineLinkCollection, pScratch );
 
 					GeneratePolyhedronFromPlanes_LineLL *pPolygonLinks[2];
-					pPolygonLinks[0] = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
-					pPolygonLinks[1] = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+					pPolygonLinks[0] = AllocLineLink( pFreeLineLinkCollection, pScratch );
+					pPolygonLinks[1] = AllocLineLink( pFreeLineLinkCollection, pScratch );
 
 					pPointLinks[0]->pLine = pPointLinks[1]->pLine = pPolygonLinks[0]->pLine = pPolygonLinks[1]->pLine = pJoinLine;
 
@@ -1637,7 +1778,7 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 					
 					//link to this line from the new polygon
 					GeneratePolyhedronFromPlanes_LineLL *pNewLineLink;
-					pNewLineLink = (GeneratePolyhedronFromPlanes_LineLL *)stackalloc( sizeof( GeneratePolyhedronFromPlanes_LineLL ) );
+					pNewLineLink = AllocLineLink( pFreeLineLinkCollection, pScratch );
 					
 					pNewLineLink->pLine = pTestLine->pLine;
 					pNewLineLink->iReferenceIndex = pTestLine->iReferenceIndex;
@@ -1710,7 +1851,7 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 		}
 
 		//maintain the cut history
-		DebugCutHistory.AddToTail( ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, false ) );
+		DebugCutHistory.AddToTail( ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, false, NULL ) );
 #endif
 	}
 
@@ -1723,7 +1864,7 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 	DebugCutHistory.RemoveAll();
 #endif
 
-	return ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, bUseTemporaryMemory );
+	return ConvertLinkedGeometryToPolyhedron( pAllPolygons, pAllLines, pAllPoints, bUseTemporaryMemory, pScratch );
 }
 
 
@@ -1776,13 +1917,18 @@ CPolyhedron *ClipLinkedGeometry( GeneratePolyhedronFromPlanes_UnorderedPolygonLL
 	StartingPolygon_To_Lines_Links[(polynum * 4) + 3].pNext = &StartingPolygon_To_Lines_Links[(polynum * 4) + 0];
 
 
-CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory )
+CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory, CPolyhedronScratch *pScratch )
 {
 	//this is version 2 of the polyhedron generator, version 1 made individual polygons and joined points together, some guesswork is involved and it therefore isn't a solid method
 	//this version will start with a cube and hack away at it (retaining point connection information) to produce a polyhedron with no guesswork involved, this method should be rock solid
 	
 	//the polygon clipping functions we're going to use want inward facing planes
-	float *pFlippedPlanes = (float *)stackalloc( (iPlaneCount * 4) * sizeof( float ) );
+	if( pScratch == NULL )
+		pScratch = GetThreadPolyhedronScratch();
+
+	pScratch->Reset();
+
+	float *pFlippedPlanes = (float *)pScratch->Alloc( (iPlaneCount * 4) * sizeof( float ) );
 	for( int i = 0; i != iPlaneCount * 4; ++i )
 	{
 		pFlippedPlanes[i] = -pOutwardFacingPlanes[i];
@@ -1790,7 +1936,7 @@ CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, in
 
 	//our first goal is to find the size of a cube big enough to encapsulate all points that will be in the final polyhedron
 	Vector vAABBMins, vAABBMaxs;
-	if( FindConvexShapeLooseAABB( pFlippedPlanes, iPlaneCount, &vAABBMins, &vAABBMaxs ) == false )
+	if( FindConvexShapeLooseAABB( pFlippedPlanes, iPlaneCount, &vAABBMins, &vAABBMaxs, pScratch ) == false )
 		return NULL; //no shape to work with apparently
 
 	
@@ -2003,7 +2149,7 @@ CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, in
 		}
 	}
 
-	return ClipLinkedGeometry( StartingPolygonList, StartingLineList, StartingPointList, pOutwardFacingPlanes, iPlaneCount, fOnPlaneEpsilon, bUseTemporaryMemory );
+	return ClipLinkedGeometry( StartingPolygonList, StartingLineList, StartingPointList, pOutwardFacingPlanes, iPlaneCount, fOnPlaneEpsilon, bUseTemporaryMemory, pScratch );
 }
 
 
@@ -78,6 +78,8 @@ CBoneSetupMemoryPool<Quaternion> g_QaternionPool;
 CBoneSetupMemoryPool<Vector> g_VectorPool;
 CBoneSetupMemoryPool<matrix3x4_t> g_MatrixPool;
 
+static CInterlockedInt g_nBoneCachesFreed;		// by the cache itself or by Studio_DestroyBoneCache
+
 // -----------------------------------------------------------------
 CBoneCache *CBoneCache::CreateResource( const bonecacheparams_t &params )
 {
@@ -115,6 +117,7 @@ unsigned int CBoneCache::EstimatedSize( const bonecacheparams_t &params )
 
 void CBoneCache::DestroyResource()
 {
+	g_nBoneCachesFreed++;
 	free( this );
 }
 
@@ -212,30 +215,82 @@ short *CBoneCache::CachedToStudio()
 	return (short *)( (char *)(this+1) + m_cachedToStudioOffset );
 }
 
-// Construct a singleton
-static CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> g_StudioBoneCache( 128 * 1024L );
+//-----------------------------------------------------------------------------
+// The bone cache is sharded so threaded bone setup doesn't serialize on one
+// mutex; see CShardedDataManager.
+//-----------------------------------------------------------------------------
+#define BONECACHE_DEFAULT_BUDGET_KB	128
+
+#ifdef CLIENT_DLL
+static ConVar cl_bonecache_budget( "cl_bonecache_budget", "128", 0, "Total size in KB of the client's studio bone cache, split evenly across its shards.", true, 16, false, 0 );
+#define bonecache_budget cl_bonecache_budget
+#else
+static ConVar sv_bonecache_budget( "sv_bonecache_budget", "128", 0, "Total size in KB of the server's studio bone cache, split evenly across its shards.", true, 16, false, 0 );
+#define bonecache_budget sv_bonecache_budget
+#endif
+
+typedef CShardedDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> CBoneCacheManager;
+
+// Counted per shard so lookups in different shards don't share a counter
+struct BoneCacheShardStats_t
+{
+	CInterlockedInt		m_nHits;
+	CInterlockedInt		m_nMisses;
+};
+
+struct BoneCacheStats_t
+{
+	int m_nHits;
+	int m_nMisses;
+	int m_nEvictions;
+};
+
+static CBoneCacheManager g_StudioBoneCache( BONECACHE_DEFAULT_BUDGET_KB * 1024 );
+static BoneCacheShardStats_t g_BoneCacheShardStats[CBoneCacheManager::NUM_SHARDS];
+static CInterlockedInt g_nBoneCachesDestroyed;		// by Studio_DestroyBoneCache
+static BoneCacheStats_t g_BoneCacheLastFrame;
+static BoneCacheStats_t g_BoneCacheTotal;
+static int g_nBoneCacheFrames;
+static int g_nBoneCacheBudgetKB = BONECACHE_DEFAULT_BUDGET_KB;
 
 CBoneCache *Studio_GetBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	return g_StudioBoneCache.GetResource_NoLock( cacheHandle );
+	CBoneCache *pCache;
+	{
+		AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
+		pCache = g_StudioBoneCache.GetResource_NoLock( cacheHandle );
+	}
+
+	BoneCacheShardStats_t &stats = g_BoneCacheShardStats[ CBoneCacheManager::ShardIndex( cacheHandle ) ];
+	if ( pCache )
+	{
+		stats.m_nHits++;
+	}
+	else
+	{
+		stats.m_nMisses++;
+	}
+	return pCache;
 }
 
 memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
 	return g_StudioBoneCache.CreateResource( params );
 }
 
 void Studio_DestroyBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
-	g_StudioBoneCache.DestroyResource( cacheHandle );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
+	if ( g_StudioBoneCache.GetResource_NoLockNoLRUTouch( cacheHandle ) )
+	{
+		g_nBoneCachesDestroyed++;
+		g_StudioBoneCache.DestroyResource( cacheHandle );
+	}
 }
 
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
 	CBoneCache *pCache = g_StudioBoneCache.GetResource_NoLock( cacheHandle );
 	if ( pCache )
 	{
@@ -243,6 +298,77 @@ void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Call once a frame, before bone setup. Latches the last frame's
+//			stats and applies changes to the budget convar.
+//-----------------------------------------------------------------------------
+void Studio_BoneCacheFrameUpdate()
+{
+	BoneCacheStats_t frame = { 0, 0, 0 };
+	for ( int i = 0; i < CBoneCacheManager::NUM_SHARDS; i++ )
+	{
+		BoneCacheShardStats_t &stats = g_BoneCacheShardStats[i];
+		int nHits = stats.m_nHits;
+		int nMisses = stats.m_nMisses;
+		stats.m_nHits -= nHits;
+		stats.m_nMisses -= nMisses;
+		frame.m_nHits += nHits;
+		frame.m_nMisses += nMisses;
+	}
+
+	int nFreed = g_nBoneCachesFreed;
+	int nDestroyed = g_nBoneCachesDestroyed;
+	g_nBoneCachesFreed -= nFreed;
+	g_nBoneCachesDestroyed -= nDestroyed;
+	frame.m_nEvictions = MAX( nFreed - nDestroyed, 0 );
+
+	g_BoneCacheLastFrame = frame;
+	g_BoneCacheTotal.m_nHits += frame.m_nHits;
+	g_BoneCacheTotal.m_nMisses += frame.m_nMisses;
+	g_BoneCacheTotal.m_nEvictions += frame.m_nEvictions;
+	g_nBoneCacheFrames++;
+
+	if ( bonecache_budget.GetInt() != g_nBoneCacheBudgetKB )
+	{
+		g_nBoneCacheBudgetKB = bonecache_budget.GetInt();
+		g_StudioBoneCache.SetTargetSize( (unsigned int)g_nBoneCacheBudgetKB * 1024 );
+		g_StudioBoneCache.FlushToTargetSize();
+	}
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND_F( cl_bonecache_stats, "Display hits, misses and evictions of the studio bone cache (client only). 'reset' clears the totals.", 0 )
+#else
+CON_COMMAND_F( sv_bonecache_stats, "Display hits, misses and evictions of the studio bone cache (server only). 'reset' clears the totals.", 0 )
+#endif
+{
+	const BoneCacheStats_t &frame = g_BoneCacheLastFrame;
+	const BoneCacheStats_t &total = g_BoneCacheTotal;
+	int nFrameLookups = frame.m_nHits + frame.m_nMisses;
+	int nTotalLookups = total.m_nHits + total.m_nMisses;
+
+	Msg( "Bone cache: %d shards, %d KB budget\n", g_StudioBoneCache.GetShardCount(), g_nBoneCacheBudgetKB );
+	Msg( "  last frame: %5d hits %5d misses %5d evictions (%.1f%% hit)\n",
+		frame.m_nHits, frame.m_nMisses, frame.m_nEvictions, nFrameLookups ? 100.0f * frame.m_nHits / nFrameLookups : 0.0f );
+	Msg( "  %d frames:  %d hits %d misses %d evictions (%.1f%% hit, %.1f evictions/frame)\n",
+		g_nBoneCacheFrames, total.m_nHits, total.m_nMisses, total.m_nEvictions,
+		nTotalLookups ? 100.0f * total.m_nHits / nTotalLookups : 0.0f,
+		g_nBoneCacheFrames ? (float)total.m_nEvictions / g_nBoneCacheFrames : 0.0f );
+
+	for ( int i = 0; i < g_StudioBoneCache.GetShardCount(); i++ )
+	{
+		CBoneCacheManager::ShardType_t &shard = g_StudioBoneCache.GetShard( i );
+		AUTO_LOCK( shard.AccessMutex() );
+		Msg( "  shard %d: %6d / %6d bytes used\n", i, shard.UsedSize(), shard.TargetSize() );
+	}
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		memset( &g_BoneCacheTotal, 0, sizeof(g_BoneCacheTotal) );
+		g_nBoneCacheFrames = 0;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
@@ -1246,6 +1372,211 @@ FORCEINLINE fltx4 QuaternionAccumulateSIMD( const fltx4 &p, float s, const fltx4
 
 
 
+//-----------------------------------------------------------------------------
+// Four bones at a time: the slerp, blend and bone matrix stages load four
+// quaternions and transpose them so x, y, z and w each sit in one register.
+// Every op then works on four bones, and per bone decisions become masks.
+//-----------------------------------------------------------------------------
+static ConVar anim_simd_bones( "anim_simd_bones", "1", FCVAR_REPLICATED, "Slerp, blend and build bone matrices four bones at a time with SIMD." );
+
+bool Studio_SIMDBoneSetupEnabled()
+{
+	return anim_simd_bones.GetBool();
+}
+
+struct FourQuaternions_t
+{
+	fltx4 x, y, z, w;
+};
+
+// QuaternionAligned arrays are walked as Quaternion arrays below
+COMPILE_TIME_ASSERT( sizeof( QuaternionAligned ) == sizeof( Quaternion ) );
+
+FORCEINLINE void LoadFourQuaternions( const Quaternion *pQ, FourQuaternions_t &q )
+{
+	q.x = LoadUnalignedSIMD( pQ[0].Base() );
+	q.y = LoadUnalignedSIMD( pQ[1].Base() );
+	q.z = LoadUnalignedSIMD( pQ[2].Base() );
+	q.w = LoadUnalignedSIMD( pQ[3].Base() );
+	TransposeSIMD( q.x, q.y, q.z, q.w );
+}
+
+// Only the bones in mask are written
+FORCEINLINE void StoreFourQuaternions( const FourQuaternions_t &q, const fltx4 &mask, Quaternion *pQ )
+{
+	fltx4 q0 = q.x, q1 = q.y, q2 = q.z, q3 = q.w;
+	TransposeSIMD( q0, q1, q2, q3 );
+
+	int nMask = TestSignSIMD( mask );
+	if ( nMask & 1 ) StoreUnalignedSIMD( pQ[0].Base(), q0 );
+	if ( nMask & 2 ) StoreUnalignedSIMD( pQ[1].Base(), q1 );
+	if ( nMask & 4 ) StoreUnalignedSIMD( pQ[2].Base(), q2 );
+	if ( nMask & 8 ) StoreUnalignedSIMD( pQ[3].Base(), q3 );
+}
+
+FORCEINLINE fltx4 FourQuaternionsDot( const FourQuaternions_t &p, const FourQuaternions_t &q )
+{
+	return MaddSIMD( p.x, q.x, MaddSIMD( p.y, q.y, MaddSIMD( p.z, q.z, MulSIMD( p.w, q.w ) ) ) );
+}
+
+// Same test as QuaternionAlign, flips q where it's closer to -p. Bones in noAlignMask are left alone.
+FORCEINLINE void FourQuaternionsAlign( const FourQuaternions_t &p, FourQuaternions_t &q, const fltx4 &noAlignMask )
+{
+	fltx4 dx = SubSIMD( p.x, q.x ), dy = SubSIMD( p.y, q.y ), dz = SubSIMD( p.z, q.z ), dw = SubSIMD( p.w, q.w );
+	fltx4 sx = AddSIMD( p.x, q.x ), sy = AddSIMD( p.y, q.y ), sz = AddSIMD( p.z, q.z ), sw = AddSIMD( p.w, q.w );
+	fltx4 a = MaddSIMD( dx, dx, MaddSIMD( dy, dy, MaddSIMD( dz, dz, MulSIMD( dw, dw ) ) ) );
+	fltx4 b = MaddSIMD( sx, sx, MaddSIMD( sy, sy, MaddSIMD( sz, sz, MulSIMD( sw, sw ) ) ) );
+
+	fltx4 flip = AndNotSIMD( noAlignMask, CmpGtSIMD( a, b ) );
+	q.x = MaskedAssign( flip, NegSIMD( q.x ), q.x );
+	q.y = MaskedAssign( flip, NegSIMD( q.y ), q.y );
+	q.z = MaskedAssign( flip, NegSIMD( q.z ), q.z );
+	q.w = MaskedAssign( flip, NegSIMD( q.w ), q.w );
+}
+
+// QuaternionNormalize, zero length quaternions are left as they are
+FORCEINLINE void FourQuaternionsNormalize( FourQuaternions_t &q )
+{
+	fltx4 radius = FourQuaternionsDot( q, q );
+	fltx4 nonZero = CmpGtSIMD( radius, Four_Zeros );
+	fltx4 iradius = MaskedAssign( nonZero, DivSIMD( Four_Ones, SqrtSIMD( radius ) ), Four_Ones );
+	q.x = MulSIMD( q.x, iradius );
+	q.y = MulSIMD( q.y, iradius );
+	q.z = MulSIMD( q.z, iradius );
+	q.w = MulSIMD( q.w, iradius );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionSlerp( p, q, t, qt ) for four bones, or QuaternionSlerpNoAlign
+//			for the ones in noAlignMask
+//-----------------------------------------------------------------------------
+static void FourQuaternionsSlerp( const FourQuaternions_t &p, const FourQuaternions_t &qIn, const fltx4 &t, const fltx4 &noAlignMask, FourQuaternions_t &qt )
+{
+	FourQuaternions_t q = qIn;
+	FourQuaternionsAlign( p, q, noAlignMask );
+
+	fltx4 cosom = FourQuaternionsDot( p, q );
+	fltx4 oneMinusT = SubSIMD( Four_Ones, t );
+	fltx4 epsilon = ReplicateX4( 0.000001f );
+
+	// Nearly the same rotation just lerps, like QuaternionSlerpNoAlign. The
+	// other lanes are computed anyway and masked off.
+	fltx4 omega = ArcCosSIMD( cosom );
+	fltx4 sinom = SinSIMD( omega );
+	fltx4 sclp = DivSIMD( SinSIMD( MulSIMD( oneMinusT, omega ) ), sinom );
+	fltx4 sclq = DivSIMD( SinSIMD( MulSIMD( t, omega ) ), sinom );
+
+	fltx4 bSlerp = CmpGtSIMD( SubSIMD( Four_Ones, cosom ), epsilon );
+	sclp = MaskedAssign( bSlerp, sclp, oneMinusT );
+	sclq = MaskedAssign( bSlerp, sclq, t );
+
+	qt.x = MaddSIMD( sclp, p.x, MulSIMD( sclq, q.x ) );
+	qt.y = MaddSIMD( sclp, p.y, MulSIMD( sclq, q.y ) );
+	qt.z = MaddSIMD( sclp, p.z, MulSIMD( sclq, q.z ) );
+	qt.w = MaddSIMD( sclp, p.w, MulSIMD( sclq, q.w ) );
+
+	// Opposite rotations go through a perpendicular one. This only happens
+	// with BONE_FIXED_ALIGNMENT bones, so it's rare enough to branch on.
+	fltx4 bOpposite = CmpLeSIMD( AddSIMD( Four_Ones, cosom ), epsilon );
+	if ( TestSignSIMD( bOpposite ) )
+	{
+		fltx4 halfPi = ReplicateX4( 0.5f * M_PI );
+		sclp = SinSIMD( MulSIMD( oneMinusT, halfPi ) );
+		sclq = SinSIMD( MulSIMD( t, halfPi ) );
+
+		qt.x = MaskedAssign( bOpposite, SubSIMD( MulSIMD( sclp, p.x ), MulSIMD( sclq, q.y ) ), qt.x );
+		qt.y = MaskedAssign( bOpposite, MaddSIMD( sclp, p.y, MulSIMD( sclq, q.x ) ), qt.y );
+		qt.z = MaskedAssign( bOpposite, SubSIMD( MulSIMD( sclp, p.z ), MulSIMD( sclq, q.w ) ), qt.z );
+		qt.w = MaskedAssign( bOpposite, q.z, qt.w );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionBlend( p, q, t, qt ) for four bones, or QuaternionBlendNoAlign
+//			for the ones in noAlignMask
+//-----------------------------------------------------------------------------
+static void FourQuaternionsBlend( const FourQuaternions_t &p, const FourQuaternions_t &qIn, const fltx4 &t, const fltx4 &noAlignMask, FourQuaternions_t &qt )
+{
+	FourQuaternions_t q = qIn;
+	FourQuaternionsAlign( p, q, noAlignMask );
+
+	fltx4 sclp = SubSIMD( Four_Ones, t );
+	qt.x = MaddSIMD( sclp, p.x, MulSIMD( t, q.x ) );
+	qt.y = MaddSIMD( sclp, p.y, MulSIMD( t, q.y ) );
+	qt.z = MaddSIMD( sclp, p.z, MulSIMD( t, q.z ) );
+	qt.w = MaddSIMD( sclp, p.w, MulSIMD( t, q.w ) );
+	FourQuaternionsNormalize( qt );
+}
+
+// ~0 for each of the four bones starting at iBone that has nFlag set
+FORCEINLINE fltx4 FourBoneFlagsMask( const CStudioHdr *pStudioHdr, int iBone, int nFlag )
+{
+	ALIGN16 int32 mask[4] ALIGN16_POST;
+	for ( int k = 0; k < 4; k++ )
+	{
+		mask[k] = ( pStudioHdr->boneFlags( iBone + k ) & nFlag ) ? ~0 : 0;
+	}
+	return LoadAlignedSIMD( (float *)mask );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionMatrix( q[i], pos[i], pBoneLocal[i] ) for nBones bones, four
+//			at a time when anim_simd_bones is set
+//-----------------------------------------------------------------------------
+void Studio_BuildLocalMatrices( int nBones, const Quaternion q[], const Vector pos[], matrix3x4_t *pBoneLocal )
+{
+	int i = 0;
+	if ( anim_simd_bones.GetBool() )
+	{
+		ALIGN16 float px[4] ALIGN16_POST, py[4] ALIGN16_POST, pz[4] ALIGN16_POST;
+		for ( ; i + 4 <= nBones; i += 4 )
+		{
+			FourQuaternions_t q4;
+			LoadFourQuaternions( &q[i], q4 );
+
+			fltx4 x2 = AddSIMD( q4.x, q4.x ), y2 = AddSIMD( q4.y, q4.y ), z2 = AddSIMD( q4.z, q4.z );
+			fltx4 xx = MulSIMD( q4.x, x2 ), yy = MulSIMD( q4.y, y2 ), zz = MulSIMD( q4.z, z2 );
+			fltx4 xy = MulSIMD( q4.x, y2 ), xz = MulSIMD( q4.x, z2 ), yz = MulSIMD( q4.y, z2 );
+			fltx4 wx = MulSIMD( q4.w, x2 ), wy = MulSIMD( q4.w, y2 ), wz = MulSIMD( q4.w, z2 );
+
+			for ( int k = 0; k < 4; k++ )
+			{
+				px[k] = pos[i + k].x;
+				py[k] = pos[i + k].y;
+				pz[k] = pos[i + k].z;
+			}
+
+			// One register per matrix element, then transpose each row back into four matrices
+			fltx4 m00 = SubSIMD( Four_Ones, AddSIMD( yy, zz ) ), m01 = SubSIMD( xy, wz ), m02 = AddSIMD( xz, wy ), m03 = LoadAlignedSIMD( px );
+			fltx4 m10 = AddSIMD( xy, wz ), m11 = SubSIMD( Four_Ones, AddSIMD( xx, zz ) ), m12 = SubSIMD( yz, wx ), m13 = LoadAlignedSIMD( py );
+			fltx4 m20 = SubSIMD( xz, wy ), m21 = AddSIMD( yz, wx ), m22 = SubSIMD( Four_Ones, AddSIMD( xx, yy ) ), m23 = LoadAlignedSIMD( pz );
+
+			TransposeSIMD( m00, m01, m02, m03 );
+			TransposeSIMD( m10, m11, m12, m13 );
+			TransposeSIMD( m20, m21, m22, m23 );
+
+			StoreUnalignedSIMD( pBoneLocal[i][0], m00 );
+			StoreUnalignedSIMD( pBoneLocal[i][1], m10 );
+			StoreUnalignedSIMD( pBoneLocal[i][2], m20 );
+			StoreUnalignedSIMD( pBoneLocal[i + 1][0], m01 );
+			StoreUnalignedSIMD( pBoneLocal[i + 1][1], m11 );
+			StoreUnalignedSIMD( pBoneLocal[i + 1][2], m21 );
+			StoreUnalignedSIMD( pBoneLocal[i + 2][0], m02 );
+			StoreUnalignedSIMD( pBoneLocal[i + 2][1], m12 );
+			StoreUnalignedSIMD( pBoneLocal[i + 2][2], m22 );
+			StoreUnalignedSIMD( pBoneLocal[i + 3][0], m03 );
+			StoreUnalignedSIMD( pBoneLocal[i + 3][1], m13 );
+			StoreUnalignedSIMD( pBoneLocal[i + 3][2], m23 );
+		}
+	}
+
+	for ( ; i < nBones; i++ )
+	{
+		QuaternionMatrix( q[i], pos[i], pBoneLocal[i] );
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: blend together in world space q1,pos1 with q2,pos2.  Return result in q1,pos1.  
 //			0 returns q1, pos1.  1 returns q2, pos2
@@ -1481,8 +1812,39 @@ void SlerpBones(
 		return;
 	}
 
+	i = 0;
+	if ( anim_simd_bones.GetBool() )
+	{
+		for ( ; i + 4 <= nBoneCount; i += 4 )
+		{
+			fltx4 s2x4 = LoadUnalignedSIMD( &pS2[i] );
+			fltx4 bActive = CmpGtSIMD( s2x4, Four_Zeros );
+			if ( !TestSignSIMD( bActive ) )
+				continue;
+
+			FourQuaternions_t p4, q4, result;
+			LoadFourQuaternions( &q2[i], p4 );
+			LoadFourQuaternions( &q1[i], q4 );
+			fltx4 s1x4 = SubSIMD( Four_Ones, s2x4 );
+			FourQuaternionsSlerp( p4, q4, s1x4, FourBoneFlagsMask( pStudioHdr, i, BONE_FIXED_ALIGNMENT ), result );
+			StoreFourQuaternions( result, bActive, &q1[i] );
+
+			for ( j = i; j < i + 4; j++ )
+			{
+				s2 = pS2[j];
+				if ( s2 <= 0.0f )
+					continue;
+
+				s1 = 1.0 - s2;
+				pos1[j][0] = pos1[j][0] * s1 + pos2[j][0] * s2;
+				pos1[j][1] = pos1[j][1] * s1 + pos2[j][1] * s2;
+				pos1[j][2] = pos1[j][2] * s1 + pos2[j][2] * s2;
+			}
+		}
+	}
+
 	QuaternionAligned q3;
-	for (i = 0; i < nBoneCount; i++)
+	for ( ; i < nBoneCount; i++)
 	{
 		s2 = pS2[i];
 		if ( s2 <= 0.0f )
@@ -1592,7 +1954,49 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	i = 0;
+	if ( anim_simd_bones.GetBool() )
+	{
+		fltx4 s1x4 = ReplicateX4( s1 );
+		ALIGN16 int32 active[4] ALIGN16_POST;
+		int nBoneCount = pStudioHdr->numbones();
+		for ( ; i + 4 <= nBoneCount; i += 4 )
+		{
+			int nActive = 0;
+			for ( int k = 0; k < 4; k++ )
+			{
+				j = -1;
+				if ( pStudioHdr->boneFlags( i + k ) & boneMask )
+				{
+					j = pSeqGroup ? pSeqGroup->boneMap[i + k] : i + k;
+				}
+
+				active[k] = ( j >= 0 && seqdesc.weight( j ) > 0.0 ) ? ~0 : 0;
+				nActive |= active[k];
+			}
+
+			if ( !nActive )
+				continue;
+
+			FourQuaternions_t p4, q4, result;
+			LoadFourQuaternions( &q2[i], p4 );
+			LoadFourQuaternions( &q1[i], q4 );
+			FourQuaternionsBlend( p4, q4, s1x4, FourBoneFlagsMask( pStudioHdr, i, BONE_FIXED_ALIGNMENT ), result );
+			StoreFourQuaternions( result, LoadAlignedSIMD( (float *)active ), &q1[i] );
+
+			for ( int k = 0; k < 4; k++ )
+			{
+				if ( !active[k] )
+					continue;
+
+				pos1[i + k][0] = pos1[i + k][0] * s1 + pos2[i + k][0] * s2;
+				pos1[i + k][1] = pos1[i + k][1] * s1 + pos2[i + k][1] * s2;
+				pos1[i + k][2] = pos1[i + k][2] * s1 + pos2[i + k][2] * s2;
+			}
+		}
+	}
+
+	for ( ; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones
 		if (!(pStudioHdr->boneFlags(i) & boneMask))
@@ -4560,12 +4964,28 @@ void Studio_BuildMatrices(
 		VectorScale( rotationmatrix[2], flScale, rotationmatrix[2] );
 	}
 
+	// When building every bone, make all the local matrices in one pass so
+	// they're done four at a time
+	matrix3x4_t *pBoneLocal = NULL;
+	if ( iBone == -1 && anim_simd_bones.GetBool() )
+	{
+		pBoneLocal = (matrix3x4_t *)stackalloc( chainlength * sizeof( matrix3x4_t ) );
+		Studio_BuildLocalMatrices( chainlength, q, pos, pBoneLocal );
+	}
+
 	for (j = chainlength - 1; j >= 0; j--)
 	{
 		i = chain[j];
 		if (pStudioHdr->boneFlags(i) & boneMask)
 		{
-			QuaternionMatrix( q[i], pos[i], bonematrix );
+			if ( pBoneLocal )
+			{
+				bonematrix = pBoneLocal[i];
+			}
+			else
+			{
+				QuaternionMatrix( q[i], pos[i], bonematrix );
+			}
 
 			if (pStudioHdr->boneParent(i) == -1) 
 			{
@@ -331,6 +331,12 @@ void Studio_BuildMatrices(
 	int boneMask
 	);
 
+// QuaternionMatrix( q[i], pos[i], pBoneLocal[i] ) for the first nBones bones,
+// four at a time unless anim_simd_bones is off
+void Studio_BuildLocalMatrices( int nBones, const Quaternion q[], const Vector pos[], matrix3x4_t *pBoneLocal );
+
+// anim_simd_bones, for bone setup code outside this file that batches its own work
+bool Studio_SIMDBoneSetupEnabled();
 
 // Get a bone->bone relative transform
 void Studio_CalcBoneToBoneTransform( const CStudioHdr *pStudioHdr, int inputBoneIndex, int outputBoneIndex, matrix3x4_t &matrixOut );
@@ -436,6 +442,9 @@ memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params );
 void Studio_DestroyBoneCache( memhandle_t cacheHandle );
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle );
 
+// Latches per-frame bone cache stats and applies budget changes; call once a frame.
+void Studio_BoneCacheFrameUpdate();
+
 // Given a ray, trace for an intersection with this studiomodel.  Get the array of bones from StudioSetupHitboxBones
 bool TraceToStudio( class IPhysicsSurfaceProps *pProps, const Ray_t& ray, CStudioHdr *pStudioHdr, mstudiohitboxset_t *set, matrix3x4_t **hitboxbones, int fContentsMask, const Vector &vecOrigin, float flScale, trace_t &trace );
 
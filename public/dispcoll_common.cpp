@@ -23,7 +23,7 @@
 //	Cache
 
 #ifdef ENGINE_DLL
-CDataManager<CDispCollTree, CDispCollTree *, bool, CThreadFastMutex> g_DispCollTriCache( 2048*1024 );
+CShardedDataManager<CDispCollTree, CDispCollTree *, bool, CThreadFastMutex> g_DispCollTriCache( 2048*1024 );
 #endif
 
 
@@ -63,11 +63,76 @@ private:
 	CPolyhedron_AllocByNew( void ) { }; //CPolyhedron_AllocByNew::Allocate() is the only way to create one of these.
 };
 
-CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory = false ); //be sure to polyhedron->Release()
-CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory = false ); //this does NOT modify/delete the existing polyhedron
+class CPolyhedron_TempMemory : public CPolyhedron
+{
+public:
+#ifdef DBGFLAG_ASSERT
+	int iReferenceCount;
+#endif
+
+	virtual void Release( void )
+	{
+#ifdef DBGFLAG_ASSERT
+		--iReferenceCount;
+#endif
+	}
+
+	CPolyhedron_TempMemory( void )
+#ifdef DBGFLAG_ASSERT
+		: iReferenceCount( 0 )
+#endif
+	{ };
+};
+
+//-----------------------------------------------------------------------------
+// Scratch memory for building and clipping polyhedrons. The working geometry
+// and the temporary polyhedron both come out of it, so once it has grown to
+// fit the shapes being clipped, a clip allocates nothing. Give each thread its
+// own; calls that don't pass one use the calling thread's.
+//-----------------------------------------------------------------------------
+class CPolyhedronScratch
+{
+public:
+	CPolyhedronScratch( int iBlockSize = 32 * 1024 );
+	~CPolyhedronScratch( void );
+
+	CPolyhedron *GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons ); //same rules as ::GetTempPolyhedron(), but per scratch
+
+	void *Alloc( int iSize ); //working memory, good until the next Reset()
+	void Reset( void ); //frees all working memory, but keeps it around for reuse
+	void Purge( void ); //gives everything back to the heap
+
+	int GetBytesReserved( void ) const { return m_iBytesReserved; }
+	int GetHeapAllocationCount( void ) const { return m_iHeapAllocations; } //lifetime count, stops going up once the scratch is warm
+
+private:
+	CPolyhedronScratch( const CPolyhedronScratch & );
+	CPolyhedronScratch &operator=( const CPolyhedronScratch & );
+
+	struct Block_t
+	{
+		Block_t *pNext;
+		int iSize;
+		int iUsed; //including this header
+	};
+
+	Block_t *m_pBlocks; //newest first, allocations come from the head
+	int m_iBlockSize;
+	int m_iBytesReserved;
+	int m_iHeapAllocations;
+
+	unsigned char *m_pTempMemory;
+	int m_iTempMemorySize;
+	CPolyhedron_TempMemory m_TempPolyhedron;
+};
+
+CPolyhedron *GeneratePolyhedronFromPlanes( const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory = false, CPolyhedronScratch *pScratch = NULL ); //be sure to polyhedron->Release()
+CPolyhedron *ClipPolyhedron( const CPolyhedron *pExistingPolyhedron, const float *pOutwardFacingPlanes, int iPlaneCount, float fOnPlaneEpsilon, bool bUseTemporaryMemory = false, CPolyhedronScratch *pScratch = NULL ); //this does NOT modify/delete the existing polyhedron
 
-CPolyhedron *GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons ); //grab the temporary polyhedron. Avoids new/delete for quick work. Can only be in use by one chunk of code at a time
+CPolyhedron *GetTempPolyhedron( unsigned short iVertices, unsigned short iLines, unsigned short iIndices, unsigned short iPolygons ); //grab the calling thread's temporary polyhedron. Avoids new/delete for quick work. Can only be in use by one chunk of code at a time on each thread
 
+CPolyhedronScratch *GetThreadPolyhedronScratch( void ); //the scratch used when none is passed in, created on first use
+void FreeThreadPolyhedronScratch( void ); //worker threads that used the thread scratch should call this before they exit
 
 #endif //#ifndef POLYHEDRON_H_
 
@@ -193,6 +193,21 @@ protected:
 };
 
 
+// The wide BVH is an alternative to the kd-tree (RTE_FLAGS_WIDE_BVH). Each node holds the
+// boxes of up to 8 children in SoA order so one ray can be tested against all of them with a
+// single pass of 8 wide AVX instructions. Leaves are ranges of WideBVHTriangles.
+#define WIDEBVH_WIDTH 8
+
+struct WideBVHNode_t
+{
+	float m_flMins[3][WIDEBVH_WIDTH];						// child boxes
+	float m_flMaxs[3][WIDEBVH_WIDTH];
+	int32 m_nChild[WIDEBVH_WIDTH];							// node index, or first triangle for
+															// leaves. -1 for unused slots
+	int32 m_nTriangleCount[WIDEBVH_WIDTH];					// 0 for interior nodes and unused slots
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -220,6 +235,8 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_WIDE_BVH 8								// trace with the wide BVH instead of the
+															// kd-tree. cleared if the cpu lacks AVX
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -268,11 +285,19 @@ public:
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
 
+	CUtlVector<WideBVHNode_t> WideBVHNodes;					//< the wide bvh, if used. root is 0
+	CUtlVector<TriIntersectData_t> WideBVHTriangles;		//< triangles in bvh leaf order
+	CUtlVector<int32> WideBVHTriangleIndexList;				//< OptimizedTriangleList index of each
+
+	int m_nBuildThreads;									//< threads for building the acceleration
+															// structure. 0 = one per cpu
+
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_nBuildThreads=0;
 	}
 
 
@@ -344,18 +369,20 @@ public:
 
 	int MakeLeafNode(int first_tri, int last_tri);
 
+	void BuildKDTree(void);
 
-	float CalculateCostsOfSplit(
-		int split_plane,int32 const *tri_list,int ntris,
-		Vector MinBound,Vector MaxBound, float &split_value,
-		int &nleft, int &nright, int &nboth);
-		
-	void RefineNode(int node_number,int32 const *tri_list,int ntris,
-						 Vector MinBound,Vector MaxBound, int depth);
-	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// wide bvh back end (widebvh.cpp)
+	void BuildWideBVH(void);
+
+	void TraceWideBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+						   RayTracingResult *rslt_out,
+						   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
+	static bool CPUSupportsWideBVH(void);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
@@ -299,8 +299,11 @@ private:
 	const char * ReadToken( CUtlBuffer &buf, bool &wasQuoted, bool &wasConditional );
 	void WriteIndents( IBaseFileSystem *filesystem, FileHandle_t f, CUtlBuffer *pBuf, int indentLevel );
 
+	// m_sValue / m_wsValue come from the current arena if this node lives in one
 	void FreeAllocatedValue();
-	void AllocateValueBlock(int size);
+	void FreeStringValue();
+	char *AllocateValueBlock( int size );
+	wchar_t *AllocateWValueBlock( int nChars );
 
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
@@ -320,7 +323,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nArenaFlags; // which of the node and its values were allocated from a CKeyValuesArena
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -349,6 +352,72 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+//-----------------------------------------------------------------------------
+// Purpose: Bump allocator for KeyValues trees that are loaded in bulk and thrown
+//			away together, like per-map scripts. While a CKeyValuesArenaScope is
+//			active on a thread, new KeyValues and their string values on that
+//			thread are carved out of the arena instead of the heap.
+//
+//			deleteThis() still works on arena nodes: it runs the destructors,
+//			which free anything that was heap allocated (values set after the
+//			scope closed, or strings GetString() made from numbers), but the arena
+//			memory only goes away with FreeAll(). A tree that was never changed
+//			outside its scope can be released with FreeAll() alone.
+//
+//			As with the growable string table, don't hand arena trees to another
+//			module, and only change them inside their own arena's scope or outside
+//			any scope.
+//-----------------------------------------------------------------------------
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena( int nBlockSize = 64 * 1024 );
+	~CKeyValuesArena();
+
+	void *Alloc( int nSize );
+
+	// Releases every tree allocated from the arena at once
+	void FreeAll();
+
+	// Since the last FreeAll. Every allocation is one the heap didn't have to make.
+	int GetAllocationCount() const	{ return m_nAllocations; }
+	int GetBytesAllocated() const	{ return m_nBytesAllocated; }
+	int GetBytesReserved() const	{ return m_nBytesReserved; }
+
+private:
+	CKeyValuesArena( const CKeyValuesArena & );
+	CKeyValuesArena &operator=( const CKeyValuesArena & );
+
+	struct Block_t
+	{
+		Block_t *m_pNext;
+		int m_nSize;
+		int m_nUsed;	// including this header
+	};
+
+	Block_t *m_pBlocks;	// newest first, allocations come from the head
+	int m_nBlockSize;
+	int m_nAllocations;
+	int m_nBytesAllocated;
+	int m_nBytesReserved;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Routes KeyValues allocations on this thread to an arena for as long
+//			as it's in scope. Scopes nest.
+//-----------------------------------------------------------------------------
+class CKeyValuesArenaScope
+{
+public:
+	explicit CKeyValuesArenaScope( CKeyValuesArena *pArena );
+	~CKeyValuesArenaScope();
+
+	static CKeyValuesArena *GetCurrent();
+
+private:
+	CKeyValuesArena *m_pPrevious;
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
@@ -181,9 +181,16 @@ public:
 	memhandle_t CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked = false )
 	{
 		BaseClass::EnsureCapacity(STORAGE_TYPE::EstimatedSize(createParams));
-		unsigned short memoryIndex = BaseClass::CreateHandle( bCreateLocked );
+		// The handle stays locked until it has storage, otherwise another thread
+		// could evict it from the LRU while the resource is still being created.
+		unsigned short memoryIndex = BaseClass::CreateHandle( true );
 		STORAGE_TYPE *pStore = STORAGE_TYPE::CreateResource( createParams );
-		return BaseClass::StoreResourceInHandle( memoryIndex, pStore, pStore->Size() );
+		memhandle_t hMem = BaseClass::StoreResourceInHandle( memoryIndex, pStore, pStore->Size() );
+		if ( !bCreateLocked )
+		{
+			BaseClass::UnlockResource( hMem );
+		}
+		return hMem;
 	}
 
 	// Iteration. Must lock first
@@ -247,6 +254,144 @@ private:
 	MUTEX_TYPE m_mutex;
 };
 
+//-----------------------------------------------------------------------------
+// A data manager split into 2^SHARD_BITS independent CDataManagers, each with
+// its own mutex, LRU and an equal share of the target size. Use it in place of
+// CDataManager for caches that many threads hit at once: callers only contend
+// when their handles land in the same shard. Each shard evicts on its own, so
+// the LRU order is only approximate across shards.
+//
+// New resources are dealt out to the shards round robin. A handle keeps the
+// shard's serial in the high word and packs the shard's handle index with the
+// shard number in the low word, so handles still fit in a memhandle_t and
+// route straight back to their shard.
+//-----------------------------------------------------------------------------
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE = STORAGE_TYPE *, class MUTEX_TYPE = CThreadFastMutex, int SHARD_BITS = 3 >
+class CShardedDataManager
+{
+public:
+	typedef CDataManager<STORAGE_TYPE, CREATE_PARAMS, LOCK_TYPE, MUTEX_TYPE> ShardType_t;
+
+	enum
+	{
+		NUM_SHARDS = ( 1 << SHARD_BITS ),
+		SHARD_MASK = NUM_SHARDS - 1,
+		MAX_SHARD_INDEX = ( 0xFFFF >> SHARD_BITS ) - 1,	// so no handle is ever INVALID_MEMHANDLE
+	};
+
+	CShardedDataManager( unsigned int size = (unsigned)-1 )
+	{
+		SetTargetSize( size );
+	}
+
+	memhandle_t CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked = false )
+	{
+		int iFirstShard = ( m_nNextShard++ ) & SHARD_MASK;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			int iShard = ( iFirstShard + i ) & SHARD_MASK;
+			memhandle_t hShard = m_Shards[iShard].CreateResource( createParams, bCreateLocked );
+			unsigned int fullWord = (unsigned int)hShard;
+			if ( ( fullWord & 0xFFFF ) <= MAX_SHARD_INDEX )
+				return (memhandle_t)( ( fullWord & 0xFFFF0000 ) | ( ( fullWord & 0xFFFF ) << SHARD_BITS ) | iShard );
+
+			// More live resources in this shard than fit in a handle, try the next one
+			if ( bCreateLocked )
+			{
+				m_Shards[iShard].UnlockResource( hShard );
+			}
+			m_Shards[iShard].DestroyResource( hShard );
+		}
+
+		Warning( "CShardedDataManager: every shard is out of handles\n" );
+		return INVALID_MEMHANDLE;
+	}
+
+	void		DestroyResource( memhandle_t handle )		{ Shard( handle ).DestroyResource( ShardHandle( handle ) ); }
+	LOCK_TYPE	LockResource( memhandle_t handle )			{ return Shard( handle ).LockResource( ShardHandle( handle ) ); }
+	int			UnlockResource( memhandle_t handle )		{ return Shard( handle ).UnlockResource( ShardHandle( handle ) ); }
+	void		TouchResource( memhandle_t handle )			{ Shard( handle ).TouchResource( ShardHandle( handle ) ); }
+	void		MarkAsStale( memhandle_t handle )			{ Shard( handle ).MarkAsStale( ShardHandle( handle ) ); }
+	int			LockCount( memhandle_t handle )				{ return Shard( handle ).LockCount( ShardHandle( handle ) ); }
+	int			BreakLock( memhandle_t handle )				{ return Shard( handle ).BreakLock( ShardHandle( handle ) ); }
+	void		NotifySizeChanged( memhandle_t handle, unsigned int oldSize, unsigned int newSize ) { Shard( handle ).NotifySizeChanged( ShardHandle( handle ), oldSize, newSize ); }
+
+	// Only the shard's own lookup is locked, the same as CDataManager
+	LOCK_TYPE	GetResource_NoLock( memhandle_t handle )			{ return Shard( handle ).GetResource_NoLock( ShardHandle( handle ) ); }
+	LOCK_TYPE	GetResource_NoLockNoLRUTouch( memhandle_t handle )	{ return Shard( handle ).GetResource_NoLockNoLRUTouch( ShardHandle( handle ) ); }
+
+	// The mutex of the shard that owns handle. Hold it to keep the resource from
+	// being evicted while it's used through GetResource_NoLock.
+	MUTEX_TYPE	&AccessMutex( memhandle_t handle )			{ return Shard( handle ).AccessMutex(); }
+
+	int			BreakAllLocks()								{ int n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].BreakAllLocks(); return n; }
+	unsigned int FlushAllUnlocked()							{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].FlushAllUnlocked(); return n; }
+	unsigned int FlushToTargetSize()						{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].FlushToTargetSize(); return n; }
+	unsigned int FlushAll()									{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].FlushAll(); return n; }
+	unsigned int Purge( unsigned int nBytesToPurge )		{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].Purge( nBytesToPurge / NUM_SHARDS ); return n; }
+
+	// Makes room for size bytes in every shard, since the next resource could go to any of them.
+	unsigned int EnsureCapacity( unsigned int size )		{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].EnsureCapacity( size ); return n; }
+
+	unsigned int TargetSize()		{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].TargetSize(); return n; }
+	unsigned int AvailableSize()	{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].AvailableSize(); return n; }
+	unsigned int UsedSize()			{ unsigned n = 0; for ( int i = 0; i < NUM_SHARDS; i++ ) n += m_Shards[i].UsedSize(); return n; }
+
+	// Splits targetSize evenly across the shards. Doesn't flush.
+	void SetTargetSize( unsigned int targetSize )
+	{
+		unsigned int nShardSize = ( targetSize == (unsigned)-1 ) ? targetSize : targetSize / NUM_SHARDS;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			AUTO_LOCK( m_Shards[i].AccessMutex() );
+			m_Shards[i].SetTargetSize( nShardSize );
+		}
+	}
+
+	int GetShardCount() const						{ return NUM_SHARDS; }
+	ShardType_t &GetShard( int iShard )				{ return m_Shards[iShard]; }
+	static int ShardIndex( memhandle_t handle )		{ return (unsigned int)handle & SHARD_MASK; }
+
+	// Debugging only!!!!
+	void GetLRUHandleList( CUtlVector< memhandle_t >& list )	{ GetHandleList( list, false ); }
+	void GetLockHandleList( CUtlVector< memhandle_t >& list )	{ GetHandleList( list, true ); }
+
+private:
+	ShardType_t &Shard( memhandle_t handle )		{ return m_Shards[ ShardIndex( handle ) ]; }
+
+	static memhandle_t ShardHandle( memhandle_t handle )
+	{
+		unsigned int fullWord = (unsigned int)handle;
+		return (memhandle_t)( ( fullWord & 0xFFFF0000 ) | ( ( fullWord & 0xFFFF ) >> SHARD_BITS ) );
+	}
+
+	void GetHandleList( CUtlVector< memhandle_t >& list, bool bLocked )
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			int nFirst = list.Count();
+			if ( bLocked )
+			{
+				m_Shards[i].GetLockHandleList( list );
+			}
+			else
+			{
+				m_Shards[i].GetLRUHandleList( list );
+			}
+
+			for ( int j = nFirst; j < list.Count(); j++ )
+			{
+				unsigned int fullWord = (unsigned int)list[j];
+				list[j] = (memhandle_t)( ( fullWord & 0xFFFF0000 ) | ( ( fullWord & 0xFFFF ) << SHARD_BITS ) | i );
+			}
+		}
+	}
+
+	ShardType_t m_Shards[NUM_SHARDS];
+	CInterlockedInt m_nNextShard;
+};
+
+
 //-----------------------------------------------------------------------------
 
 inline unsigned short CDataManagerBase::FromHandle( memhandle_t handle )
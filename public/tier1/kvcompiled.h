@@ -0,0 +1,174 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compiled, read-only KeyValues. A text KeyValues file is parsed once
+//			and flattened into a single position independent block (header, node
+//			array, string table) that is cached on disk and mapped straight back
+//			in on later loads, as long as the text file's CRC still matches.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef KVCOMPILED_H
+#define KVCOMPILED_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "checksum_crc.h"
+
+class IFileSystem;
+class CUtlBuffer;
+
+#define COMPILED_KV_ID				(('B'<<24)+('C'<<16)+('V'<<8)+'K')	// little-endian "KVCB"
+#define COMPILED_KV_VERSION			1
+
+// Loose cache files go here, under the DEFAULT_WRITE_PATH search path.
+#define COMPILED_KV_CACHE_DIR		"kvcache"
+#define COMPILED_KV_CACHE_EXTENSION	".kvb"
+
+// All fields are little-endian. Offsets are from the start of the header.
+struct CompiledKeyValuesHeader_t
+{
+	uint32	m_nId;
+	uint32	m_nVersion;
+	uint32	m_nSourceCRC;		// CRC32 of the text file this was compiled from
+	uint32	m_nSourceSize;
+	uint32	m_nBuildFlags;		// COMPILED_KV_* flags the text was parsed with
+	uint32	m_nNodeCount;
+	uint32	m_nNodeOffset;
+	uint32	m_nStringOffset;
+	uint32	m_nStringSize;		// the first string is always ""
+	uint32	m_nTotalSize;
+};
+
+enum
+{
+	COMPILED_KV_ESCAPE_SEQUENCES	= 0x1,
+
+	// Conditionals ([$X360] etc) are resolved when the text is parsed.
+	COMPILED_KV_PLATFORM_X360		= 0x10,
+	COMPILED_KV_PLATFORM_WIN32		= 0x20,
+	COMPILED_KV_PLATFORM_OSX		= 0x40,
+	COMPILED_KV_PLATFORM_LINUX		= 0x80,
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: One key in a compiled image. These only ever exist inside the
+//			image, so they're handed out by pointer just like KeyValues and
+//			support the same read accessors. Values are converted when the
+//			image is compiled, so the getters don't parse anything.
+//-----------------------------------------------------------------------------
+class CKeyValuesView
+{
+public:
+	const char *GetName() const;
+
+	// Accepts "a/b/c" paths like KeyValues::FindKey. Names compare case insensitively.
+	const CKeyValuesView *FindKey( const char *keyName ) const;
+
+	const CKeyValuesView *GetFirstSubKey() const	{ return NodeAt( m_nSub ); }
+	const CKeyValuesView *GetNextKey() const		{ return NodeAt( m_nPeer ); }
+
+	const CKeyValuesView *GetFirstTrueSubKey() const;
+	const CKeyValuesView *GetNextTrueSubKey() const;
+	const CKeyValuesView *GetFirstValue() const;
+	const CKeyValuesView *GetNextValue() const;
+
+	int   GetInt( const char *keyName = NULL, int defaultValue = 0 ) const;
+	uint64 GetUint64( const char *keyName = NULL, uint64 defaultValue = 0 ) const;
+	float GetFloat( const char *keyName = NULL, float defaultValue = 0.0f ) const;
+	const char *GetString( const char *keyName = NULL, const char *defaultValue = "" ) const;
+	bool GetBool( const char *keyName = NULL, bool defaultValue = false ) const;
+	Color GetColor( const char *keyName = NULL ) const;
+	bool IsEmpty( const char *keyName = NULL ) const;
+	KeyValues::types_t GetDataType( const char *keyName = NULL ) const;
+
+private:
+	friend class CCompiledKeyValues;
+	friend class CKeyValuesCompiler;
+
+	const CompiledKeyValuesHeader_t *Header() const { return (const CompiledKeyValuesHeader_t *)( (const byte *)this - m_nOffset ); }
+	const CKeyValuesView *NodeAt( uint32 nIndex ) const;
+	const char *StringAt( uint32 nOffset ) const;
+
+	uint32	m_nOffset;			// of this node, so the image can be found from any node
+	uint32	m_nName;			// string offset
+	uint32	m_nNameHash;		// HashStringCaseless of the name
+	uint32	m_nString;			// string offset of what GetString returns, 0 if no value
+	uint32	m_nSub;				// node index of the first child, 0 if none
+	uint32	m_nPeer;			// node index of the next sibling, 0 if none
+	int32	m_iValue;			// what GetInt returns
+	float	m_flValue;			// what GetFloat returns
+	uint32	m_nUint64[2];		// what GetUint64 returns, low half first
+	uint8	m_Color[4];			// what GetColor returns
+	uint8	m_iDataType;		// KeyValues::types_t
+	uint8	m_nPad[3];
+};
+
+inline const CKeyValuesView *CKeyValuesView::NodeAt( uint32 nIndex ) const
+{
+	if ( !nIndex )
+		return NULL;
+
+	const CompiledKeyValuesHeader_t *pHeader = Header();
+	return (const CKeyValuesView *)( (const byte *)pHeader + pHeader->m_nNodeOffset ) + nIndex;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Owns a compiled image, either mapped from the cache file or built
+//			in memory when there's no usable cache.
+//-----------------------------------------------------------------------------
+class CCompiledKeyValues
+{
+public:
+	CCompiledKeyValues();
+	~CCompiledKeyValues();
+
+	// Loads a text KeyValues file through the cache. The text is always read
+	// so its CRC can be checked; it's only parsed when the cache is missing or
+	// stale, and then the cache is rewritten. Files using #include or #base are
+	// compiled but never cached, since their dependencies aren't tracked.
+	bool LoadFromFile( IFileSystem *pFileSystem, const char *resourceName, const char *pathID = NULL, bool bUsesEscapeSequences = false );
+
+	// Takes a copy of an image made by Compile.
+	bool LoadFromBuffer( const CUtlBuffer &buf );
+
+	void Unload();
+	bool IsLoaded() const { return m_pImage != NULL; }
+
+	// The first top level key, or NULL if nothing is loaded. Further top level
+	// keys are its peers, as with KeyValues::LoadFromFile.
+	const CKeyValuesView *GetRoot() const;
+
+	// Builds a regular KeyValues tree (including the root's peers) for code
+	// that needs one. Cheaper than parsing, but it does allocate every node.
+	KeyValues *MakeKeyValues() const;
+
+	// Flattens pKV and its peers into an image.
+	static bool Compile( KeyValues *pKV, CRC32_t nSourceCRC, uint32 nSourceSize, uint32 nBuildFlags, CUtlBuffer &buf );
+
+	// -nokvcache on the command line turns off the disk cache.
+	static bool IsDiskCacheEnabled();
+
+	static uint32 GetBuildFlags( bool bUsesEscapeSequences );
+
+private:
+	CCompiledKeyValues( const CCompiledKeyValues & );
+	CCompiledKeyValues &operator=( const CCompiledKeyValues & );
+
+	bool MapCacheFile( IFileSystem *pFileSystem, const char *pCacheFile, CRC32_t nSourceCRC, uint32 nSourceSize, uint32 nBuildFlags );
+	static bool ValidateImage( const void *pImage, uint32 nSize );
+
+	const CompiledKeyValuesHeader_t *m_pImage;
+	uint32 m_nImageSize;
+	bool m_bMapped;			// false if m_pImage is heap memory
+#ifdef _WIN32
+	void *m_hMapping;
+#endif
+};
+
+#endif // KVCOMPILED_H
@@ -0,0 +1,31 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Counters for the Linux case insensitive path matching in pathmatch.cpp.
+//
+// pathmatch.o is linked into every module, so these count the lookups made
+// through the copy the calling module resolves to.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PATHMATCH_H
+#define PATHMATCH_H
+#pragma once
+
+#ifdef LINUX
+
+struct PathMatchStats_t
+{
+	unsigned int m_nIndexHits;			// directory lookups answered from an index
+	unsigned int m_nIndexMisses;		// lookups that had to (re)build an index
+	unsigned int m_nDirScans;			// directories read with readdir
+	unsigned int m_nInvalidations;		// indexes thrown away because the directory changed
+};
+
+// Counters are per module: each binary that links tier1 keeps its own copy.
+extern "C" void PathMatch_GetStats( PathMatchStats_t *pStats );
+extern "C" void PathMatch_ResetStats();
+
+#endif // LINUX
+
+#endif // PATHMATCH_H
@@ -85,6 +85,11 @@ protected:
 //    of strings to symbols and back. The symbol class itself contains
 //    a static version of this class for creating global strings, but this
 //    class can also be instanced to create local symbol tables.
+//
+//    Strings are found through an open addressing hash table. Symbols are
+//    never removed (short of RemoveAll) and nothing a lookup reads is ever
+//    moved or modified once it's visible, so Find and String can run while
+//    another thread is adding strings.
 //-----------------------------------------------------------------------------
 
 class CUtlSymbolTable
@@ -103,51 +108,37 @@ public:
 	// Look up the string associated with a particular symbol
 	const char* String( CUtlSymbol id ) const;
 	
-	// Remove all symbols in the table.
+	// Remove all symbols in the table. Not safe while other threads are using it.
 	void  RemoveAll();
 
 	int GetNumStrings( void ) const
 	{
-		return m_Lookup.Count();
+		return m_nSymbols;
 	}
 
 protected:
-	class CStringPoolIndex
+	enum
 	{
-	public:
-		inline CStringPoolIndex()
-		{
-		}
-
-		inline CStringPoolIndex( unsigned short iPool, unsigned short iOffset )
-		{
-			m_iPool = iPool;
-			m_iOffset = iOffset;
-		}
-
-		inline bool operator==( const CStringPoolIndex &other )	const
-		{
-			return m_iPool == other.m_iPool && m_iOffset == other.m_iOffset;
-		}
-
-		unsigned short m_iPool;		// Index into m_StringPools.
-		unsigned short m_iOffset;	// Index into the string pool.
+		SYMBOL_BLOCK_SHIFT = 8,
+		SYMBOL_BLOCK_SIZE = 1 << SYMBOL_BLOCK_SHIFT,
+		MAX_SYMBOL_BLOCKS = ( UTL_INVAL_SYMBOL + SYMBOL_BLOCK_SIZE - 1 ) / SYMBOL_BLOCK_SIZE,
 	};
 
-	class CLess
+	// Symbols live in fixed size blocks so they stay put as the table grows.
+	struct Symbol_t
 	{
-	public:
-		CLess( int ignored = 0 ) {} // permits default initialization to NULL in CUtlRBTree
-		bool operator!() const { return false; }
-		bool operator()( const CStringPoolIndex &left, const CStringPoolIndex &right ) const;
+		const char *m_pString;		// in one of the string pools
+		unsigned int m_nHash;
 	};
 
-	// Stores the symbol lookup
-	class CTree : public CUtlRBTree<CStringPoolIndex, unsigned short, CLess>
+	// Each slot is the top half of a string's hash over its symbol + 1, 0 if empty,
+	// so most probes never touch the string. Replaced slot arrays are kept until
+	// RemoveAll since a lookup may still be walking one.
+	struct HashSlots_t
 	{
-	public:
-		CTree(  int growSize, int initSize ) : CUtlRBTree<CStringPoolIndex, unsigned short, CLess>( growSize, initSize ) {}
-		friend class CUtlSymbolTable::CLess; // Needed to allow CLess to calculate pointer to symbol table
+		HashSlots_t *m_pPrev;
+		unsigned int m_nMask;
+		unsigned int m_Slots[1];
 	};
 
 	struct StringPool_t
@@ -157,18 +148,23 @@ protected:
 		char m_Data[1];
 	};
 
-	CTree m_Lookup;
+	HashSlots_t * volatile m_pSlots;
+	Symbol_t **m_ppSymbolBlocks;
+	volatile int m_nSymbols;
+	int m_nInitSize;
 	bool m_bInsensitive;
-	mutable const char* m_pUserSearchString;
 
 	// stores the string data
 	CUtlVector<StringPool_t*> m_StringPools;
 
 private:
+	unsigned int HashString( const char *pString ) const;
+	UtlSymId_t FindHashed( const char *pString, unsigned int nHash ) const;
+	void InsertSlot( HashSlots_t *pSlots, UtlSymId_t id, unsigned int nHash );
+	void GrowSlots();
 	int FindPoolWithSpace( int len ) const;
-	const char* StringFromIndex( const CStringPoolIndex &index ) const;
-
-	friend class CLess;
+	const char *AddToPool( const char *pString );
+	const Symbol_t &SymbolFromId( UtlSymId_t id ) const;
 };
 
 class CUtlSymbolTableMT : private CUtlSymbolTable
@@ -181,34 +177,30 @@ public:
 
 	CUtlSymbol AddString( const char* pString )
 	{
-		m_lock.LockForWrite();
-		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
-		m_lock.UnlockWrite();
+		// Most strings are already in the table, and those don't need the lock.
+		CUtlSymbol result = CUtlSymbolTable::Find( pString );
+		if ( result.IsValid() || !pString )
+			return result;
+
+		m_lock.Lock();
+		result = CUtlSymbolTable::AddString( pString );
+		m_lock.Unlock();
 		return result;
 	}
 
 	CUtlSymbol Find( const char* pString ) const
 	{
-		m_lock.LockForRead();
-		CUtlSymbol result = CUtlSymbolTable::Find( pString );
-		m_lock.UnlockRead();
-		return result;
+		return CUtlSymbolTable::Find( pString );
 	}
 
 	const char* String( CUtlSymbol id ) const
 	{
-		m_lock.LockForRead();
-		const char *pszResult = CUtlSymbolTable::String( id );
-		m_lock.UnlockRead();
-		return pszResult;
+		return CUtlSymbolTable::String( id );
 	}
 	
 private:
-#if defined(WIN32) || defined(_WIN32)
-	mutable CThreadSpinRWLock m_lock;
-#else
-	mutable CThreadRWLock m_lock;
-#endif
+	// Only taken to add strings.
+	CThreadFastMutex m_lock;
 };
 
 
@@ -0,0 +1,25 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Worker threads for building ray tracing acceleration structures.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef BUILDTASKS_H
+#define BUILDTASKS_H
+#pragma once
+
+
+#define MAX_RAYTRACE_BUILD_THREADS 64
+
+typedef void (*RayTraceBuildTaskFn_t)( void *pContext, int iTask );
+
+// Number of threads to build with. 0 means one per logical processor.
+int GetRayTraceBuildThreads( int nRequested );
+
+// Calls pfnTask for tasks 0..nTasks-1 spread over nThreads threads (including the calling one),
+// returning when they're all done. Tasks are handed out in order.
+void RunRayTraceBuildTasks( int nTasks, int nThreads, RayTraceBuildTaskFn_t pfnTask, void *pContext );
+
+
+#endif // BUILDTASKS_H
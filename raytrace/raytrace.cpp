@@ -2,6 +2,7 @@
 // $Id$
 
 #include "raytrace.h"
+#include "buildtasks.h"
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
@@ -280,6 +281,13 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+	{
+		// the bvh doesn't care about direction signs
+		TraceWideBVH4Rays(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -348,6 +356,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+	{
+		TraceWideBVH4Rays(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -625,7 +639,7 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 }
 
 
-// Both the "quick" and regular kd tree building algorithms here use the "surface area heuristic":
+// The kd tree builder uses the "surface area heuristic":
 // the relative probability of hitting the "left" subvolume (Vl) from a split is equal to that
 // subvolume's surface area divided by its parent's surface area (Vp) : P(Vl | V)=SA(Vl)/SA(Vp).
 // The same holds for the right subvolume, Vp. Nl is the number of triangles in the left volume,
@@ -639,251 +653,462 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 //  This both provides a metric to minimize when computing how and where to split, and also a
 //  termination criterion.
 //
-// the "quick" method just splits down the middle, while the slow method splits at the best
-// discontinuity of the cost formula. The quick method splits along the longest axis ; the 
-// regular algorithm tries all 3 to find which one results in the minimum cost
-// 
-// both methods use the additional optimization of "growing" empty nodes - if the split results in
-// one side being devoid of triangles, the empty side is "grown" as much as possible.
+// Split candidates are found by binning: each triangle's extent along an axis is dropped into
+// KD_SPLIT_BINS buckets between the node bounds, and one sweep over the buckets gives the
+// left/right/straddling counts at every bucket boundary. The planes at the ends of the
+// triangles' extents are tried as well so that empty space can be cut off ("grown" empty
+// nodes). The builder only reads the triangles, so once the top of the tree has been refined,
+// the subtrees below it are built on separate threads and spliced back in.
 //
 
 #define COST_OF_TRAVERSAL 75								// approximate #operations
 #define COST_OF_INTERSECTION 167							// approximate #operations
 
+#define KD_SPLIT_BINS 32
+#define KD_MIN_TASK_TRIANGLES 2048							// smaller subtrees aren't worth a thread
+
 
-float RayTracingEnvironment::CalculateCostsOfSplit(
-	int split_plane,int32 const *tri_list,int ntris,
-	Vector MinBound,Vector MaxBound, float &split_value,
-	int &nleft, int &nright, int &nboth)
+struct KDBuildTriangle_t
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
-	nleft=0;
-	nright=0;
-	nboth=0;
-	float min_coord=1.0e23,max_coord=-1.0e23;
+	float m_flMins[3];
+	float m_flMaxs[3];
+};
 
-	for(int t=0;t<ntris;t++)
+// a subtree handed off to a worker thread
+struct KDBuildTask_t
+{
+	int m_nNode;											// node in the main tree it hangs from
+	CUtlVector<int32> m_Triangles;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;				// the subtree. root is 0
+	CUtlVector<int32> m_TriangleIndices;
+};
+
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( const KDBuildTriangle_t *pTriangles, CUtlVector<CacheOptimizedKDNode> &nodes,
+					CUtlVector<int32> &triangleIndices ) :
+		m_pTriangles( pTriangles ), m_Nodes( nodes ), m_TriangleIndices( triangleIndices )
 	{
-		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-		// determine max and min coordinate values for later optimization
-		for(int v=0;v<3;v++)
-		{
-			min_coord = min( min_coord, tri.Vertex(v)[split_plane] );
-			max_coord = max( max_coord, tri.Vertex(v)[split_plane] );
-		}
-		switch(tri.ClassifyAgainstAxisSplit(split_plane,split_value))
-		{
-			case PLANECHECK_NEGATIVE:
-				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
-				break;
+		m_pTasks = NULL;
+		m_nTaskDepth = 0;
+	}
 
-			case PLANECHECK_POSITIVE:
-				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
-				break;
+	void RefineNode( int node_number, int32 const *tri_list, int ntris,
+					 Vector MinBound, Vector MaxBound, int depth );
 
-			case PLANECHECK_STRADDLING:
-				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
-				break;
-		}
+	// if set, big subtrees at m_nTaskDepth are added here instead of being built
+	CUtlVector<KDBuildTask_t *> *m_pTasks;
+	int m_nTaskDepth;
+
+private:
+	void MakeLeaf( int node_number, int32 const *tri_list, int ntris, Vector MinBound, Vector MaxBound );
+
+	float FindBestSplit( int32 const *tri_list, int ntris, Vector MinBound, Vector MaxBound,
+						 int &split_plane, float &split_value );
+
+	// same answer as CacheOptimizedTriangle::ClassifyAgainstAxisSplit
+	int Classify( int32 tri, int split_plane, float split_value ) const
+	{
+		const KDBuildTriangle_t &bounds = m_pTriangles[tri];
+		if ( bounds.m_flMins[split_plane] >= split_value )
+			return PLANECHECK_POSITIVE;
+		if ( bounds.m_flMaxs[split_plane] <= split_value )
+			return PLANECHECK_NEGATIVE;
+		return PLANECHECK_STRADDLING;
 	}
-	// now, if the split resulted in one half being empty, "grow" the empty half
-	if (nleft && (nboth==0) && (nright==0))
-		split_value=max_coord;
-	if (nright && (nboth==0) && (nleft==0))
-		split_value=min_coord;
 
-	// now, perform surface area/cost check to determine whether this split was worth it
-	Vector LeftMins=MinBound;
+	const KDBuildTriangle_t *m_pTriangles;
+	CUtlVector<CacheOptimizedKDNode> &m_Nodes;
+	CUtlVector<int32> &m_TriangleIndices;
+};
+
+
+static float SplitCost( Vector const &MinBound, Vector const &MaxBound, float ISA,
+						int split_plane, float split_value, int nleft, int nright, int nboth )
+{
 	Vector LeftMaxes=MaxBound;
 	Vector RightMins=MinBound;
-	Vector RightMaxes=MaxBound;
 	LeftMaxes[split_plane]=split_value;
 	RightMins[split_plane]=split_value;
-	float SA_L=BoxSurfaceArea(LeftMins,LeftMaxes);
-	float SA_R=BoxSurfaceArea(RightMins,RightMaxes);
-	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
-	float cost_of_split=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+	float SA_L=BoxSurfaceArea(MinBound,LeftMaxes);
+	float SA_R=BoxSurfaceArea(RightMins,MaxBound);
+	return COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
 		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
-	return cost_of_split;
+}
+
+
+float CKDTreeBuilder::FindBestSplit( int32 const *tri_list, int ntris, Vector MinBound, Vector MaxBound,
+									 int &split_plane, float &split_value )
+{
+	float best_cost=1.0e23;
+	float SA=BoxSurfaceArea(MinBound,MaxBound);
+	if ( SA <= 0 )
+		return best_cost;
+	float ISA=1.0/SA;
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float flExtent=MaxBound[axis]-MinBound[axis];
+		if ( flExtent <= 0 )
+			continue;
+		float flBinScale=KD_SPLIT_BINS/flExtent;
+
+		// count where each triangle's extent (clipped to the node) starts and ends
+		int nStarts[KD_SPLIT_BINS];
+		int nEnds[KD_SPLIT_BINS];
+		memset( nStarts, 0, sizeof( nStarts ) );
+		memset( nEnds, 0, sizeof( nEnds ) );
+		float min_coord=1.0e23,max_coord=-1.0e23;
+		for(int t=0;t<ntris;t++)
+		{
+			const KDBuildTriangle_t &bounds=m_pTriangles[tri_list[t]];
+			float flLo=max( bounds.m_flMins[axis], MinBound[axis] );
+			float flHi=min( bounds.m_flMaxs[axis], MaxBound[axis] );
+			min_coord=min( min_coord, flLo );
+			max_coord=max( max_coord, flHi );
+			nStarts[clamp( (int)( ( flLo-MinBound[axis] )*flBinScale ), 0, KD_SPLIT_BINS-1 )]++;
+			nEnds[clamp( (int)( ( flHi-MinBound[axis] )*flBinScale ), 0, KD_SPLIT_BINS-1 )]++;
+		}
+
+		// bucket boundaries. triangles ending in a bucket below the plane are left of it, ones
+		// starting in a bucket above it are right of it, and the rest straddle it.
+		int nleft=0;
+		int nright=ntris;
+		for(int b=1;b<KD_SPLIT_BINS;b++)
+		{
+			nleft+=nEnds[b-1];
+			nright-=nStarts[b-1];
+			float trial_splitvalue=MinBound[axis]+b/flBinScale;
+			float trial_cost=SplitCost( MinBound, MaxBound, ISA, axis, trial_splitvalue,
+										nleft, nright, ntris-nleft-nright );
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+
+		// cut off the empty space on either side
+		if ( max_coord<MaxBound[axis] )
+		{
+			float trial_cost=SplitCost( MinBound, MaxBound, ISA, axis, max_coord, ntris, 0, 0 );
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=max_coord;
+			}
+		}
+		if ( min_coord>MinBound[axis] )
+		{
+			float trial_cost=SplitCost( MinBound, MaxBound, ISA, axis, min_coord, 0, ntris, 0 );
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=min_coord;
+			}
+		}
+	}
+	return best_cost;
+}
+
+
+void CKDTreeBuilder::MakeLeaf( int node_number, int32 const *tri_list, int ntris, Vector MinBound, Vector MaxBound )
+{
+	m_Nodes[node_number].Children=KDNODE_STATE_LEAF+(m_TriangleIndices.Count()<<2);
+	m_Nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	m_Nodes[node_number].vecMins = MinBound;
+	m_Nodes[node_number].vecMaxs = MaxBound;
+#endif
+	m_TriangleIndices.AddMultipleToTail( ntris, tri_list );
 }
 
 
 #define NEVER_SPLIT 0
 
-void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
-									   Vector MinBound,Vector MaxBound, int depth)
+void CKDTreeBuilder::RefineNode(int node_number,int32 const *tri_list,int ntris,
+								Vector MinBound,Vector MaxBound, int depth)
 {
 	if (ntris<3)											// never split empty lists
 	{
 		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
+		MakeLeaf( node_number, tri_list, ntris, MinBound, MaxBound );
+		return;
+	}
 
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+	if ( m_pTasks && ( depth == m_nTaskDepth ) && ( ntris >= KD_MIN_TASK_TRIANGLES ) )
+	{
+		KDBuildTask_t *pTask = new KDBuildTask_t;
+		pTask->m_nNode = node_number;
+		pTask->m_Triangles.CopyArray( tri_list, ntris );
+		pTask->m_MinBound = MinBound;
+		pTask->m_MaxBound = MaxBound;
+		pTask->m_nDepth = depth;
+		m_pTasks->AddToTail( pTask );
 		return;
 	}
 
-	float best_cost=1.0e23;
-	int best_nleft=0,best_nright=0,best_nboth=0;
-	float best_splitvalue=0;
 	int split_plane=0;
+	float best_splitvalue=0;
+	float best_cost=FindBestSplit( tri_list, ntris, MinBound, MaxBound, split_plane, best_splitvalue );
 
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
-	for(int axis=0;axis<3;axis++)
-	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
-		{
-			for(int tv=0;tv<3;tv++)
-			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
-				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
-				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
-				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
-					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
-					}
-				}
-				if (ts==-1)
-					break;
-			}
-		}
-
-	}
 	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
 	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
 	{
 		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		MakeLeaf( node_number, tri_list, ntris, MinBound, MaxBound );
+		return;
 	}
-	else
+
+	// its worth splitting!
+	int best_nleft=0,best_nright=0,best_nboth=0;
+	for(int t=0;t<ntris;t++)
 	{
-// 		printf("best split was %d at %f (mid=%f,n=%d, sk=%d)\n",split_plane,best_splitvalue,
-// 			   0.5*(MinBound[split_plane]+MaxBound[split_plane]),ntris,tri_skip);
-		// its worth splitting!
-		// we will achieve the splitting without sorting by using a selection algorithm.
-		int32 *new_triangle_list;
-		new_triangle_list=new int32[ntris];
-
-		// now, perform surface area/cost check to determine whether this split was worth it
-		Vector LeftMins=MinBound;
-		Vector LeftMaxes=MaxBound;
-		Vector RightMins=MinBound;
-		Vector RightMaxes=MaxBound;
-		LeftMaxes[split_plane]=best_splitvalue;
-		RightMins[split_plane]=best_splitvalue;
-		
-		int n_left_output=0;
-		int n_both_output=0;
-		int n_right_output=0;
-		for(int t=0;t<ntris;t++)
+		switch( Classify( tri_list[t], split_plane, best_splitvalue ) )
 		{
-			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
-			{
-				case PLANECHECK_NEGATIVE:
-//					printf("%d goes left\n",t);
-					new_triangle_list[n_left_output++]=tri_list[t];
-					break;
-				case PLANECHECK_POSITIVE:
-					n_right_output++;
-//					printf("%d goes right\n",t);
-					new_triangle_list[ntris-n_right_output]=tri_list[t];
-					break;
-				case PLANECHECK_STRADDLING:
-//					printf("%d goes both\n",t);
-					new_triangle_list[best_nleft+n_both_output]=tri_list[t];
-					n_both_output++;
-					break;
+			case PLANECHECK_NEGATIVE:
+				best_nleft++;
+				break;
+			case PLANECHECK_POSITIVE:
+				best_nright++;
+				break;
+			case PLANECHECK_STRADDLING:
+				best_nboth++;
+				break;
+		}
+	}
 
-					
-			}
+	// we will achieve the splitting without sorting by using a selection algorithm.
+	int32 *new_triangle_list;
+	new_triangle_list=new int32[ntris];
+
+	Vector LeftMins=MinBound;
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	Vector RightMaxes=MaxBound;
+	LeftMaxes[split_plane]=best_splitvalue;
+	RightMins[split_plane]=best_splitvalue;
+
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch( Classify( tri_list[t], split_plane, best_splitvalue ) )
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[best_nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
 		}
-		int left_child=OptimizedKDTree.Count();
-		int right_child=left_child+1;
-// 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
-// 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
-// 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
+	}
+	int left_child=m_Nodes.Count();
+	m_Nodes[node_number].Children=split_plane+(left_child<<2);
+	m_Nodes[node_number].SplittingPlaneValue=best_splitvalue;
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+	m_Nodes[node_number].vecMins = MinBound;
+	m_Nodes[node_number].vecMaxs = MaxBound;
 #endif
-		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
-		// now, recurse!
-		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
-			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
-		delete[] new_triangle_list;
-	}	
+	CacheOptimizedKDNode newnode;
+	m_Nodes.AddToTail(newnode);
+	m_Nodes.AddToTail(newnode);
+	// now, recurse!
+	if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
+		depth+=100;
+	RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
+	RefineNode(left_child+1,new_triangle_list+best_nleft,best_nright+best_nboth,
+			   RightMins,RightMaxes,depth+1);
+	delete[] new_triangle_list;
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+//-----------------------------------------------------------------------------
+// Build threads, shared with the wide bvh builder
+//-----------------------------------------------------------------------------
+struct RayTraceBuildTasks_t
+{
+	RayTraceBuildTaskFn_t m_pfnTask;
+	void *m_pContext;
+	int m_nTasks;
+	CInterlockedInt m_nNextTask;
+};
+
+static unsigned RayTraceBuildThread( void *pParam )
+{
+	RayTraceBuildTasks_t *pTasks = (RayTraceBuildTasks_t *)pParam;
+	for(;;)
+	{
+		int iTask = pTasks->m_nNextTask++;
+		if ( iTask >= pTasks->m_nTasks )
+			break;
+		pTasks->m_pfnTask( pTasks->m_pContext, iTask );
+	}
+	return 0;
+}
+
+int GetRayTraceBuildThreads( int nRequested )
+{
+	int nThreads = ( nRequested > 0 ) ? nRequested : GetCPUInformation()->m_nLogicalProcessors;
+	return clamp( nThreads, 1, MAX_RAYTRACE_BUILD_THREADS );
+}
+
+void RunRayTraceBuildTasks( int nTasks, int nThreads, RayTraceBuildTaskFn_t pfnTask, void *pContext )
+{
+	RayTraceBuildTasks_t tasks;
+	tasks.m_pfnTask = pfnTask;
+	tasks.m_pContext = pContext;
+	tasks.m_nTasks = nTasks;
+	tasks.m_nNextTask = 0;
+
+	nThreads = min( nThreads, nTasks );
+	ThreadHandle_t hThreads[MAX_RAYTRACE_BUILD_THREADS];
+	for(int i=1;i<nThreads;i++)
+		hThreads[i] = CreateSimpleThread( RayTraceBuildThread, &tasks );
+
+	RayTraceBuildThread( &tasks );
+
+	for(int i=1;i<nThreads;i++)
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// kd-tree
+//-----------------------------------------------------------------------------
+struct KDBuildContext_t
 {
+	const KDBuildTriangle_t *m_pTriangles;
+	KDBuildTask_t **m_ppTasks;
+};
+
+static void BuildKDSubtree( void *pContext, int iTask )
+{
+	KDBuildContext_t *pBuild = (KDBuildContext_t *)pContext;
+	KDBuildTask_t *pTask = pBuild->m_ppTasks[iTask];
+
+	CKDTreeBuilder builder( pBuild->m_pTriangles, pTask->m_Nodes, pTask->m_TriangleIndices );
 	CacheOptimizedKDNode root;
-	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
-	for(int t=0;t<OptimizedTriangleList.Count();t++)
+	pTask->m_Nodes.AddToTail( root );
+	builder.RefineNode( 0, pTask->m_Triangles.Base(), pTask->m_Triangles.Count(),
+						pTask->m_MinBound, pTask->m_MaxBound, pTask->m_nDepth );
+	pTask->m_Triangles.Purge();
+}
+
+static int __cdecl CompareKDBuildTaskSize( KDBuildTask_t * const *ppA, KDBuildTask_t * const *ppB )
+{
+	return (*ppB)->m_Triangles.Count() - (*ppA)->m_Triangles.Count();
+}
+
+// moves a node built in a subtree into the main tree
+static void RelocateKDNode( CacheOptimizedKDNode &node, int nNodeBase, int nTriangleBase )
+{
+	if ( node.NodeType() == KDNODE_STATE_LEAF )
+		node.Children=KDNODE_STATE_LEAF+((node.TriangleIndexStart()+nTriangleBase)<<2);
+	else
+		node.Children=node.NodeType()+((node.LeftChild()+nNodeBase)<<2);
+}
+
+void RayTracingEnvironment::BuildKDTree(void)
+{
+	int ntris=OptimizedTriangleList.Count();
+
+	CUtlVector<KDBuildTriangle_t> triangleBounds;
+	triangleBounds.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle const &tri=OptimizedTriangleList[t];
+		for(int c=0;c<3;c++)
+		{
+			triangleBounds[t].m_flMins[c]=min( tri.Vertex(0)[c], min( tri.Vertex(1)[c], tri.Vertex(2)[c] ) );
+			triangleBounds[t].m_flMaxs[c]=max( tri.Vertex(0)[c], max( tri.Vertex(1)[c], tri.Vertex(2)[c] ) );
+		}
+	}
+
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
 		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	CalculateTriangleListBounds(root_triangle_list,ntris,m_MinBound,m_MaxBound);
+
+	// refine the top of the tree here, down to roughly 8 subtrees per thread
+	int nThreads=GetRayTraceBuildThreads( m_nBuildThreads );
+	CUtlVector<KDBuildTask_t *> tasks;
+	CKDTreeBuilder builder( triangleBounds.Base(), OptimizedKDTree, TriangleIndexList );
+	if ( nThreads > 1 )
+	{
+		builder.m_pTasks=&tasks;
+		while ( ( 1 << builder.m_nTaskDepth ) < nThreads * 8 )
+			builder.m_nTaskDepth++;
+	}
+
+	CacheOptimizedKDNode root;
+	OptimizedKDTree.AddToTail(root);
+	builder.RefineNode(0,root_triangle_list,ntris,m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
 
+	if ( !tasks.Count() )
+		return;
+
+	// hand out the biggest subtrees first, but splice them in the order they were made so the
+	// tree doesn't depend on thread timing
+	CUtlVector<KDBuildTask_t *> schedule;
+	schedule.CopyArray( tasks.Base(), tasks.Count() );
+	schedule.Sort( CompareKDBuildTaskSize );
+
+	KDBuildContext_t context;
+	context.m_pTriangles=triangleBounds.Base();
+	context.m_ppTasks=schedule.Base();
+	RunRayTraceBuildTasks( schedule.Count(), nThreads, BuildKDSubtree, &context );
+
+	for(int i=0;i<tasks.Count();i++)
+	{
+		KDBuildTask_t *pTask=tasks[i];
+
+		// the subtree root replaces its placeholder, the rest go on the end
+		int nNodeBase=OptimizedKDTree.Count()-1;
+		int nTriangleBase=TriangleIndexList.Count();
+		for(int n=0;n<pTask->m_Nodes.Count();n++)
+			RelocateKDNode( pTask->m_Nodes[n], nNodeBase, nTriangleBase );
+
+		OptimizedKDTree[pTask->m_nNode]=pTask->m_Nodes[0];
+		OptimizedKDTree.AddMultipleToTail( pTask->m_Nodes.Count()-1, pTask->m_Nodes.Base()+1 );
+		TriangleIndexList.AddMultipleToTail( pTask->m_TriangleIndices.Count(), pTask->m_TriangleIndices.Base() );
+		delete pTask;
+	}
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	if ( ( Flags & RTE_FLAGS_WIDE_BVH ) && !CPUSupportsWideBVH() )
+	{
+		Warning( "This cpu doesn't support AVX, tracing with the kd-tree instead of the wide bvh.\n" );
+		Flags &= ~RTE_FLAGS_WIDE_BVH;
+	}
+
+	if ( Flags & RTE_FLAGS_WIDE_BVH )
+		BuildWideBVH();
+	else
+		BuildKDTree();
+
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
@@ -0,0 +1,703 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: 8 wide BVH back end for RayTracingEnvironment.
+//
+// The tree is built top down with binned SAH splits over triangle centroids.
+// Each node takes a range of triangles and splits the part with the most
+// surface area until it has 8 parts or every part is small enough to be a
+// leaf. Once the top of the tree is built the remaining subtrees are built on
+// separate threads; they work on disjoint ranges of the triangle index list,
+// so only their nodes have to be spliced back in.
+//
+// Tracing takes the same 4 ray packets as the kd-tree. At each node every
+// live ray is tested against all 8 child boxes at once with AVX, the children
+// hit by any ray are pushed nearest last, and leaves run the 4 ray SSE
+// triangle test. Entries farther than every ray's closest hit are skipped.
+//
+// The AVX code only uses intrinsics on raw floats, so that no mathlib inline
+// compiled for AVX can end up being used by the rest of the program.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "raytrace.h"
+#include "buildtasks.h"
+#include <float.h>
+
+#if !defined( _X360 ) && ( defined( _WIN32 ) || ( defined( __GNUC__ ) && !defined( __clang__ ) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) ) )
+#define WIDEBVH_AVX 1
+#include <immintrin.h>
+#if defined( _WIN32 )
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined( WIDEBVH_AVX ) && defined( __GNUC__ )
+#define WIDEBVH_AVX_FUNCTION __attribute__(( target( "avx" ) ))
+#else
+#define WIDEBVH_AVX_FUNCTION
+#endif
+
+
+#define WIDEBVH_LEAF_TRIANGLES 4							// ranges this small become leaves
+#define WIDEBVH_SPLIT_BINS 16
+#define WIDEBVH_MAX_DEPTH 64								// deeper than this, ranges are just halved
+#define WIDEBVH_STACK_SIZE 1024
+
+
+struct BVHBuildTriangle_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	Vector m_Centroid;
+};
+
+struct BVHRange_t
+{
+	int m_nFirst;
+	int m_nCount;
+	Vector m_Mins;
+	Vector m_Maxs;
+};
+
+// a range that still has to become a node
+struct BVHWork_t
+{
+	int m_nParent;											// -1 for the root of a build
+	int m_nSlot;
+	BVHRange_t m_Range;
+	int m_nDepth;
+};
+
+// a subtree handed off to a worker thread
+struct BVHBuildTask_t
+{
+	BVHWork_t m_Work;
+	CUtlVector<WideBVHNode_t> m_Nodes;						// the subtree. root is 0
+};
+
+
+static float BVHSurfaceArea( Vector const &boxmin, Vector const &boxmax )
+{
+	Vector boxdim=boxmax-boxmin;
+	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
+}
+
+
+class CWideBVHBuilder
+{
+public:
+	CWideBVHBuilder( const BVHBuildTriangle_t *pTriangles, int32 *pTriangleIndices, CUtlVector<WideBVHNode_t> &nodes ) :
+		m_pTriangles( pTriangles ), m_pTriangleIndices( pTriangleIndices ), m_Nodes( nodes )
+	{
+		m_pTasks = NULL;
+		m_nMaxTaskTriangles = 0;
+	}
+
+	// Builds the nodes for a range, returning the index of the first one.
+	int BuildTree( const BVHRange_t &range, int nDepth );
+
+	void CalculateRangeBounds( BVHRange_t &range ) const;
+
+	// if set, ranges of up to m_nMaxTaskTriangles below the root are added here instead of being built
+	CUtlVector<BVHBuildTask_t *> *m_pTasks;
+	int m_nMaxTaskTriangles;
+
+private:
+	void SplitRange( const BVHRange_t &range, int nDepth, BVHRange_t &left, BVHRange_t &right );
+
+	const BVHBuildTriangle_t *m_pTriangles;
+	int32 *m_pTriangleIndices;
+	CUtlVector<WideBVHNode_t> &m_Nodes;
+};
+
+
+void CWideBVHBuilder::CalculateRangeBounds( BVHRange_t &range ) const
+{
+	range.m_Mins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	range.m_Maxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = range.m_nFirst; i < range.m_nFirst + range.m_nCount; i++ )
+	{
+		const BVHBuildTriangle_t &tri = m_pTriangles[m_pTriangleIndices[i]];
+		VectorMin( range.m_Mins, tri.m_Mins, range.m_Mins );
+		VectorMax( range.m_Maxs, tri.m_Maxs, range.m_Maxs );
+	}
+}
+
+
+void CWideBVHBuilder::SplitRange( const BVHRange_t &range, int nDepth, BVHRange_t &left, BVHRange_t &right )
+{
+	int nFirst = range.m_nFirst;
+	int nEnd = range.m_nFirst + range.m_nCount;
+	int nMid = nFirst;
+
+	if ( nDepth < WIDEBVH_MAX_DEPTH )
+	{
+		Vector centroidMins( FLT_MAX, FLT_MAX, FLT_MAX );
+		Vector centroidMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		for ( int i = nFirst; i < nEnd; i++ )
+		{
+			const Vector &centroid = m_pTriangles[m_pTriangleIndices[i]].m_Centroid;
+			VectorMin( centroidMins, centroid, centroidMins );
+			VectorMax( centroidMaxs, centroid, centroidMaxs );
+		}
+
+		float flBestCost = FLT_MAX;
+		int nBestAxis = -1;
+		int nBestBin = 0;
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			float flExtent = centroidMaxs[axis] - centroidMins[axis];
+			if ( flExtent <= 0 )
+				continue;
+			float flBinScale = WIDEBVH_SPLIT_BINS / flExtent;
+
+			int nBinCount[WIDEBVH_SPLIT_BINS];
+			Vector binMins[WIDEBVH_SPLIT_BINS], binMaxs[WIDEBVH_SPLIT_BINS];
+			for ( int b = 0; b < WIDEBVH_SPLIT_BINS; b++ )
+			{
+				nBinCount[b] = 0;
+				binMins[b].Init( FLT_MAX, FLT_MAX, FLT_MAX );
+				binMaxs[b].Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+			}
+			for ( int i = nFirst; i < nEnd; i++ )
+			{
+				const BVHBuildTriangle_t &tri = m_pTriangles[m_pTriangleIndices[i]];
+				int b = clamp( (int)( ( tri.m_Centroid[axis] - centroidMins[axis] ) * flBinScale ), 0, WIDEBVH_SPLIT_BINS-1 );
+				nBinCount[b]++;
+				VectorMin( binMins[b], tri.m_Mins, binMins[b] );
+				VectorMax( binMaxs[b], tri.m_Maxs, binMaxs[b] );
+			}
+
+			// sweep from the right to get the cost of everything above each bin boundary
+			float flRightCost[WIDEBVH_SPLIT_BINS];
+			Vector sweepMins( FLT_MAX, FLT_MAX, FLT_MAX ), sweepMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+			int nSweepCount = 0;
+			for ( int b = WIDEBVH_SPLIT_BINS-1; b > 0; b-- )
+			{
+				VectorMin( sweepMins, binMins[b], sweepMins );
+				VectorMax( sweepMaxs, binMaxs[b], sweepMaxs );
+				nSweepCount += nBinCount[b];
+				flRightCost[b] = nSweepCount ? nSweepCount * BVHSurfaceArea( sweepMins, sweepMaxs ) : 0;
+			}
+
+			// then from the left, adding the two
+			sweepMins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+			sweepMaxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+			nSweepCount = 0;
+			for ( int b = 1; b < WIDEBVH_SPLIT_BINS; b++ )
+			{
+				VectorMin( sweepMins, binMins[b-1], sweepMins );
+				VectorMax( sweepMaxs, binMaxs[b-1], sweepMaxs );
+				nSweepCount += nBinCount[b-1];
+				if ( !nSweepCount || nSweepCount == range.m_nCount )
+					continue;
+
+				float flCost = nSweepCount * BVHSurfaceArea( sweepMins, sweepMaxs ) + flRightCost[b];
+				if ( flCost < flBestCost )
+				{
+					flBestCost = flCost;
+					nBestAxis = axis;
+					nBestBin = b;
+				}
+			}
+		}
+
+		if ( nBestAxis >= 0 )
+		{
+			// partition the index list in place
+			float flBinScale = WIDEBVH_SPLIT_BINS / ( centroidMaxs[nBestAxis] - centroidMins[nBestAxis] );
+			int nLast = nEnd - 1;
+			while ( nMid <= nLast )
+			{
+				const Vector &centroid = m_pTriangles[m_pTriangleIndices[nMid]].m_Centroid;
+				int b = clamp( (int)( ( centroid[nBestAxis] - centroidMins[nBestAxis] ) * flBinScale ), 0, WIDEBVH_SPLIT_BINS-1 );
+				if ( b < nBestBin )
+				{
+					nMid++;
+				}
+				else
+				{
+					V_swap( m_pTriangleIndices[nMid], m_pTriangleIndices[nLast] );
+					nLast--;
+				}
+			}
+		}
+	}
+
+	// all the centroids in one place, or too deep: any split will do
+	if ( nMid <= nFirst || nMid >= nEnd )
+	{
+		nMid = nFirst + range.m_nCount / 2;
+	}
+
+	left.m_nFirst = nFirst;
+	left.m_nCount = nMid - nFirst;
+	right.m_nFirst = nMid;
+	right.m_nCount = nEnd - nMid;
+	CalculateRangeBounds( left );
+	CalculateRangeBounds( right );
+}
+
+
+int CWideBVHBuilder::BuildTree( const BVHRange_t &range, int nDepth )
+{
+	int nRoot = -1;
+
+	CUtlVector<BVHWork_t> work;
+	BVHWork_t &rootWork = work[ work.AddToTail() ];
+	rootWork.m_nParent = -1;
+	rootWork.m_nSlot = 0;
+	rootWork.m_Range = range;
+	rootWork.m_nDepth = nDepth;
+
+	while ( work.Count() )
+	{
+		BVHWork_t item = work.Tail();
+		work.RemoveMultipleFromTail( 1 );
+
+		if ( m_pTasks && ( item.m_nParent >= 0 ) && ( item.m_Range.m_nCount <= m_nMaxTaskTriangles ) )
+		{
+			BVHBuildTask_t *pTask = new BVHBuildTask_t;
+			pTask->m_Work = item;
+			m_pTasks->AddToTail( pTask );
+			continue;
+		}
+
+		int nNode = m_Nodes.AddToTail();
+		if ( item.m_nParent >= 0 )
+			m_Nodes[item.m_nParent].m_nChild[item.m_nSlot] = nNode;
+		else
+			nRoot = nNode;
+
+		// keep splitting the biggest part that's too big for a leaf
+		BVHRange_t parts[WIDEBVH_WIDTH];
+		parts[0] = item.m_Range;
+		int nParts = 1;
+		while ( nParts < WIDEBVH_WIDTH )
+		{
+			int nBest = -1;
+			float flBestArea = -1;
+			for ( int i = 0; i < nParts; i++ )
+			{
+				if ( parts[i].m_nCount <= WIDEBVH_LEAF_TRIANGLES )
+					continue;
+				float flArea = BVHSurfaceArea( parts[i].m_Mins, parts[i].m_Maxs );
+				if ( flArea > flBestArea )
+				{
+					flBestArea = flArea;
+					nBest = i;
+				}
+			}
+			if ( nBest < 0 )
+				break;
+
+			BVHRange_t split = parts[nBest];
+			SplitRange( split, item.m_nDepth, parts[nBest], parts[nParts] );
+			nParts++;
+		}
+
+		WideBVHNode_t &node = m_Nodes[nNode];
+		for ( int i = 0; i < WIDEBVH_WIDTH; i++ )
+		{
+			if ( i >= nParts )
+			{
+				for ( int c = 0; c < 3; c++ )
+				{
+					node.m_flMins[c][i] = FLT_MAX;
+					node.m_flMaxs[c][i] = FLT_MAX;
+				}
+				node.m_nChild[i] = -1;
+				node.m_nTriangleCount[i] = 0;
+				continue;
+			}
+
+			for ( int c = 0; c < 3; c++ )
+			{
+				node.m_flMins[c][i] = parts[i].m_Mins[c];
+				node.m_flMaxs[c][i] = parts[i].m_Maxs[c];
+			}
+
+			if ( parts[i].m_nCount <= WIDEBVH_LEAF_TRIANGLES )
+			{
+				node.m_nChild[i] = parts[i].m_nFirst;
+				node.m_nTriangleCount[i] = parts[i].m_nCount;
+			}
+			else
+			{
+				node.m_nChild[i] = -1;						// filled in when the child is built
+				node.m_nTriangleCount[i] = 0;
+
+				BVHWork_t &child = work[ work.AddToTail() ];
+				child.m_nParent = nNode;
+				child.m_nSlot = i;
+				child.m_Range = parts[i];
+				child.m_nDepth = item.m_nDepth + 1;
+			}
+		}
+	}
+
+	return nRoot;
+}
+
+
+struct BVHBuildContext_t
+{
+	const BVHBuildTriangle_t *m_pTriangles;
+	int32 *m_pTriangleIndices;
+	BVHBuildTask_t **m_ppTasks;
+};
+
+static void BuildWideBVHSubtree( void *pContext, int iTask )
+{
+	BVHBuildContext_t *pBuild = (BVHBuildContext_t *)pContext;
+	BVHBuildTask_t *pTask = pBuild->m_ppTasks[iTask];
+
+	CWideBVHBuilder builder( pBuild->m_pTriangles, pBuild->m_pTriangleIndices, pTask->m_Nodes );
+	builder.BuildTree( pTask->m_Work.m_Range, pTask->m_Work.m_nDepth );
+}
+
+static int __cdecl CompareBVHBuildTaskSize( BVHBuildTask_t * const *ppA, BVHBuildTask_t * const *ppB )
+{
+	return (*ppB)->m_Work.m_Range.m_nCount - (*ppA)->m_Work.m_Range.m_nCount;
+}
+
+
+void RayTracingEnvironment::BuildWideBVH(void)
+{
+	int ntris=OptimizedTriangleList.Count();
+
+	WideBVHNodes.Purge();
+	WideBVHTriangles.Purge();
+	WideBVHTriangleIndexList.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+		WideBVHTriangleIndexList[t]=t;
+	CalculateTriangleListBounds(WideBVHTriangleIndexList.Base(),ntris,m_MinBound,m_MaxBound);
+	if ( !ntris )
+		return;
+
+	CUtlVector<BVHBuildTriangle_t> triangles;
+	triangles.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle const &tri=OptimizedTriangleList[t];
+		BVHBuildTriangle_t &build=triangles[t];
+		build.m_Mins=tri.Vertex(0);
+		build.m_Maxs=tri.Vertex(0);
+		for(int v=1;v<3;v++)
+		{
+			VectorMin( build.m_Mins, tri.Vertex(v), build.m_Mins );
+			VectorMax( build.m_Maxs, tri.Vertex(v), build.m_Maxs );
+		}
+		build.m_Centroid=0.5f*(build.m_Mins+build.m_Maxs);
+	}
+
+	// build the top of the tree here, leaving subtrees of about 1/8th of a thread's share
+	int nThreads=GetRayTraceBuildThreads( m_nBuildThreads );
+	CUtlVector<BVHBuildTask_t *> tasks;
+	CWideBVHBuilder builder( triangles.Base(), WideBVHTriangleIndexList.Base(), WideBVHNodes );
+	if ( nThreads > 1 )
+	{
+		builder.m_pTasks=&tasks;
+		builder.m_nMaxTaskTriangles=ntris/(nThreads*8);
+	}
+
+	BVHRange_t root;
+	root.m_nFirst=0;
+	root.m_nCount=ntris;
+	builder.CalculateRangeBounds( root );
+	builder.BuildTree( root, 0 );
+
+	if ( tasks.Count() )
+	{
+		CUtlVector<BVHBuildTask_t *> schedule;
+		schedule.CopyArray( tasks.Base(), tasks.Count() );
+		schedule.Sort( CompareBVHBuildTaskSize );
+
+		BVHBuildContext_t context;
+		context.m_pTriangles=triangles.Base();
+		context.m_pTriangleIndices=WideBVHTriangleIndexList.Base();
+		context.m_ppTasks=schedule.Base();
+		RunRayTraceBuildTasks( schedule.Count(), nThreads, BuildWideBVHSubtree, &context );
+
+		// splice the subtrees in the order they were made so the tree doesn't depend on thread timing
+		for(int i=0;i<tasks.Count();i++)
+		{
+			BVHBuildTask_t *pTask=tasks[i];
+			int nNodeBase=WideBVHNodes.Count();
+			for(int n=0;n<pTask->m_Nodes.Count();n++)
+			{
+				WideBVHNode_t &node=pTask->m_Nodes[n];
+				for(int c=0;c<WIDEBVH_WIDTH;c++)
+				{
+					if ( !node.m_nTriangleCount[c] && node.m_nChild[c] >= 0 )
+						node.m_nChild[c]+=nNodeBase;
+				}
+			}
+			WideBVHNodes[pTask->m_Work.m_nParent].m_nChild[pTask->m_Work.m_nSlot]=nNodeBase;
+			WideBVHNodes.AddMultipleToTail( pTask->m_Nodes.Count(), pTask->m_Nodes.Base() );
+			delete pTask;
+		}
+	}
+
+	// the leaves index triangles by their position in the reordered list
+	WideBVHTriangles.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle tri=OptimizedTriangleList[WideBVHTriangleIndexList[t]];
+		tri.ChangeIntoIntersectionFormat();
+		WideBVHTriangles[t]=tri.m_Data.m_IntersectData;
+	}
+}
+
+
+bool RayTracingEnvironment::CPUSupportsWideBVH(void)
+{
+#if defined( WIDEBVH_AVX )
+	static int s_nSupported = -1;
+	if ( s_nSupported < 0 )
+	{
+		// the cpu has to have AVX and the OS has to save the ymm registers
+		unsigned int nInfo[4];
+#if defined( _WIN32 )
+		__cpuid( (int *)nInfo, 1 );
+#else
+		__cpuid( 1, nInfo[0], nInfo[1], nInfo[2], nInfo[3] );
+#endif
+		bool bOSXSave = ( nInfo[2] & ( 1 << 27 ) ) != 0;
+		bool bAVX = ( nInfo[2] & ( 1 << 28 ) ) != 0;
+		s_nSupported = 0;
+		if ( bOSXSave && bAVX )
+		{
+#if defined( _WIN32 )
+			uint64 nXCR0 = _xgetbv( 0 );
+#else
+			unsigned int nLow, nHigh;
+			__asm__ __volatile__ ( "xgetbv" : "=a"( nLow ), "=d"( nHigh ) : "c"( 0 ) );
+			uint64 nXCR0 = ( (uint64)nHigh << 32 ) | nLow;
+#endif
+			s_nSupported = ( ( nXCR0 & 6 ) == 6 ) ? 1 : 0;
+		}
+	}
+	return s_nSupported != 0;
+#else
+	return false;
+#endif
+}
+
+
+#if defined( WIDEBVH_AVX )
+
+struct WideBVHStackEntry_t
+{
+	int32 m_nChild;
+	int32 m_nTriangleCount;
+	float m_flDist;											// nearest entry of any ray
+};
+
+static WIDEBVH_AVX_FUNCTION void TraceWideBVH4Rays_AVX( const WideBVHNode_t *pNodes,
+	const TriIntersectData_t *pTriangles, const int32 *pTriangleIndices,
+	const FourRays &rays, fltx4 TMin, fltx4 TMax, RayTracingResult *rslt_out,
+	int32 skip_id, ITransparentTriangleCallback *pCallback )
+{
+	__m128 origin[3] = { rays.origin.x, rays.origin.y, rays.origin.z };
+	__m128 direction[3] = { rays.direction.x, rays.direction.y, rays.direction.z };
+
+	// per ray copies for broadcasting into the box tests
+	ALIGN16 float flOrigin[3][4] ALIGN16_POST;
+	ALIGN16 float flInvDir[3][4] ALIGN16_POST;
+	ALIGN16 float flTMin[4] ALIGN16_POST;
+	ALIGN16 float flTMax[4] ALIGN16_POST;				// shrinks to the closest hit so far
+
+	const __m128 signMask = _mm_castsi128_ps( _mm_set1_epi32( 0x80000000 ) );
+	const __m128 minDir = _mm_set1_ps( 1.0e-20f );
+	for ( int c = 0; c < 3; c++ )
+	{
+		// keep the reciprocal finite for axis aligned rays, so 0*inf can't make NaNs
+		__m128 dir = _mm_or_ps( _mm_max_ps( _mm_andnot_ps( signMask, direction[c] ), minDir ), _mm_and_ps( signMask, direction[c] ) );
+		_mm_store_ps( flInvDir[c], _mm_div_ps( _mm_set1_ps( 1.0f ), dir ) );
+		_mm_store_ps( flOrigin[c], origin[c] );
+	}
+
+	__m128 hitIds = _mm_load_ps( (const float *)rslt_out->HitIds );
+	__m128 hitDist = rslt_out->HitDistance;
+	__m128 hitNormal[3] = { rslt_out->surface_normal.x, rslt_out->surface_normal.y, rslt_out->surface_normal.z };
+	_mm_store_ps( flTMin, TMin );
+	_mm_store_ps( flTMax, _mm_min_ps( TMax, hitDist ) );
+
+	const __m128 epsilon = _mm_set1_ps( 1.0e-10f );
+	const __m128 negativeEpsilon = _mm_set1_ps( -1.0e-10f );
+	const __m128 one = _mm_set1_ps( 1.0f );
+
+	WideBVHStackEntry_t stack[WIDEBVH_STACK_SIZE];
+	stack[0].m_nChild = 0;
+	stack[0].m_nTriangleCount = 0;
+	stack[0].m_flDist = -FLT_MAX;
+	int nStack = 1;
+
+	while ( nStack )
+	{
+		WideBVHStackEntry_t entry = stack[--nStack];
+
+		// skip anything beyond every live ray's closest hit
+		float flFarthest = -FLT_MAX;
+		for ( int r = 0; r < 4; r++ )
+		{
+			if ( flTMin[r] <= flTMax[r] )
+				flFarthest = max( flFarthest, flTMax[r] );
+		}
+		if ( entry.m_flDist > flFarthest )
+			continue;
+
+		if ( entry.m_nTriangleCount )
+		{
+			for ( int t = entry.m_nChild; t < entry.m_nChild + entry.m_nTriangleCount; t++ )
+			{
+				const TriIntersectData_t *tri = &pTriangles[t];
+				if ( tri->m_nTriangleID == skip_id )
+					continue;
+
+				__m128 N[3] = { _mm_set1_ps( tri->m_flNx ), _mm_set1_ps( tri->m_flNy ), _mm_set1_ps( tri->m_flNz ) };
+				__m128 DDotN = _mm_add_ps( _mm_add_ps( _mm_mul_ps( direction[0], N[0] ), _mm_mul_ps( direction[1], N[1] ) ),
+										   _mm_mul_ps( direction[2], N[2] ) );
+				// mask off zero or near zero (ray parallel to surface)
+				__m128 did_hit = _mm_or_ps( _mm_cmpgt_ps( DDotN, epsilon ), _mm_cmplt_ps( DDotN, negativeEpsilon ) );
+
+				__m128 ODotN = _mm_add_ps( _mm_add_ps( _mm_mul_ps( origin[0], N[0] ), _mm_mul_ps( origin[1], N[1] ) ),
+										   _mm_mul_ps( origin[2], N[2] ) );
+				__m128 isect_t = _mm_div_ps( _mm_sub_ps( _mm_set1_ps( tri->m_flD ), ODotN ), DDotN );
+				did_hit = _mm_and_ps( did_hit, _mm_cmpgt_ps( isect_t, epsilon ) );
+				did_hit = _mm_and_ps( did_hit, _mm_cmplt_ps( isect_t, hitDist ) );
+				did_hit = _mm_and_ps( did_hit, _mm_cmpge_ps( isect_t, TMin ) );
+				did_hit = _mm_and_ps( did_hit, _mm_cmple_ps( isect_t, TMax ) );
+				if ( !_mm_movemask_ps( did_hit ) )
+					continue;
+
+				// now, check 3 edges
+				__m128 hitc1 = _mm_add_ps( origin[tri->m_nCoordSelect0], _mm_mul_ps( isect_t, direction[tri->m_nCoordSelect0] ) );
+				__m128 hitc2 = _mm_add_ps( origin[tri->m_nCoordSelect1], _mm_mul_ps( isect_t, direction[tri->m_nCoordSelect1] ) );
+
+				__m128 B0 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 ),
+													_mm_mul_ps( _mm_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) ),
+										_mm_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+				did_hit = _mm_and_ps( did_hit, _mm_cmpge_ps( B0, epsilon ) );
+
+				__m128 B1 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 ),
+													_mm_mul_ps( _mm_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) ),
+										_mm_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+				did_hit = _mm_and_ps( did_hit, _mm_cmpge_ps( B1, epsilon ) );
+
+				__m128 B2 = _mm_add_ps( B1, B0 );
+				did_hit = _mm_and_ps( did_hit, _mm_cmple_ps( B2, one ) );
+
+				if ( !_mm_movemask_ps( did_hit ) )
+					continue;
+
+				int32 tnum = pTriangleIndices[t];
+				if ( ( tri->m_nFlags & FCACHETRI_TRANSPARENT ) && pCallback )
+				{
+					// same barycentric order as Trace4Rays
+					__m128 b2 = _mm_sub_ps( one, B2 );
+					if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+						continue;
+				}
+
+				__m128 replicated_n = _mm_castsi128_ps( _mm_set1_epi32( tnum ) );
+				hitIds = _mm_or_ps( _mm_and_ps( replicated_n, did_hit ), _mm_andnot_ps( did_hit, hitIds ) );
+				hitDist = _mm_or_ps( _mm_and_ps( isect_t, did_hit ), _mm_andnot_ps( did_hit, hitDist ) );
+				for ( int c = 0; c < 3; c++ )
+				{
+					hitNormal[c] = _mm_or_ps( _mm_and_ps( N[c], did_hit ), _mm_andnot_ps( did_hit, hitNormal[c] ) );
+				}
+			}
+
+			_mm_store_ps( flTMax, _mm_min_ps( TMax, hitDist ) );
+			continue;
+		}
+
+		// test each live ray against all 8 children
+		const WideBVHNode_t &node = pNodes[entry.m_nChild];
+		__m256 mins[3], maxs[3];
+		for ( int c = 0; c < 3; c++ )
+		{
+			mins[c] = _mm256_loadu_ps( node.m_flMins[c] );
+			maxs[c] = _mm256_loadu_ps( node.m_flMaxs[c] );
+		}
+
+		__m256 nearest = _mm256_set1_ps( FLT_MAX );
+		int nHitMask = 0;
+		for ( int r = 0; r < 4; r++ )
+		{
+			if ( flTMin[r] > flTMax[r] )
+				continue;
+
+			__m256 tNear = _mm256_set1_ps( flTMin[r] );
+			__m256 tFar = _mm256_set1_ps( flTMax[r] );
+			for ( int c = 0; c < 3; c++ )
+			{
+				__m256 rayOrigin = _mm256_set1_ps( flOrigin[c][r] );
+				__m256 rayInvDir = _mm256_set1_ps( flInvDir[c][r] );
+				__m256 t0 = _mm256_mul_ps( _mm256_sub_ps( mins[c], rayOrigin ), rayInvDir );
+				__m256 t1 = _mm256_mul_ps( _mm256_sub_ps( maxs[c], rayOrigin ), rayInvDir );
+				tNear = _mm256_max_ps( tNear, _mm256_min_ps( t0, t1 ) );
+				tFar = _mm256_min_ps( tFar, _mm256_max_ps( t0, t1 ) );
+			}
+			__m256 hit = _mm256_cmp_ps( tNear, tFar, _CMP_LE_OQ );
+			nHitMask |= _mm256_movemask_ps( hit );
+			nearest = _mm256_min_ps( nearest, _mm256_blendv_ps( nearest, tNear, hit ) );
+		}
+
+		float flNearest[WIDEBVH_WIDTH];
+		_mm256_storeu_ps( flNearest, nearest );
+
+		// the rest of the loop is SSE, which is slow to mix with dirty upper halves
+		_mm256_zeroupper();
+
+		// push the children that were hit sorted so the nearest comes off first
+		Assert( nStack + WIDEBVH_WIDTH <= WIDEBVH_STACK_SIZE );
+		int nFirst = nStack;
+		for ( int i = 0; i < WIDEBVH_WIDTH; i++ )
+		{
+			if ( !( nHitMask & ( 1 << i ) ) || ( node.m_nChild[i] < 0 ) )
+				continue;
+
+			int j = nStack++;
+			while ( j > nFirst && stack[j-1].m_flDist < flNearest[i] )
+			{
+				stack[j] = stack[j-1];
+				j--;
+			}
+			stack[j].m_nChild = node.m_nChild[i];
+			stack[j].m_nTriangleCount = node.m_nTriangleCount[i];
+			stack[j].m_flDist = flNearest[i];
+		}
+	}
+
+	_mm_store_ps( (float *)rslt_out->HitIds, hitIds );
+	rslt_out->HitDistance = hitDist;
+	rslt_out->surface_normal.x = hitNormal[0];
+	rslt_out->surface_normal.y = hitNormal[1];
+	rslt_out->surface_normal.z = hitNormal[2];
+}
+
+#endif // WIDEBVH_AVX
+
+
+void RayTracingEnvironment::TraceWideBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+											  RayTracingResult *rslt_out,
+											  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+
+#if defined( WIDEBVH_AVX )
+	if ( WideBVHNodes.Count() )
+	{
+		TraceWideBVH4Rays_AVX( WideBVHNodes.Base(), WideBVHTriangles.Base(), WideBVHTriangleIndexList.Base(),
+							   rays, TMin, TMax, rslt_out, skip_id, pCallback );
+	}
+#endif
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include "tier0/dbg.h"
 #include "tier0/mem.h"
+#include "tier0/threadtools.h"
 #include "utlvector.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
@@ -42,6 +43,20 @@ CKeyValuesGrowableStringTable *KeyValues::s_pGrowableStringTable = NULL;
 #define KEYVALUES_TOKEN_SIZE	4096
 static char s_pTokenBuf[KEYVALUES_TOKEN_SIZE];
 
+// KeyValues::m_nArenaFlags
+enum
+{
+	KV_ARENA_NODE		= 0x1,	// the node itself was allocated from a CKeyValuesArena
+	KV_ARENA_STRING		= 0x2,	// m_sValue was
+	KV_ARENA_WSTRING	= 0x4,	// m_wsValue was
+};
+
+// The arena new KeyValues are allocated from on this thread, see CKeyValuesArenaScope
+static CThreadLocalPtr< CKeyValuesArena > s_pCurrentArena;
+
+// Set by operator new so Init() can tell the node it's constructing came from the arena
+static CThreadLocalPtr< KeyValues > s_pNewArenaNode;
+
 
 #define INTERNALWRITE( pData, len ) InternalWrite( filesystem, f, pBuf, pData, len )
 
@@ -453,8 +468,12 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nArenaFlags = 0;
+	if ( s_pNewArenaNode == this )
+	{
+		m_nArenaFlags = KV_ARENA_NODE;
+		s_pNewArenaNode = (KeyValues *)NULL;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -478,20 +497,17 @@ void KeyValues::RemoveEverything()
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
-	m_sValue = NULL;
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	FreeAllocatedValue();
 }
 
 //-----------------------------------------------------------------------------
@@ -1508,13 +1524,69 @@ void KeyValues::SetColor( const char *keyName, Color value)
 	}
 }
 
-void KeyValues::SetStringValue( char const *strValue )
+//-----------------------------------------------------------------------------
+// Purpose: Allocates m_sValue, from the current arena if this node lives in one
+//-----------------------------------------------------------------------------
+char *KeyValues::AllocateValueBlock( int size )
+{
+	Assert( !m_sValue );
+
+	CKeyValuesArena *pArena = s_pCurrentArena;
+	if ( pArena && ( m_nArenaFlags & KV_ARENA_NODE ) )
+	{
+		m_sValue = (char *)pArena->Alloc( size );
+		m_nArenaFlags |= KV_ARENA_STRING;
+	}
+	else
+	{
+		m_sValue = new char[size];
+	}
+	return m_sValue;
+}
+
+wchar_t *KeyValues::AllocateWValueBlock( int nChars )
+{
+	Assert( !m_wsValue );
+
+	CKeyValuesArena *pArena = s_pCurrentArena;
+	if ( pArena && ( m_nArenaFlags & KV_ARENA_NODE ) )
+	{
+		m_wsValue = (wchar_t *)pArena->Alloc( nChars * sizeof(wchar_t) );
+		m_nArenaFlags |= KV_ARENA_WSTRING;
+	}
+	else
+	{
+		m_wsValue = new wchar_t[nChars];
+	}
+	return m_wsValue;
+}
+
+void KeyValues::FreeStringValue()
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
+	if ( !( m_nArenaFlags & KV_ARENA_STRING ) )
+	{
+		delete [] m_sValue;
+	}
+	m_sValue = NULL;
+	m_nArenaFlags &= ~KV_ARENA_STRING;
+}
+
+void KeyValues::FreeAllocatedValue()
+{
+	FreeStringValue();
+
+	if ( !( m_nArenaFlags & KV_ARENA_WSTRING ) )
+	{
+		delete [] m_wsValue;
+	}
 	m_wsValue = NULL;
+	m_nArenaFlags &= ~KV_ARENA_WSTRING;
+}
+
+void KeyValues::SetStringValue( char const *strValue )
+{
+	// delete the old value, make sure we're not storing the WSTRING  - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1524,8 +1596,7 @@ void KeyValues::SetStringValue( char const *strValue )
 
 	// allocate memory for the new value and copy it in
 	int len = Q_strlen( strValue );
-	m_sValue = new char[len + 1];
-	Q_memcpy( m_sValue, strValue, len+1 );
+	Q_memcpy( AllocateValueBlock( len + 1 ), strValue, len+1 );
 
 	m_iDataType = TYPE_STRING;
 }
@@ -1544,11 +1615,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, make sure we're not storing the WSTRING  - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1558,8 +1626,7 @@ void KeyValues::SetString( const char *keyName, const char *value )
 
 		// allocate memory for the new value and copy it in
 		int len = Q_strlen( value );
-		dat->m_sValue = new char[len + 1];
-		Q_memcpy( dat->m_sValue, value, len+1 );
+		Q_memcpy( dat->AllocateValueBlock( len + 1 ), value, len+1 );
 
 		dat->m_iDataType = TYPE_STRING;
 	}
@@ -1573,11 +1640,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, make sure we're not storing the STRING  - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1587,8 +1651,7 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 
 		// allocate memory for the new value and copy it in
 		int len = wcslen( value );
-		dat->m_wsValue = new wchar_t[len + 1];
-		Q_memcpy( dat->m_wsValue, value, (len+1) * sizeof(wchar_t) );
+		Q_memcpy( dat->AllocateWValueBlock( len + 1 ), value, (len+1) * sizeof(wchar_t) );
 
 		dat->m_iDataType = TYPE_WSTRING;
 	}
@@ -1617,14 +1680,10 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, make sure we're not storing the WSTRING  - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
-		dat->m_sValue = new char[sizeof(uint64)];
-		*((uint64 *)dat->m_sValue) = value;
+		*((uint64 *)dat->AllocateValueBlock( sizeof(uint64) )) = value;
 		dat->m_iDataType = TYPE_UINT64;
 	}
 }
@@ -1680,8 +1739,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 			if( src.m_sValue )
 			{
 				int len = Q_strlen(src.m_sValue) + 1;
-				m_sValue = new char[len];
-				Q_strncpy( m_sValue, src.m_sValue, len );
+				Q_strncpy( AllocateValueBlock( len ), src.m_sValue, len );
 			}
 			break;
 		case TYPE_INT:
@@ -1689,8 +1747,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 				m_iValue = src.m_iValue;
 				Q_snprintf( buf,sizeof(buf), "%d", m_iValue );
 				int len = Q_strlen(buf) + 1;
-				m_sValue = new char[len];
-				Q_strncpy( m_sValue, buf, len  );
+				Q_strncpy( AllocateValueBlock( len ), buf, len  );
 			}
 			break;
 		case TYPE_FLOAT:
@@ -1698,8 +1755,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 				m_flValue = src.m_flValue;
 				Q_snprintf( buf,sizeof(buf), "%f", m_flValue );
 				int len = Q_strlen(buf) + 1;
-				m_sValue = new char[len];
-				Q_strncpy( m_sValue, buf, len );
+				Q_strncpy( AllocateValueBlock( len ), buf, len );
 			}
 			break;
 		case TYPE_PTR:
@@ -1709,8 +1765,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 			break;
 		case TYPE_UINT64:
 			{
-				m_sValue = new char[sizeof(uint64)];
-				Q_memcpy( m_sValue, src.m_sValue, sizeof(uint64) );
+				Q_memcpy( AllocateValueBlock( sizeof(uint64) ), src.m_sValue, sizeof(uint64) );
 			}
 			break;
 		case TYPE_COLOR:
@@ -1769,7 +1824,12 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 KeyValues& KeyValues::operator=( KeyValues& src )
 {
 	RemoveEverything();
-	Init();	// reset all values
+
+	// reset all values, but an arena node stays one
+	char nArenaFlags = m_nArenaFlags & KV_ARENA_NODE;
+	Init();
+	m_nArenaFlags = nArenaFlags;
+
 	RecursiveCopyKeyValues( src );
 	return *this;
 }
@@ -1823,8 +1883,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 			{
 				int len = Q_strlen( m_sValue );
 				Assert( !newKeyValue->m_sValue );
-				newKeyValue->m_sValue = new char[len + 1];
-				Q_memcpy( newKeyValue->m_sValue, m_sValue, len+1 );
+				Q_memcpy( newKeyValue->AllocateValueBlock( len + 1 ), m_sValue, len+1 );
 			}
 		}
 		break;
@@ -1833,8 +1892,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 			if ( m_wsValue )
 			{
 				int len = wcslen( m_wsValue );
-				newKeyValue->m_wsValue = new wchar_t[len+1];
-				Q_memcpy( newKeyValue->m_wsValue, m_wsValue, (len+1)*sizeof(wchar_t));
+				Q_memcpy( newKeyValue->AllocateWValueBlock( len+1 ), m_wsValue, (len+1)*sizeof(wchar_t));
 			}
 		}
 		break;
@@ -1859,8 +1917,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 		break;
 
 	case TYPE_UINT64:
-		newKeyValue->m_sValue = new char[sizeof(uint64)];
-		Q_memcpy( newKeyValue->m_sValue, m_sValue, sizeof(uint64) );
+		Q_memcpy( newKeyValue->AllocateValueBlock( sizeof(uint64) ), m_sValue, sizeof(uint64) );
 		break;
 	};
 
@@ -1890,7 +1947,10 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -1912,6 +1972,13 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	if ( m_nArenaFlags & KV_ARENA_NODE )
+	{
+		// Free anything that was heap allocated, the arena owns the node itself
+		this->~KeyValues();
+		return;
+	}
+
 	delete this;
 }
 
@@ -2332,11 +2399,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeStringValue();
 
 			int len = Q_strlen( value );
 
@@ -2376,8 +2439,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 							digit -= 'A' - ( '9' + 1 );
 					retVal = ( retVal * 16 ) + ( digit - '0' );
 				}
-				dat->m_sValue = new char[sizeof(uint64)];
-				*((uint64 *)dat->m_sValue) = retVal;
+				*((uint64 *)dat->AllocateValueBlock( sizeof(uint64) )) = retVal;
 				dat->m_iDataType = TYPE_UINT64;
 			}
 			else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
@@ -2398,8 +2460,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
-				dat->m_sValue = new char[len+1];
-				Q_memcpy( dat->m_sValue, value, len+1 );
+				Q_memcpy( dat->AllocateValueBlock( len+1 ), value, len+1 );
 			}
 
 			// Look ahead one token for a conditional tag
@@ -2540,7 +2601,11 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		return false;
 
 	RemoveEverything(); // remove current content
-	Init();	// reset
+
+	// reset, but an arena node stays one
+	char nArenaFlags = m_nArenaFlags & KV_ARENA_NODE;
+	Init();
+	m_nArenaFlags = nArenaFlags;
 
 	if ( nStackDepth > 100 )
 	{
@@ -2581,8 +2646,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 				token[KEYVALUES_TOKEN_SIZE-1] = 0;
 
 				int len = Q_strlen( token );
-				dat->m_sValue = new char[len + 1];
-				Q_memcpy( dat->m_sValue, token, len+1 );
+				Q_memcpy( dat->AllocateValueBlock( len + 1 ), token, len+1 );
 
 				break;
 			}
@@ -2600,8 +2664,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 
 		case TYPE_UINT64:
 			{
-				dat->m_sValue = new char[sizeof(uint64)];
-				*((uint64 *)dat->m_sValue) = buffer.GetInt64();
+				*((uint64 *)dat->AllocateValueBlock( sizeof(uint64) )) = buffer.GetInt64();
 				break;
 			}
 
@@ -2650,12 +2713,28 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 //-----------------------------------------------------------------------------
 void *KeyValues::operator new( size_t iAllocSize )
 {
+	CKeyValuesArena *pArena = s_pCurrentArena;
+	if ( pArena )
+	{
+		KeyValues *pNode = (KeyValues *)pArena->Alloc( iAllocSize );
+		s_pNewArenaNode = pNode;
+		return pNode;
+	}
+
 	MEM_ALLOC_CREDIT();
 	return KeyValuesSystem()->AllocKeyValuesMemory(iAllocSize);
 }
 
 void *KeyValues::operator new( size_t iAllocSize, int nBlockUse, const char *pFileName, int nLine )
 {
+	CKeyValuesArena *pArena = s_pCurrentArena;
+	if ( pArena )
+	{
+		KeyValues *pNode = (KeyValues *)pArena->Alloc( iAllocSize );
+		s_pNewArenaNode = pNode;
+		return pNode;
+	}
+
 	MemAlloc_PushAllocDbgInfo( pFileName, nLine );
 	void *p = KeyValuesSystem()->AllocKeyValuesMemory(iAllocSize);
 	MemAlloc_PopAllocDbgInfo();
@@ -3031,3 +3110,85 @@ bool CKeyValuesDumpContextAsDevMsg::KvWriteText( char const *szText )
 	}
 	return true;
 }
+
+
+//-----------------------------------------------------------------------------
+// CKeyValuesArena
+//-----------------------------------------------------------------------------
+#define KEYVALUES_ARENA_ALIGNMENT	8
+
+CKeyValuesArena::CKeyValuesArena( int nBlockSize ) :
+	m_pBlocks( NULL ),
+	m_nBlockSize( nBlockSize ),
+	m_nAllocations( 0 ),
+	m_nBytesAllocated( 0 ),
+	m_nBytesReserved( 0 )
+{
+}
+
+CKeyValuesArena::~CKeyValuesArena()
+{
+	FreeAll();
+}
+
+void *CKeyValuesArena::Alloc( int nSize )
+{
+	const int nHeaderSize = AlignValue( (int)sizeof( Block_t ), KEYVALUES_ARENA_ALIGNMENT );
+	nSize = AlignValue( nSize, KEYVALUES_ARENA_ALIGNMENT );
+
+	Block_t *pBlock = m_pBlocks;
+	if ( !pBlock || pBlock->m_nUsed + nSize > pBlock->m_nSize )
+	{
+		// Start a new block. Anything bigger than a block gets one to itself.
+		int nBlockSize = MAX( m_nBlockSize, nHeaderSize + nSize );
+		pBlock = (Block_t *)malloc( nBlockSize );
+		pBlock->m_pNext = m_pBlocks;
+		pBlock->m_nSize = nBlockSize;
+		pBlock->m_nUsed = nHeaderSize;
+		m_pBlocks = pBlock;
+		m_nBytesReserved += nBlockSize;
+	}
+
+	void *pMem = (byte *)pBlock + pBlock->m_nUsed;
+	pBlock->m_nUsed += nSize;
+
+	m_nAllocations++;
+	m_nBytesAllocated += nSize;
+	return pMem;
+}
+
+void CKeyValuesArena::FreeAll()
+{
+	Assert( s_pCurrentArena != this );
+
+	while ( m_pBlocks )
+	{
+		Block_t *pNext = m_pBlocks->m_pNext;
+		free( m_pBlocks );
+		m_pBlocks = pNext;
+	}
+
+	m_nAllocations = 0;
+	m_nBytesAllocated = 0;
+	m_nBytesReserved = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CKeyValuesArenaScope
+//-----------------------------------------------------------------------------
+CKeyValuesArenaScope::CKeyValuesArenaScope( CKeyValuesArena *pArena )
+{
+	m_pPrevious = s_pCurrentArena;
+	s_pCurrentArena = pArena;
+}
+
+CKeyValuesArenaScope::~CKeyValuesArenaScope()
+{
+	s_pCurrentArena = m_pPrevious;
+}
+
+CKeyValuesArena *CKeyValuesArenaScope::GetCurrent()
+{
+	return s_pCurrentArena;
+}
@@ -0,0 +1,703 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compiled, read-only KeyValues and their on-disk cache.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#if defined( _WIN32 ) && !defined( _X360 )
+#include <windows.h>
+#elif defined( POSIX )
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "kvcompiled.h"
+#include "filesystem.h"
+#include "generichash.h"
+#include "utlbuffer.h"
+#include "utlsymbol.h"
+#include "tier0/dbg.h"
+#include "tier0/icommandline.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+//-----------------------------------------------------------------------------
+// CKeyValuesView
+//-----------------------------------------------------------------------------
+inline const char *CKeyValuesView::StringAt( uint32 nOffset ) const
+{
+	const CompiledKeyValuesHeader_t *pHeader = Header();
+	return (const char *)pHeader + pHeader->m_nStringOffset + nOffset;
+}
+
+const char *CKeyValuesView::GetName() const
+{
+	return StringAt( m_nName );
+}
+
+const CKeyValuesView *CKeyValuesView::FindKey( const char *keyName ) const
+{
+	// return the current key if a NULL subkey is asked for
+	if ( !keyName || !keyName[0] )
+		return this;
+
+	// look for '/' characters deliminating sub fields
+	char szBuf[256];
+	const char *subStr = strchr( keyName, '/' );
+	const char *searchStr = keyName;
+
+	// pull out the substring if it exists
+	if ( subStr )
+	{
+		int size = MIN( (int)( subStr - keyName ), (int)sizeof( szBuf ) - 1 );
+		Q_memcpy( szBuf, keyName, size );
+		szBuf[size] = 0;
+		searchStr = szBuf;
+	}
+
+	uint32 nHash = HashStringCaseless( searchStr );
+	const CKeyValuesView *dat;
+	for ( dat = GetFirstSubKey(); dat != NULL; dat = dat->GetNextKey() )
+	{
+		if ( dat->m_nNameHash == nHash && !Q_stricmp( dat->GetName(), searchStr ) )
+			break;
+	}
+
+	if ( dat && subStr )
+	{
+		return dat->FindKey( subStr + 1 );
+	}
+
+	return dat;
+}
+
+const CKeyValuesView *CKeyValuesView::GetFirstTrueSubKey() const
+{
+	const CKeyValuesView *pRet = GetFirstSubKey();
+	while ( pRet && pRet->m_iDataType != KeyValues::TYPE_NONE )
+		pRet = pRet->GetNextKey();
+
+	return pRet;
+}
+
+const CKeyValuesView *CKeyValuesView::GetNextTrueSubKey() const
+{
+	const CKeyValuesView *pRet = GetNextKey();
+	while ( pRet && pRet->m_iDataType != KeyValues::TYPE_NONE )
+		pRet = pRet->GetNextKey();
+
+	return pRet;
+}
+
+const CKeyValuesView *CKeyValuesView::GetFirstValue() const
+{
+	const CKeyValuesView *pRet = GetFirstSubKey();
+	while ( pRet && pRet->m_iDataType == KeyValues::TYPE_NONE )
+		pRet = pRet->GetNextKey();
+
+	return pRet;
+}
+
+const CKeyValuesView *CKeyValuesView::GetNextValue() const
+{
+	const CKeyValuesView *pRet = GetNextKey();
+	while ( pRet && pRet->m_iDataType == KeyValues::TYPE_NONE )
+		pRet = pRet->GetNextKey();
+
+	return pRet;
+}
+
+int CKeyValuesView::GetInt( const char *keyName, int defaultValue ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return dat ? dat->m_iValue : defaultValue;
+}
+
+uint64 CKeyValuesView::GetUint64( const char *keyName, uint64 defaultValue ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return dat ? ( (uint64)dat->m_nUint64[1] << 32 ) | dat->m_nUint64[0] : defaultValue;
+}
+
+float CKeyValuesView::GetFloat( const char *keyName, float defaultValue ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return dat ? dat->m_flValue : defaultValue;
+}
+
+const char *CKeyValuesView::GetString( const char *keyName, const char *defaultValue ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	if ( !dat )
+		return defaultValue;
+
+	switch ( dat->m_iDataType )
+	{
+	case KeyValues::TYPE_STRING:
+	case KeyValues::TYPE_INT:
+	case KeyValues::TYPE_FLOAT:
+	case KeyValues::TYPE_UINT64:
+		return dat->StringAt( dat->m_nString );
+	default:
+		return defaultValue;
+	}
+}
+
+bool CKeyValuesView::GetBool( const char *keyName, bool defaultValue ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return dat ? dat->m_iValue != 0 : defaultValue;
+}
+
+Color CKeyValuesView::GetColor( const char *keyName ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	if ( !dat )
+		return Color( 0, 0, 0, 0 );
+
+	return Color( dat->m_Color[0], dat->m_Color[1], dat->m_Color[2], dat->m_Color[3] );
+}
+
+bool CKeyValuesView::IsEmpty( const char *keyName ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return !dat || ( dat->m_iDataType == KeyValues::TYPE_NONE && !dat->m_nSub );
+}
+
+KeyValues::types_t CKeyValuesView::GetDataType( const char *keyName ) const
+{
+	const CKeyValuesView *dat = FindKey( keyName );
+	return dat ? (KeyValues::types_t)dat->m_iDataType : KeyValues::TYPE_NONE;
+}
+
+
+//-----------------------------------------------------------------------------
+// Compiling. Siblings are laid out next to each other, and every node comes
+// after its parent and its previous sibling, which is what ValidateImage
+// relies on to rule out loops.
+//-----------------------------------------------------------------------------
+class CKeyValuesCompiler
+{
+public:
+	CKeyValuesCompiler() : m_StringSymbols( 0, 32, false ) {}
+
+	bool AddKeys( KeyValues *pFirst, int *pFirstIndex );
+
+	CUtlVector<CKeyValuesView> m_Nodes;
+	CUtlBuffer m_Strings;
+
+private:
+	uint32 AddString( const char *pString );
+	bool SetValue( KeyValues *pKV, CKeyValuesView &node );
+
+	CUtlSymbolTable m_StringSymbols;
+	CUtlVector<uint32> m_StringOffsets;
+};
+
+uint32 CKeyValuesCompiler::AddString( const char *pString )
+{
+	if ( !pString[0] )
+		return 0;
+
+	CUtlSymbol sym = m_StringSymbols.Find( pString );
+	if ( sym.IsValid() )
+		return m_StringOffsets[sym];
+
+	// Past what a symbol table holds the remaining strings just aren't shared.
+	uint32 nOffset = m_Strings.TellPut();
+	m_Strings.PutString( pString );
+	if ( m_StringOffsets.Count() < UTL_INVAL_SYMBOL - 1 )
+	{
+		m_StringSymbols.AddString( pString );
+		m_StringOffsets.AddToTail( nOffset );
+	}
+	return nOffset;
+}
+
+// Works out up front what each of the KeyValues getters would return.
+bool CKeyValuesCompiler::SetValue( KeyValues *pKV, CKeyValuesView &node )
+{
+	char buf[64];
+	const char *pString = NULL;
+	int64 nValue64 = 0;
+
+	node.m_iDataType = pKV->GetDataType();
+	switch ( node.m_iDataType )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+
+	case KeyValues::TYPE_WSTRING:
+		// keep the UTF-8 conversion GetString would make
+		node.m_iDataType = KeyValues::TYPE_STRING;
+		// fall through
+	case KeyValues::TYPE_STRING:
+		{
+			pString = pKV->GetString();
+			node.m_iValue = atoi( pString );
+			node.m_flValue = (float)atof( pString );
+			nValue64 = Q_atoi64( pString );
+
+			float a = 0.0f, b = 0.0f, c = 0.0f, d = 0.0f;
+			sscanf( pString, "%f %f %f %f", &a, &b, &c, &d );
+			node.m_Color[0] = (unsigned char)a;
+			node.m_Color[1] = (unsigned char)b;
+			node.m_Color[2] = (unsigned char)c;
+			node.m_Color[3] = (unsigned char)d;
+		}
+		break;
+
+	case KeyValues::TYPE_INT:
+		node.m_iValue = pKV->GetInt();
+		node.m_flValue = (float)node.m_iValue;
+		nValue64 = node.m_iValue;
+		node.m_Color[0] = (unsigned char)node.m_iValue;
+		Q_snprintf( buf, sizeof( buf ), "%d", node.m_iValue );
+		pString = buf;
+		break;
+
+	case KeyValues::TYPE_FLOAT:
+		node.m_flValue = pKV->GetFloat();
+		node.m_iValue = (int)node.m_flValue;
+		nValue64 = node.m_iValue;
+		node.m_Color[0] = (unsigned char)node.m_iValue;
+		Q_snprintf( buf, sizeof( buf ), "%f", node.m_flValue );
+		pString = buf;
+		break;
+
+	case KeyValues::TYPE_UINT64:
+		nValue64 = (int64)pKV->GetUint64();
+		node.m_flValue = (float)(uint64)nValue64;
+		Q_snprintf( buf, sizeof( buf ), "%lld", nValue64 );
+		pString = buf;
+		break;
+
+	case KeyValues::TYPE_COLOR:
+		{
+			Color color = pKV->GetColor();
+			for ( int i = 0; i < 4; i++ )
+			{
+				node.m_Color[i] = color[i];
+			}
+			node.m_iValue = color.GetRawColor();
+			nValue64 = node.m_iValue;
+		}
+		break;
+
+	default:
+		// pointers don't mean anything once they're written out
+		Warning( "CCompiledKeyValues: key \"%s\" has a value type (%d) that can't be compiled\n", pKV->GetName(), node.m_iDataType );
+		return false;
+	}
+
+	node.m_nUint64[0] = (uint32)( (uint64)nValue64 & 0xFFFFFFFF );
+	node.m_nUint64[1] = (uint32)( (uint64)nValue64 >> 32 );
+	if ( pString )
+	{
+		node.m_nString = AddString( pString );
+	}
+	return true;
+}
+
+bool CKeyValuesCompiler::AddKeys( KeyValues *pFirst, int *pFirstIndex )
+{
+	int nFirst = m_Nodes.Count();
+	*pFirstIndex = nFirst;
+
+	for ( KeyValues *dat = pFirst; dat != NULL; dat = dat->GetNextKey() )
+	{
+		int i = m_Nodes.AddToTail();
+		CKeyValuesView &node = m_Nodes[i];
+		Q_memset( &node, 0, sizeof( node ) );
+
+		node.m_nName = AddString( dat->GetName() );
+		node.m_nNameHash = HashStringCaseless( dat->GetName() );
+		if ( !SetValue( dat, node ) )
+			return false;
+
+		if ( dat->GetNextKey() )
+		{
+			node.m_nPeer = i + 1;
+		}
+	}
+
+	int i = nFirst;
+	for ( KeyValues *dat = pFirst; dat != NULL; dat = dat->GetNextKey(), i++ )
+	{
+		if ( dat->GetFirstSubKey() )
+		{
+			int nSub;
+			if ( !AddKeys( dat->GetFirstSubKey(), &nSub ) )
+				return false;
+
+			m_Nodes[i].m_nSub = nSub;
+		}
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// CCompiledKeyValues
+//-----------------------------------------------------------------------------
+CCompiledKeyValues::CCompiledKeyValues() :
+	m_pImage( NULL ), m_nImageSize( 0 ), m_bMapped( false )
+{
+#ifdef _WIN32
+	m_hMapping = NULL;
+#endif
+}
+
+CCompiledKeyValues::~CCompiledKeyValues()
+{
+	Unload();
+}
+
+bool CCompiledKeyValues::IsDiskCacheEnabled()
+{
+#ifdef VALVE_BIG_ENDIAN
+	// the cache files are little-endian
+	return false;
+#else
+	return !CommandLine()->FindParm( "-nokvcache" );
+#endif
+}
+
+uint32 CCompiledKeyValues::GetBuildFlags( bool bUsesEscapeSequences )
+{
+	uint32 nFlags = bUsesEscapeSequences ? COMPILED_KV_ESCAPE_SEQUENCES : 0;
+#if defined( _X360 )
+	nFlags |= COMPILED_KV_PLATFORM_X360;
+#elif defined( _WIN32 )
+	nFlags |= COMPILED_KV_PLATFORM_WIN32;
+#elif defined( OSX )
+	nFlags |= COMPILED_KV_PLATFORM_OSX;
+#elif defined( LINUX )
+	nFlags |= COMPILED_KV_PLATFORM_LINUX;
+#endif
+	return nFlags;
+}
+
+bool CCompiledKeyValues::Compile( KeyValues *pKV, CRC32_t nSourceCRC, uint32 nSourceSize, uint32 nBuildFlags, CUtlBuffer &buf )
+{
+	CKeyValuesCompiler compiler;
+
+	// node 0 is the root, so index 0 can mean "none" for children and peers
+	compiler.m_Strings.PutChar( 0 );
+	int nRoot;
+	if ( !pKV || !compiler.AddKeys( pKV, &nRoot ) )
+		return false;
+
+	CompiledKeyValuesHeader_t header;
+	header.m_nId = COMPILED_KV_ID;
+	header.m_nVersion = COMPILED_KV_VERSION;
+	header.m_nSourceCRC = nSourceCRC;
+	header.m_nSourceSize = nSourceSize;
+	header.m_nBuildFlags = nBuildFlags;
+	header.m_nNodeCount = compiler.m_Nodes.Count();
+	header.m_nNodeOffset = sizeof( header );
+	header.m_nStringOffset = header.m_nNodeOffset + header.m_nNodeCount * sizeof( CKeyValuesView );
+	header.m_nStringSize = compiler.m_Strings.TellPut();
+	header.m_nTotalSize = header.m_nStringOffset + header.m_nStringSize;
+
+	for ( int i = 0; i < compiler.m_Nodes.Count(); i++ )
+	{
+		compiler.m_Nodes[i].m_nOffset = header.m_nNodeOffset + i * sizeof( CKeyValuesView );
+	}
+
+	buf.Purge();
+	buf.EnsureCapacity( header.m_nTotalSize );
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( compiler.m_Nodes.Base(), compiler.m_Nodes.Count() * sizeof( CKeyValuesView ) );
+	buf.Put( compiler.m_Strings.Base(), compiler.m_Strings.TellPut() );
+	return buf.IsValid();
+}
+
+//-----------------------------------------------------------------------------
+// Checks everything a lookup could trip over, so a truncated or corrupt cache
+// file is rejected rather than followed off the end of the mapping.
+//-----------------------------------------------------------------------------
+bool CCompiledKeyValues::ValidateImage( const void *pImage, uint32 nSize )
+{
+	const CompiledKeyValuesHeader_t *pHeader = (const CompiledKeyValuesHeader_t *)pImage;
+	if ( nSize < sizeof( *pHeader ) ||
+		pHeader->m_nId != COMPILED_KV_ID || pHeader->m_nVersion != COMPILED_KV_VERSION || pHeader->m_nTotalSize != nSize )
+		return false;
+
+	if ( pHeader->m_nNodeCount == 0 || pHeader->m_nNodeOffset % 4 ||
+		pHeader->m_nNodeOffset > nSize || pHeader->m_nNodeCount > ( nSize - pHeader->m_nNodeOffset ) / sizeof( CKeyValuesView ) )
+		return false;
+
+	if ( pHeader->m_nStringSize == 0 || pHeader->m_nStringOffset > nSize || pHeader->m_nStringSize > nSize - pHeader->m_nStringOffset )
+		return false;
+
+	const char *pStrings = (const char *)pImage + pHeader->m_nStringOffset;
+	if ( pStrings[0] || pStrings[pHeader->m_nStringSize - 1] )
+		return false;
+
+	const CKeyValuesView *pNodes = (const CKeyValuesView *)( (const byte *)pImage + pHeader->m_nNodeOffset );
+	for ( uint32 i = 0; i < pHeader->m_nNodeCount; i++ )
+	{
+		const CKeyValuesView &node = pNodes[i];
+		if ( node.m_nOffset != pHeader->m_nNodeOffset + i * sizeof( CKeyValuesView ) ||
+			node.m_nName >= pHeader->m_nStringSize || node.m_nString >= pHeader->m_nStringSize ||
+			node.m_iDataType >= KeyValues::TYPE_NUMTYPES || node.m_iDataType == KeyValues::TYPE_PTR || node.m_iDataType == KeyValues::TYPE_WSTRING )
+			return false;
+
+		if ( ( node.m_nSub && ( node.m_nSub <= i || node.m_nSub >= pHeader->m_nNodeCount ) ) ||
+			( node.m_nPeer && ( node.m_nPeer <= i || node.m_nPeer >= pHeader->m_nNodeCount ) ) )
+			return false;
+	}
+
+	return true;
+}
+
+bool CCompiledKeyValues::LoadFromBuffer( const CUtlBuffer &buf )
+{
+	Unload();
+
+	uint32 nSize = buf.TellPut();
+	if ( !ValidateImage( buf.Base(), nSize ) )
+		return false;
+
+	byte *pImage = new byte[nSize];
+	Q_memcpy( pImage, buf.Base(), nSize );
+	m_pImage = (const CompiledKeyValuesHeader_t *)pImage;
+	m_nImageSize = nSize;
+	m_bMapped = false;
+	return true;
+}
+
+bool CCompiledKeyValues::MapCacheFile( IFileSystem *pFileSystem, const char *pCacheFile, CRC32_t nSourceCRC, uint32 nSourceSize, uint32 nBuildFlags )
+{
+	char szLocalPath[MAX_PATH];
+	if ( !pFileSystem->RelativePathToFullPath( pCacheFile, "DEFAULT_WRITE_PATH", szLocalPath, sizeof( szLocalPath ), FILTER_CULLPACK ) )
+		return false;
+
+#if defined( _WIN32 ) && !defined( _X360 )
+	HANDLE hFile = CreateFile( szLocalPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD nSize = GetFileSize( hFile, NULL );
+	HANDLE hMapping = NULL;
+	if ( nSize != INVALID_FILE_SIZE && nSize >= sizeof( CompiledKeyValuesHeader_t ) )
+	{
+		hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	}
+	CloseHandle( hFile );
+	if ( !hMapping )
+		return false;
+
+	void *pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( !pView )
+	{
+		CloseHandle( hMapping );
+		return false;
+	}
+	m_hMapping = hMapping;
+#elif defined( POSIX )
+	int fd = open( szLocalPath, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	void *pView = MAP_FAILED;
+	if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( CompiledKeyValuesHeader_t ) && st.st_size < INT_MAX )
+	{
+		pView = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	}
+	close( fd );
+	if ( pView == MAP_FAILED )
+		return false;
+
+	uint32 nSize = (uint32)st.st_size;
+#else
+	return false;
+#endif
+
+	m_pImage = (const CompiledKeyValuesHeader_t *)pView;
+	m_nImageSize = nSize;
+	m_bMapped = true;
+
+	if ( !ValidateImage( m_pImage, m_nImageSize ) ||
+		m_pImage->m_nSourceCRC != nSourceCRC || m_pImage->m_nSourceSize != nSourceSize || m_pImage->m_nBuildFlags != nBuildFlags )
+	{
+		Unload();
+		return false;
+	}
+
+	return true;
+}
+
+void CCompiledKeyValues::Unload()
+{
+	if ( !m_pImage )
+		return;
+
+	if ( m_bMapped )
+	{
+#if defined( _WIN32 ) && !defined( _X360 )
+		UnmapViewOfFile( m_pImage );
+		CloseHandle( m_hMapping );
+		m_hMapping = NULL;
+#elif defined( POSIX )
+		munmap( (void *)m_pImage, m_nImageSize );
+#endif
+	}
+	else
+	{
+		delete [] (byte *)m_pImage;
+	}
+
+	m_pImage = NULL;
+	m_nImageSize = 0;
+	m_bMapped = false;
+}
+
+const CKeyValuesView *CCompiledKeyValues::GetRoot() const
+{
+	if ( !m_pImage )
+		return NULL;
+
+	return (const CKeyValuesView *)( (const byte *)m_pImage + m_pImage->m_nNodeOffset );
+}
+
+bool CCompiledKeyValues::LoadFromFile( IFileSystem *pFileSystem, const char *resourceName, const char *pathID, bool bUsesEscapeSequences )
+{
+	Assert( pFileSystem );
+	Unload();
+
+	CUtlBuffer text;
+	if ( !pFileSystem->ReadFile( resourceName, pathID, text ) )
+		return false;
+
+	uint32 nSourceSize = text.TellPut();
+	CRC32_t nSourceCRC = CRC32_ProcessSingleBuffer( text.Base(), nSourceSize );
+	uint32 nBuildFlags = GetBuildFlags( bUsesEscapeSequences );
+
+	// null terminate as EOF, and again in case this is a unicode file
+	text.PutChar( 0 );
+	text.PutChar( 0 );
+	const char *pText = (const char *)text.Base();
+
+	char szCacheFile[MAX_PATH];
+	bool bDiskCache = IsDiskCacheEnabled() && !V_IsAbsolutePath( resourceName ) && !V_strstr( resourceName, ".." );
+	if ( bDiskCache )
+	{
+		Q_snprintf( szCacheFile, sizeof( szCacheFile ), "%s/%s%s", COMPILED_KV_CACHE_DIR, resourceName, COMPILED_KV_CACHE_EXTENSION );
+		Q_FixSlashes( szCacheFile );
+
+		if ( MapCacheFile( pFileSystem, szCacheFile, nSourceCRC, nSourceSize, nBuildFlags ) )
+			return true;
+	}
+
+	// No usable cache, so parse the text the way KeyValues::LoadFromFile does
+	KeyValues *pKV = new KeyValues( resourceName );
+	pKV->UsesEscapeSequences( bUsesEscapeSequences );
+	bool bRetOK = pKV->LoadFromBuffer( resourceName, pText, pFileSystem );
+
+	CUtlBuffer image;
+	if ( bRetOK )
+	{
+		bRetOK = Compile( pKV, nSourceCRC, nSourceSize, nBuildFlags, image );
+	}
+	pKV->deleteThis();
+
+	if ( !bRetOK )
+		return false;
+
+	bool bUnicode = nSourceSize >= 2 && (uint8)pText[0] == 0xFF && (uint8)pText[1] == 0xFE;
+	if ( bDiskCache && !bUnicode && !Q_stristr( pText, "#include" ) && !Q_stristr( pText, "#base" ) )
+	{
+		// Write beside the old file and swap it in, so anything that still has
+		// the old one mapped keeps its pages.
+		char szDir[MAX_PATH], szTempFile[MAX_PATH];
+		Q_ExtractFilePath( szCacheFile, szDir, sizeof( szDir ) );
+		Q_snprintf( szTempFile, sizeof( szTempFile ), "%s.tmp", szCacheFile );
+
+		pFileSystem->CreateDirHierarchy( szDir, "DEFAULT_WRITE_PATH" );
+		if ( pFileSystem->WriteFile( szTempFile, "DEFAULT_WRITE_PATH", image ) )
+		{
+			pFileSystem->RemoveFile( szCacheFile, "DEFAULT_WRITE_PATH" );
+			if ( !pFileSystem->RenameFile( szTempFile, szCacheFile, "DEFAULT_WRITE_PATH" ) )
+			{
+				pFileSystem->RemoveFile( szTempFile, "DEFAULT_WRITE_PATH" );
+			}
+		}
+	}
+
+	return LoadFromBuffer( image );
+}
+
+
+//-----------------------------------------------------------------------------
+// Converting back to KeyValues
+//-----------------------------------------------------------------------------
+static KeyValues *MakeKey( const CKeyValuesView *pNode, bool bUsesEscapeSequences )
+{
+	KeyValues *pKV = new KeyValues( pNode->GetName() );
+	pKV->UsesEscapeSequences( bUsesEscapeSequences );
+
+	switch ( pNode->GetDataType() )
+	{
+	case KeyValues::TYPE_STRING:
+		pKV->SetStringValue( pNode->GetString() );
+		break;
+	case KeyValues::TYPE_INT:
+		pKV->SetInt( NULL, pNode->GetInt() );
+		break;
+	case KeyValues::TYPE_FLOAT:
+		pKV->SetFloat( NULL, pNode->GetFloat() );
+		break;
+	case KeyValues::TYPE_UINT64:
+		pKV->SetUint64( NULL, pNode->GetUint64() );
+		break;
+	case KeyValues::TYPE_COLOR:
+		pKV->SetColor( NULL, pNode->GetColor() );
+		break;
+	default:
+		break;
+	}
+
+	// AddSubKey walks the list, so link the rest of the children up directly
+	KeyValues *pLastChild = NULL;
+	for ( const CKeyValuesView *pSub = pNode->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+	{
+		KeyValues *pChild = MakeKey( pSub, bUsesEscapeSequences );
+		if ( pLastChild )
+		{
+			pLastChild->SetNextKey( pChild );
+		}
+		else
+		{
+			pKV->AddSubKey( pChild );
+		}
+		pLastChild = pChild;
+	}
+
+	return pKV;
+}
+
+KeyValues *CCompiledKeyValues::MakeKeyValues() const
+{
+	const CKeyValuesView *pRoot = GetRoot();
+	if ( !pRoot )
+		return NULL;
+
+	bool bUsesEscapeSequences = ( m_pImage->m_nBuildFlags & COMPILED_KV_ESCAPE_SEQUENCES ) != 0;
+	KeyValues *pFirst = MakeKey( pRoot, bUsesEscapeSequences );
+	KeyValues *pLast = pFirst;
+	for ( const CKeyValuesView *pPeer = pRoot->GetNextKey(); pPeer; pPeer = pPeer->GetNextKey() )
+	{
+		KeyValues *pKV = MakeKey( pPeer, bUsesEscapeSequences );
+		pLast->SetNextKey( pKV );
+		pLast = pKV;
+	}
+	return pFirst;
+}
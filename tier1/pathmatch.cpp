@@ -53,12 +53,13 @@
 #include <sys/mount.h>
 #include <fcntl.h>
 #include <utime.h>
-#include <map>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <string>
+#include <vector>
 #include <time.h>
-
-// Enable to do pathmatch caching. Beware: this code isn't threadsafe.
-// #define DO_PATHMATCH_CACHE
+#include "tier1/pathmatch.h"
 
 #ifdef UTF8_PATHMATCH
 #define strcasecmp utf8casecmp
@@ -68,6 +69,7 @@ static bool s_bShowDiag;
 #define DEBUG_MSG( ... ) if ( s_bShowDiag ) fprintf( stderr, ##__VA_ARGS__ )
 #define DEBUG_BREAK() __asm__ __volatile__ ( "int $3" )
 #define _COMPILE_TIME_ASSERT(pred) switch(0){case 0:case pred:;}
+#define PATHMATCH_BARRIER() __asm__ __volatile__ ( "" ::: "memory" )
 
 #define WRAP( fn, ret, ... ) \
 	ret __real_##fn(__VA_ARGS__); \
@@ -370,6 +372,461 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// Directory index
+//
+// Every absolute directory Descend looks in gets an index of its entries hashed
+// by case folded name, built on first use and kept until the directory changes.
+// inotify says when that happens; if it isn't available, or the watch limit is
+// hit, the directory's mtime is checked on every lookup instead. Relative
+// directories depend on the cwd, so they are scanned each time as before.
+//
+// Indexes are never modified once published, so lookups don't lock. Building an
+// index and handling inotify events take s_IndexMutex. A replaced index is freed
+// once no lookup is in flight (see EndIndexRead).
+//-----------------------------------------------------------------------------
+
+#define DIR_NODE_BUCKETS	4096
+#define DIR_WATCH_EVENTS	( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+struct DirIndexEntry_t
+{
+	uint32_t m_nHash;
+	uint32_t m_nNext;				// next entry in the bucket + 1, 0 ends the chain
+	uint32_t m_nName;				// offset of the name in m_pNames
+};
+
+struct DirIndex_t
+{
+	DirIndex_t *m_pNextRetired;
+	struct timespec m_MTime;		// of the directory when it was read
+	uint32_t m_nBucketMask;
+	uint32_t *m_pBuckets;			// first entry in each bucket + 1
+	DirIndexEntry_t *m_pEntries;
+	char *m_pNames;
+};
+
+struct DirNode_t
+{
+	DirNode_t *m_pNext;				// next node in the same s_DirNodes bucket
+	DirNode_t *m_pNextSameWatch;	// paths that reach the same directory share a watch
+	DirIndex_t * volatile m_pIndex;	// NULL until read, or after a change
+	volatile int m_nWatch;			// inotify watch, -1 to check the mtime
+	uint32_t m_nHash;
+	char m_Path[1];
+};
+
+static DirNode_t * volatile s_DirNodes[DIR_NODE_BUCKETS];
+// First node for each watch descriptor. Not a std::vector, since files can be opened
+// before static constructors have run.
+static DirNode_t **s_pWatchNodes;
+static int s_nWatchNodes;
+static DirIndex_t *s_pRetiredIndexes;
+static pthread_mutex_t s_IndexMutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int s_nIndexReaders;
+static volatile int s_bHandlingEvents;
+static int s_nInotify = -2;							// -2 until first use, -1 if unavailable
+static PathMatchStats_t s_Stats;
+
+static inline void IncrementStat( unsigned int *pStat )
+{
+	__sync_fetch_and_add( pStat, 1 );
+}
+
+static uint32_t HashDirPath( const char *pPath )
+{
+	uint32_t nHash = 2166136261u;
+	while ( *pPath )
+	{
+		nHash = ( nHash ^ (uint8_t)*pPath++ ) * 16777619u;
+	}
+	return nHash;
+}
+
+// Equal for any two names strcasecmp (or utf8casecmp) calls equal.
+static uint32_t HashFoldedName( const char *pName )
+{
+	uint32_t nHash = 2166136261u;
+	while ( *pName )
+	{
+#ifdef UTF8_PATHMATCH
+		if ( *pName & 0x80 )
+		{
+			const char *pStart = pName;
+			uint32_t fold[3];
+			locate_case_fold_mapping( utf8codepoint( &pName ), fold );
+			if ( pName == pStart )
+			{
+				// bad sequences don't always advance
+				pName++;
+			}
+			for ( int i = 0; i < 3 && fold[i]; i++ )
+			{
+				nHash = ( nHash ^ fold[i] ) * 16777619u;
+			}
+			continue;
+		}
+#endif
+		nHash = ( nHash ^ (uint32_t)tolower( (uint8_t)*pName++ ) ) * 16777619u;
+	}
+	return nHash;
+}
+
+static DirIndex_t *ScanDir( const char *pDir )
+{
+	CDirPtr spDir( __real_opendir( pDir ) );
+	if ( !spDir )
+		return NULL;
+
+	IncrementStat( &s_Stats.m_nDirScans );
+
+	// Take the time before reading, so a change made while we read shows up as newer.
+	struct stat dirStat;
+	if ( fstat( dirfd( spDir ), &dirStat ) != 0 )
+		memset( &dirStat, 0, sizeof( dirStat ) );
+
+	std::string names;
+	std::vector<uint32_t> nameOffsets;
+	while ( struct dirent *pEntry = readdir( spDir ) )
+	{
+		if ( !strcmp( pEntry->d_name, "." ) || !strcmp( pEntry->d_name, ".." ) )
+			continue;
+
+		nameOffsets.push_back( (uint32_t)names.size() );
+		names.append( pEntry->d_name, strlen( pEntry->d_name ) + 1 );
+	}
+
+	uint32_t nEntries = (uint32_t)nameOffsets.size();
+	uint32_t nBuckets = 1;
+	while ( nBuckets < nEntries )
+	{
+		nBuckets <<= 1;
+	}
+
+	// One block: header, buckets, entries, names.
+	size_t nSize = sizeof( DirIndex_t ) + nBuckets * sizeof( uint32_t ) + nEntries * sizeof( DirIndexEntry_t ) + names.size();
+	DirIndex_t *pIndex = (DirIndex_t *)malloc( nSize );
+	if ( !pIndex )
+		return NULL;
+
+	pIndex->m_pNextRetired = NULL;
+	pIndex->m_MTime = dirStat.st_mtim;
+	pIndex->m_nBucketMask = nBuckets - 1;
+	pIndex->m_pBuckets = (uint32_t *)( pIndex + 1 );
+	pIndex->m_pEntries = (DirIndexEntry_t *)( pIndex->m_pBuckets + nBuckets );
+	pIndex->m_pNames = (char *)( pIndex->m_pEntries + nEntries );
+	memset( pIndex->m_pBuckets, 0, nBuckets * sizeof( uint32_t ) );
+	if ( !names.empty() )
+		memcpy( pIndex->m_pNames, names.data(), names.size() );
+
+	for ( uint32_t i = 0; i < nEntries; i++ )
+	{
+		DirIndexEntry_t &entry = pIndex->m_pEntries[i];
+		entry.m_nName = nameOffsets[i];
+		entry.m_nHash = HashFoldedName( pIndex->m_pNames + entry.m_nName );
+
+		uint32_t *pBucket = &pIndex->m_pBuckets[entry.m_nHash & pIndex->m_nBucketMask];
+		entry.m_nNext = *pBucket;
+		*pBucket = i + 1;
+	}
+
+	return pIndex;
+}
+
+static bool IsDirUnchanged( const char *pDir, const DirIndex_t *pIndex )
+{
+	struct stat dirStat;
+	if ( fstatat( AT_FDCWD, pDir, &dirStat, 0 ) != 0 )
+		return false;
+
+	return dirStat.st_mtim.tv_sec == pIndex->m_MTime.tv_sec && dirStat.st_mtim.tv_nsec == pIndex->m_MTime.tv_nsec;
+}
+
+static DirNode_t *FindDirNode( const char *pDir, uint32_t nHash )
+{
+	DirNode_t *pNode = s_DirNodes[nHash % DIR_NODE_BUCKETS];
+	PATHMATCH_BARRIER();
+	for ( ; pNode; pNode = pNode->m_pNext )
+	{
+		if ( pNode->m_nHash == nHash && !strcmp( pNode->m_Path, pDir ) )
+			return pNode;
+	}
+	return NULL;
+}
+
+// s_IndexMutex must be held.
+static void RetireDirIndex( DirNode_t *pNode )
+{
+	DirIndex_t *pIndex = pNode->m_pIndex;
+	if ( pIndex )
+	{
+		pNode->m_pIndex = NULL;
+		pIndex->m_pNextRetired = s_pRetiredIndexes;
+		s_pRetiredIndexes = pIndex;
+		IncrementStat( &s_Stats.m_nInvalidations );
+	}
+}
+
+// s_IndexMutex must be held.
+static void ForgetWatch( int nWatch )
+{
+	if ( nWatch < 0 || nWatch >= s_nWatchNodes )
+		return;
+
+	for ( DirNode_t *pNode = s_pWatchNodes[nWatch]; pNode; )
+	{
+		DirNode_t *pNext = pNode->m_pNextSameWatch;
+		RetireDirIndex( pNode );
+		pNode->m_nWatch = -1;
+		pNode->m_pNextSameWatch = NULL;
+		pNode = pNext;
+	}
+	s_pWatchNodes[nWatch] = NULL;
+}
+
+// s_IndexMutex must be held.
+static void AddWatch( DirNode_t *pNode )
+{
+	if ( s_nInotify == -2 )
+	{
+		s_nInotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		if ( s_nInotify < 0 )
+		{
+			DEBUG_MSG( "inotify unavailable (%d), checking directory times instead\n", errno );
+		}
+	}
+	if ( s_nInotify < 0 )
+		return;
+
+	int nWatch = inotify_add_watch( s_nInotify, pNode->m_Path, DIR_WATCH_EVENTS );
+	if ( nWatch < 0 )
+	{
+		DEBUG_MSG( "inotify_add_watch( %s ) failed (%d), checking its time instead\n", pNode->m_Path, errno );
+		return;
+	}
+
+	if ( nWatch >= s_nWatchNodes )
+	{
+		int nCount = ( nWatch + 64 ) & ~63;
+		DirNode_t **pWatchNodes = (DirNode_t **)realloc( s_pWatchNodes, nCount * sizeof( DirNode_t * ) );
+		if ( !pWatchNodes )
+		{
+			inotify_rm_watch( s_nInotify, nWatch );
+			return;
+		}
+		memset( pWatchNodes + s_nWatchNodes, 0, ( nCount - s_nWatchNodes ) * sizeof( DirNode_t * ) );
+		s_pWatchNodes = pWatchNodes;
+		s_nWatchNodes = nCount;
+	}
+
+	// Another path may already reach this directory through a link.
+	pNode->m_pNextSameWatch = s_pWatchNodes[nWatch];
+	s_pWatchNodes[nWatch] = pNode;
+	pNode->m_nWatch = nWatch;
+}
+
+// Applies any directory changes inotify has queued up. Called before each Descend so a
+// file created by one thread is found by the next lookup on any thread.
+static void HandleDirEvents()
+{
+	if ( s_nInotify < 0 )
+		return;
+
+	int nPending = 0;
+	if ( ioctl( s_nInotify, FIONREAD, &nPending ) != 0 )
+		nPending = 0;
+	__sync_synchronize();
+	if ( nPending <= 0 && !s_bHandlingEvents )
+		return;
+
+	// Either there are events or another thread is applying them; both mean waiting on it.
+	pthread_mutex_lock( &s_IndexMutex );
+	s_bHandlingEvents = 1;
+	__sync_synchronize();
+
+	char buf[ 4096 ] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t nRead;
+	while ( ( nRead = read( s_nInotify, buf, sizeof( buf ) ) ) > 0 )
+	{
+		for ( char *p = buf; p < buf + nRead; )
+		{
+			const struct inotify_event *pEvent = (const struct inotify_event *)p;
+			p += sizeof( struct inotify_event ) + pEvent->len;
+
+			if ( pEvent->mask & IN_Q_OVERFLOW )
+			{
+				// Lost track of what changed, so everything has to be read again.
+				DEBUG_MSG( "inotify queue overflowed, dropping all directory indexes\n" );
+				for ( int i = 0; i < DIR_NODE_BUCKETS; i++ )
+				{
+					for ( DirNode_t *pNode = s_DirNodes[i]; pNode; pNode = pNode->m_pNext )
+					{
+						RetireDirIndex( pNode );
+					}
+				}
+				continue;
+			}
+
+			if ( pEvent->wd < 0 || pEvent->wd >= s_nWatchNodes )
+				continue;
+
+			if ( pEvent->mask & ( IN_IGNORED | IN_MOVE_SELF ) )
+			{
+				// The watch is gone, or the path now leads somewhere else.
+				if ( pEvent->mask & IN_MOVE_SELF )
+					inotify_rm_watch( s_nInotify, pEvent->wd );
+				ForgetWatch( pEvent->wd );
+				continue;
+			}
+
+			for ( DirNode_t *pNode = s_pWatchNodes[pEvent->wd]; pNode; pNode = pNode->m_pNextSameWatch )
+			{
+				RetireDirIndex( pNode );
+			}
+		}
+	}
+
+	s_bHandlingEvents = 0;
+	pthread_mutex_unlock( &s_IndexMutex );
+}
+
+static DirIndex_t *RebuildDirIndex( const char *pDir, uint32_t nHash )
+{
+	pthread_mutex_lock( &s_IndexMutex );
+
+	DirNode_t *pNode = FindDirNode( pDir, nHash );
+	if ( !pNode )
+	{
+		size_t nLen = strlen( pDir );
+		pNode = (DirNode_t *)malloc( sizeof( DirNode_t ) + nLen );
+		if ( !pNode )
+		{
+			pthread_mutex_unlock( &s_IndexMutex );
+			return NULL;
+		}
+		memcpy( pNode->m_Path, pDir, nLen + 1 );
+		pNode->m_nHash = nHash;
+		pNode->m_pIndex = NULL;
+		pNode->m_nWatch = -1;
+		pNode->m_pNextSameWatch = NULL;
+		pNode->m_pNext = s_DirNodes[nHash % DIR_NODE_BUCKETS];
+
+		// Readers may walk the bucket as soon as the node is in it.
+		__sync_synchronize();
+		s_DirNodes[nHash % DIR_NODE_BUCKETS] = pNode;
+	}
+
+	// Another thread may have just read it.
+	DirIndex_t *pIndex = pNode->m_pIndex;
+	if ( pIndex && ( pNode->m_nWatch >= 0 || IsDirUnchanged( pDir, pIndex ) ) )
+	{
+		pthread_mutex_unlock( &s_IndexMutex );
+		return pIndex;
+	}
+
+	// Watch before reading, so nothing that changes in between is missed.
+	if ( pNode->m_nWatch < 0 )
+	{
+		AddWatch( pNode );
+	}
+
+	RetireDirIndex( pNode );
+	pIndex = ScanDir( pDir );
+	__sync_synchronize();
+	pNode->m_pIndex = pIndex;
+
+	pthread_mutex_unlock( &s_IndexMutex );
+	return pIndex;
+}
+
+// Must be called between BeginIndexRead and EndIndexRead.
+static DirIndex_t *GetDirIndex( const char *pDir, bool *pbOwned )
+{
+	*pbOwned = false;
+	if ( pDir[0] != '/' )
+	{
+		*pbOwned = true;
+		return ScanDir( pDir );
+	}
+
+	uint32_t nHash = HashDirPath( pDir );
+	DirNode_t *pNode = FindDirNode( pDir, nHash );
+	if ( pNode )
+	{
+		DirIndex_t *pIndex = pNode->m_pIndex;
+		PATHMATCH_BARRIER();
+		if ( pIndex && ( pNode->m_nWatch >= 0 || IsDirUnchanged( pDir, pIndex ) ) )
+		{
+			IncrementStat( &s_Stats.m_nIndexHits );
+			return pIndex;
+		}
+	}
+
+	IncrementStat( &s_Stats.m_nIndexMisses );
+	return RebuildDirIndex( pDir, nHash );
+}
+
+static void BeginIndexRead()
+{
+	__sync_fetch_and_add( &s_nIndexReaders, 1 );
+}
+
+static void EndIndexRead()
+{
+	if ( __sync_sub_and_fetch( &s_nIndexReaders, 1 ) != 0 || !s_pRetiredIndexes )
+		return;
+
+	if ( pthread_mutex_trylock( &s_IndexMutex ) != 0 )
+		return;
+
+	// Everything on the list was unpublished before we took it. If nobody is reading
+	// after that, nobody can still be holding one of them.
+	DirIndex_t *pRetired = s_pRetiredIndexes;
+	s_pRetiredIndexes = NULL;
+	__sync_synchronize();
+	if ( s_nIndexReaders == 0 )
+	{
+		while ( pRetired )
+		{
+			DirIndex_t *pNext = pRetired->m_pNextRetired;
+			free( pRetired );
+			pRetired = pNext;
+		}
+	}
+	else
+	{
+		s_pRetiredIndexes = pRetired;
+	}
+
+	pthread_mutex_unlock( &s_IndexMutex );
+}
+
+// Frees an index that was read for a relative directory and never published.
+class CDirIndexPtr
+{
+public:
+	CDirIndexPtr( DirIndex_t *pIndex, bool bOwned ) : m_pIndex( pIndex ), m_bOwned( bOwned ) {}
+	~CDirIndexPtr() { if ( m_bOwned ) free( m_pIndex ); }
+
+	DirIndex_t *operator->() { return m_pIndex; }
+	operator bool() { return m_pIndex != NULL; }
+
+private:
+	DirIndex_t *m_pIndex;
+	bool m_bOwned;
+};
+
+extern "C" void PathMatch_GetStats( PathMatchStats_t *pStats )
+{
+	*pStats = s_Stats;
+}
+
+extern "C" void PathMatch_ResetStats()
+{
+	memset( &s_Stats, 0, sizeof( s_Stats ) );
+}
+
+
 enum PathMod_t
 {
 	kPathUnchanged,
@@ -411,12 +868,13 @@ static bool Descend( char *pPath, size_t nStartIdx, bool bAllowBasenameMismatch,
 			return true;
 	}
 
-	// Start enumerating dirents
-	CDirPtr spDir;
+	// Look the component up in the directory's index
+	bool bOwned = false;
+	DirIndex_t *pIndex;
 	if ( nStartIdx )
 	{
 		// we have a path
-		spDir = __real_opendir( CDirTrimmer( pPath, nStartIdx ) );
+		pIndex = GetDirIndex( CDirTrimmer( pPath, nStartIdx ), &bOwned );
 		nStartIdx++;
 	}
 	else
@@ -428,25 +886,32 @@ static bool Descend( char *pPath, size_t nStartIdx, bool bAllowBasenameMismatch,
 		    pRoot = "/";
 		    nStartIdx++;
 		}
-		spDir = __real_opendir( pRoot );
+		pIndex = GetDirIndex( pRoot, &bOwned );
 	}
+	CDirIndexPtr spIndex( pIndex, bOwned );
 
-    errno = 0;
-    struct dirent *pEntry = spDir ? readdir( spDir ) : NULL;
     char *pszComponent = pPath + nStartIdx;
     size_t cbComponent = nNextSlash - nStartIdx;
-    while ( pEntry )
+    uint32_t nHash = HashFoldedName( CDirTrimmer(pszComponent, cbComponent) );
+    uint32_t nEntry = spIndex ? spIndex->m_pBuckets[nHash & spIndex->m_nBucketMask] : 0;
+    while ( nEntry )
     {
-        DEBUG_MSG( "\t(%zu) comparing %s with %s\n", nLevel, pEntry->d_name, (const char *)CDirTrimmer(pszComponent, cbComponent) );
+        const DirIndexEntry_t &entry = spIndex->m_pEntries[nEntry - 1];
+        nEntry = entry.m_nNext;
+        if ( entry.m_nHash != nHash )
+            continue;
+
+        const char *pszName = spIndex->m_pNames + entry.m_nName;
+        DEBUG_MSG( "\t(%zu) comparing %s with %s\n", nLevel, pszName, (const char *)CDirTrimmer(pszComponent, cbComponent) );
 
         // the candidate must match the target, but not be a case-identical match (we would
         // have looked there in the short-circuit code above, so don't look again)
-        bool bMatches = ( strcasecmp( CDirTrimmer(pszComponent, cbComponent), pEntry->d_name ) == 0 &&
-                          strcmp( CDirTrimmer(pszComponent, cbComponent), pEntry->d_name ) != 0 );
+        bool bMatches = ( strcasecmp( CDirTrimmer(pszComponent, cbComponent), pszName ) == 0 &&
+                          strcmp( CDirTrimmer(pszComponent, cbComponent), pszName ) != 0 );
 
         if ( bMatches )
         {
-            char *pSrc = pEntry->d_name;
+            const char *pSrc = pszName;
             char *pDst = &pPath[nStartIdx];
             // found a match; copy it in.
             while ( *pSrc && (*pSrc != '/') )
@@ -462,7 +927,6 @@ static bool Descend( char *pPath, size_t nStartIdx, bool bAllowBasenameMismatch,
 
             // If descend fails, try more directories
         }
-        pEntry = readdir( spDir );
     }
 
     if ( bIsDir )
@@ -480,12 +944,6 @@ static bool Descend( char *pPath, size_t nStartIdx, bool bAllowBasenameMismatch,
 	return false;
 }
 
-#ifdef DO_PATHMATCH_CACHE
-typedef std::map<std::string, std::pair<std::string, time_t> > resultCache_t;
-typedef std::map<std::string, std::pair<std::string, time_t> >::iterator resultCacheItr_t;
-static resultCache_t resultCache;
-static const int k_cMaxCacheLifetimeSeconds = 2;
-#endif // DO_PATHMATCH_CACHE
 
 PathMod_t pathmatch( const char *pszIn, char **ppszOut, bool bAllowBasenameMismatch, char *pszOutBuf, size_t OutBufLen )
 {
@@ -506,32 +964,6 @@ PathMod_t pathmatch( const char *pszIn, char **ppszOut, bool bAllowBasenameMisma
 	if ( __real_access( pszIn, F_OK ) == 0 )
 		return kPathUnchanged;
 
-#ifdef DO_PATHMATCH_CACHE
-	resultCacheItr_t cachedResult = resultCache.find( pszIn );
-	if ( cachedResult != resultCache.end() )
-	{
-		unsigned int age = time( NULL ) - cachedResult->second.second;
-		const char *pszResult = cachedResult->second.first.c_str(); 
-		if ( pszResult[0] != '\0' || age <= k_cMaxCacheLifetimeSeconds )
-		{
-			if ( pszResult[0] != '\0' )
-			{
-				*ppszOut = strdup( pszResult );
-				DEBUG_MSG( "Cached '%s' -> '%s'\n", pszIn, *ppszOut );
-				return kPathChanged;
-			}
-			else
-			{
-				DEBUG_MSG( "Cached '%s' -> kPathFailed\n", pszIn );
-				return kPathFailed;
-			}
-		}
-		else if ( age <= k_cMaxCacheLifetimeSeconds )
-		{
-			DEBUG_MSG( "Rechecking '%s' - cache is %u seconds old\n", pszIn, age );			
-		}
-	}
-#endif // DO_PATHMATCH_CACHE
 
 	char *pPath;
 	if( strlen( pszIn ) >= OutBufLen )
@@ -611,7 +1043,10 @@ PathMod_t pathmatch( const char *pszIn, char **ppszOut, bool bAllowBasenameMisma
 			DEBUG_BREAK();
 		}
 
+		HandleDirEvents();
+		BeginIndexRead();
 		bool bSuccess = Descend( pPath, 0, bAllowBasenameMismatch );
+		EndIndexRead();
 		if ( bSuccess )
 		{
 			*ppszOut = pPath;
@@ -622,21 +1057,7 @@ PathMod_t pathmatch( const char *pszIn, char **ppszOut, bool bAllowBasenameMisma
 			DEBUG_MSG( "Unmatched %s\n", pszIn );
 		}
 
-#ifndef DO_PATHMATCH_CACHE
 		return bSuccess ? kPathChanged : kPathFailed;
-#else
-		time_t now = time(NULL);
-		if ( bSuccess )
-		{
-			resultCache[ pszIn ] = std::make_pair( *ppszOut, now ); 
-			return kPathChanged;
-		}
-		else
-		{
-			resultCache[ pszIn ] = std::make_pair( "", now ); 
-			return kPathFailed;			
-		}
-#endif
 	}
 	return kPathFailed;
 }
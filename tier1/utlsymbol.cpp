@@ -36,9 +36,8 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-#define INVALID_STRING_INDEX CStringPoolIndex( 0xFFFF, 0xFFFF )
-
 #define MIN_STRING_POOL_SIZE	2048
+#define MIN_HASH_SLOTS			16
 
 //-----------------------------------------------------------------------------
 // globals
@@ -126,37 +125,122 @@ bool CUtlSymbol::operator==( const char* pStr ) const
 // symbol table stuff
 //-----------------------------------------------------------------------------
 
-inline const char* CUtlSymbolTable::StringFromIndex( const CStringPoolIndex &index ) const
+inline const CUtlSymbolTable::Symbol_t &CUtlSymbolTable::SymbolFromId( UtlSymId_t id ) const
 {
-	Assert( index.m_iPool < m_StringPools.Count() );
-	Assert( index.m_iOffset < m_StringPools[index.m_iPool]->m_TotalLen );
-
-	return &m_StringPools[index.m_iPool]->m_Data[index.m_iOffset];
+	Assert( id < m_nSymbols );
+	return m_ppSymbolBlocks[id >> SYMBOL_BLOCK_SHIFT][id & ( SYMBOL_BLOCK_SIZE - 1 )];
 }
 
 
-bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex &i1, const CStringPoolIndex &i2 ) const
+//-----------------------------------------------------------------------------
+// FNV-1a. The case insensitive hash folds the way V_stricmp compares: ASCII
+// letters directly, anything else through the CRT.
+//-----------------------------------------------------------------------------
+inline unsigned int CUtlSymbolTable::HashString( const char *pString ) const
 {
-	// Need to do pointer math because CUtlSymbolTable is used in CUtlVectors, and hence
-	// can be arbitrarily moved in memory on a realloc. Yes, this is portable. In reality,
-	// right now at least, because m_LessFunc is the first member of CUtlRBTree, and m_Lookup
-	// is the first member of CUtlSymbolTabke, this == pTable
-	CUtlSymbolTable *pTable = (CUtlSymbolTable *)( (byte *)this - offsetof(CUtlSymbolTable::CTree, m_LessFunc) ) - offsetof(CUtlSymbolTable, m_Lookup );
-	const char* str1 = (i1 == INVALID_STRING_INDEX) ? pTable->m_pUserSearchString :
-													  pTable->StringFromIndex( i1 );
-	const char* str2 = (i2 == INVALID_STRING_INDEX) ? pTable->m_pUserSearchString :
-													  pTable->StringFromIndex( i2 );
-
-	if ( !str1 && str2 )
-		return false;
-	if ( !str2 && str1 )
-		return true;
-	if ( !str1 && !str2 )
-		return false;
-	if ( !pTable->m_bInsensitive )
-		return V_strcmp( str1, str2 ) < 0;
+	const unsigned char *p = (const unsigned char *)pString;
+	unsigned int nHash = 2166136261u;
+	if ( !m_bInsensitive )
+	{
+		for ( ; *p; p++ )
+		{
+			nHash = ( nHash ^ *p ) * 16777619u;
+		}
+	}
 	else
-		return V_stricmp( str1, str2 ) < 0;
+	{
+		for ( ; *p; p++ )
+		{
+			unsigned int c = *p;
+			if ( c < 0x80 )
+			{
+				if ( (unsigned int)( c - 'A' ) <= ( 'Z' - 'A' ) )
+					c |= 0x20;
+			}
+			else
+			{
+				c = tolower( c );
+			}
+			nHash = ( nHash ^ c ) * 16777619u;
+		}
+	}
+	return nHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Safe to call while another thread is adding strings: slots only ever go from
+// empty to filled, and a filled slot's symbol was written before the slot was.
+//-----------------------------------------------------------------------------
+UtlSymId_t CUtlSymbolTable::FindHashed( const char *pString, unsigned int nHash ) const
+{
+	const HashSlots_t *pSlots = m_pSlots;
+	if ( !pSlots )
+		return UTL_INVAL_SYMBOL;
+
+	ThreadMemoryBarrier();
+
+	unsigned int nTag = nHash & 0xFFFF0000;
+	for ( unsigned int i = nHash & pSlots->m_nMask; ; i = ( i + 1 ) & pSlots->m_nMask )
+	{
+		unsigned int nSlot = pSlots->m_Slots[i];
+		if ( !nSlot )
+			return UTL_INVAL_SYMBOL;
+
+		if ( ( nSlot & 0xFFFF0000 ) != nTag )
+			continue;
+
+		ThreadMemoryBarrier();
+
+		UtlSymId_t id = (UtlSymId_t)( ( nSlot & 0xFFFF ) - 1 );
+		const char *pSymbolString = SymbolFromId( id ).m_pString;
+		if ( pSymbolString == pString ||
+			( m_bInsensitive ? V_stricmp( pSymbolString, pString ) : V_strcmp( pSymbolString, pString ) ) == 0 )
+		{
+			return id;
+		}
+	}
+}
+
+
+void CUtlSymbolTable::InsertSlot( HashSlots_t *pSlots, UtlSymId_t id, unsigned int nHash )
+{
+	unsigned int i = nHash & pSlots->m_nMask;
+	while ( pSlots->m_Slots[i] )
+	{
+		i = ( i + 1 ) & pSlots->m_nMask;
+	}
+	pSlots->m_Slots[i] = ( nHash & 0xFFFF0000 ) | ( id + 1 );
+}
+
+
+void CUtlSymbolTable::GrowSlots()
+{
+	HashSlots_t *pOldSlots = m_pSlots;
+
+	unsigned int nSlots = MIN_HASH_SLOTS;
+	while ( nSlots < (unsigned int)( m_nSymbols + 1 ) * 2 || nSlots < (unsigned int)m_nInitSize * 2 )
+	{
+		nSlots <<= 1;
+	}
+	if ( pOldSlots && nSlots <= pOldSlots->m_nMask + 1 )
+	{
+		nSlots = ( pOldSlots->m_nMask + 1 ) * 2;
+	}
+
+	HashSlots_t *pSlots = (HashSlots_t *)malloc( sizeof( HashSlots_t ) + ( nSlots - 1 ) * sizeof( unsigned int ) );
+	pSlots->m_pPrev = pOldSlots;
+	pSlots->m_nMask = nSlots - 1;
+	memset( pSlots->m_Slots, 0, nSlots * sizeof( unsigned int ) );
+
+	for ( int i = 0; i < m_nSymbols; i++ )
+	{
+		InsertSlot( pSlots, (UtlSymId_t)i, SymbolFromId( (UtlSymId_t)i ).m_nHash );
+	}
+
+	// The new array has to be complete before lookups can see it.
+	ThreadMemoryBarrier();
+	m_pSlots = pSlots;
 }
 
 
@@ -164,7 +248,7 @@ bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex &i1, const CStri
 // constructor, destructor
 //-----------------------------------------------------------------------------
 CUtlSymbolTable::CUtlSymbolTable( int growSize, int initSize, bool caseInsensitive ) : 
-	m_Lookup( growSize, initSize ), m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
+	m_pSlots( NULL ), m_ppSymbolBlocks( NULL ), m_nSymbols( 0 ), m_nInitSize( initSize ), m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
 {
 }
 
@@ -180,18 +264,7 @@ CUtlSymbol CUtlSymbolTable::Find( const char* pString ) const
 	if (!pString)
 		return CUtlSymbol();
 	
-	// Store a special context used to help with insertion
-	m_pUserSearchString = pString;
-	
-	// Passing this special invalid symbol makes the comparison function
-	// use the string passed in the context
-	UtlSymId_t idx = m_Lookup.Find( INVALID_STRING_INDEX );
-
-#ifdef _DEBUG
-	m_pUserSearchString = NULL;
-#endif
-
-	return CUtlSymbol( idx );
+	return CUtlSymbol( FindHashed( pString, HashString( pString ) ) );
 }
 
 
@@ -211,20 +284,8 @@ int CUtlSymbolTable::FindPoolWithSpace( int len )	const
 }
 
 
-//-----------------------------------------------------------------------------
-// Finds and/or creates a symbol based on the string
-//-----------------------------------------------------------------------------
-
-CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
+const char *CUtlSymbolTable::AddToPool( const char *pString )
 {
-	if (!pString) 
-		return CUtlSymbol( UTL_INVAL_SYMBOL );
-
-	CUtlSymbol id = Find( pString );
-	
-	if (id.IsValid())
-		return id;
-
 	int len = V_strlen(pString) + 1;
 
 	// Find a pool with space for this string, or allocate a new one.
@@ -241,21 +302,59 @@ CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
 
 	// Copy the string in.
 	StringPool_t *pPool = m_StringPools[iPool];
-	Assert( pPool->m_SpaceUsed < 0xFFFF );	// This should never happen, because if we had a string > 64k, it
-											// would have been given its entire own pool.
-	
-	unsigned short iStringOffset = pPool->m_SpaceUsed;
-
-	memcpy( &pPool->m_Data[pPool->m_SpaceUsed], pString, len );
+	char *pPooled = &pPool->m_Data[pPool->m_SpaceUsed];
+	memcpy( pPooled, pString, len );
 	pPool->m_SpaceUsed += len;
+	return pPooled;
+}
+
 
-	// didn't find, insert the string into the vector.
-	CStringPoolIndex index;
-	index.m_iPool = iPool;
-	index.m_iOffset = iStringOffset;
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
 
-	UtlSymId_t idx = m_Lookup.Insert( index );
-	return CUtlSymbol( idx );
+CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
+{
+	if (!pString) 
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
+
+	unsigned int nHash = HashString( pString );
+	UtlSymId_t id = FindHashed( pString, nHash );
+	if ( id != UTL_INVAL_SYMBOL )
+		return CUtlSymbol( id );
+
+	if ( m_nSymbols >= UTL_INVAL_SYMBOL )
+	{
+		Error( "CUtlSymbolTable overflow!\n" );
+	}
+
+	// Keep the slots at most half full.
+	if ( !m_pSlots || (unsigned int)( m_nSymbols + 1 ) * 2 > m_pSlots->m_nMask + 1 )
+	{
+		GrowSlots();
+	}
+
+	id = (UtlSymId_t)m_nSymbols;
+	if ( !m_ppSymbolBlocks )
+	{
+		m_ppSymbolBlocks = (Symbol_t **)calloc( MAX_SYMBOL_BLOCKS, sizeof( Symbol_t * ) );
+	}
+	Symbol_t *&pBlock = m_ppSymbolBlocks[id >> SYMBOL_BLOCK_SHIFT];
+	if ( !pBlock )
+	{
+		pBlock = (Symbol_t *)malloc( SYMBOL_BLOCK_SIZE * sizeof( Symbol_t ) );
+	}
+
+	Symbol_t &symbol = pBlock[id & ( SYMBOL_BLOCK_SIZE - 1 )];
+	symbol.m_pString = AddToPool( pString );
+	symbol.m_nHash = nHash;
+	m_nSymbols = m_nSymbols + 1;
+
+	// The symbol has to be written before the slot that leads to it.
+	ThreadMemoryBarrier();
+	InsertSlot( m_pSlots, id, nHash );
+
+	return CUtlSymbol( id );
 }
 
 
@@ -268,8 +367,7 @@ const char* CUtlSymbolTable::String( CUtlSymbol id ) const
 	if (!id.IsValid()) 
 		return "";
 	
-	Assert( m_Lookup.IsValidIndex((UtlSymId_t)id) );
-	return StringFromIndex( m_Lookup[id] );
+	return SymbolFromId( id ).m_pString;
 }
 
 
@@ -279,7 +377,23 @@ const char* CUtlSymbolTable::String( CUtlSymbol id ) const
 
 void CUtlSymbolTable::RemoveAll()
 {
-	m_Lookup.Purge();
+	HashSlots_t *pSlots = m_pSlots;
+	while ( pSlots )
+	{
+		HashSlots_t *pPrev = pSlots->m_pPrev;
+		free( pSlots );
+		pSlots = pPrev;
+	}
+	m_pSlots = NULL;
+
+	if ( m_ppSymbolBlocks )
+	{
+		for ( int i=0; i < MAX_SYMBOL_BLOCKS; i++ )
+			free( m_ppSymbolBlocks[i] );
+		free( m_ppSymbolBlocks );
+		m_ppSymbolBlocks = NULL;
+	}
+	m_nSymbols = 0;
 	
 	for ( int i=0; i < m_StringPools.Count(); i++ )
 		free( m_StringPools[i] );
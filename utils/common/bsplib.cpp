@@ -26,6 +26,7 @@
 #include "tier0/dbg.h"
 #include "lumpfiles.h"
 #include "vtf/vtf.h"
+#include "threads.h"
 
 //=============================================================================
 
@@ -3865,6 +3866,89 @@ const char *ResolveStaticPropToModel( const char *pPropName )
 	return g_StaticPropNames[iModel].String();
 }
 
+//-----------------------------------------------------------------------------
+// Compresses a batch of independent buffers through the caller's compress
+// callback on all the tool threads. The callback must be thread safe.
+//-----------------------------------------------------------------------------
+struct CompressJob_t
+{
+	CompressJob_t() : m_pInput( NULL ), m_nInputSize( 0 ), m_nSkip( 0 ), m_bCompressed( false ), m_flTime( 0.0f ) {}
+
+	CUtlString		m_Name;			// for the timings
+	byte			*m_pInput;
+	int				m_nInputSize;
+	int				m_nSkip;		// leading bytes of the input that are left uncompressed
+	CUtlBuffer		m_Compressed;
+	bool			m_bCompressed;
+	float			m_flTime;		// seconds spent in the callback
+};
+
+static CompressJob_t	**g_ppCompressJobs;
+static CompressFunc_t	g_pCompressJobFunc;
+
+static void CompressJobThread( int iThread, int iJob )
+{
+	CompressJob_t *pJob = g_ppCompressJobs[iJob];
+
+	double flStart = Plat_FloatTime();
+	CUtlBuffer inputBuffer;
+	inputBuffer.SetExternalBuffer( pJob->m_pInput, pJob->m_nInputSize, pJob->m_nInputSize );
+	inputBuffer.SeekGet( CUtlBuffer::SEEK_HEAD, pJob->m_nSkip );
+	pJob->m_bCompressed = g_pCompressJobFunc( inputBuffer, pJob->m_Compressed );
+	pJob->m_flTime = Plat_FloatTime() - flStart;
+}
+
+static int __cdecl CompareCompressJobSize( CompressJob_t * const *ppA, CompressJob_t * const *ppB )
+{
+	return (*ppB)->m_nInputSize - (*ppA)->m_nInputSize;
+}
+
+static void RunCompressJobs( CUtlVector< CompressJob_t > &jobs, CompressFunc_t pCompressFunc, const char *pDescription )
+{
+	if ( !jobs.Count() )
+		return;
+
+	// biggest first, so a big job doesn't start last and hold everything up
+	CUtlVector< CompressJob_t * > schedule;
+	for ( int i = 0; i < jobs.Count(); i++ )
+	{
+		schedule.AddToTail( &jobs[i] );
+	}
+	schedule.Sort( CompareCompressJobSize );
+
+	double flStart = Plat_FloatTime();
+	g_ppCompressJobs = schedule.Base();
+	g_pCompressJobFunc = pCompressFunc;
+	RunThreadsOnIndividual( schedule.Count(), false, CompressJobThread );
+	g_ppCompressJobs = NULL;
+	g_pCompressJobFunc = NULL;
+	double flWallTime = Plat_FloatTime() - flStart;
+
+	double flWorkTime = 0;
+	int nInput = 0;
+	int nOutput = 0;
+	for ( int i = 0; i < jobs.Count(); i++ )
+	{
+		CompressJob_t &job = jobs[i];
+		int nOutputSize = job.m_bCompressed ? job.m_nSkip + job.m_Compressed.TellPut() : job.m_nInputSize;
+		DevMsg( "  %-36s %9d -> %9d bytes %8.2f ms%s\n", job.m_Name.Get(), job.m_nInputSize, nOutputSize,
+			job.m_flTime * 1000.0f, job.m_bCompressed ? "" : " (stored)" );
+		flWorkTime += job.m_flTime;
+		nInput += job.m_nInputSize;
+		nOutput += nOutputSize;
+	}
+
+	Msg( "Compressed %d %s, %d -> %d bytes in %.2f seconds (%.2f seconds of work on %d threads)\n",
+		jobs.Count(), pDescription, nInput, nOutput, flWallTime, flWorkTime, numthreads );
+}
+
+struct ConvertedPakFile_t
+{
+	CUtlString	m_Name;
+	CUtlBuffer	m_Data;
+	bool		m_bCompress;	// VHV data after the header is compressed
+};
+
 //-----------------------------------------------------------------------------
 // Iterate files in pak file, distribute to converters
 // pak file will be ready for serialization upon completion
@@ -3878,6 +3962,10 @@ void ConvertPakFileContents( const char *pInFilename )
 	bool bConverted;
 	CUtlVector< CUtlString > hdrFiles;
 
+	// Everything is converted first and added to the new pak afterwards, in the
+	// same order, so the VHV compression in between can run on all the threads.
+	CUtlVector< ConvertedPakFile_t > convertedFiles;
+
 	int id = -1;
 	int fileSize;
 	while ( 1 )
@@ -3893,6 +3981,7 @@ void ConvertPakFileContents( const char *pInFilename )
 
 		const char* pExtension = V_GetFileExtension( relativeName );
 		const char* pExt = 0;
+		bool bCompress = false;
 
 		bool bOK = ReadFileFromPak( GetPakFile(), relativeName, false, sourceBuf );
 		if ( !bOK )
@@ -3951,35 +4040,18 @@ void ConvertPakFileContents( const char *pInFilename )
 			}
 			targetBuf.SeekPut( CUtlBuffer::SEEK_HEAD, tempBuffer.TellPut() );
 
-			if ( g_pCompressFunc )
-			{
-				CUtlBuffer compressedBuffer;
-				targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, sizeof( HardwareVerts::FileHeader_t ) );
-				bool bCompressed = g_pCompressFunc( targetBuf, compressedBuffer );
-				if ( bCompressed )
-				{
-					// copy all the header data off
-					CUtlBuffer headerBuffer;
-					headerBuffer.EnsureCapacity( sizeof( HardwareVerts::FileHeader_t ) );
-					headerBuffer.Put( targetBuf.Base(), sizeof( HardwareVerts::FileHeader_t ) );
-
-					// reform the target with the header and then the compressed data
-					targetBuf.Clear();
-					targetBuf.Put( headerBuffer.Base(), sizeof( HardwareVerts::FileHeader_t ) );
-					targetBuf.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				}
-
-				targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-			}
-
+			bCompress = ( g_pCompressFunc != NULL );
 			bConverted = true;
 			pExt = ".vhv";
 		}
 
+		int iFile = convertedFiles.AddToTail();
+		ConvertedPakFile_t &file = convertedFiles[iFile];
+		file.m_bCompress = bCompress;
 		if ( !bConverted )
 		{
 			// straight copy
-			AddBufferToPak( newPakFile, relativeName, sourceBuf.Base(), sourceBuf.TellMaxPut(), false );
+			file.m_Data.Put( sourceBuf.Base(), sourceBuf.TellMaxPut() );
 		}
 		else
 		{
@@ -3987,16 +4059,54 @@ void ConvertPakFileContents( const char *pInFilename )
 			V_StripExtension( relativeName, relativeName, sizeof( relativeName ) );
 			V_strcat( relativeName, ".360", sizeof( relativeName ) );
 			V_strcat( relativeName, pExt, sizeof( relativeName ) );
-			AddBufferToPak( newPakFile, relativeName, targetBuf.Base(), targetBuf.TellMaxPut(), false );
+			file.m_Data.Put( targetBuf.Base(), targetBuf.TellMaxPut() );
 		}
+		file.m_Name = relativeName;
 
 		if ( V_stristr( relativeName, ".hdr" ) || V_stristr( relativeName, "_hdr" ) )
 		{
 			hdrFiles.AddToTail( relativeName );
 		}
+	}
 
-		DevMsg( "Created '%s' in lump pak in '%s'.\n", relativeName, pInFilename );
+	// compress the VHVs
+	CUtlVector< CompressJob_t > compressJobs;
+	CUtlVector< int > compressJobFiles;
+	for ( int i = 0; i < convertedFiles.Count(); i++ )
+	{
+		ConvertedPakFile_t &file = convertedFiles[i];
+		if ( file.m_bCompress )
+		{
+			CompressJob_t &job = compressJobs[ compressJobs.AddToTail() ];
+			job.m_Name = file.m_Name;
+			job.m_pInput = (byte *)file.m_Data.Base();
+			job.m_nInputSize = file.m_Data.TellMaxPut();
+			job.m_nSkip = sizeof( HardwareVerts::FileHeader_t );
+			compressJobFiles.AddToTail( i );
+		}
 	}
+	RunCompressJobs( compressJobs, g_pCompressFunc, "pak files" );
+
+	for ( int i = 0; i < compressJobs.Count(); i++ )
+	{
+		CompressJob_t &job = compressJobs[i];
+		if ( job.m_bCompressed )
+		{
+			// reform the file with the header and then the compressed data
+			CUtlBuffer &data = convertedFiles[ compressJobFiles[i] ].m_Data;
+			data.SeekPut( CUtlBuffer::SEEK_HEAD, sizeof( HardwareVerts::FileHeader_t ) );
+			data.Put( job.m_Compressed.Base(), job.m_Compressed.TellPut() );
+		}
+	}
+
+	for ( int i = 0; i < convertedFiles.Count(); i++ )
+	{
+		ConvertedPakFile_t &file = convertedFiles[i];
+		AddBufferToPak( newPakFile, file.m_Name.Get(), file.m_Data.Base(), file.m_Data.TellPut(), false );
+		DevMsg( "Created '%s' in lump pak in '%s'.\n", file.m_Name.Get(), pInFilename );
+	}
+	compressJobs.Purge();
+	convertedFiles.Purge();
 
 	// strip ldr version of hdr files
 	for ( int i=0; i<hdrFiles.Count(); i++ )
@@ -4400,7 +4510,10 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+// The input game lump directory has already been swapped to native, pJobs holds
+// the compressed game lumps with pJobIndices mapping each game lump to its job
+// (-1 for empty ones).
+static bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressJob_t *pJobs, const int *pJobIndices )
 {
 	CByteswap	byteSwap;
 
@@ -4408,8 +4521,6 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
 
 	byteSwap.ActivateByteSwapping( true );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
 
 	unsigned int newOffset = outputBuffer.TellPut();
 	outputBuffer.Put( pInGameLumpHeader, sizeof( dgamelumpheader_t ) );
@@ -4427,27 +4538,20 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
-		CUtlBuffer compressedBuffer;
-
 		pOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
-		if ( pInGameLump[i].filelen )
+		if ( pJobIndices[i] != -1 )
 		{
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen, pInGameLump[i].filelen );
-
-			bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-			if ( bCompressed )
+			CompressJob_t &job = pJobs[ pJobIndices[i] ];
+			if ( job.m_bCompressed )
 			{
 				pOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
-
-				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				compressedBuffer.Purge();
+				outputBuffer.Put( job.m_Compressed.Base(), job.m_Compressed.TellPut() );
 			}
 			else
 			{
 				// as is
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( job.m_pInput, job.m_nInputSize );
 			}
 		}
 	}
@@ -4481,6 +4585,53 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 	byteSwap.ActivateByteSwapping( true );
 	byteSwap.SwapFieldsToTargetEndian( pInBSPHeader );
 
+	// the game lump directory too, its entries get compressed separately
+	dgamelumpheader_t *pInGameLumpHeader = NULL;
+	dgamelump_t *pInGameLump = NULL;
+	if ( pInBSPHeader->lumps[LUMP_GAME_LUMP].filelen )
+	{
+		pInGameLumpHeader = (dgamelumpheader_t *)( (byte *)pInBSPHeader + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs );
+		pInGameLump = (dgamelump_t *)( pInGameLumpHeader + 1 );
+		byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
+		byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
+	}
+
+	// the lumps are independent, so compress them all up front across the threads
+	// and only lay them out in order below
+	CUtlVector< CompressJob_t > compressJobs;
+	int lumpJobs[HEADER_LUMPS];
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		lumpJobs[i] = -1;
+		if ( !pInBSPHeader->lumps[i].filelen || i == LUMP_GAME_LUMP || i == LUMP_PAKFILE )
+			continue;
+
+		lumpJobs[i] = compressJobs.AddToTail();
+		CompressJob_t &job = compressJobs[ lumpJobs[i] ];
+		job.m_Name = GetLumpName( i );
+		job.m_pInput = (byte *)pInBSPHeader + pInBSPHeader->lumps[i].fileofs;
+		job.m_nInputSize = pInBSPHeader->lumps[i].filelen;
+	}
+
+	CUtlVector< int > gameLumpJobs;
+	for ( int i = 0; pInGameLumpHeader && i < pInGameLumpHeader->lumpCount; i++ )
+	{
+		gameLumpJobs.AddToTail( -1 );
+		if ( !pInGameLump[i].filelen )
+			continue;
+
+		gameLumpJobs[i] = compressJobs.AddToTail();
+		CompressJob_t &job = compressJobs[ gameLumpJobs[i] ];
+		GameLumpId_t id = pInGameLump[i].id;
+		char name[64];
+		V_snprintf( name, sizeof( name ), "LUMP_GAME_LUMP '%c%c%c%c'", ( id >> 24 ) & 0xFF, ( id >> 16 ) & 0xFF, ( id >> 8 ) & 0xFF, id & 0xFF );
+		job.m_Name = name;
+		job.m_pInput = (byte *)pInBSPHeader + pInGameLump[i].fileofs;
+		job.m_nInputSize = pInGameLump[i].filelen;
+	}
+
+	RunCompressJobs( compressJobs, pCompressFunc, "lumps" );
+
 	// output will be smaller, use input size as upper bound
 	outputBuffer.EnsureCapacity( inputBuffer.TellMaxPut() );
 	outputBuffer.Put( pInBSPHeader, sizeof( dheader_t ) );
@@ -4521,38 +4672,33 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 			// only set by compressed lumps, hides the uncompressed size
 			*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = 0;
 
-			CUtlBuffer inputBuffer;
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
-
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
 				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, pCompressFunc );
+				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, compressJobs.Base(), gameLumpJobs.Base() );
 			}
 			else if ( lumpNum == LUMP_PAKFILE )
 			{
 				// add as is
 				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen );
 			}
 			else
 			{
-				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-				if ( bCompressed )
+				CompressJob_t &job = compressJobs[ lumpJobs[lumpNum] ];
+				if ( job.m_bCompressed )
 				{
 					// placing the uncompressed size in the unused fourCC, will decode at runtime
-					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( inputBuffer.TellPut() );
-					pOutBSPHeader->lumps[lumpNum].filelen = compressedBuffer.TellPut();
+					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( job.m_nInputSize );
+					pOutBSPHeader->lumps[lumpNum].filelen = job.m_Compressed.TellPut();
 					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-					compressedBuffer.Purge();
+					outputBuffer.Put( job.m_Compressed.Base(), job.m_Compressed.TellPut() );
 				}
 				else
 				{
 					// add as is
 					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+					outputBuffer.Put( job.m_pInput, job.m_nInputSize );
 				}
 			}
 		}
@@ -0,0 +1,377 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Checkpoint files so long tool runs can be resumed after a crash.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <windows.h>
+#include "cmdlib.h"
+#include "checkpoint.h"
+#include "tier0/threadtools.h"
+
+
+CToolCheckpoint g_Checkpoint;
+
+
+static int64 AlignSectionOffset( int64 nOffset, int64 nAlign )
+{
+	return ( nOffset + nAlign - 1 ) & ~( nAlign - 1 );
+}
+
+
+CToolCheckpoint::CToolCheckpoint()
+{
+	m_hFile = NULL;
+	m_Filename[0] = 0;
+	memset( &m_Header, 0, sizeof( m_Header ) );
+	m_nFileSize = 0;
+	m_pStream = NULL;
+	m_nStreamPos = 0;
+	m_nLastFlushTime = 0;
+}
+
+
+CToolCheckpoint::~CToolCheckpoint()
+{
+	Shutdown( false );
+}
+
+
+bool CToolCheckpoint::Init( const char *pFilename, const char *pToolName, CRC32_t key, bool bResume )
+{
+	Shutdown( false );
+
+	Q_strncpy( m_Filename, pFilename, sizeof( m_Filename ) );
+	m_nLastFlushTime = (long)Plat_FloatTime();
+
+	HANDLE hFile = CreateFile( m_Filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+	{
+		Warning( "Can't open checkpoint %s, continuing without one.\n", m_Filename );
+		return false;
+	}
+	m_hFile = hFile;
+
+	if ( bResume )
+	{
+		LARGE_INTEGER size;
+		GetFileSizeEx( hFile, &size );
+		m_nFileSize = size.QuadPart;
+
+		if ( m_nFileSize >= (int64)sizeof( m_Header ) && ReadAt( 0, &m_Header, sizeof( m_Header ) ) &&
+			m_Header.m_nId == CHECKPOINT_ID && m_Header.m_nVersion == CHECKPOINT_VERSION &&
+			!Q_stricmp( m_Header.m_ToolName, pToolName ) && m_Header.m_Key == key )
+		{
+			Msg( "Resuming from %s\n", m_Filename );
+			return true;
+		}
+
+		Warning( "%s doesn't match this map and command line, starting over.\n", m_Filename );
+	}
+
+	// Start a fresh file with just the header.
+	memset( &m_Header, 0, sizeof( m_Header ) );
+	m_Header.m_nId = CHECKPOINT_ID;
+	m_Header.m_nVersion = CHECKPOINT_VERSION;
+	Q_strncpy( m_Header.m_ToolName, pToolName, sizeof( m_Header.m_ToolName ) );
+	m_Header.m_Key = key;
+
+	SetFilePointer( hFile, 0, NULL, FILE_BEGIN );
+	SetEndOfFile( hFile );
+	m_nFileSize = 0;
+	WriteHeader();
+	return false;
+}
+
+
+void CToolCheckpoint::Shutdown( bool bDelete )
+{
+	if ( !m_hFile )
+		return;
+
+	for ( int i=0; i < m_Views.Count(); i++ )
+	{
+		FlushViewOfFile( m_Views[i], 0 );
+		UnmapViewOfFile( m_Views[i] );
+	}
+	for ( int i=0; i < m_Mappings.Count(); i++ )
+	{
+		CloseHandle( (HANDLE)m_Mappings[i] );
+	}
+	m_Views.Purge();
+	m_Mappings.Purge();
+
+	CloseHandle( (HANDLE)m_hFile );
+	m_hFile = NULL;
+	m_pStream = NULL;
+
+	if ( bDelete )
+	{
+		DeleteFile( m_Filename );
+	}
+}
+
+
+CToolCheckpoint::section_t *CToolCheckpoint::FindSection( const char *pName, bool bCommittedOnly )
+{
+	// Later sections replace earlier ones with the same name.
+	for ( int i=m_Header.m_nSections-1; i >= 0; i-- )
+	{
+		section_t *pSection = &m_Header.m_Sections[i];
+		if ( !Q_stricmp( pSection->m_Name, pName ) && ( pSection->m_bCommitted || !bCommittedOnly ) )
+			return pSection;
+	}
+	return NULL;
+}
+
+
+CToolCheckpoint::section_t *CToolCheckpoint::AddSection( const char *pName, int64 nSize )
+{
+	if ( m_Header.m_nSections >= MAX_SECTIONS )
+		Error( "Too many sections in checkpoint %s\n", m_Filename );
+
+	section_t *pSection = &m_Header.m_Sections[m_Header.m_nSections++];
+	memset( pSection, 0, sizeof( *pSection ) );
+	Q_strncpy( pSection->m_Name, pName, sizeof( pSection->m_Name ) );
+	pSection->m_nOffset = AlignSectionOffset( max( m_nFileSize, (int64)sizeof( m_Header ) ), SECTION_ALIGN );
+	pSection->m_nSize = nSize;
+
+	m_nFileSize = pSection->m_nOffset + nSize;
+	return pSection;
+}
+
+
+void CToolCheckpoint::WriteHeader()
+{
+	if ( !WriteAt( 0, &m_Header, sizeof( m_Header ) ) )
+		Error( "Error writing checkpoint %s\n", m_Filename );
+	FlushFileBuffers( (HANDLE)m_hFile );
+}
+
+
+bool CToolCheckpoint::ReadAt( int64 nOffset, void *pData, int64 nSize )
+{
+	LARGE_INTEGER pos;
+	pos.QuadPart = nOffset;
+	if ( !SetFilePointerEx( (HANDLE)m_hFile, pos, NULL, FILE_BEGIN ) )
+		return false;
+
+	while ( nSize > 0 )
+	{
+		DWORD nChunk = (DWORD)min( nSize, (int64)( 64 * 1024 * 1024 ) );
+		DWORD nRead = 0;
+		if ( !ReadFile( (HANDLE)m_hFile, pData, nChunk, &nRead, NULL ) || nRead != nChunk )
+			return false;
+		pData = (byte *)pData + nChunk;
+		nSize -= nChunk;
+	}
+	return true;
+}
+
+
+bool CToolCheckpoint::WriteAt( int64 nOffset, const void *pData, int64 nSize )
+{
+	LARGE_INTEGER pos;
+	pos.QuadPart = nOffset;
+	if ( !SetFilePointerEx( (HANDLE)m_hFile, pos, NULL, FILE_BEGIN ) )
+		return false;
+
+	while ( nSize > 0 )
+	{
+		DWORD nChunk = (DWORD)min( nSize, (int64)( 64 * 1024 * 1024 ) );
+		DWORD nWritten = 0;
+		if ( !WriteFile( (HANDLE)m_hFile, pData, nChunk, &nWritten, NULL ) || nWritten != nChunk )
+			return false;
+		pData = (const byte *)pData + nChunk;
+		nSize -= nChunk;
+	}
+	return true;
+}
+
+
+void *CToolCheckpoint::MapSection( const char *pName, int64 nSize, bool &bExisting )
+{
+	bExisting = false;
+	if ( !m_hFile || nSize <= 0 )
+		return NULL;
+
+	section_t *pSection = FindSection( pName, true );
+	if ( pSection && pSection->m_nSize == nSize )
+	{
+		bExisting = true;
+	}
+	else
+	{
+		// Grow the file; the new space reads back as zeros.
+		pSection = AddSection( pName, nSize );
+		LARGE_INTEGER end;
+		end.QuadPart = m_nFileSize;
+		if ( !SetFilePointerEx( (HANDLE)m_hFile, end, NULL, FILE_BEGIN ) || !SetEndOfFile( (HANDLE)m_hFile ) )
+			Error( "Error growing checkpoint %s\n", m_Filename );
+
+		// All zeros is a valid empty section, so it's committed straight away.
+		pSection->m_bCommitted = true;
+		WriteHeader();
+	}
+
+	HANDLE hMapping = CreateFileMapping( (HANDLE)m_hFile, NULL, PAGE_READWRITE, 0, 0, NULL );
+	if ( !hMapping )
+		Error( "Can't map checkpoint %s\n", m_Filename );
+
+	void *pView = MapViewOfFile( hMapping, FILE_MAP_WRITE, (DWORD)( pSection->m_nOffset >> 32 ), (DWORD)pSection->m_nOffset, (SIZE_T)nSize );
+	if ( !pView )
+		Error( "Can't map %s from checkpoint %s (%.1f megs)\n", pName, m_Filename, (float)nSize / ( 1024 * 1024 ) );
+
+	m_Mappings.AddToTail( hMapping );
+	m_Views.AddToTail( pView );
+	return pView;
+}
+
+
+void CToolCheckpoint::FlushSection( void *pSection )
+{
+	if ( pSection )
+	{
+		FlushViewOfFile( pSection, 0 );
+	}
+}
+
+
+bool CToolCheckpoint::ShouldFlush()
+{
+	long nLast = m_nLastFlushTime;
+	long nNow = (long)Plat_FloatTime();
+	if ( nNow - nLast < (long)CHECKPOINT_FLUSH_INTERVAL )
+		return false;
+
+	return ThreadInterlockedAssignIf( &m_nLastFlushTime, nNow, nLast );
+}
+
+
+void CToolCheckpoint::BeginWrite( const char *pName )
+{
+	Assert( !m_pStream );
+	m_pStream = AddSection( pName, 0 );
+	m_nStreamPos = m_pStream->m_nOffset;
+}
+
+
+void CToolCheckpoint::Write( const void *pData, int64 nSize )
+{
+	Assert( m_pStream );
+	if ( !WriteAt( m_nStreamPos, pData, nSize ) )
+		Error( "Error writing checkpoint %s\n", m_Filename );
+
+	m_nStreamPos += nSize;
+	m_pStream->m_nSize += nSize;
+}
+
+
+void CToolCheckpoint::EndWrite()
+{
+	Assert( m_pStream );
+
+	// The data has to be on disk before the header says it's there.
+	FlushFileBuffers( (HANDLE)m_hFile );
+	m_pStream->m_bCommitted = true;
+	m_nFileSize = m_pStream->m_nOffset + m_pStream->m_nSize;
+	m_pStream = NULL;
+	WriteHeader();
+}
+
+
+bool CToolCheckpoint::BeginRead( const char *pName, int64 *pSize )
+{
+	Assert( !m_pStream );
+	if ( !m_hFile )
+		return false;
+
+	m_pStream = FindSection( pName, true );
+	if ( !m_pStream )
+		return false;
+
+	m_nStreamPos = m_pStream->m_nOffset;
+	if ( pSize )
+	{
+		*pSize = m_pStream->m_nSize;
+	}
+	return true;
+}
+
+
+bool CToolCheckpoint::Read( void *pData, int64 nSize )
+{
+	Assert( m_pStream );
+	if ( m_nStreamPos + nSize > m_pStream->m_nOffset + m_pStream->m_nSize )
+		return false;
+
+	if ( !ReadAt( m_nStreamPos, pData, nSize ) )
+		return false;
+
+	m_nStreamPos += nSize;
+	return true;
+}
+
+
+void CToolCheckpoint::EndRead()
+{
+	m_pStream = NULL;
+}
+
+
+bool Checkpoint_CRCFile( CRC32_t *pCRC, const char *pFilename )
+{
+	FileHandle_t fp = g_pFileSystem->Open( pFilename, "rb" );
+	if ( !fp )
+		return false;
+
+	byte chunk[64 * 1024];
+	int nRead;
+	while ( ( nRead = g_pFileSystem->Read( chunk, sizeof( chunk ), fp ) ) > 0 )
+	{
+		CRC32_ProcessBuffer( pCRC, chunk, nRead );
+	}
+
+	g_pFileSystem->Close( fp );
+	return true;
+}
+
+
+void Checkpoint_CRCCommandLine( CRC32_t *pCRC, int argc, char **argv )
+{
+	// options that take a value are followed by how many args to skip
+	static const char *s_IgnoredOptions[] =
+	{
+		"-threads", "1",
+		"-threadchunk", "1",
+		"-threadsteal", "0",
+		"-low", "0",
+		"-checkpoint", "0",
+		"-resume", "0",
+		"-FullMinidumps", "0",
+		"-rederror", "0",
+		"-novconfig", "0",
+	};
+
+	for ( int i=1; i < argc; i++ )
+	{
+		int nSkip = -1;
+		for ( int j=0; j < ARRAYSIZE( s_IgnoredOptions ); j += 2 )
+		{
+			if ( !Q_stricmp( argv[i], s_IgnoredOptions[j] ) )
+			{
+				nSkip = atoi( s_IgnoredOptions[j+1] );
+				break;
+			}
+		}
+
+		if ( nSkip >= 0 )
+		{
+			i += nSkip;
+			continue;
+		}
+
+		CRC32_ProcessBuffer( pCRC, argv[i], Q_strlen( argv[i] ) + 1 );
+	}
+}
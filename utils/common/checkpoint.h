@@ -0,0 +1,120 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Checkpoint files so long tool runs can be resumed after a crash.
+//
+// A checkpoint is a header followed by named sections, each aligned so it
+// can be memory mapped on its own. Small state that's updated in place is
+// mapped (MapSection), big data that's written once is streamed
+// (BeginWrite/BeginRead). The header carries a key made from the inputs and
+// options, and a file whose key doesn't match is thrown away.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#pragma once
+
+
+#include "tier1/checksum_crc.h"
+#include "tier1/utlvector.h"
+
+
+#define CHECKPOINT_FLUSH_INTERVAL	60.0	// seconds between flushes of the mapped sections
+
+
+class CToolCheckpoint
+{
+public:
+	CToolCheckpoint();
+	~CToolCheckpoint();
+
+	// Opens the checkpoint file. If bResume is set and the file exists with a matching tool and key
+	// its sections are kept and this returns true, otherwise a fresh file is started.
+	bool Init( const char *pFilename, const char *pToolName, CRC32_t key, bool bResume );
+
+	// Closes the file, deleting it if the run finished.
+	void Shutdown( bool bDelete );
+
+	bool IsActive() const		{ return m_hFile != NULL; }
+
+	// Returns a read/write mapping of a fixed size section. New sections are zero filled;
+	// bExisting is set if the section was left by a previous run.
+	void *MapSection( const char *pName, int64 nSize, bool &bExisting );
+
+	// Writes the dirty pages of a mapped section out to disk. Safe to call from any thread.
+	void FlushSection( void *pSection );
+
+	// True about once every CHECKPOINT_FLUSH_INTERVAL, for exactly one of the calling threads.
+	bool ShouldFlush();
+
+	// Streams a section out. It isn't found by BeginRead until EndWrite has committed it.
+	void BeginWrite( const char *pName );
+	void Write( const void *pData, int64 nSize );
+	void EndWrite();
+
+	// Streams a committed section back in. Returns false if it isn't in the file.
+	bool BeginRead( const char *pName, int64 *pSize = NULL );
+	bool Read( void *pData, int64 nSize );
+	void EndRead();
+
+private:
+	struct section_t
+	{
+		char	m_Name[32];
+		int64	m_nOffset;
+		int64	m_nSize;
+		int		m_bCommitted;
+		int		m_Pad;
+	};
+
+	enum
+	{
+		CHECKPOINT_ID = ( ('P'<<24) + ('K'<<16) + ('C'<<8) + 'V' ),
+		CHECKPOINT_VERSION = 1,
+		MAX_SECTIONS = 16,
+		SECTION_ALIGN = 64 * 1024,	// Windows mapping granularity
+	};
+
+	struct header_t
+	{
+		int			m_nId;
+		int			m_nVersion;
+		char		m_ToolName[32];
+		CRC32_t		m_Key;
+		int			m_nSections;
+		section_t	m_Sections[MAX_SECTIONS];
+	};
+
+	section_t *FindSection( const char *pName, bool bCommittedOnly );
+	section_t *AddSection( const char *pName, int64 nSize );
+	void WriteHeader();
+	bool ReadAt( int64 nOffset, void *pData, int64 nSize );
+	bool WriteAt( int64 nOffset, const void *pData, int64 nSize );
+
+	void			*m_hFile;
+	char			m_Filename[1024];
+	header_t		m_Header;
+	int64			m_nFileSize;
+
+	CUtlVector<void *>	m_Mappings;
+	CUtlVector<void *>	m_Views;
+
+	section_t		*m_pStream;
+	int64			m_nStreamPos;
+
+	volatile long	m_nLastFlushTime;
+};
+
+extern CToolCheckpoint g_Checkpoint;
+
+
+// Adds a file's contents to a checkpoint key. Returns false if it can't be read.
+bool Checkpoint_CRCFile( CRC32_t *pCRC, const char *pFilename );
+
+// Adds the command line to a checkpoint key, leaving out options that don't change the results
+// (thread counts, priority, checkpoint switches).
+void Checkpoint_CRCCommandLine( CRC32_t *pCRC, int argc, char **argv );
+
+
+#endif // CHECKPOINT_H
@@ -18,6 +18,8 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
 
 #define	MAX_THREADS	16
 
@@ -33,16 +35,196 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
+bool g_bThreadWorkStealing = false;
+int g_nThreadWorkChunk = 0;
 
 HANDLE g_ThreadHandles[MAX_THREADS];
 
 
+/*
+===================================================================
+
+WORK DISPATCH
+
+Work items are handed out in chunks. In the default mode every thread claims
+its next chunk from a shared atomic counter, so items are still started in
+roughly ascending order (vvis relies on this - the portals are sorted so the
+simple ones finish first and speed up the rest). With -threadsteal the range
+is split up front and threads that run dry steal half of the largest range
+left. Either way the per-item path only touches the owning thread's slot.
+
+The chunk size adapts per thread: a chunk that finishes quicker than
+THREADWORK_TARGET_CHUNK_TIME doubles the next request, a slower one halves it,
+and it's always capped by the remaining work divided across the threads so
+the tail of the phase gets split finely.
+
+===================================================================
+*/
+
+#define THREADWORK_TARGET_CHUNK_TIME	0.002
+#define THREADWORK_MAX_CHUNK			4096
+
+struct ALIGN128 CThreadWorkSlot
+{
+	// Chunk being drained by the owning thread.
+	int m_iNext;
+	int m_iEnd;
+	int m_nChunkSize;
+	double m_flChunkStartTime;
+
+	// -threadsteal: the range this thread owns, packed as (end << 32) | start.
+	// Thieves shrink it from the top with a compare-exchange.
+	volatile int64 m_Range;
+
+	// Stats for the current phase.
+	int m_nItems;
+	int m_nChunks;
+	int m_nSteals;
+	double m_flStartTime;
+	double m_flEndTime;
+} ALIGN128_POST;
+
+CThreadWorkSlot g_ThreadWorkSlots[MAX_TOOL_THREADS];
+CThreadLocalPtr<CThreadWorkSlot> g_pThreadWorkSlot;
+
+volatile int g_nWorkDispatch;
+volatile int g_nWorkClaimed;
+
+CRITICAL_SECTION g_PacifierCrit;
+
+
+static inline int64 PackWorkRange( int iStart, int iEnd )
+{
+	return ( (int64)(uint32)iEnd << 32 ) | (uint32)iStart;
+}
+
+static inline void UnpackWorkRange( int64 range, int &iStart, int &iEnd )
+{
+	iStart = (int)(uint32)( range & 0xFFFFFFFF );
+	iEnd = (int)(uint32)( range >> 32 );
+}
+
+
+// nSharers is how many threads the remaining work is split between.
+static int GetChunkRequest( CThreadWorkSlot *pSlot, int nRemaining, int nSharers )
+{
+	if ( g_nThreadWorkChunk > 0 )
+		return g_nThreadWorkChunk;
+
+	int nCap = max( nRemaining / ( nSharers * 2 ), 1 );
+	return min( pSlot->m_nChunkSize, nCap );
+}
+
+
+static void AdaptChunkSize( CThreadWorkSlot *pSlot )
+{
+	if ( pSlot->m_nChunks == 0 )
+		return;
+
+	double flElapsed = Plat_FloatTime() - pSlot->m_flChunkStartTime;
+	if ( flElapsed < THREADWORK_TARGET_CHUNK_TIME )
+		pSlot->m_nChunkSize = min( pSlot->m_nChunkSize * 2, THREADWORK_MAX_CHUNK );
+	else if ( flElapsed > THREADWORK_TARGET_CHUNK_TIME * 4 )
+		pSlot->m_nChunkSize = max( pSlot->m_nChunkSize / 2, 1 );
+}
+
+
+// Claims the next chunk from the shared counter.
+static bool ClaimSharedChunk( CThreadWorkSlot *pSlot )
+{
+	int nRequest = GetChunkRequest( pSlot, workcount - g_nWorkDispatch, numthreads );
+	int iStart = ThreadInterlockedExchangeAdd( &g_nWorkDispatch, nRequest );
+	if ( iStart >= workcount )
+		return false;
+
+	pSlot->m_iNext = iStart;
+	pSlot->m_iEnd = min( iStart + nRequest, workcount );
+	return true;
+}
+
+
+// Claims the next chunk from the thread's own range.
+static bool ClaimOwnChunk( CThreadWorkSlot *pSlot )
+{
+	for ( ;; )
+	{
+		int64 oldRange = pSlot->m_Range;
+		int iStart, iEnd;
+		UnpackWorkRange( oldRange, iStart, iEnd );
+		if ( iStart >= iEnd )
+			return false;
+
+		int nTake = min( GetChunkRequest( pSlot, iEnd - iStart, 1 ), iEnd - iStart );
+		if ( ThreadInterlockedAssignIf64( &pSlot->m_Range, PackWorkRange( iStart + nTake, iEnd ), oldRange ) )
+		{
+			pSlot->m_iNext = iStart;
+			pSlot->m_iEnd = iStart + nTake;
+			return true;
+		}
+	}
+}
+
+
+// Moves the top half of the largest range left into this thread's slot.
+static bool StealWork( CThreadWorkSlot *pSlot )
+{
+	for ( ;; )
+	{
+		CThreadWorkSlot *pVictim = NULL;
+		int64 victimRange = 0;
+		int nMost = 0;
+		for ( int i=0; i < numthreads; i++ )
+		{
+			CThreadWorkSlot *pOther = &g_ThreadWorkSlots[i];
+			if ( pOther == pSlot )
+				continue;
+
+			int64 range = pOther->m_Range;
+			int iStart, iEnd;
+			UnpackWorkRange( range, iStart, iEnd );
+			if ( iEnd - iStart > nMost )
+			{
+				pVictim = pOther;
+				victimRange = range;
+				nMost = iEnd - iStart;
+			}
+		}
+
+		// Everything else is empty or already being drained by its owner.
+		if ( !pVictim )
+			return false;
+
+		int iStart, iEnd;
+		UnpackWorkRange( victimRange, iStart, iEnd );
+		int nTake = ( nMost + 1 ) / 2;
+		if ( ThreadInterlockedAssignIf64( &pVictim->m_Range, PackWorkRange( iStart, iEnd - nTake ), victimRange ) )
+		{
+			// Nobody can steal from our slot while it's empty, so a plain store is safe.
+			pSlot->m_Range = PackWorkRange( iEnd - nTake, iEnd );
+			pSlot->m_nSteals++;
+			return true;
+		}
+	}
+}
+
+
+static void UpdateWorkPacifier( int nClaimed )
+{
+	int nDone = ThreadInterlockedExchangeAdd( &g_nWorkClaimed, nClaimed ) + nClaimed;
+
+	// The pacifier isn't thread safe, but it doesn't matter if a thread skips an update.
+	if ( pacifier && TryEnterCriticalSection( &g_PacifierCrit ) )
+	{
+		UpdatePacifier( (float)nDone / workcount );
+		LeaveCriticalSection( &g_PacifierCrit );
+	}
+}
+
 
 /*
 =============
@@ -52,23 +234,68 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	CThreadWorkSlot *pSlot = g_pThreadWorkSlot;
+	if ( !pSlot )
+	{
+		// Not running inside RunThreadsOn (or a thread started by RunThreads_Start) - hand
+		// out single items so callers still get every item exactly once.
+		int r = ThreadInterlockedExchangeAdd( &g_nWorkDispatch, 1 );
+		return ( r < workcount ) ? r : -1;
+	}
 
-	if (dispatch == workcount)
+	if ( pSlot->m_iNext < pSlot->m_iEnd )
 	{
-		ThreadUnlock ();
-		return -1;
+		pSlot->m_nItems++;
+		return pSlot->m_iNext++;
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	AdaptChunkSize( pSlot );
+
+	bool bClaimed;
+	if ( g_bThreadWorkStealing )
+		bClaimed = ClaimOwnChunk( pSlot ) || ( StealWork( pSlot ) && ClaimOwnChunk( pSlot ) );
+	else
+		bClaimed = ClaimSharedChunk( pSlot );
+
+	if ( !bClaimed )
+		return -1;
+
+	pSlot->m_nChunks++;
+	pSlot->m_flChunkStartTime = Plat_FloatTime();
+	UpdateWorkPacifier( pSlot->m_iEnd - pSlot->m_iNext );
+
+	pSlot->m_nItems++;
+	return pSlot->m_iNext++;
+}
+
+
+static void ResetThreadWork( int workcnt )
+{
+	workcount = workcnt;
+	g_nWorkDispatch = 0;
+	g_nWorkClaimed = 0;
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+	int nThreads = min( max( numthreads, 1 ), MAX_TOOL_THREADS );
+	for ( int i=0; i < MAX_TOOL_THREADS; i++ )
+	{
+		CThreadWorkSlot *pSlot = &g_ThreadWorkSlots[i];
+		pSlot->m_iNext = pSlot->m_iEnd = 0;
+		pSlot->m_nChunkSize = 1;
+		pSlot->m_nItems = pSlot->m_nChunks = pSlot->m_nSteals = 0;
+		pSlot->m_flStartTime = pSlot->m_flEndTime = 0;
 
-	return r;
+		if ( i < nThreads )
+		{
+			// Contiguous split so neighbouring items (usually neighbouring in the map too) stay on one thread.
+			int64 iStart = (int64)workcnt * i / nThreads;
+			int64 iEnd = (int64)workcnt * ( i + 1 ) / nThreads;
+			pSlot->m_Range = PackWorkRange( (int)iStart, (int)iEnd );
+		}
+		else
+		{
+			pSlot->m_Range = 0;
+		}
+	}
 }
 
 
@@ -98,6 +325,95 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 }
 
 
+/*
+===================================================================
+
+WORK STATS
+
+===================================================================
+*/
+
+struct ThreadPhaseStats_t
+{
+	const char *m_pName;
+	int m_nWorkCount;
+	int m_nThreads;
+	double m_flWallTime;
+	double m_flBusyTime[MAX_TOOL_THREADS];
+	int m_nItems[MAX_TOOL_THREADS];
+	int m_nSteals;
+};
+
+static CUtlVector<ThreadPhaseStats_t> g_ThreadPhaseStats;
+static const char *g_pThreadWorkPhaseName = NULL;
+
+
+void SetThreadWorkPhaseName( const char *pName )
+{
+	g_pThreadWorkPhaseName = pName;
+}
+
+
+static void RecordThreadPhaseStats( double flWallTime )
+{
+	ThreadPhaseStats_t &stats = g_ThreadPhaseStats[ g_ThreadPhaseStats.AddToTail() ];
+	stats.m_pName = g_pThreadWorkPhaseName ? g_pThreadWorkPhaseName : "(unnamed)";
+	stats.m_nWorkCount = workcount;
+	stats.m_nThreads = numthreads;
+	stats.m_flWallTime = flWallTime;
+	stats.m_nSteals = 0;
+	for ( int i=0; i < MAX_TOOL_THREADS; i++ )
+	{
+		const CThreadWorkSlot *pSlot = &g_ThreadWorkSlots[i];
+		stats.m_flBusyTime[i] = ( i < numthreads ) ? pSlot->m_flEndTime - pSlot->m_flStartTime : 0;
+		stats.m_nItems[i] = ( i < numthreads ) ? pSlot->m_nItems : 0;
+		stats.m_nSteals += pSlot->m_nSteals;
+	}
+
+	g_pThreadWorkPhaseName = NULL;
+}
+
+
+void PrintThreadWorkStats()
+{
+	if ( g_ThreadPhaseStats.Count() == 0 )
+		return;
+
+	Msg( "\nThread utilization (%d threads, %s dispatch):\n", numthreads, g_bThreadWorkStealing ? "stealing" : "shared" );
+	Msg( "  %-24s %9s %9s %6s %6s %6s %7s\n", "phase", "items", "seconds", "util%", "min%", "max%", "steals" );
+
+	double flTotalWall = 0;
+	double flThreadBusy[MAX_TOOL_THREADS] = { 0 };
+	int nThreadItems[MAX_TOOL_THREADS] = { 0 };
+	for ( int iPhase=0; iPhase < g_ThreadPhaseStats.Count(); iPhase++ )
+	{
+		const ThreadPhaseStats_t &stats = g_ThreadPhaseStats[iPhase];
+		double flBusy = 0, flMin = 1, flMax = 0;
+		for ( int i=0; i < stats.m_nThreads; i++ )
+		{
+			double flUtil = ( stats.m_flWallTime > 0 ) ? stats.m_flBusyTime[i] / stats.m_flWallTime : 1;
+			flMin = min( flMin, flUtil );
+			flMax = max( flMax, flUtil );
+			flBusy += stats.m_flBusyTime[i];
+			flThreadBusy[i] += stats.m_flBusyTime[i];
+			nThreadItems[i] += stats.m_nItems[i];
+		}
+
+		double flUtil = ( stats.m_flWallTime > 0 ) ? flBusy / ( stats.m_flWallTime * stats.m_nThreads ) : 1;
+		Msg( "  %-24s %9d %9.2f %6.1f %6.1f %6.1f %7d\n", stats.m_pName, stats.m_nWorkCount, stats.m_flWallTime,
+			flUtil * 100, flMin * 100, flMax * 100, stats.m_nSteals );
+		flTotalWall += stats.m_flWallTime;
+	}
+
+	Msg( "  %-24s %9s %9s %6s\n", "thread", "items", "seconds", "util%" );
+	for ( int i=0; i < numthreads; i++ )
+	{
+		double flUtil = ( flTotalWall > 0 ) ? flThreadBusy[i] / flTotalWall : 1;
+		Msg( "  %-24d %9d %9.2f %6.1f\n", i, nThreadItems[i], flThreadBusy[i], flUtil * 100 );
+	}
+}
+
+
 /*
 ===================================================================
 
@@ -117,6 +433,7 @@ public:
 	CCritInit()
 	{
 		InitializeCriticalSection (&crit);
+		InitializeCriticalSection (&g_PacifierCrit);
 	}
 } g_CritInit;
 
@@ -169,7 +486,14 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	CThreadWorkSlot *pSlot = &g_ThreadWorkSlots[pData->m_iThread];
+	g_pThreadWorkSlot = pSlot;
+
+	pSlot->m_flStartTime = Plat_FloatTime();
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	pSlot->m_flEndTime = Plat_FloatTime();
+
+	g_pThreadWorkSlot = (CThreadWorkSlot *)NULL;
 	return 0;
 }
 
@@ -227,11 +551,10 @@ RunThreadsOn
 */
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
 {
-	int		start, end;
+	double	start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
+	ResetThreadWork( workcnt );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -247,10 +570,11 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 
 
 	end = Plat_FloatTime();
+	RecordThreadPhaseStats( end - start );
 	if (pacifier)
 	{
 		EndPacifier(false);
-		printf (" (%i)\n", end-start);
+		printf (" (%i)\n", (int)(end-start));
 	}
 }
 
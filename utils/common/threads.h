@@ -27,6 +27,13 @@ extern	int		numthreads;
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
+// If set to true, GetThreadWork splits the work between the threads up front and
+// lets idle threads steal from the others instead of pulling from a shared counter.
+extern bool	g_bThreadWorkStealing;
+
+// Fixed number of work items handed out per chunk. 0 adapts it to the item cost.
+extern int	g_nThreadWorkChunk;
+
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
@@ -56,10 +63,16 @@ void RunThreads_End();
 void ThreadLock (void);
 void ThreadUnlock (void);
 
+// Names the stats recorded for the next RunThreadsOn call. The RunThreadsOn macros do this.
+void SetThreadWorkPhaseName( const char *pName );
+
+// Prints wall time and per-thread utilization for every RunThreadsOn call so far.
+void PrintThreadWorkStats();
+
 
 #ifndef NO_THREAD_NAMES
-#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
-#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOn(n,p,f) { SetThreadWorkPhaseName( #f ); if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
+#define RunThreadsOnIndividual(n,p,f) { SetThreadWorkPhaseName( #f ); if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
 #endif
 
 #endif // THREADS_H
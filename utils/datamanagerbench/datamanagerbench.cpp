@@ -0,0 +1,206 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: CDataManager contention benchmark. Threads share a table of
+//			handles and mix lock/unlock, touch and create operations on it,
+//			against the single lock CDataManager and CShardedDataManager.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/datamanager.h"
+
+
+#define DEFAULT_HANDLE_COUNT	4096
+#define DEFAULT_OPERATIONS		1000000		// per thread
+#define RESOURCE_SIZE			256
+#define MAX_BENCH_THREADS		16
+
+
+//-----------------------------------------------------------------------------
+// A fixed size resource that remembers which table slot it was made for, so
+// a lock that returns the wrong resource can be caught.
+//-----------------------------------------------------------------------------
+class CBenchResource
+{
+public:
+	static CBenchResource *CreateResource( const int &nSlot )
+	{
+		CBenchResource *pResource = (CBenchResource *)malloc( RESOURCE_SIZE );
+		pResource->m_nSlot = nSlot;
+		return pResource;
+	}
+	static unsigned int EstimatedSize( const int &nSlot )	{ return RESOURCE_SIZE; }
+	void DestroyResource()									{ free( this ); }
+	CBenchResource *GetData()								{ return this; }
+	unsigned int Size()										{ return RESOURCE_SIZE; }
+
+	int m_nSlot;
+};
+
+typedef CDataManager< CBenchResource, int, CBenchResource *, CThreadFastMutex > CSingleManager;
+typedef CShardedDataManager< CBenchResource, int, CBenchResource *, CThreadFastMutex > CShardedManager;
+
+
+//-----------------------------------------------------------------------------
+// Timed runs
+//-----------------------------------------------------------------------------
+struct benchjob_t
+{
+	void *m_pManager;
+	memhandle_t *m_pHandles;
+	int m_nHandles;
+	int m_nOperations;
+	int m_nLockPercent;
+	int m_nTouchPercent;
+	unsigned int m_nSeed;
+	int m_nCreates;
+	int m_nErrors;
+};
+
+template< class MANAGER >
+static unsigned BenchThread( void *pParam )
+{
+	benchjob_t *pJob = (benchjob_t *)pParam;
+	MANAGER *pManager = (MANAGER *)pJob->m_pManager;
+	unsigned int nRandom = pJob->m_nSeed;
+
+	for ( int i = 0; i < pJob->m_nOperations; i++ )
+	{
+		nRandom = nRandom * 1103515245 + 12345;
+		int nSlot = ( nRandom >> 8 ) % pJob->m_nHandles;
+		int nOp = ( nRandom >> 24 ) % 100;
+		memhandle_t hResource = pJob->m_pHandles[nSlot];
+
+		if ( nOp < pJob->m_nLockPercent )
+		{
+			CBenchResource *pResource = pManager->LockResource( hResource );
+			if ( pResource )
+			{
+				pJob->m_nErrors += ( pResource->m_nSlot != nSlot );
+				pManager->UnlockResource( hResource );
+				continue;
+			}
+		}
+		else if ( nOp < pJob->m_nLockPercent + pJob->m_nTouchPercent )
+		{
+			pManager->TouchResource( hResource );
+			continue;
+		}
+
+		// Creates, and locks of handles that were evicted
+		pJob->m_pHandles[nSlot] = pManager->CreateResource( nSlot );
+		pJob->m_nCreates++;
+	}
+	return 0;
+}
+
+// Returns millions of operations per second across all the threads.
+template< class MANAGER >
+static double RunBench( int nHandles, int nOperations, int nLockPercent, int nTouchPercent, int nThreads )
+{
+	// Room for half the table, so some locks miss and recreate
+	MANAGER *pManager = new MANAGER( nHandles * RESOURCE_SIZE / 2 );
+	memhandle_t *pHandles = new memhandle_t[nHandles];
+	for ( int i = 0; i < nHandles; i++ )
+	{
+		pHandles[i] = pManager->CreateResource( i );
+	}
+
+	benchjob_t jobs[MAX_BENCH_THREADS];
+	ThreadHandle_t threads[MAX_BENCH_THREADS];
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		jobs[i].m_pManager = pManager;
+		jobs[i].m_pHandles = pHandles;
+		jobs[i].m_nHandles = nHandles;
+		jobs[i].m_nOperations = nOperations;
+		jobs[i].m_nLockPercent = nLockPercent;
+		jobs[i].m_nTouchPercent = nTouchPercent;
+		jobs[i].m_nSeed = 1 + i * 7919;
+		jobs[i].m_nCreates = 0;
+		jobs[i].m_nErrors = 0;
+		threads[i] = CreateSimpleThread( BenchThread<MANAGER>, &jobs[i] );
+	}
+
+	int nCreates = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+		nCreates += jobs[i].m_nCreates;
+		if ( jobs[i].m_nErrors )
+		{
+			printf( "  error: %d locks returned another slot's resource\n", jobs[i].m_nErrors );
+		}
+	}
+	double flTime = Plat_FloatTime() - flStart;
+
+	if ( pManager->UsedSize() > pManager->TargetSize() + nThreads * RESOURCE_SIZE )
+	{
+		printf( "  error: %u bytes used, target is %u\n", pManager->UsedSize(), pManager->TargetSize() );
+	}
+
+	pManager->FlushAll();
+	if ( pManager->UsedSize() )
+	{
+		printf( "  error: %u bytes used after FlushAll\n", pManager->UsedSize() );
+	}
+
+	delete pManager;
+	delete [] pHandles;
+
+	return (double)nOperations * nThreads / ( 1.0e6 * max( flTime, 1.0e-6 ) );
+}
+
+static void RunMix( const char *pName, int nHandles, int nOperations, int nLockPercent, int nTouchPercent, int nThreads )
+{
+	printf( "%s (%d%% lock, %d%% touch, %d%% create), %d handles:\n",
+		pName, nLockPercent, nTouchPercent, 100 - nLockPercent - nTouchPercent, nHandles );
+
+	for ( int n = 1; n <= nThreads; n *= 2 )
+	{
+		double flSingle = RunBench<CSingleManager>( nHandles, nOperations, nLockPercent, nTouchPercent, n );
+		double flSharded = RunBench<CShardedManager>( nHandles, nOperations, nLockPercent, nTouchPercent, n );
+		printf( "  %2d thread%s single %7.2f M/s   sharded %7.2f M/s\n", n, n == 1 ? " " : "s", flSingle, flSharded );
+	}
+}
+
+
+int main( int argc, char **argv )
+{
+	int nHandles = DEFAULT_HANDLE_COUNT;
+	int nOperations = DEFAULT_OPERATIONS;
+	int nThreads = min( GetCPUInformation()->m_nLogicalProcessors, MAX_BENCH_THREADS );
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-handles" ) && i + 1 < argc )
+		{
+			nHandles = clamp( atoi( argv[++i] ), 16, 65536 );
+		}
+		else if ( !V_stricmp( argv[i], "-ops" ) && i + 1 < argc )
+		{
+			nOperations = atoi( argv[++i] );
+			nOperations = max( nOperations, 1 );
+		}
+		else if ( !V_stricmp( argv[i], "-threads" ) && i + 1 < argc )
+		{
+			nThreads = clamp( atoi( argv[++i] ), 1, MAX_BENCH_THREADS );
+		}
+		else
+		{
+			printf( "usage: datamanagerbench [-handles #] [-ops #] [-threads #]\n" );
+			return 1;
+		}
+	}
+
+	RunMix( "read mostly", nHandles, nOperations, 60, 38, nThreads );
+	RunMix( "churn", nHandles, nOperations, 45, 30, nThreads );
+	return 0;
+}
@@ -0,0 +1,240 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Polyhedron clipping stress benchmark. Clips a set of random convex
+//			solids against random plane sets through each of the memory modes,
+//			then clips them again on every core at once with a scratch each,
+//			checking every run produces the same shapes.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "mathlib/mathlib.h"
+#include "mathlib/polyhedron.h"
+
+
+#define DEFAULT_SOLID_COUNT		256
+#define DEFAULT_CLIPS			200000		// per run
+#define SOLID_PLANES			24
+#define MAX_CLIP_PLANES			12
+#define ON_PLANE_EPSILON		0.01f
+
+enum ClipMode_t
+{
+	CLIP_ALLOC_BY_NEW,		// a heap polyhedron per clip
+	CLIP_THREAD_SCRATCH,	// bUseTemporaryMemory, the thread's own scratch
+	CLIP_CALLER_SCRATCH,	// bUseTemporaryMemory, a scratch handed in
+};
+
+static const char *s_pModeNames[] = { "new/delete", "thread scratch", "caller scratch" };
+
+struct clipset_t
+{
+	float m_Planes[MAX_CLIP_PLANES * 4];
+	int m_nPlanes;
+};
+
+static CPolyhedron **s_ppSolids;
+static clipset_t *s_pClipSets;
+static int s_nSolids;
+
+
+//-----------------------------------------------------------------------------
+// Random shapes
+//-----------------------------------------------------------------------------
+static float RandomFloat( unsigned int &nSeed )
+{
+	nSeed = nSeed * 1664525 + 1013904223;
+	return ( nSeed >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+// Planes tangent to a sphere around vCenter, facing out
+static void RandomPlanes( float *pPlanes, int nPlanes, const Vector &vCenter, float flRadius, unsigned int &nSeed )
+{
+	for ( int i = 0; i < nPlanes; i++ )
+	{
+		Vector vNormal( RandomFloat( nSeed ) * 2.0f - 1.0f, RandomFloat( nSeed ) * 2.0f - 1.0f, RandomFloat( nSeed ) * 2.0f - 1.0f );
+		VectorNormalize( vNormal );
+		pPlanes[i * 4 + 0] = vNormal.x;
+		pPlanes[i * 4 + 1] = vNormal.y;
+		pPlanes[i * 4 + 2] = vNormal.z;
+		pPlanes[i * 4 + 3] = DotProduct( vNormal, vCenter ) + flRadius * ( 0.6f + 0.4f * RandomFloat( nSeed ) );
+	}
+}
+
+static void BuildShapes( int nSolids )
+{
+	unsigned int nSeed = 1;
+	s_ppSolids = new CPolyhedron *[nSolids];
+	s_pClipSets = new clipset_t[nSolids];
+	s_nSolids = 0;
+
+	float planes[SOLID_PLANES * 4];
+	while ( s_nSolids < nSolids )
+	{
+		RandomPlanes( planes, SOLID_PLANES, vec3_origin, 100.0f, nSeed );
+		CPolyhedron *pSolid = GeneratePolyhedronFromPlanes( planes, SOLID_PLANES, ON_PLANE_EPSILON );
+		if ( !pSolid )
+			continue;
+
+		// Cut planes through the solid, off center so some clips miss or remove everything
+		clipset_t &clipSet = s_pClipSets[s_nSolids];
+		clipSet.m_nPlanes = 1 + (int)( RandomFloat( nSeed ) * MAX_CLIP_PLANES ) % MAX_CLIP_PLANES;
+		Vector vCenter( RandomFloat( nSeed ) * 60.0f - 30.0f, RandomFloat( nSeed ) * 60.0f - 30.0f, RandomFloat( nSeed ) * 60.0f - 30.0f );
+		RandomPlanes( clipSet.m_Planes, clipSet.m_nPlanes, vCenter, 80.0f, nSeed );
+
+		s_ppSolids[s_nSolids++] = pSolid;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Clipping
+//-----------------------------------------------------------------------------
+
+// Returns a sum of the clipped shape sizes, which doesn't depend on the order
+// the clips were made in
+static unsigned int ClipSolids( ClipMode_t mode, int nFirstClip, int nClips, CPolyhedronScratch *pScratch )
+{
+	unsigned int nChecksum = 0;
+	for ( int i = 0; i < nClips; i++ )
+	{
+		int iSolid = ( nFirstClip + i ) % s_nSolids;
+		const clipset_t &clipSet = s_pClipSets[iSolid];
+
+		CPolyhedron *pClipped;
+		switch ( mode )
+		{
+		case CLIP_ALLOC_BY_NEW:
+			pClipped = ClipPolyhedron( s_ppSolids[iSolid], clipSet.m_Planes, clipSet.m_nPlanes, ON_PLANE_EPSILON );
+			break;
+		case CLIP_THREAD_SCRATCH:
+			pClipped = ClipPolyhedron( s_ppSolids[iSolid], clipSet.m_Planes, clipSet.m_nPlanes, ON_PLANE_EPSILON, true );
+			break;
+		default:
+			pClipped = ClipPolyhedron( s_ppSolids[iSolid], clipSet.m_Planes, clipSet.m_nPlanes, ON_PLANE_EPSILON, true, pScratch );
+			break;
+		}
+
+		if ( pClipped )
+		{
+			nChecksum += pClipped->iVertexCount + pClipped->iLineCount * 7 + pClipped->iPolygonCount * 131;
+			pClipped->Release();
+		}
+	}
+	return nChecksum;
+}
+
+// A share of the clips for one of the concurrent threads
+struct clipslice_t
+{
+	int m_nFirstClip;
+	int m_nClips;
+	unsigned int m_nChecksum;
+};
+
+static unsigned ClipSliceThread( void *pParam )
+{
+	clipslice_t *pSlice = (clipslice_t *)pParam;
+	CPolyhedronScratch scratch;
+	pSlice->m_nChecksum = ClipSolids( CLIP_CALLER_SCRATCH, pSlice->m_nFirstClip, pSlice->m_nClips, &scratch );
+	return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+	int nSolids = DEFAULT_SOLID_COUNT;
+	int nClips = DEFAULT_CLIPS;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-solids" ) && i + 1 < argc )
+		{
+			nSolids = clamp( atoi( argv[++i] ), 1, 65536 );
+		}
+		else if ( !V_stricmp( argv[i], "-clips" ) && i + 1 < argc )
+		{
+			nClips = atoi( argv[++i] );
+			nClips = max( nClips, 1 );
+		}
+		else
+		{
+			printf( "usage: polyhedronbench [-solids #] [-clips #]\n" );
+			return 1;
+		}
+	}
+
+	BuildShapes( nSolids );
+	printf( "%d solids of %d planes, %d clips per run:\n", nSolids, SOLID_PLANES, nClips );
+
+	// One pass over the solids first, so the scratches have grown to fit and
+	// the timed clips should not touch the heap outside CLIP_ALLOC_BY_NEW
+	CPolyhedronScratch scratch;
+	unsigned int nExpected = 0;
+	for ( int mode = CLIP_ALLOC_BY_NEW; mode <= CLIP_CALLER_SCRATCH; mode++ )
+	{
+		ClipSolids( (ClipMode_t)mode, 0, s_nSolids, &scratch );
+		int nWarmAllocations = scratch.GetHeapAllocationCount();
+
+		double flStart = Plat_FloatTime();
+		unsigned int nChecksum = ClipSolids( (ClipMode_t)mode, 0, nClips, &scratch );
+		double flTime = Plat_FloatTime() - flStart;
+
+		printf( "  %-16s %8.1f K/s\n", s_pModeNames[mode], (double)nClips / ( 1.0e3 * max( flTime, 1.0e-6 ) ) );
+		if ( mode == CLIP_ALLOC_BY_NEW )
+		{
+			nExpected = nChecksum;
+		}
+		else if ( nChecksum != nExpected )
+		{
+			printf( "  error: %s clipped different shapes\n", s_pModeNames[mode] );
+		}
+
+		if ( mode == CLIP_CALLER_SCRATCH && scratch.GetHeapAllocationCount() != nWarmAllocations )
+		{
+			printf( "  %d scratch heap allocations after warming up\n", scratch.GetHeapAllocationCount() - nWarmAllocations );
+		}
+	}
+
+	// The same clips split across every core, each thread with its own scratch
+	int nThreads = max( GetCPUInformation()->m_nLogicalProcessors, 2 );
+	clipslice_t *pSlices = new clipslice_t[nThreads];
+	ThreadHandle_t *pThreads = new ThreadHandle_t[nThreads];
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		pSlices[i].m_nFirstClip = i * ( nClips / nThreads );
+		pSlices[i].m_nClips = ( i == nThreads - 1 ) ? nClips - pSlices[i].m_nFirstClip : nClips / nThreads;
+		pThreads[i] = CreateSimpleThread( ClipSliceThread, &pSlices[i] );
+	}
+
+	unsigned int nChecksum = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( pThreads[i] );
+		ReleaseThreadHandle( pThreads[i] );
+		nChecksum += pSlices[i].m_nChecksum;
+	}
+	if ( nChecksum != nExpected )
+	{
+		printf( "  error: %d threads clipped different shapes\n", nThreads );
+	}
+	else
+	{
+		printf( "  %d threads clipped the same shapes\n", nThreads );
+	}
+	delete [] pThreads;
+	delete [] pSlices;
+
+	for ( int i = 0; i < s_nSolids; i++ )
+	{
+		s_ppSolids[i]->Release();
+	}
+	delete [] s_ppSolids;
+	delete [] s_pClipSets;
+	FreeThreadPolyhedronScratch();
+	return 0;
+}
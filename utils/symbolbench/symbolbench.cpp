@@ -0,0 +1,304 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: CUtlSymbolTable benchmark. Times adding and finding strings in the
+//			hashed symbol table against the red-black tree it replaced.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/utlrbtree.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlvector.h"
+
+
+#define DEFAULT_STRING_COUNT	40000
+#define LOOKUP_ROUNDS			20
+#define MAX_BENCH_THREADS		16
+
+
+//-----------------------------------------------------------------------------
+// The old table: pooled strings in a CUtlRBTree ordered by V_strcmp/V_stricmp,
+// with a read/write lock around it for the MT flavor.
+//-----------------------------------------------------------------------------
+class CTreeSymbolTable
+{
+public:
+	CTreeSymbolTable( bool bInsensitive ) : m_Tree( 0, 32, bInsensitive ? LessInsensitive : LessSensitive )
+	{
+		m_nPoolUsed = POOL_SIZE;
+	}
+
+	~CTreeSymbolTable()
+	{
+		for ( int i = 0; i < m_Pools.Count(); i++ )
+		{
+			delete [] m_Pools[i];
+		}
+	}
+
+	UtlSymId_t AddString( const char *pString )
+	{
+		UtlSymId_t id = Find( pString );
+		if ( id != m_Tree.InvalidIndex() )
+			return id;
+
+		m_Lock.LockForWrite();
+		int len = V_strlen( pString ) + 1;
+		if ( m_nPoolUsed + len > POOL_SIZE )
+		{
+			m_Pools.AddToTail( new char[ max( len, (int)POOL_SIZE ) ] );
+			m_nPoolUsed = 0;
+		}
+		char *pPooled = m_Pools.Tail() + m_nPoolUsed;
+		memcpy( pPooled, pString, len );
+		m_nPoolUsed += len;
+		id = m_Tree.Insert( pPooled );
+		m_Lock.UnlockWrite();
+		return id;
+	}
+
+	UtlSymId_t Find( const char *pString ) const
+	{
+		m_Lock.LockForRead();
+		UtlSymId_t id = m_Tree.Find( pString );
+		m_Lock.UnlockRead();
+		return id;
+	}
+
+private:
+	enum { POOL_SIZE = 2048 };
+
+	static bool LessSensitive( const char * const &a, const char * const &b )	{ return V_strcmp( a, b ) < 0; }
+	static bool LessInsensitive( const char * const &a, const char * const &b )	{ return V_stricmp( a, b ) < 0; }
+
+	CUtlRBTree< const char *, UtlSymId_t > m_Tree;
+	CUtlVector< char * > m_Pools;
+	int m_nPoolUsed;
+	mutable CThreadSpinRWLock m_Lock;
+};
+
+
+//-----------------------------------------------------------------------------
+// Test strings that look like what the tables hold in game: keyvalues keys,
+// sound script names and asset paths, many sharing long prefixes.
+//-----------------------------------------------------------------------------
+static const char *s_pPrefixes[] =
+{
+	"models/props_c17/", "materials/models/humans/", "sound/ambient/levels/", "scripts/",
+	"npc_", "weapon_", "$basetexture", "Ambient.", "HL2Player.", "ai_", "",
+};
+
+static unsigned int s_nRandom = 1;
+
+static int RandomInt( int nMax )
+{
+	s_nRandom = s_nRandom * 1103515245 + 12345;
+	return ( s_nRandom >> 8 ) % nMax;
+}
+
+static char *CopyString( const char *pString )
+{
+	int nLen = V_strlen( pString ) + 1;
+	char *pCopy = new char[nLen];
+	memcpy( pCopy, pString, nLen );
+	return pCopy;
+}
+
+static void FreeStrings( CUtlVector<char *> &strings )
+{
+	for ( int i = 0; i < strings.Count(); i++ )
+	{
+		delete [] strings[i];
+	}
+	strings.Purge();
+}
+
+static void MakeStrings( int nCount, CUtlVector<char *> &strings )
+{
+	static const char s_Chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+	for ( int i = 0; i < nCount; i++ )
+	{
+		char buf[128];
+		int nLen = V_snprintf( buf, sizeof( buf ), "%s", s_pPrefixes[ RandomInt( ARRAYSIZE( s_pPrefixes ) ) ] );
+		int nSuffix = 4 + RandomInt( 16 );
+		for ( int j = 0; j < nSuffix; j++ )
+		{
+			buf[nLen++] = s_Chars[ RandomInt( sizeof( s_Chars ) - 1 ) ];
+		}
+		V_snprintf( buf + nLen, sizeof( buf ) - nLen, "%d", i );
+		strings.AddToTail( CopyString( buf ) );
+	}
+}
+
+// Same strings in another order, with the case flipped on every other one.
+static void MakeLookups( const CUtlVector<char *> &strings, bool bFlipCase, CUtlVector<char *> &lookups )
+{
+	for ( int i = 0; i < strings.Count(); i++ )
+	{
+		char *pString = CopyString( strings[i] );
+		if ( bFlipCase && ( i & 1 ) )
+		{
+			V_strupr( pString );
+		}
+		lookups.AddToTail( pString );
+	}
+	for ( int i = lookups.Count() - 1; i > 0; i-- )
+	{
+		int j = RandomInt( i + 1 );
+		char *pTemp = lookups[i];
+		lookups[i] = lookups[j];
+		lookups[j] = pTemp;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Timed runs
+//-----------------------------------------------------------------------------
+struct lookupjob_t
+{
+	CTreeSymbolTable *m_pTree;
+	CUtlSymbolTableMT *m_pHash;
+	const CUtlVector<char *> *m_pLookups;
+	int m_nFound;
+};
+
+static unsigned LookupThread( void *pParam )
+{
+	lookupjob_t *pJob = (lookupjob_t *)pParam;
+	const CUtlVector<char *> &lookups = *pJob->m_pLookups;
+	int nFound = 0;
+	for ( int r = 0; r < LOOKUP_ROUNDS; r++ )
+	{
+		for ( int i = 0; i < lookups.Count(); i++ )
+		{
+			if ( pJob->m_pTree )
+				nFound += ( pJob->m_pTree->Find( lookups[i] ) != (UtlSymId_t)~0 );
+			else
+				nFound += pJob->m_pHash->Find( lookups[i] ).IsValid();
+		}
+	}
+	pJob->m_nFound = nFound;
+	return 0;
+}
+
+// Returns millions of lookups per second across all the threads.
+static double RunLookups( CTreeSymbolTable *pTree, CUtlSymbolTableMT *pHash, const CUtlVector<char *> &lookups, int nThreads )
+{
+	lookupjob_t jobs[MAX_BENCH_THREADS];
+	ThreadHandle_t threads[MAX_BENCH_THREADS];
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		jobs[i].m_pTree = pTree;
+		jobs[i].m_pHash = pHash;
+		jobs[i].m_pLookups = &lookups;
+		threads[i] = CreateSimpleThread( LookupThread, &jobs[i] );
+	}
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+		if ( jobs[i].m_nFound != lookups.Count() * LOOKUP_ROUNDS )
+		{
+			printf( "  error: %d of %d lookups found\n", jobs[i].m_nFound, lookups.Count() * LOOKUP_ROUNDS );
+		}
+	}
+	double flTime = Plat_FloatTime() - flStart;
+
+	return (double)lookups.Count() * LOOKUP_ROUNDS * nThreads / ( 1.0e6 * max( flTime, 1.0e-6 ) );
+}
+
+static void RunBench( const CUtlVector<char *> &strings, bool bInsensitive, int nThreads )
+{
+	CUtlVector<char *> lookups;
+	MakeLookups( strings, bInsensitive, lookups );
+
+	printf( "%s, %d strings:\n", bInsensitive ? "case insensitive" : "case sensitive", strings.Count() );
+
+	CTreeSymbolTable *pTree = new CTreeSymbolTable( bInsensitive );
+	CUtlSymbolTableMT *pHash = new CUtlSymbolTableMT( 0, 32, bInsensitive );
+
+	// Adds
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < strings.Count(); i++ )
+	{
+		pTree->AddString( strings[i] );
+	}
+	double flTreeAdd = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < strings.Count(); i++ )
+	{
+		pHash->AddString( strings[i] );
+	}
+	double flHashAdd = Plat_FloatTime() - flStart;
+
+	printf( "  add            tree %7.2f M/s   hash %7.2f M/s\n",
+		strings.Count() / ( 1.0e6 * max( flTreeAdd, 1.0e-6 ) ), strings.Count() / ( 1.0e6 * max( flHashAdd, 1.0e-6 ) ) );
+
+	// Both hand out ids in the order strings were added, so they have to agree.
+	int nMismatches = 0;
+	for ( int i = 0; i < lookups.Count(); i++ )
+	{
+		UtlSymId_t treeId = pTree->Find( lookups[i] );
+		CUtlSymbol hashId = pHash->Find( lookups[i] );
+		if ( treeId != (UtlSymId_t)hashId || ( bInsensitive ? V_stricmp : V_strcmp )( pHash->String( hashId ), lookups[i] ) )
+		{
+			nMismatches++;
+		}
+	}
+	if ( nMismatches )
+	{
+		printf( "  error: %d lookups disagree with the tree\n", nMismatches );
+	}
+
+	// Finds of existing strings, which is what AddString mostly does when parsing
+	for ( int n = 1; n <= nThreads; n *= 2 )
+	{
+		double flTree = RunLookups( pTree, NULL, lookups, n );
+		double flHash = RunLookups( NULL, pHash, lookups, n );
+		printf( "  find %2d thread%s tree %7.2f M/s   hash %7.2f M/s\n", n, n == 1 ? " " : "s", flTree, flHash );
+	}
+
+	delete pTree;
+	delete pHash;
+	FreeStrings( lookups );
+}
+
+
+int main( int argc, char **argv )
+{
+	int nStrings = DEFAULT_STRING_COUNT;
+	int nThreads = min( GetCPUInformation()->m_nLogicalProcessors, MAX_BENCH_THREADS );
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-strings" ) && i + 1 < argc )
+		{
+			nStrings = clamp( atoi( argv[++i] ), 1, UTL_INVAL_SYMBOL - 1 );
+		}
+		else if ( !V_stricmp( argv[i], "-threads" ) && i + 1 < argc )
+		{
+			nThreads = clamp( atoi( argv[++i] ), 1, MAX_BENCH_THREADS );
+		}
+		else
+		{
+			printf( "usage: symbolbench [-strings #] [-threads #]\n" );
+			return 1;
+		}
+	}
+
+	CUtlVector<char *> strings;
+	MakeStrings( nStrings, strings );
+
+	RunBench( strings, false, nThreads );
+	RunBench( strings, true, nThreads );
+
+	FreeStrings( strings );
+	return 0;
+}
@@ -0,0 +1,334 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Ray tracer benchmark. Loads a bsp, builds each acceleration structure
+//			the ray tracer has from the world brush faces and fires the same set of
+//			rays through them, reporting build times and traced rays per second.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cmdlib.h"
+#include "bsplib.h"
+#include "threads.h"
+#include "tools_minidump.h"
+#include "raytrace.h"
+#include "mathlib/mathlib.h"
+#include "vstdlib/random.h"
+#include "tier0/icommandline.h"
+#include "tier0/threadtools.h"
+
+
+#define DEFAULT_RAY_COUNT		( 4 * 1024 * 1024 )
+#define PACKETS_PER_WORK_ITEM	256
+
+struct tracebackend_t
+{
+	const char	*m_pName;
+	uint32		m_nFlags;
+	float		m_flBuildTime;
+	float		m_flTraceTime;
+	int			m_nHits;
+	CUtlVector<int32> m_HitIds;
+};
+
+static int g_nRayCount = DEFAULT_RAY_COUNT;
+static int g_nSeed = 1;
+
+// Every packet is four rays out of one spot in front of a world face, the way vrad
+// samples the sky and ambient cube from a luxel.
+static CUtlVector<Vector> g_PacketStarts;
+static CUtlVector<Vector> g_RayDirections;
+static float g_flRayLength;
+
+static RayTracingEnvironment *g_pTraceEnv;
+static tracebackend_t *g_pTraceBackend;
+static CInterlockedInt g_nTraceHits;
+
+
+static Vector FaceVertex( const dface_t &face, int nVert )
+{
+	int nEdge = dsurfedges[face.firstedge + nVert];
+	int nPoint = ( nEdge < 0 ) ? dedges[-nEdge].v[1] : dedges[nEdge].v[0];
+	return dvertexes[nPoint].point;
+}
+
+
+static void AddWorldFaces( RayTracingEnvironment &env )
+{
+	const dmodel_t &world = dmodels[0];
+	for ( int i=0; i < world.numfaces; i++ )
+	{
+		const dface_t &face = dfaces[world.firstface + i];
+
+		// displacements replace their base face; vrad adds them from the disp info
+		if ( face.dispinfo != -1 || face.numedges < 3 )
+			continue;
+
+		Vector v0 = FaceVertex( face, 0 );
+		for ( int j=1; j < face.numedges - 1; j++ )
+		{
+			env.AddTriangle( world.firstface + i, v0, FaceVertex( face, j ), FaceVertex( face, j+1 ), Vector( 1, 1, 1 ) );
+		}
+	}
+}
+
+
+static void MakeRays( const Vector &vMins, const Vector &vMaxs )
+{
+	CUtlVector<int> faces;
+	const dmodel_t &world = dmodels[0];
+	for ( int i=0; i < world.numfaces; i++ )
+	{
+		if ( dfaces[world.firstface + i].dispinfo == -1 && dfaces[world.firstface + i].numedges >= 3 )
+		{
+			faces.AddToTail( world.firstface + i );
+		}
+	}
+	if ( !faces.Count() )
+		Error( "No world faces to trace against\n" );
+
+	g_flRayLength = ( vMaxs - vMins ).Length();
+
+	int nPackets = ( g_nRayCount + 3 ) / 4;
+	g_PacketStarts.SetCount( nPackets );
+	g_RayDirections.SetCount( nPackets * 4 );
+
+	RandomSeed( g_nSeed );
+	for ( int i=0; i < nPackets; i++ )
+	{
+		const dface_t &face = dfaces[faces[RandomInt( 0, faces.Count() - 1 )]];
+		Vector vNormal = dplanes[face.planenum].normal;
+		if ( face.side )
+		{
+			vNormal = -vNormal;
+		}
+
+		// a random spot on the face, nudged off it like a luxel
+		Vector vStart = FaceVertex( face, 0 );
+		int nTri = RandomInt( 1, face.numedges - 2 );
+		float flU = RandomFloat( 0, 1 );
+		float flV = RandomFloat( 0, 1 );
+		if ( flU + flV > 1.0f )
+		{
+			flU = 1.0f - flU;
+			flV = 1.0f - flV;
+		}
+		vStart += flU * ( FaceVertex( face, nTri ) - vStart ) + flV * ( FaceVertex( face, nTri + 1 ) - vStart );
+		g_PacketStarts[i] = vStart + vNormal;
+
+		for ( int j=0; j < 4; j++ )
+		{
+			Vector vDir;
+			do
+			{
+				vDir.Init( RandomFloat( -1, 1 ), RandomFloat( -1, 1 ), RandomFloat( -1, 1 ) );
+			}
+			while ( vDir.LengthSqr() > 1.0f || vDir.LengthSqr() < 0.01f );
+
+			if ( DotProduct( vDir, vNormal ) < 0 )
+			{
+				vDir = -vDir;
+			}
+			VectorNormalize( vDir );
+			g_RayDirections[i * 4 + j] = vDir;
+		}
+	}
+}
+
+
+static void TracePackets( int iThread, int iWorkItem )
+{
+	int nFirst = iWorkItem * PACKETS_PER_WORK_ITEM;
+	int nLast = min( nFirst + PACKETS_PER_WORK_ITEM, g_PacketStarts.Count() );
+
+	fltx4 TMax = ReplicateX4( g_flRayLength );
+	int nHits = 0;
+	for ( int i=nFirst; i < nLast; i++ )
+	{
+		FourRays rays;
+		rays.origin.DuplicateVector( g_PacketStarts[i] );
+		rays.direction.LoadAndSwizzle( g_RayDirections[i*4], g_RayDirections[i*4+1], g_RayDirections[i*4+2], g_RayDirections[i*4+3] );
+
+		RayTracingResult result;
+		g_pTraceEnv->Trace4Rays( rays, Four_Zeros, TMax, &result );
+
+		for ( int j=0; j < 4; j++ )
+		{
+			g_pTraceBackend->m_HitIds[i*4 + j] = result.HitIds[j];
+			if ( result.HitIds[j] != -1 )
+			{
+				nHits++;
+			}
+		}
+	}
+
+	g_nTraceHits += nHits;
+}
+
+
+static void RunBackend( tracebackend_t &backend )
+{
+	RayTracingEnvironment *pEnv = new RayTracingEnvironment;
+	pEnv->Flags |= backend.m_nFlags;
+	pEnv->m_nBuildThreads = numthreads;
+	AddWorldFaces( *pEnv );
+
+	double flStart = Plat_FloatTime();
+	pEnv->SetupAccelerationStructure();
+	backend.m_flBuildTime = Plat_FloatTime() - flStart;
+
+	if ( ( pEnv->Flags & RTE_FLAGS_WIDE_BVH ) != ( backend.m_nFlags & RTE_FLAGS_WIDE_BVH ) )
+	{
+		// fell back to the kd-tree, nothing new to measure
+		backend.m_flBuildTime = backend.m_flTraceTime = 0;
+		delete pEnv;
+		return;
+	}
+
+	if ( !g_PacketStarts.Count() )
+	{
+		MakeRays( pEnv->m_MinBound, pEnv->m_MaxBound );
+	}
+
+	g_pTraceEnv = pEnv;
+	g_pTraceBackend = &backend;
+	g_nTraceHits = 0;
+	backend.m_HitIds.SetCount( g_PacketStarts.Count() * 4 );
+
+	int nWorkItems = ( g_PacketStarts.Count() + PACKETS_PER_WORK_ITEM - 1 ) / PACKETS_PER_WORK_ITEM;
+	flStart = Plat_FloatTime();
+	RunThreadsOnIndividual( nWorkItems, false, TracePackets );
+	backend.m_flTraceTime = Plat_FloatTime() - flStart;
+	backend.m_nHits = g_nTraceHits;
+
+	float flRays = (float)backend.m_HitIds.Count();
+	Msg( "%-10s build %6.2fs   trace %6.2fs   %7.2f Mrays/s   %.1f%% hit\n",
+		backend.m_pName, backend.m_flBuildTime, backend.m_flTraceTime,
+		flRays / ( 1.0e6f * max( backend.m_flTraceTime, 1.0e-6f ) ), 100.0f * backend.m_nHits / flRays );
+
+	delete pEnv;
+}
+
+
+static void CompareBackends( const tracebackend_t &a, const tracebackend_t &b )
+{
+	if ( !a.m_flTraceTime || !b.m_flTraceTime )
+		return;
+
+	int nMismatches = 0;
+	for ( int i=0; i < a.m_HitIds.Count(); i++ )
+	{
+		if ( a.m_HitIds[i] != b.m_HitIds[i] )
+		{
+			nMismatches++;
+		}
+	}
+
+	// rays that graze an edge shared by two triangles can legitimately pick either one
+	Msg( "%s vs %s: %d of %d rays hit a different triangle\n", b.m_pName, a.m_pName, nMismatches, a.m_HitIds.Count() );
+}
+
+
+static void PrintUsage()
+{
+	Msg( "\n"
+		"usage  : tracebench [options...] bspfile\n"
+		"example: tracebench -rays 1000000 c:\\hl2\\hl2\\maps\\test\n"
+		"\n"
+		"Builds each ray tracer acceleration structure from the world brushes of a map and\n"
+		"fires the same rays through them.\n"
+		"\n"
+		"  -rays #         : Number of rays to trace (default %d).\n"
+		"  -seed #         : Seed for the random rays (default 1).\n"
+		"  -threads #      : Number of threads to build and trace with (defaults to the #\n"
+		"                    of processors on your machine).\n"
+		"  -novconfig      : Don't bring up graphical UI on vproject errors.\n"
+		"\n", DEFAULT_RAY_COUNT );
+}
+
+
+static int ParseCommandLine( int argc, char **argv )
+{
+	int i;
+	for ( i=1; i < argc - 1; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-rays" ) )
+		{
+			g_nRayCount = atoi( argv[++i] );
+			if ( g_nRayCount < 4 )
+				return -1;
+		}
+		else if ( !Q_stricmp( argv[i], "-seed" ) )
+		{
+			g_nSeed = atoi( argv[++i] );
+		}
+		else if ( !Q_stricmp( argv[i], "-threads" ) )
+		{
+			numthreads = atoi( argv[++i] );
+			if ( numthreads <= 0 )
+				return -1;
+		}
+		else if ( !Q_stricmp( argv[i], "-novconfig" ) )
+		{
+			// handled by the filesystem init
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return i;
+}
+
+
+int main( int argc, char **argv )
+{
+	CommandLine()->CreateCmdLine( argc, argv );
+	MathLib_Init( 2.2f, 2.2f, 0.0f, 1.0f, false, false, false, false );
+	InstallSpewFunction();
+	SetupDefaultToolsMinidumpHandler();
+
+	Msg( "Valve Software - tracebench.exe (%s)\n", __DATE__ );
+
+	if ( argc < 2 || ParseCommandLine( argc, argv ) != argc - 1 )
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	char source[1024];
+	Q_StripExtension( argv[argc - 1], source, sizeof( source ) );
+	CmdLib_InitFileSystem( argv[argc - 1] );
+	Q_FileBase( source, source, sizeof( source ) );
+	strcpy( source, ExpandPath( source ) );
+
+	ThreadSetDefault();
+
+	char targetPath[1024];
+	GetPlatformMapPath( source, targetPath, 0, sizeof( targetPath ) );
+	Msg( "reading %s\n", targetPath );
+	LoadBSPFile( targetPath );
+	if ( !nummodels || !numfaces )
+		Error( "Empty map" );
+
+	Msg( "%d world faces, %d rays, %d threads%s\n", dmodels[0].numfaces, g_nRayCount, numthreads,
+		RayTracingEnvironment::CPUSupportsWideBVH() ? "" : ", no AVX" );
+
+	tracebackend_t backends[] =
+	{
+		{ "kd-tree", 0 },
+		{ "wide bvh", RTE_FLAGS_WIDE_BVH },
+	};
+	for ( int i=0; i < ARRAYSIZE( backends ); i++ )
+	{
+		RunBackend( backends[i] );
+	}
+	for ( int i=1; i < ARRAYSIZE( backends ); i++ )
+	{
+		CompareBackends( backends[0], backends[i] );
+	}
+
+	ReleasePakFileLumps();
+	CmdLib_Cleanup();
+	return 0;
+}
@@ -535,6 +535,74 @@ int	QuickTestBrushToPlanenum (bspbrush_t *brush, int planenum, int *numsplits)
 	return s;
 }
 
+/*
+============
+SetBrushScoreBounds
+
+Bounds the windings TestBrushToPlanenum counts splits on
+============
+*/
+void SetBrushScoreBounds (bspbrush_t *brush)
+{
+	int			i, j;
+	winding_t	*w;
+
+	ClearBounds (brush->scoremins, brush->scoremaxs);
+	for (i=0 ; i<brush->numsides ; i++)
+	{
+		if (brush->sides[i].texinfo == TEXINFO_NODE)
+			continue;
+		if (!brush->sides[i].visible)
+			continue;
+		w = brush->sides[i].winding;
+		if (!w)
+			continue;
+		for (j=0 ; j<w->numpoints ; j++)
+			AddPointToBounds (w->p[j], brush->scoremins, brush->scoremaxs);
+	}
+}
+
+/*
+============
+ScoreBoundsClearOfPlane
+
+True if every point in the brush's score bounds is at least a unit from the
+plane, on the same side. The extra tenth covers rounding, so this never
+disagrees with testing the points one at a time.
+============
+*/
+#define	SCORE_CLEAR_DIST	1.1
+
+qboolean ScoreBoundsClearOfPlane (bspbrush_t *brush, plane_t *plane)
+{
+	int		i;
+	Vector	corners[2];
+	vec_t	dist1, dist2;
+
+	// no windings count at all
+	if (brush->scoremins[0] > brush->scoremaxs[0])
+		return true;
+
+	for (i=0 ; i<3 ; i++)
+	{
+		if (plane->normal[i] < 0)
+		{
+			corners[0][i] = brush->scoremins[i];
+			corners[1][i] = brush->scoremaxs[i];
+		}
+		else
+		{
+			corners[1][i] = brush->scoremins[i];
+			corners[0][i] = brush->scoremaxs[i];
+		}
+	}
+
+	dist1 = DotProduct (plane->normal, corners[0]) - plane->dist;	// furthest in front
+	dist2 = DotProduct (plane->normal, corners[1]) - plane->dist;	// furthest behind
+
+	return ( dist2 >= SCORE_CLEAR_DIST || dist1 <= -SCORE_CLEAR_DIST );
+}
+
 /*
 ============
 TestBrushToPlanenum
@@ -574,6 +642,11 @@ int	TestBrushToPlanenum (bspbrush_t *brush, int planenum,
 	if (s != PSIDE_BOTH)
 		return s;
 
+	// if the windings that count are well clear of the plane, none of them
+	// are split and the brush can't be an epsilon brush
+	if ( ScoreBoundsClearOfPlane( brush, plane ) )
+		return s;
+
 // if both sides, count the visible faces split
 	d_front = d_back = 0;
 
@@ -867,6 +940,9 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 	bestvalue = -99999;
 	bestsplits = 0;
 
+	for (brush = brushes ; brush ; brush=brush->next)
+		SetBrushScoreBounds (brush);
+
 	// the search order goes: visible-structural, nonvisible-structural
 	// If any valid plane is available in a pass, no further
 	// passes will be tried.
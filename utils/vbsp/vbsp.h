@@ -180,6 +180,7 @@ struct bspbrush_t
 	bspbrush_t			*next;
 	Vector	            mins, maxs;
 	int		            side, testside;		// side of node during construction
+	Vector				scoremins, scoremaxs;	// bounds of the windings SelectSplitSide counts splits on
 	mapbrush_t	        *original;
 	int		            numsides;
 	side_t	            sides[6];			// variably sized
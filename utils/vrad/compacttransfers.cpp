@@ -0,0 +1,349 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact transfer lists and the SIMD GatherLight kernel that reads them.
+//
+// A transfer_t is a 32 bit patch index and a float form factor, 8 bytes, and
+// the bounces spend most of their time streaming them in. Here each patch's
+// transfers are sorted by patch index and packed four to a block: the indices
+// as 16 bit deltas from the previous transfer and the form factors quantized
+// to 16 bits against the patch's largest one, so a transfer takes 4 bytes.
+// A gap too big for a delta is bridged with zero weight transfers.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "compacttransfers.h"
+#include "mathlib/ssemath.h"
+
+
+bool g_bCompactTransfers = false;
+bool g_bCompareTransfers = false;
+
+extern int total_transfer;
+extern CUtlVector<Vector> emitlight;
+
+
+#define TRANSFER_BLOCK_SIZE		4
+#define MAX_TRANSFER_DELTA		0xFFFF
+#define MAX_TRANSFER_WEIGHT		0xFFFF
+
+struct transferblock_t
+{
+	unsigned short	delta[TRANSFER_BLOCK_SIZE];		// patch index minus the previous transfer's
+	unsigned short	weight[TRANSFER_BLOCK_SIZE];	// form factor / scale, 0 for padding
+};
+
+struct compactpatch_t
+{
+	int		firstBlock;
+	int		numBlocks;
+	int		firstPatch;		// the delta chain starts from here
+	float	scale;			// form factor per weight step
+};
+
+// What each patch shoots this bounce, padded so it can be loaded straight into SIMD registers.
+struct shooter_t
+{
+	Vector	light;			// emitlight * reflectivity
+	float	pad0;
+	Vector	origin;
+	float	pad1;
+};
+
+static CUtlVector<compactpatch_t>	g_CompactPatches;
+static CUtlVector<transferblock_t>	g_TransferBlocks;
+static CUtlVector<shooter_t>		g_Shooters;
+
+// -comparetransfers, per thread
+static double g_flCompareDiff[MAX_TOOL_THREADS+1];
+static double g_flCompareTotal[MAX_TOOL_THREADS+1];
+static float g_flCompareMaxError[MAX_TOOL_THREADS+1];
+
+
+//-----------------------------------------------------------------------------
+// Building
+//-----------------------------------------------------------------------------
+static int __cdecl TransferCompare( const void *a, const void *b )
+{
+	return ( (const transfer_t *)a )->patch - ( (const transfer_t *)b )->patch;
+}
+
+
+static int CountTransferSlots( const transfer_t *pTransfers, int nTransfers )
+{
+	int nSlots = 0;
+	int prev = pTransfers[0].patch;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		int gap = pTransfers[i].patch - prev;
+		nSlots += 1 + gap / ( MAX_TRANSFER_DELTA + 1 );
+		prev = pTransfers[i].patch;
+	}
+	return nSlots;
+}
+
+
+// Sorts the patch's transfers and works out how many blocks they need.
+static void SizeCompactTransfers( int iThread, int ndxPatch )
+{
+	CPatch *patch = &g_Patches[ndxPatch];
+	compactpatch_t &cp = g_CompactPatches[ndxPatch];
+
+	cp.firstBlock = 0;
+	cp.numBlocks = 0;
+	cp.firstPatch = 0;
+	cp.scale = 0;
+	if ( !patch->numtransfers )
+		return;
+
+	qsort( patch->transfers, patch->numtransfers, sizeof( transfer_t ), TransferCompare );
+
+	float maxTransfer = 0;
+	for ( int i = 0; i < patch->numtransfers; i++ )
+	{
+		maxTransfer = max( maxTransfer, patch->transfers[i].transfer );
+	}
+
+	int nSlots = CountTransferSlots( patch->transfers, patch->numtransfers );
+	cp.numBlocks = ( nSlots + TRANSFER_BLOCK_SIZE - 1 ) / TRANSFER_BLOCK_SIZE;
+	cp.firstPatch = patch->transfers[0].patch;
+	cp.scale = maxTransfer / MAX_TRANSFER_WEIGHT;
+}
+
+
+static void EncodeCompactTransfers( int iThread, int ndxPatch )
+{
+	CPatch *patch = &g_Patches[ndxPatch];
+	const compactpatch_t &cp = g_CompactPatches[ndxPatch];
+	if ( !cp.numBlocks )
+		return;
+
+	transferblock_t *pBlocks = &g_TransferBlocks[cp.firstBlock];
+	memset( pBlocks, 0, cp.numBlocks * sizeof( transferblock_t ) );
+
+	float invScale = ( cp.scale > 0 ) ? 1.0f / cp.scale : 0;
+	int nSlot = 0;
+	int prev = cp.firstPatch;
+	for ( int i = 0; i < patch->numtransfers; i++ )
+	{
+		const transfer_t &t = patch->transfers[i];
+
+		int gap = t.patch - prev;
+		while ( gap > MAX_TRANSFER_DELTA )
+		{
+			pBlocks[nSlot / TRANSFER_BLOCK_SIZE].delta[nSlot % TRANSFER_BLOCK_SIZE] = MAX_TRANSFER_DELTA;
+			gap -= MAX_TRANSFER_DELTA;
+			nSlot++;
+		}
+
+		int weight = (int)( t.transfer * invScale + 0.5f );
+		transferblock_t &block = pBlocks[nSlot / TRANSFER_BLOCK_SIZE];
+		block.delta[nSlot % TRANSFER_BLOCK_SIZE] = gap;
+		block.weight[nSlot % TRANSFER_BLOCK_SIZE] = clamp( weight, 0, MAX_TRANSFER_WEIGHT );
+		nSlot++;
+		prev = t.patch;
+	}
+
+	Assert( ( nSlot + TRANSFER_BLOCK_SIZE - 1 ) / TRANSFER_BLOCK_SIZE == cp.numBlocks );
+}
+
+
+void BuildCompactTransfers()
+{
+	int nPatches = g_Patches.Count();
+	g_CompactPatches.SetCount( nPatches );
+
+	RunThreadsOnIndividual( nPatches, false, SizeCompactTransfers );
+
+	int nBlocks = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		g_CompactPatches[i].firstBlock = nBlocks;
+		nBlocks += g_CompactPatches[i].numBlocks;
+	}
+	g_TransferBlocks.SetCount( nBlocks );
+
+	RunThreadsOnIndividual( nPatches, false, EncodeCompactTransfers );
+
+	// The compact lists replace the full ones unless they're being compared.
+	if ( !g_bCompareTransfers )
+	{
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			free( g_Patches[i].transfers );
+			g_Patches[i].transfers = NULL;
+		}
+	}
+
+	g_Shooters.SetCount( nPatches );
+
+	double flBytes = (double)nBlocks * sizeof( transferblock_t ) + (double)nPatches * sizeof( compactpatch_t );
+	Msg( "compact transfers: %.1f megs, %.2f bytes/transfer (was %d), %.1f%% padding\n",
+		flBytes / ( 1024 * 1024 ), total_transfer ? flBytes / total_transfer : 0, (int)sizeof( transfer_t ),
+		nBlocks ? 100.0 * ( (double)nBlocks * TRANSFER_BLOCK_SIZE - total_transfer ) / ( (double)nBlocks * TRANSFER_BLOCK_SIZE ) : 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Gathering
+//-----------------------------------------------------------------------------
+void PrepareCompactGather()
+{
+	int nPatches = g_Patches.Count();
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		shooter_t &shooter = g_Shooters[i];
+		const CPatch &patch = g_Patches[i];
+		shooter.light = emitlight[i] * patch.reflectivity;
+		shooter.pad0 = 0;
+		shooter.origin = patch.origin;
+		shooter.pad1 = 0;
+	}
+
+	memset( g_flCompareDiff, 0, sizeof( g_flCompareDiff ) );
+	memset( g_flCompareTotal, 0, sizeof( g_flCompareTotal ) );
+	memset( g_flCompareMaxError, 0, sizeof( g_flCompareMaxError ) );
+}
+
+
+static FORCEINLINE void DecodeTransferBlock( const transferblock_t &block, int &prev, int index[TRANSFER_BLOCK_SIZE], fltx4 &weight, const fltx4 &scale )
+{
+	ALIGN16 float flWeight[TRANSFER_BLOCK_SIZE] ALIGN16_POST;
+	for ( int i = 0; i < TRANSFER_BLOCK_SIZE; i++ )
+	{
+		prev += block.delta[i];
+		index[i] = prev;
+		flWeight[i] = block.weight[i];
+	}
+	weight = MulSIMD( LoadAlignedSIMD( flWeight ), scale );
+}
+
+
+static FORCEINLINE Vector SumFourVectors( const FourVectors &v )
+{
+	return Vector( SubFloat( v.x, 0 ) + SubFloat( v.x, 1 ) + SubFloat( v.x, 2 ) + SubFloat( v.x, 3 ),
+				   SubFloat( v.y, 0 ) + SubFloat( v.y, 1 ) + SubFloat( v.y, 2 ) + SubFloat( v.y, 3 ),
+				   SubFloat( v.z, 0 ) + SubFloat( v.z, 1 ) + SubFloat( v.z, 2 ) + SubFloat( v.z, 3 ) );
+}
+
+
+void GatherCompactLight( int ndxPatch, Vector &light )
+{
+	const compactpatch_t &cp = g_CompactPatches[ndxPatch];
+	const transferblock_t *pBlock = g_TransferBlocks.Base() + cp.firstBlock;
+	const shooter_t *pShooters = g_Shooters.Base();
+
+	FourVectors sum;
+	sum.x = sum.y = sum.z = Four_Zeros;
+
+	fltx4 scale = ReplicateX4( cp.scale );
+	int prev = cp.firstPatch;
+	for ( int b = 0; b < cp.numBlocks; b++, pBlock++ )
+	{
+		int index[TRANSFER_BLOCK_SIZE];
+		fltx4 weight;
+		DecodeTransferBlock( *pBlock, prev, index, weight, scale );
+
+		FourVectors shot;
+		shot.LoadAndSwizzle( pShooters[index[0]].light, pShooters[index[1]].light, pShooters[index[2]].light, pShooters[index[3]].light );
+		shot *= weight;
+		sum += shot;
+	}
+
+	light = SumFourVectors( sum );
+}
+
+
+void GatherCompactBumpLight( int ndxPatch, const Vector normals[NUM_BUMP_VECTS+1], bumplights_t &light )
+{
+	const CPatch *patch = &g_Patches[ndxPatch];
+	const compactpatch_t &cp = g_CompactPatches[ndxPatch];
+	const transferblock_t *pBlock = g_TransferBlocks.Base() + cp.firstBlock;
+	const shooter_t *pShooters = g_Shooters.Base();
+
+	FourVectors origin, flatNormal, normal4[NUM_BUMP_VECTS+1], sum[NUM_BUMP_VECTS+1];
+	origin.DuplicateVector( patch->origin );
+	flatNormal.DuplicateVector( patch->normal );
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		normal4[i].DuplicateVector( normals[i] );
+		sum[i].x = sum[i].y = sum[i].z = Four_Zeros;
+	}
+
+	fltx4 scale = ReplicateX4( cp.scale );
+	int prev = cp.firstPatch;
+	for ( int b = 0; b < cp.numBlocks; b++, pBlock++ )
+	{
+		int index[TRANSFER_BLOCK_SIZE];
+		fltx4 weight;
+		DecodeTransferBlock( *pBlock, prev, index, weight, scale );
+
+		// Padding can point back at this patch, which makes a zero length delta, so it's
+		// masked out rather than just relying on its zero weight.
+		fltx4 valid = CmpGtSIMD( weight, Four_Zeros );
+
+		FourVectors delta;
+		delta.LoadAndSwizzle( pShooters[index[0]].origin, pShooters[index[1]].origin, pShooters[index[2]].origin, pShooters[index[3]].origin );
+		delta -= origin;
+		delta.VectorNormalize();
+
+		// remove normal already factored into transfer steradian
+		fltx4 amount = AndSIMD( MulSIMD( weight, ReciprocalSIMD( delta * flatNormal ) ), valid );
+
+		FourVectors shot;
+		shot.LoadAndSwizzle( pShooters[index[0]].light, pShooters[index[1]].light, pShooters[index[2]].light, pShooters[index[3]].light );
+		shot *= amount;
+
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			fltx4 dot = AndSIMD( MaxSIMD( delta * normal4[i], Four_Zeros ), valid );
+			FourVectors bumpShot = shot;
+			bumpShot *= dot;
+			sum[i] += bumpShot;
+		}
+	}
+
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		light.light[i] = SumFourVectors( sum[i] );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// -comparetransfers
+//-----------------------------------------------------------------------------
+void CompareCompactLight( int iThread, const Vector *pLight, const Vector *pCompactLight, int nLights )
+{
+	for ( int i = 0; i < nLights; i++ )
+	{
+		float flDiff = fabs( pLight[i].x - pCompactLight[i].x ) + fabs( pLight[i].y - pCompactLight[i].y ) + fabs( pLight[i].z - pCompactLight[i].z );
+		float flTotal = fabs( pLight[i].x ) + fabs( pLight[i].y ) + fabs( pLight[i].z );
+
+		g_flCompareDiff[iThread] += flDiff;
+		g_flCompareTotal[iThread] += flTotal;
+
+		// relative error only means something once the light is visible
+		if ( flTotal > 1.0f )
+		{
+			g_flCompareMaxError[iThread] = max( g_flCompareMaxError[iThread], flDiff / flTotal );
+		}
+	}
+}
+
+
+void ReportCompactCompare()
+{
+	double flDiff = 0, flTotal = 0;
+	float flMaxError = 0;
+	for ( int i = 0; i <= MAX_TOOL_THREADS; i++ )
+	{
+		flDiff += g_flCompareDiff[i];
+		flTotal += g_flCompareTotal[i];
+		flMaxError = max( flMaxError, g_flCompareMaxError[i] );
+	}
+
+	Msg( "\tcompact transfers: %.4f%% total error, %.4f%% worst patch\n",
+		flTotal > 0 ? 100.0 * flDiff / flTotal : 0.0, 100.0f * flMaxError );
+}
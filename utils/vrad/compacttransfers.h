@@ -0,0 +1,39 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact transfer lists and the SIMD GatherLight kernel that reads them.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef COMPACTTRANSFERS_H
+#define COMPACTTRANSFERS_H
+#pragma once
+
+#include "mathlib/bumpvects.h"
+
+struct bumplights_t;
+
+
+// -compacttransfers: bounce from the compact lists and free the transfer_t lists.
+extern bool g_bCompactTransfers;
+
+// -comparetransfers: keep both and report how far the compact results are off.
+extern bool g_bCompareTransfers;
+
+
+// Builds the compact lists from every patch's transfers (after MakeAllScales).
+void BuildCompactTransfers();
+
+// Caches what each patch shoots this bounce. Call before each GatherLight pass.
+void PrepareCompactGather();
+
+// Light gathered by a patch through its compact transfer list.
+void GatherCompactLight( int ndxPatch, Vector &light );
+void GatherCompactBumpLight( int ndxPatch, const Vector normals[NUM_BUMP_VECTS+1], bumplights_t &light );
+
+// -comparetransfers bookkeeping: called with both results for each patch, then once per bounce.
+void CompareCompactLight( int iThread, const Vector *pLight, const Vector *pCompactLight, int nLights );
+void ReportCompactCompare();
+
+
+#endif // COMPACTTRANSFERS_H
@@ -19,6 +19,8 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "checkpoint.h"
+#include "compacttransfers.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -111,6 +113,9 @@ float		luxeldensity = 1.0;
 unsigned	num_degenerate_faces;
 
 qboolean	g_bLowPriority = false;
+bool		g_bCheckpoint = false;
+bool		g_bResume = false;
+bool		g_bWideBVH = false;
 qboolean	g_bLogHashData = false;
 bool		g_bNoDetailLighting = false;
 double		g_flStartTime;
@@ -1582,6 +1587,17 @@ void GatherLight (int threadnum, void *pUserData)
 			// FIXME: why does the patch not use the phong normal?
 			normals[0] = patch->normal;
 
+			bumplights_t compactLight;
+			if ( g_bCompactTransfers )
+			{
+				GatherCompactBumpLight( j, normals, compactLight );
+				if ( !g_bCompareTransfers )
+				{
+					addlight[j] = compactLight;
+					continue;
+				}
+			}
+
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
 				VectorFill( bumpSum[i], 0 );
@@ -1621,9 +1637,25 @@ void GatherLight (int threadnum, void *pUserData)
 			{
 				VectorCopy( bumpSum[i], addlight[j].light[i] );
 			}
+
+			if ( g_bCompareTransfers )
+			{
+				CompareCompactLight( threadnum, bumpSum, compactLight.light, NUM_BUMP_VECTS+1 );
+			}
 		}
 		else
 		{
+			Vector compactLight;
+			if ( g_bCompactTransfers )
+			{
+				GatherCompactLight( j, compactLight );
+				if ( !g_bCompareTransfers )
+				{
+					VectorCopy( compactLight, addlight[j].light[0] );
+					continue;
+				}
+			}
+
 			VectorFill( sum, 0 );
 			for (k=0 ; k<num ; k++, trans++)
 			{
@@ -1635,6 +1667,11 @@ void GatherLight (int threadnum, void *pUserData)
 				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
+
+			if ( g_bCompareTransfers )
+			{
+				CompareCompactLight( threadnum, &sum, &compactLight, 1 );
+			}
 		}
 	}
 }
@@ -1644,6 +1681,87 @@ void GatherLight (int threadnum, void *pUserData)
 #endif
 
 
+/*
+=============
+Bounce checkpoints
+
+The radiosity state after each bounce is saved into one of two slots, taking
+turns, so a crash while one is being written leaves the previous bounce.
+=============
+*/
+struct bouncecheckpoint_t
+{
+	int		bounce;			// bounces done, 0 if the slot is empty
+	int		finished;		// no more bounces needed
+	int		pad[2];
+	// Vector emitlight[numpatches], bumplights_t totallight[numpatches]
+};
+
+static byte *g_pBounceCheckpoint;
+static int64 g_nBounceSlotSize;
+
+static bouncecheckpoint_t *GetBounceSlot( int slot )
+{
+	return (bouncecheckpoint_t *)( g_pBounceCheckpoint + slot * g_nBounceSlotSize );
+}
+
+static void InitBounceCheckpoint( unsigned &bounce, qboolean &bouncing )
+{
+	g_pBounceCheckpoint = NULL;
+	if ( !g_Checkpoint.IsActive() )
+		return;
+
+	unsigned int uiPatchCount = g_Patches.Size();
+	g_nBounceSlotSize = sizeof( bouncecheckpoint_t ) + (int64)uiPatchCount * ( sizeof( Vector ) + sizeof( bumplights_t ) );
+
+	bool bExisting;
+	g_pBounceCheckpoint = (byte *)g_Checkpoint.MapSection( "bounce", g_nBounceSlotSize * 2, bExisting );
+	if ( !g_pBounceCheckpoint || !bExisting )
+		return;
+
+	bouncecheckpoint_t *pSlot = GetBounceSlot( 0 );
+	if ( GetBounceSlot( 1 )->bounce > pSlot->bounce )
+		pSlot = GetBounceSlot( 1 );
+	if ( pSlot->bounce <= 0 )
+		return;
+
+	Vector *pEmit = (Vector *)( pSlot + 1 );
+	bumplights_t *pTotal = (bumplights_t *)( pEmit + uiPatchCount );
+	memcpy( emitlight.Base(), pEmit, uiPatchCount * sizeof( Vector ) );
+	for ( unsigned i = 0; i < uiPatchCount; i++ )
+	{
+		g_Patches[i].totallight = pTotal[i];
+	}
+
+	bounce = pSlot->bounce;
+	bouncing = !pSlot->finished && (int)bounce < numbounce;
+	Msg( "Restored bounce %d from checkpoint\n", bounce );
+}
+
+static void SaveBounceCheckpoint( unsigned bounce, bool finished )
+{
+	if ( !g_pBounceCheckpoint )
+		return;
+
+	// the slot we overwrite always holds an older bounce than the other one
+	bouncecheckpoint_t *pSlot = GetBounceSlot( bounce & 1 );
+	unsigned int uiPatchCount = g_Patches.Size();
+
+	Vector *pEmit = (Vector *)( pSlot + 1 );
+	bumplights_t *pTotal = (bumplights_t *)( pEmit + uiPatchCount );
+	memcpy( pEmit, emitlight.Base(), uiPatchCount * sizeof( Vector ) );
+	for ( unsigned i = 0; i < uiPatchCount; i++ )
+	{
+		pTotal[i] = g_Patches[i].totallight;
+	}
+	g_Checkpoint.FlushSection( g_pBounceCheckpoint );
+
+	pSlot->finished = finished;
+	pSlot->bounce = bounce;
+	g_Checkpoint.FlushSection( g_pBounceCheckpoint );
+}
+
+
 /*
 =============
 BounceLight
@@ -1700,10 +1818,18 @@ void BounceLight (void)
 #endif
 
 	i = 0;
+	InitBounceCheckpoint( i, bouncing );
+
 	while ( bouncing )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
+		double flBounceStart = Plat_FloatTime();
+		if ( g_bCompactTransfers )
+		{
+			PrepareCompactGather();
+		}
+
 		unsigned int uiPatchCount = g_Patches.Size();
 		RunThreadsOn (uiPatchCount, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
@@ -1711,12 +1837,18 @@ void BounceLight (void)
 		// light is always received to leaf patches
 		CollectLight( added );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f) in %.1fs\n", i+1, added[0], added[1], added[2], Plat_FloatTime() - flBounceStart );
+		if ( g_bCompareTransfers )
+		{
+			ReportCompactCompare();
+		}
 
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
 
 		i++;
+		SaveBounceCheckpoint( i, !bouncing );
+
 		if ( g_bDumpPatches && !bouncing && i != 1)
 		{
 			sprintf (name, "bounce%i.txt", i);
@@ -1921,18 +2053,111 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Streams the transfer lists into the checkpoint: the patch count, each
+//			patch's transfer count, then all of the transfers in patch order.
+//-----------------------------------------------------------------------------
+static void SaveTransfersToCheckpoint()
+{
+	if ( !g_Checkpoint.IsActive() )
+		return;
+
+	int nPatches = g_Patches.Size();
+	CUtlVector<int> counts;
+	counts.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		counts[i] = g_Patches[i].numtransfers;
+	}
+
+	g_Checkpoint.BeginWrite( "transfers" );
+	g_Checkpoint.Write( &nPatches, sizeof( nPatches ) );
+	g_Checkpoint.Write( counts.Base(), nPatches * sizeof( int ) );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		if ( counts[i] )
+		{
+			g_Checkpoint.Write( g_Patches[i].transfers, counts[i] * sizeof( transfer_t ) );
+		}
+	}
+	g_Checkpoint.EndWrite();
+}
+
+
+static bool LoadTransfersFromCheckpoint()
+{
+	if ( !g_Checkpoint.BeginRead( "transfers" ) )
+		return false;
+
+	int nPatches = g_Patches.Size();
+	int nSavedPatches = 0;
+	CUtlVector<int> counts;
+
+	bool bOk = g_Checkpoint.Read( &nSavedPatches, sizeof( nSavedPatches ) ) && nSavedPatches == nPatches;
+	if ( bOk )
+	{
+		counts.SetCount( nPatches );
+		bOk = g_Checkpoint.Read( counts.Base(), nPatches * sizeof( int ) );
+	}
+
+	total_transfer = max_transfer = 0;
+	for ( int i = 0; bOk && i < nPatches; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		patch->numtransfers = counts[i];
+		if ( !patch->numtransfers )
+			continue;
+
+		patch->transfers = ( transfer_t* )calloc( 1, patch->numtransfers * sizeof( transfer_t ) );
+		if ( !patch->transfers )
+			Error( "Memory allocation failure" );
+
+		bOk = g_Checkpoint.Read( patch->transfers, patch->numtransfers * sizeof( transfer_t ) );
+		total_transfer += patch->numtransfers;
+		max_transfer = max( max_transfer, patch->numtransfers );
+	}
+	g_Checkpoint.EndRead();
+
+	if ( !bOk )
+	{
+		Warning( "Transfers in the checkpoint don't match the patches, rebuilding them.\n" );
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			free( g_Patches[i].transfers );
+			g_Patches[i].transfers = NULL;
+			g_Patches[i].numtransfers = 0;
+		}
+		total_transfer = max_transfer = 0;
+		return false;
+	}
+
+	Msg( "Restored transfers from checkpoint\n" );
+	return true;
+}
+
+
 void MakeAllScales (void)
 {
-	// determine visibility between patches
-	BuildVisMatrix ();
-	
-	// release visibility matrix
-	FreeVisMatrix ();
+	if ( !LoadTransfersFromCheckpoint() )
+	{
+		// determine visibility between patches
+		BuildVisMatrix ();
+		
+		// release visibility matrix
+		FreeVisMatrix ();
+
+		SaveTransfersToCheckpoint();
+	}
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
 	qprintf ("transfer lists: %5.1f megs\n"
 		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+
+	if ( g_bCompactTransfers )
+	{
+		BuildCompactTransfers();
+	}
 }
 
 
@@ -2257,6 +2482,9 @@ void VRAD_LoadBSP( char const *pFilename )
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
+	g_RtEnv.m_nBuildThreads = numthreads;
+	if ( g_bWideBVH )
+		g_RtEnv.Flags |= RTE_FLAGS_WIDE_BVH;
 	g_RtEnv.SetupAccelerationStructure();
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
@@ -2329,6 +2557,8 @@ void VRAD_Finish()
 
 	double end = Plat_FloatTime();
 	
+	PrintThreadWorkStats();
+
 	char str[512];
 	GetHourMinuteSecondsString( (int)( end - g_flStartTime ), str, sizeof( str ) );
 	Msg( "%s elapsed\n", str );
@@ -2529,6 +2759,44 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-checkpoint" ) )
+		{
+			g_bCheckpoint = true;
+		}
+		else if( !Q_stricmp( argv[i], "-resume" ) )
+		{
+			g_bCheckpoint = true;
+			g_bResume = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadsteal" ) )
+		{
+			g_bThreadWorkStealing = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadchunk" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nThreadWorkChunk = atoi( argv[i] );
+			}
+			else
+			{
+				Warning("Error: expected a value after '-threadchunk'\n" );
+				return 1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-widebvh" ) )
+		{
+			g_bWideBVH = true;
+		}
+		else if( !Q_stricmp( argv[i], "-compacttransfers" ) )
+		{
+			g_bCompactTransfers = true;
+		}
+		else if( !Q_stricmp( argv[i], "-comparetransfers" ) )
+		{
+			g_bCompactTransfers = true;
+			g_bCompareTransfers = true;
+		}
 		else if( !Q_stricmp( argv[i], "-loghash" ) )
 		{
 			g_bLogHashData = true;
@@ -2794,6 +3062,13 @@ void PrintUsage( int argc, char **argv )
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -checkpoint     : Periodically save transfers and bounces to <mapname>.vrad.ckp.\n"
+		"  -resume         : Continue from the checkpoint left by an interrupted -checkpoint run.\n"
+		"  -threadsteal    : Split work between threads up front and let idle threads steal.\n"
+		"  -threadchunk #  : Hand out # work items at a time (default: adapts to item cost).\n"
+		"  -widebvh        : Trace rays through an 8 wide BVH instead of the k-d tree (needs AVX).\n"
+		"  -compacttransfers : Bounce light with 16 bit packed transfer lists (half the memory).\n"
+		"  -comparetransfers : Bounce with both transfer lists and report the difference.\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
 		"                    level lights file.\n"
 		"  -noextra        : Disable supersampling.\n"
@@ -2862,6 +3137,43 @@ void PrintUsage( int argc, char **argv )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Opens the checkpoint for -checkpoint/-resume, keyed on the bsp, the
+//			lights files and the command line.
+//-----------------------------------------------------------------------------
+void InitRadCheckpoint( int argc, char **argv )
+{
+	if ( g_bUseMPI || g_pIncremental )
+	{
+		Warning( "Checkpoints aren't supported with -mpi or incremental lighting.\n" );
+		return;
+	}
+
+	char platformPath[MAX_PATH];
+	GetPlatformMapPath( source, platformPath, 0, MAX_PATH );
+
+	CRC32_t key;
+	CRC32_Init( &key );
+	if ( !Checkpoint_CRCFile( &key, platformPath ) || !Checkpoint_CRCFile( &key, global_lights ) )
+	{
+		Warning( "Can't checksum the map, continuing without a checkpoint.\n" );
+		return;
+	}
+	if ( *designer_lights )
+		Checkpoint_CRCFile( &key, designer_lights );
+	if ( *level_lights )
+		Checkpoint_CRCFile( &key, level_lights );
+	Checkpoint_CRCCommandLine( &key, argc, argv );
+	CRC32_Final( &key );
+
+	char filename[MAX_PATH];
+	Q_strncpy( filename, source, sizeof( filename ) );
+	Q_StripExtension( filename, filename, sizeof( filename ) );
+	Q_strncat( filename, ".vrad.ckp", sizeof( filename ), COPY_ALL_CHARACTERS );
+	g_Checkpoint.Init( filename, "vrad", key, g_bResume );
+}
+
+
 int RunVRAD( int argc, char **argv )
 {
 #if defined(_MSC_VER) && ( _MSC_VER >= 1310 )
@@ -2885,6 +3197,11 @@ int RunVRAD( int argc, char **argv )
 
 	VRAD_LoadBSP( argv[i] );
 
+	if ( g_bCheckpoint )
+	{
+		InitRadCheckpoint( argc, argv );
+	}
+
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
 	{
 		RadWorld_Go();
@@ -2894,6 +3211,9 @@ int RunVRAD( int argc, char **argv )
 
 	VRAD_Finish();
 
+	// finished, so the checkpoint isn't needed any more
+	g_Checkpoint.Shutdown( true );
+
 	VMPI_SetCurrentStage( "master done" );
 
 	DeleteCmdLine( argc, argv );
@@ -7,6 +7,8 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include "checkpoint.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -507,11 +509,14 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.portal = NULL;
 
 	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
+	vis = (long *)thread->portalvis;
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
 	{
+		// when a portal is split into branches, each one only flows through one portal of the first leaf
+		if ( thread->branch >= 0 && prevstack == &thread->pstack_head && i != thread->branch )
+			continue;
 
 		p = leaf->portals[i];
 		pnum = p - portals;
@@ -538,7 +543,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			more |= (might[j] & ~vis[j]);
 		}
 		
-		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
+		if ( !more && CheckBit( thread->portalvis, pnum ) )
 		{	// can't see anything new
 			continue;
 		}
@@ -594,7 +599,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{	// the second leaf can only be blocked if coplanar
 
 			// mark the portal as visible
-			SetBit( thread->base->portalvis, pnum );
+			SetBit( thread->portalvis, pnum );
 
 			RecursiveLeafFlow (p->leaf, thread, &stack);
 			continue;
@@ -609,7 +614,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			continue;
 
 		// mark the portal as visible
-		SetBit( thread->base->portalvis, pnum );
+		SetBit( thread->portalvis, pnum );
 
 		// flow through it for real
 		RecursiveLeafFlow (p->leaf, thread, &stack);
@@ -624,20 +629,20 @@ PortalFlow
 generates the portalvis bit vector
 ===============
 */
-void PortalFlow (int iThread, int portalnum)
+static void FlowPortal (portal_t *p)
 {
 	threaddata_t	data;
 	int				i;
-	portal_t		*p;
 	int				c_might, c_can;
 
-	p = sorted_portals[portalnum];
 	p->status = stat_working;
 				
 	c_might = CountBits (p->portalflood, g_numportals*2);
 
 	memset (&data, 0, sizeof(data));
 	data.base = p;
+	data.portalvis = p->portalvis;
+	data.branch = -1;
 	
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
@@ -656,6 +661,416 @@ void PortalFlow (int iThread, int portalnum)
 		(int)(p - portals),	c_might, c_can, data.c_chains);
 }
 
+void PortalFlow (int iThread, int portalnum)
+{
+	FlowPortal (sorted_portals[portalnum]);
+}
+
+
+/*
+===============================================================================
+
+PortalFlow scheduling
+
+The sorted order lets simple portals finish first so the complex ones can skip
+through their portalvis, but it also leaves the few giant portals for last,
+where they run one per thread while the rest of the threads sit idle.
+
+So the portals are costed from their flood, the cheap bulk is flowed in
+sorted order as before, and the most expensive ones are held back for a tail
+pass. There they're split into one work item per portal of the first leaf they
+flow into (each with its own portalvis, merged at the end) and the items are
+started most expensive first.
+
+===============================================================================
+*/
+
+#define	TAIL_COST_FRACTION	4		// hold back portals costing more than 1/(threads*this) of the total
+#define	MAX_TAIL_PORTALS	256
+
+bool g_bSplitTailPortals = true;
+
+struct flowbranch_t
+{
+	portal_t	*portal;
+	int			branch;			// index into the portal's leaf portals, or -1 for the whole flow
+	double		cost;
+	byte		*portalvis;
+};
+
+// -checkpoint: each flowed portal's portalvis is copied into the checkpoint as it finishes.
+struct portalcheckpoint_t
+{
+	CRC32_t		crc;		// of the saved portalvis, catches pages that didn't make it to disk
+	int			done;
+};
+
+static portalcheckpoint_t *g_pPortalCheckpoints;
+static byte *g_pPortalCheckpointVis;
+
+static CUtlVector<portal_t *> g_BulkFlowPortals;
+static CUtlVector<portal_t *> g_TailFlowPortals;
+static CUtlVector<flowbranch_t> g_TailFlowBranches;
+
+// Seconds and estimated cost flowed by each thread during the bulk pass, to calibrate the tail estimate.
+static double g_flBulkFlowTime[MAX_TOOL_THREADS+1];
+static double g_flBulkFlowCost[MAX_TOOL_THREADS+1];
+
+
+static int CountBitsAnd (byte *a, byte *b)
+{
+	int		c = 0;
+
+	for (int j=0 ; j<portallongs ; j++)
+	{
+		unsigned long bits = ((unsigned long *)a)[j] & ((unsigned long *)b)[j];
+		for ( ; bits ; bits &= bits - 1 )
+			c++;
+	}
+
+	return c;
+}
+
+
+/*
+==============
+FlowBranchCost
+
+The work under a first level branch grows with roughly the square of what can
+still be seen through it.
+==============
+*/
+static double FlowBranchCost (portal_t *p, portal_t *branch)
+{
+	double might = CountBitsAnd (p->portalflood, branch->portalflood);
+	return 1 + might * might;
+}
+
+
+void EstimatePortalFlowCost (int iThread, int portalnum)
+{
+	portal_t	*p = portals + portalnum;
+	leaf_t		*leaf = &leafs[p->leaf];
+
+	p->flowcost = 1;
+	for (int i=0 ; i<leaf->portals.Count() ; i++)
+	{
+		portal_t *branch = leaf->portals[i];
+		if ( CheckBit( p->portalflood, branch - portals ) )
+		{
+			p->flowcost += FlowBranchCost (p, branch);
+		}
+	}
+}
+
+
+static int __cdecl TailPortalCompare (portal_t * const *a, portal_t * const *b)
+{
+	if ( (*a)->flowcost == (*b)->flowcost )
+		return 0;
+	return ( (*a)->flowcost > (*b)->flowcost ) ? -1 : 1;
+}
+
+
+static int __cdecl TailBranchCompare (const flowbranch_t *a, const flowbranch_t *b)
+{
+	if ( a->cost == b->cost )
+		return 0;
+	return ( a->cost > b->cost ) ? -1 : 1;
+}
+
+
+/*
+==============
+InitPortalCheckpoint
+
+Maps the portalvis checkpoint and marks the portals a previous run finished as done.
+==============
+*/
+static void InitPortalCheckpoint (void)
+{
+	g_pPortalCheckpoints = NULL;
+	g_pPortalCheckpointVis = NULL;
+	if ( !g_Checkpoint.IsActive() )
+		return;
+
+	int		count = g_numportals*2;
+	bool	existing;
+	byte	*base = (byte *)g_Checkpoint.MapSection( "portalvis", (int64)count * ( sizeof(portalcheckpoint_t) + portalbytes ), existing );
+	if ( !base )
+		return;
+
+	g_pPortalCheckpoints = (portalcheckpoint_t *)base;
+	g_pPortalCheckpointVis = base + count * sizeof(portalcheckpoint_t);
+	if ( !existing )
+		return;
+
+	int restored = 0;
+	for (int i=0 ; i<count ; i++)
+	{
+		portalcheckpoint_t *saved = &g_pPortalCheckpoints[i];
+		if ( !saved->done )
+			continue;
+
+		byte *vis = g_pPortalCheckpointVis + (int64)i * portalbytes;
+		if ( CRC32_ProcessSingleBuffer( vis, portalbytes ) != saved->crc )
+		{
+			saved->done = 0;
+			continue;
+		}
+
+		memcpy (portals[i].portalvis, vis, portalbytes);
+		portals[i].status = stat_done;
+		restored++;
+	}
+
+	Msg ("Restored %d of %d portals from checkpoint\n", restored, count);
+}
+
+
+static void CheckpointPortal (portal_t *p)
+{
+	if ( !g_pPortalCheckpoints )
+		return;
+
+	int		i = p - portals;
+	byte	*vis = g_pPortalCheckpointVis + (int64)i * portalbytes;
+
+	memcpy (vis, p->portalvis, portalbytes);
+	g_pPortalCheckpoints[i].crc = CRC32_ProcessSingleBuffer( vis, portalbytes );
+	g_pPortalCheckpoints[i].done = 1;
+
+	if ( g_Checkpoint.ShouldFlush() )
+	{
+		g_Checkpoint.FlushSection( g_pPortalCheckpoints );
+	}
+}
+
+
+static void SchedulePortalFlow (void)
+{
+	g_BulkFlowPortals.RemoveAll();
+	g_TailFlowPortals.RemoveAll();
+	g_TailFlowBranches.RemoveAll();
+
+	// portals restored from a checkpoint are already done
+	CUtlVector<portal_t *> remaining;
+	for (int i=0 ; i<g_numportals*2 ; i++)
+	{
+		if ( sorted_portals[i]->status != stat_done )
+		{
+			remaining.AddToTail( sorted_portals[i] );
+		}
+	}
+
+	int count = remaining.Count();
+	if ( !g_bSplitTailPortals || numthreads <= 1 )
+	{
+		g_BulkFlowPortals.CopyArray( remaining.Base(), count );
+		return;
+	}
+
+	RunThreadsOnIndividual (g_numportals*2, false, EstimatePortalFlowCost);
+
+	double totalcost = 0;
+	CUtlVector<portal_t *> bycost;
+	bycost.CopyArray( remaining.Base(), count );
+	for (int i=0 ; i<count ; i++)
+	{
+		totalcost += bycost[i]->flowcost;
+	}
+	bycost.Sort( TailPortalCompare );
+
+	double threshold = totalcost / ( numthreads * TAIL_COST_FRACTION );
+	for (int i=0 ; i<count && i<MAX_TAIL_PORTALS ; i++)
+	{
+		if ( bycost[i]->flowcost <= threshold )
+			break;
+		g_TailFlowPortals.AddToTail( bycost[i] );
+	}
+
+	// bulk keeps the sorted order
+	for (int i=0 ; i<count ; i++)
+	{
+		if ( g_TailFlowPortals.Find( remaining[i] ) == g_TailFlowPortals.InvalidIndex() )
+		{
+			g_BulkFlowPortals.AddToTail( remaining[i] );
+		}
+	}
+
+	for (int i=0 ; i<g_TailFlowPortals.Count() ; i++)
+	{
+		portal_t	*p = g_TailFlowPortals[i];
+		leaf_t		*leaf = &leafs[p->leaf];
+		int			firstbranch = g_TailFlowBranches.Count();
+
+		for (int j=0 ; j<leaf->portals.Count() ; j++)
+		{
+			portal_t *branch = leaf->portals[j];
+			if ( !CheckBit( p->portalflood, branch - portals ) )
+				continue;
+
+			flowbranch_t &b = g_TailFlowBranches[ g_TailFlowBranches.AddToTail() ];
+			b.portal = p;
+			b.branch = j;
+			b.cost = FlowBranchCost (p, branch);
+			b.portalvis = NULL;
+		}
+
+		if ( g_TailFlowBranches.Count() == firstbranch )
+		{
+			flowbranch_t &b = g_TailFlowBranches[ g_TailFlowBranches.AddToTail() ];
+			b.portal = p;
+			b.branch = -1;
+			b.cost = p->flowcost;
+			b.portalvis = NULL;
+		}
+	}
+
+	g_TailFlowBranches.Sort( TailBranchCompare );
+}
+
+
+/*
+==============
+EstimateTailTime
+
+Longest-first onto numthreads threads, at the rate the bulk pass ran.
+==============
+*/
+static double EstimateTailTime (void)
+{
+	double time = 0, cost = 0;
+	for (int i=0 ; i<=MAX_TOOL_THREADS ; i++)
+	{
+		time += g_flBulkFlowTime[i];
+		cost += g_flBulkFlowCost[i];
+	}
+	if ( cost <= 0 )
+		return 0;
+
+	double load[MAX_TOOL_THREADS];
+	int nthreads = min( numthreads, MAX_TOOL_THREADS );
+	memset (load, 0, sizeof(load));
+	for (int i=0 ; i<g_TailFlowBranches.Count() ; i++)
+	{
+		int best = 0;
+		for (int j=1 ; j<nthreads ; j++)
+		{
+			if ( load[j] < load[best] )
+				best = j;
+		}
+		load[best] += g_TailFlowBranches[i].cost;
+	}
+
+	double makespan = 0;
+	for (int j=0 ; j<nthreads ; j++)
+	{
+		makespan = max( makespan, load[j] );
+	}
+
+	return makespan * time / cost;
+}
+
+
+void BulkPortalFlow (int iThread, int iPortal)
+{
+	portal_t *p = g_BulkFlowPortals[iPortal];
+
+	double start = Plat_FloatTime();
+	FlowPortal (p);
+	g_flBulkFlowTime[iThread] += Plat_FloatTime() - start;
+	g_flBulkFlowCost[iThread] += p->flowcost;
+
+	CheckpointPortal (p);
+}
+
+
+void TailPortalFlow (int iThread, int iBranch)
+{
+	flowbranch_t	*b = &g_TailFlowBranches[iBranch];
+	portal_t		*p = b->portal;
+	threaddata_t	data;
+
+	b->portalvis = (byte*)malloc (portalbytes);
+	memset (b->portalvis, 0, portalbytes);
+
+	memset (&data, 0, sizeof(data));
+	data.base = p;
+	data.portalvis = b->portalvis;
+	data.branch = b->branch;
+
+	data.pstack_head.portal = p;
+	data.pstack_head.source = p->winding;
+	data.pstack_head.portalplane = p->plane;
+	for (int i=0 ; i<portallongs ; i++)
+		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+
+	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
+}
+
+
+/*
+==============
+RunPortalFlow
+
+Flows every portal, see PortalFlow scheduling above.
+==============
+*/
+void RunPortalFlow (void)
+{
+	InitPortalCheckpoint ();
+	SchedulePortalFlow ();
+
+	memset (g_flBulkFlowTime, 0, sizeof(g_flBulkFlowTime));
+	memset (g_flBulkFlowCost, 0, sizeof(g_flBulkFlowCost));
+
+	RunThreadsOnIndividual (g_BulkFlowPortals.Count(), true, BulkPortalFlow);
+
+	if ( !g_TailFlowPortals.Count() )
+	{
+		g_Checkpoint.FlushSection( g_pPortalCheckpoints );
+		return;
+	}
+
+	for (int i=0 ; i<g_TailFlowPortals.Count() ; i++)
+	{
+		g_TailFlowPortals[i]->status = stat_working;
+	}
+
+	double expected = EstimateTailTime ();
+	double start = Plat_FloatTime();
+
+	RunThreadsOnIndividual (g_TailFlowBranches.Count(), true, TailPortalFlow);
+
+	double actual = Plat_FloatTime() - start;
+
+	// merge the branches back into their portals
+	for (int i=0 ; i<g_TailFlowBranches.Count() ; i++)
+	{
+		flowbranch_t *b = &g_TailFlowBranches[i];
+		for (int j=0 ; j<portallongs ; j++)
+			((long *)b->portal->portalvis)[j] |= ((long *)b->portalvis)[j];
+		free (b->portalvis);
+		b->portalvis = NULL;
+	}
+
+	for (int i=0 ; i<g_TailFlowPortals.Count() ; i++)
+	{
+		portal_t *p = g_TailFlowPortals[i];
+		p->status = stat_done;
+		CheckpointPortal (p);
+
+		qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (tail)\n", 
+			(int)(p - portals), p->nummightsee, CountBits (p->portalvis, g_numportals*2));
+	}
+
+	g_Checkpoint.FlushSection( g_pPortalCheckpoints );
+
+	Msg ("PortalFlow tail: %d portals in %d branches, expected %.1fs, actual %.1fs\n",
+		g_TailFlowPortals.Count(), g_TailFlowBranches.Count(), expected, actual);
+}
+
 
 /*
 ===============================================================================
@@ -56,6 +56,7 @@ struct portal_t
 	byte		*portalvis;		// [portals], final
 
 	int			nummightsee;	// bit count on portalflood for sort
+	double		flowcost;		// estimated PortalFlow cost, from portalflood
 };
 
 struct leaf_t
@@ -82,6 +83,8 @@ struct pstack_t
 struct threaddata_t
 {
 	portal_t	*base;
+	byte		*portalvis;		// where the flow marks visible portals, normally base->portalvis
+	int			branch;			// if >= 0, only flow through this portal of the base's leaf
 	int			c_chains;
 	pstack_t	pstack_head;
 };
@@ -113,9 +116,11 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void RunPortalFlow (void);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
+extern bool g_bSplitTailPortals;
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
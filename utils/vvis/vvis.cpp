@@ -10,6 +10,7 @@
 #include <windows.h>
 #include "vis.h"
 #include "threads.h"
+#include "checkpoint.h"
 #include "stdlib.h"
 #include "pacifier.h"
 #include "vmpi.h"
@@ -46,6 +47,8 @@ int			portalbytes, portallongs;
 
 bool		fastvis;
 bool		nosort;
+bool		g_bCheckpoint = false;
+bool		g_bResume = false;
 
 int			totalvis;
 
@@ -308,7 +311,7 @@ void CalcPortalVis (void)
 	}
 	else 
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		RunPortalFlow ();
 	}
 }
 
@@ -947,12 +950,41 @@ int ParseCommandLine( int argc, char **argv )
 			Msg ("nosort = true\n");
 			nosort = true;
 		}
+		else if (!Q_stricmp (argv[i],"-checkpoint"))
+		{
+			g_bCheckpoint = true;
+		}
+		else if (!Q_stricmp (argv[i],"-resume"))
+		{
+			g_bCheckpoint = true;
+			g_bResume = true;
+		}
+		else if (!Q_stricmp (argv[i],"-nosplit"))
+		{
+			Msg ("nosplit = true\n");
+			g_bSplitTailPortals = false;
+		}
 		else if (!Q_stricmp (argv[i],"-tmpin"))
 			strcpy (inbase, "/tmp");
 		else if( !Q_stricmp( argv[i], "-low" ) )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-threadsteal" ) )
+		{
+			g_bThreadWorkStealing = true;
+		}
+		else if( !Q_stricmp( argv[i], "-threadchunk" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nThreadWorkChunk = atoi( argv[i] );
+			}
+			else
+			{
+				Error( "Error: expected a value after '-threadchunk'\n" );
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1029,7 +1061,13 @@ void PrintUsage( int argc, char **argv )
 		"  -mpi_pw <pw>    : Use a password to choose a specific set of VMPI workers.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -threadsteal    : Split work between threads up front and let idle threads steal.\n"
+		"  -threadchunk #  : Hand out # work items at a time (default: adapts to item cost).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -checkpoint     : Periodically save finished portals to <mapname>.vvis.ckp.\n"
+		"  -resume         : Continue from the checkpoint left by an interrupted -checkpoint run.\n"
+		"  -nosplit        : Don't hold back the most expensive portals and split them\n"
+		"                    across threads at the end of PortalFlow.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1068,6 +1106,34 @@ void PrintUsage( int argc, char **argv )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Opens the checkpoint for -checkpoint/-resume, keyed on the bsp, the
+//			portal file and the command line.
+//-----------------------------------------------------------------------------
+void InitVisCheckpoint( const char *pSource, const char *pBSPFile, const char *pPortalFile, int argc, char **argv )
+{
+	if ( g_bUseMPI || fastvis || g_TraceClusterStart >= 0 )
+	{
+		Warning( "Checkpoints aren't supported with -mpi, -fast or -trace.\n" );
+		return;
+	}
+
+	CRC32_t key;
+	CRC32_Init( &key );
+	if ( !Checkpoint_CRCFile( &key, pBSPFile ) || !Checkpoint_CRCFile( &key, pPortalFile ) )
+	{
+		Warning( "Can't checksum the map, continuing without a checkpoint.\n" );
+		return;
+	}
+	Checkpoint_CRCCommandLine( &key, argc, argv );
+	CRC32_Final( &key );
+
+	char filename[1024];
+	Q_snprintf( filename, sizeof( filename ), "%s.vvis.ckp", pSource );
+	g_Checkpoint.Init( filename, "vvis", key, g_bResume );
+}
+
+
 int RunVVis( int argc, char **argv )
 {
 	char	portalfile[1024];
@@ -1155,6 +1221,11 @@ int RunVVis( int argc, char **argv )
 	Msg ("reading %s\n", portalfile);
 	LoadPortals (portalfile);
 
+	if ( g_bCheckpoint )
+	{
+		InitVisCheckpoint( source, targetPath, portalfile, argc, argv );
+	}
+
 	// don't write out results when simply doing a trace
 	if ( g_TraceClusterStart < 0 )
 	{
@@ -1173,6 +1244,9 @@ int RunVVis( int argc, char **argv )
 
 		Msg ("writing %s\n", targetPath);
 		WriteBSPFile (targetPath);	
+
+		// finished, so the checkpoint isn't needed any more
+		g_Checkpoint.Shutdown( true );
 	}
 	else
 	{
@@ -1190,6 +1264,8 @@ int RunVVis( int argc, char **argv )
 	
 	end = Plat_FloatTime();
 	
+	PrintThreadWorkStats();
+
 	char str[512];
 	GetHourMinuteSecondsString( (int)( end - start ), str, sizeof( str ) );
 	Msg( "%s elapsed\n", str );